@@ -413,6 +413,8 @@ setconfig (char *name, char *value, struct config_data *cfg)
 		ssi (noconv, &name, &src, &len, "storage.conf%d.extend",
 		     "storage.keys_conf[%d].extend", i);
 	}
+	ss (uintnum, &name, &src, &len, "storage.crypto_workers",
+	    "storage.crypto_workers");
 	/* vmm */
 	ss (uintnum, &name, &src, &len, "vmm.f11panic", "vmm.f11panic");
 	ss (uintnum, &name, &src, &len, "vmm.f12msg", "vmm.f12msg");
@@ -429,6 +431,9 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	    "vmm.ignore_tsc_invariant");
 	ss (uintnum, &name, &src, &len, "vmm.unsafe_nested_virtualization",
 	    "vmm.unsafe_nested_virtualization");
+	ss (uintnum, &name, &src, &len, "vmm.ept_tables", "vmm.ept_tables");
+	ss (uintnum, &name, &src, &len, "vmm.eager_nested_paging",
+	    "vmm.eager_nested_paging");
 	ss (mac_addr, &name, &src, &len, "vmm.tty_mac_address",
 	    "vmm.tty_mac_address");
 	ss (uintnum, &name, &src, &len, "vmm.tty_syslog.enable",
@@ -441,9 +446,11 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	ss (uintnum, &name, &src, &len, "vmm.tty_rtl8169", "vmm.tty_rtl8169");
 	ss (uintnum, &name, &src, &len, "vmm.tty_x540", "vmm.tty_x540");
 	ss (uintnum, &name, &src, &len, "vmm.tty_ieee1394", "vmm.tty_ieee1394");
+	ss (uintnum, &name, &src, &len, "vmm.tty_log_rate", "vmm.tty_log_rate");
 	ss (uintnum, &name, &src, &len, "vmm.driver.ata", "vmm.driver.ata");
 	ss (uintnum, &name, &src, &len, "vmm.driver.usb.uhci", "vmm.driver.usb.uhci");
 	ss (uintnum, &name, &src, &len, "vmm.driver.usb.ehci", "vmm.driver.usb.ehci");
+	ss (uintnum, &name, &src, &len, "vmm.driver.usb.ehci_poll", "vmm.driver.usb.ehci_poll");
 	ss (uintnum, &name, &src, &len, "vmm.driver.concealEHCI",
 	    "vmm.driver.concealEHCI");
 	ss (uintnum, &name, &src, &len, "vmm.driver.conceal1394",
@@ -584,6 +591,7 @@ setconfig (char *name, char *value, struct config_data *cfg)
 		CONF1 ("storage.keys_conf[%d].extend", i,
 		       cfg->storage.keys_conf[i].extend);
 	}
+	CONF (storage.crypto_workers);
 	/* vmm */
 	CONF (vmm.f11panic);
 	CONF (vmm.f12msg);
@@ -596,6 +604,8 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (vmm.no_intr_intercept);
 	CONF (vmm.ignore_tsc_invariant);
 	CONF (vmm.unsafe_nested_virtualization);
+	CONF (vmm.ept_tables);
+	CONF (vmm.eager_nested_paging);
 	CONF (vmm.tty_mac_address);
 	CONF (vmm.tty_syslog.enable);
 	CONF (vmm.tty_syslog.src_ipaddr);
@@ -604,9 +614,11 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (vmm.tty_rtl8169);
 	CONF (vmm.tty_x540);
 	CONF (vmm.tty_ieee1394);
+	CONF (vmm.tty_log_rate);
 	CONF (vmm.driver.ata);
 	CONF (vmm.driver.usb.uhci);
 	CONF (vmm.driver.usb.ehci);
+	CONF (vmm.driver.usb.ehci_poll);
 	CONF (vmm.driver.concealEHCI);
 	CONF (vmm.driver.conceal1394);
 	CONF (vmm.driver.concealPRO1000);
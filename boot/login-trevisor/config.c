@@ -203,7 +203,7 @@ main (int argc, char **argv, const char *const envp[])
     
     /* copy the salt into the configuration */
 	for (i=0; i<NUM_OF_STORAGE_KEYS_CONF; i++) {
-		if (strcmp(config.storage.keys_conf[i].crypto_name, "tresor") == 0)  {
+		if (memcmp(config.storage.keys_conf[i].crypto_name, "tresor", 6) == 0)  {
 			memcpy(&config.storage.keys_conf[i].salt, config.vmm.randomSeed, SALTLEN);
 			sha256((const char*)digest, 32,(unsigned char*)config.storage.keys[i]); 
 		}
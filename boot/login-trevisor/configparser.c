@@ -370,6 +370,8 @@ setconfig (char *name, char *value, struct config_data *cfg)
 		     "storage.keys_conf[%d].salt", i);
 
 	}
+	ss (uintnum, &name, &src, &len, "storage.crypto_workers",
+	    "storage.crypto_workers");
 	/* vmm */
 	ss (uintnum, &name, &src, &len, "vmm.f11panic", "vmm.f11panic");
 	ss (uintnum, &name, &src, &len, "vmm.f12msg", "vmm.f12msg");
@@ -378,15 +380,20 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	ss (uintnum, &name, &src, &len, "vmm.dbgsh", "vmm.dbgsh");
 	ss (uintnum, &name, &src, &len, "vmm.status", "vmm.status");
 	ss (uintnum, &name, &src, &len, "vmm.boot_active", "vmm.boot_active");
+	ss (uintnum, &name, &src, &len, "vmm.ept_tables", "vmm.ept_tables");
+	ss (uintnum, &name, &src, &len, "vmm.eager_nested_paging",
+	    "vmm.eager_nested_paging");
 	ss (uintnum, &name, &src, &len, "vmm.tty_pro1000", "vmm.tty_pro1000");
 	ss (mac_addr, &name, &src, &len, "vmm.tty_pro1000_mac_address",
 	    "vmm.tty_pro1000_mac_address");
 	ss (uintnum, &name, &src, &len, "vmm.tty_rtl8169", "vmm.tty_rtl8169");
 	ss (mac_addr, &name, &src, &len, "vmm.tty_rtl8169_mac_address",
 	    "vmm.tty_rtl8169_mac_address");
+	ss (uintnum, &name, &src, &len, "vmm.tty_log_rate", "vmm.tty_log_rate");
 	ss (uintnum, &name, &src, &len, "vmm.driver.ata", "vmm.driver.ata");
 	ss (uintnum, &name, &src, &len, "vmm.driver.usb.uhci", "vmm.driver.usb.uhci");
 	ss (uintnum, &name, &src, &len, "vmm.driver.usb.ehci", "vmm.driver.usb.ehci");
+	ss (uintnum, &name, &src, &len, "vmm.driver.usb.ehci_poll", "vmm.driver.usb.ehci_poll");
 	ss (uintnum, &name, &src, &len, "vmm.driver.concealEHCI",
 	    "vmm.driver.concealEHCI");
 	ss (uintnum, &name, &src, &len, "vmm.driver.conceal1394",
@@ -521,6 +528,7 @@ setconfig (char *name, char *value, struct config_data *cfg)
 		       cfg->storage.keys_conf[i].salt);
 
 	}
+	CONF (storage.crypto_workers);
 	/* vmm */
 	CONF (vmm.f11panic);
 	CONF (vmm.f12msg);
@@ -529,13 +537,17 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (vmm.dbgsh);
 	CONF (vmm.status);
 	CONF (vmm.boot_active);
+	CONF (vmm.ept_tables);
+	CONF (vmm.eager_nested_paging);
 	CONF (vmm.tty_pro1000);
 	CONF (vmm.tty_pro1000_mac_address);
 	CONF (vmm.tty_rtl8169);
 	CONF (vmm.tty_rtl8169_mac_address);
+	CONF (vmm.tty_log_rate);
 	CONF (vmm.driver.ata);
 	CONF (vmm.driver.usb.uhci);
 	CONF (vmm.driver.usb.ehci);
+	CONF (vmm.driver.usb.ehci_poll);
 	CONF (vmm.driver.concealEHCI);
 	CONF (vmm.driver.conceal1394);
 	CONF (vmm.driver.concealPRO1000);
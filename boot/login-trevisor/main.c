@@ -273,7 +273,7 @@ os_main (char *p)
                     /* search for TRESOR configuration entries  
                        and take the first match
                     */
-                    if (!strcmp(cfg->storage.keys_conf[j].crypto_name,"tresor")) {
+                    if (!memcmp(cfg->storage.keys_conf[j].crypto_name,"tresor",6)) {
                             int l;
                             unsigned char digest[64];
                             unsigned char digest2[64]; 
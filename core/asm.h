@@ -825,6 +825,12 @@ asm_lock_incl (u32 *d)
 	asm volatile ("lock incl %0" : "+m" (*d));
 }
 
+static inline void
+asm_lock_decl (u32 *d)
+{
+	asm volatile ("lock decl %0" : "+m" (*d));
+}
+
 /*
   if (*dest == *cmp) {
       *dest = eq;
@@ -125,6 +125,8 @@
 #define MSR_IA32_VMX_PROCBASED_CTLS	0x482
 #define MSR_IA32_VMX_EXIT_CTLS		0x483
 #define MSR_IA32_VMX_ENTRY_CTLS		0x484
+#define MSR_IA32_VMX_MISC		0x485
+#define MSR_IA32_VMX_MISC_PREEMPT_TIMER_RATE_MASK	0x1F
 #define MSR_IA32_VMX_CR0_FIXED0		0x486
 #define MSR_IA32_VMX_CR0_FIXED1		0x487
 #define MSR_IA32_VMX_CR4_FIXED0		0x488
@@ -133,7 +135,9 @@
 #define MSR_IA32_VMX_EPT_VPID_CAP	0x48C
 #define MSR_IA32_VMX_EPT_VPID_CAP_PAGEWALK_LENGTH_4_BIT	0x40
 #define MSR_IA32_VMX_EPT_VPID_CAP_EPTSTRUCT_WB_BIT	0x4000
+#define MSR_IA32_VMX_EPT_VPID_CAP_1GB_PAGE_BIT	0x20000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_BIT	0x100000
+#define MSR_IA32_VMX_EPT_VPID_CAP_AD_BIT	0x200000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_ALL_CONTEXT_BIT	0x4000000
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVVPID_BIT	0x100000000ULL
 #define MSR_IA32_VMX_EPT_VPID_CAP_INVVPID_SINGLE_CONTEXT_BIT 0x20000000000ULL
@@ -289,6 +293,7 @@
 #define VMCS_GUEST_ACTIVITY_STATE	0x4826
 #define VMCS_GUEST_SMBASE		0x4828
 #define VMCS_GUEST_IA32_SYSENTER_CS	0x482A
+#define VMCS_VMX_PREEMPT_TIMER_VALUE	0x482E
 
 /* 32-Bit Host-State Field */
 #define VMCS_HOST_IA32_SYSENTER_CS	0x4C00
@@ -354,6 +359,7 @@
 #define VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT_BIT	0x1
 #define VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT_BIT	0x8
 #define VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS_BIT	0x20
+#define VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER_BIT	0x40
 #define VMCS_PROC_BASED_VMEXEC_CTL_INTRWINEXIT_BIT	0x4
 #define VMCS_PROC_BASED_VMEXEC_CTL_USETSCOFF_BIT	0x8
 #define VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT_BIT		0x80
@@ -392,6 +398,7 @@
 #define VMCS_GUEST_ACTIVITY_STATE_SHUTDOWN	0x2
 #define VMCS_GUEST_ACTIVITY_STATE_WAIT_FOR_SIPI	0x3
 #define VMCS_EPT_POINTER_EPT_WB		0x6
+#define VMCS_EPT_POINTER_EPT_AD		0x40
 #define VMCS_EPT_PAGEWALK_LENGTH_4	0x18
 
 #define VMXON_REGION_SIZE		0x1000
@@ -33,6 +33,7 @@
 #include "cpu_mmu.h"
 #include "cpu_stack.h"
 #include "current.h"
+#include "exitprof.h"
 #include "panic.h"
 #include "printf.h"
 
@@ -64,6 +65,7 @@ cpu_emul_rdmsr (void)
 	/* FIXME: Privilege check */
 	current->vmctl.read_general_reg (GENERAL_REG_RCX, &lc);
 	ic = lc;
+	exitprof_tag (EXITPROF_TAG_MSR, ic);
 	err = current->vmctl.read_msr (ic, &msrdata);
 	conv64to32 (msrdata, &oa, &od);
 	current->vmctl.write_general_reg (GENERAL_REG_RAX, oa);
@@ -83,6 +85,7 @@ cpu_emul_wrmsr (void)
 	current->vmctl.read_general_reg (GENERAL_REG_RAX, &ia);
 	current->vmctl.read_general_reg (GENERAL_REG_RDX, &id);
 	conv32to64 (ia, id, &msrdata);
+	exitprof_tag (EXITPROF_TAG_MSR, (u32)ic);
 	err = current->vmctl.write_msr (ic, msrdata);
 	return err;
 }
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Per-CPU VM exit profiling.  Each exit is timed with the TSC and
+ * accounted to its exit reason, with a log2 latency histogram, and
+ * to the last tag set by the handler (I/O port, MSR number, MMIO
+ * handler, EPT violation region).  The raw per-CPU tables are
+ * returned to the guest by the "get_exitprof" vmmcall. */
+
+#include "asm.h"
+#include "config.h"
+#include "cpu_mmu.h"
+#include "current.h"
+#include "exitprof.h"
+#include "initfunc.h"
+#include "mm.h"
+#include "pcpu.h"
+#include "spinlock.h"
+#include "string.h"
+#include "vmmcall.h"
+#include "vmmcall_status.h"
+
+struct exitprof_pcpu {
+	struct exitprof data;
+	enum exitprof_tag_type tag_type;
+	u64 tag_value;
+};
+
+struct exitprof_copy_data {
+	ulong addr;
+	ulong len;
+	ulong off;
+	bool err;
+};
+
+static spinlock_t exitprof_lock;
+
+static u64
+exitprof_rdtsc (void)
+{
+	u32 a, d;
+
+	asm_rdtsc (&a, &d);
+	return (u64)d << 32 | a;
+}
+
+u64
+exitprof_begin (void)
+{
+	struct exitprof_pcpu *p;
+
+	p = currentcpu->exitprof;
+	if (!p)
+		return 0;
+	p->tag_type = EXITPROF_TAG_NONE;
+	return exitprof_rdtsc ();
+}
+
+void
+exitprof_tag (enum exitprof_tag_type type, u64 value)
+{
+	struct exitprof_pcpu *p;
+
+	p = currentcpu->exitprof;
+	if (!p)
+		return;
+	p->tag_type = type;
+	p->tag_value = value;
+}
+
+static void
+exitprof_tag_account (struct exitprof_pcpu *p, u64 cycles)
+{
+	struct exitprof_tag *t;
+	u32 h;
+	int i;
+
+	h = p->tag_type * 0x9E3779B1 ^ (u32)p->tag_value ^
+		(u32)(p->tag_value >> 32) * 0x85EBCA6B;
+	h ^= h >> 16;
+	for (i = 0; i < 8; i++) {
+		t = &p->data.tag[(h + i) % EXITPROF_TAGS];
+		if (t->type == EXITPROF_TAG_NONE) {
+			t->type = p->tag_type;
+			t->value = p->tag_value;
+		} else if (t->type != p->tag_type ||
+			   t->value != p->tag_value) {
+			continue;
+		}
+		t->count++;
+		t->cycles += cycles;
+		return;
+	}
+	p->data.tag_overflow++;
+}
+
+void
+exitprof_end (u64 begin, uint reason)
+{
+	struct exitprof_pcpu *p;
+	struct exitprof_reason *r;
+	u64 cycles;
+	int b;
+
+	p = currentcpu->exitprof;
+	if (!p || !begin)
+		return;
+	cycles = exitprof_rdtsc () - begin;
+	if (reason >= EXITPROF_REASONS)
+		reason = EXITPROF_REASONS - 1;
+	r = &p->data.reason[reason];
+	r->count++;
+	r->cycles += cycles;
+	for (b = 0; b < EXITPROF_BUCKETS - 1 && (cycles >> (b + 1)); b++);
+	r->hist[b]++;
+	if (p->tag_type != EXITPROF_TAG_NONE)
+		exitprof_tag_account (p, cycles);
+}
+
+static bool
+exitprof_write (struct exitprof_copy_data *d, void *data, uint len)
+{
+	u64 *q;
+
+	if (d->off + len > d->len) {
+		d->off += len;
+		return false;
+	}
+	for (q = data; len >= sizeof *q; len -= sizeof *q) {
+		if (write_linearaddr_q (d->addr + d->off, *q++) !=
+		    VMMERR_SUCCESS) {
+			d->err = true;
+			return true;
+		}
+		d->off += sizeof *q;
+	}
+	return false;
+}
+
+static bool
+exitprof_count_cpu (struct pcpu *p, void *q)
+{
+	u32 *n;
+
+	n = q;
+	if (p->exitprof)
+		(*n)++;
+	return false;
+}
+
+static bool
+exitprof_copy_cpu (struct pcpu *p, void *q)
+{
+	if (!p->exitprof)
+		return false;
+	return exitprof_write (q, &p->exitprof->data,
+			       sizeof p->exitprof->data);
+}
+
+/*
+  ebx=linear address of a buffer
+  ecx=size of the buffer
+  returns eax=0 on success and ecx=size of the data
+ */
+static void
+get_exitprof (void)
+{
+	struct exitprof_copy_data d;
+	struct exitprof_header h;
+	ulong rbx, rcx;
+
+	if (!config.vmm.status)
+		return;
+	current->vmctl.read_general_reg (GENERAL_REG_RBX, &rbx);
+	current->vmctl.read_general_reg (GENERAL_REG_RCX, &rcx);
+	memset (&h, 0, sizeof h);
+	h.magic = EXITPROF_MAGIC;
+	h.version = EXITPROF_VERSION;
+	h.nreasons = EXITPROF_REASONS;
+	h.nbuckets = EXITPROF_BUCKETS;
+	h.ntags = EXITPROF_TAGS;
+	h.arch = currentcpu->fullvirtualize == FULLVIRTUALIZE_SVM ?
+		EXITPROF_ARCH_SVM : EXITPROF_ARCH_VT;
+	pcpu_list_foreach (exitprof_count_cpu, &h.ncpus);
+	d.addr = rbx;
+	d.len = rcx;
+	d.off = 0;
+	d.err = false;
+	spinlock_lock (&exitprof_lock);
+	if (!exitprof_write (&d, &h, sizeof h))
+		pcpu_list_foreach (exitprof_copy_cpu, &d);
+	spinlock_unlock (&exitprof_lock);
+	current->vmctl.write_general_reg (GENERAL_REG_RCX, d.off);
+	current->vmctl.write_general_reg (GENERAL_REG_RAX,
+					  d.err || d.off > d.len);
+}
+
+static void
+exitprof_init_pcpu (void)
+{
+	struct exitprof_pcpu *p = NULL;
+
+#ifdef VMMCALL_STATUS_ENABLE
+	p = alloc (sizeof *p);
+	memset (p, 0, sizeof *p);
+	p->data.cpunum = currentcpu->cpunum;
+#endif
+	currentcpu->exitprof = p;
+}
+
+static void
+exitprof_init (void)
+{
+	spinlock_init (&exitprof_lock);
+#ifdef VMMCALL_STATUS_ENABLE
+	vmmcall_register ("get_exitprof", get_exitprof);
+#else
+	if (0)
+		get_exitprof ();	/* supress warnings */
+#endif
+}
+
+INITFUNC ("pcpu3", exitprof_init_pcpu);
+INITFUNC ("vmmcal0", exitprof_init);
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CORE_EXITPROF_H
+#define _CORE_EXITPROF_H
+
+#include "types.h"
+
+/* The layout below is returned as is by the "get_exitprof" vmmcall.
+ * tools/common/exitprof.h must be kept in sync with it. */
+#define EXITPROF_MAGIC		0x46505845 /* "EXPF" */
+#define EXITPROF_VERSION	1
+#define EXITPROF_REASONS	256
+#define EXITPROF_BUCKETS	32
+#define EXITPROF_TAGS		256
+#define EXITPROF_ARCH_VT	1
+#define EXITPROF_ARCH_SVM	2
+
+enum exitprof_tag_type {
+	EXITPROF_TAG_NONE = 0,
+	EXITPROF_TAG_EPT = 1,	/* value: 1GiB region of the faulting gphys */
+	EXITPROF_TAG_IO = 2,	/* value: I/O port number */
+	EXITPROF_TAG_MMIO = 3,	/* value: MMIO handler address */
+	EXITPROF_TAG_MSR = 4,	/* value: MSR number */
+};
+
+struct exitprof_header {
+	u32 magic;
+	u32 version;
+	u32 ncpus;
+	u32 nreasons;
+	u32 nbuckets;
+	u32 ntags;
+	u32 arch;
+	u32 reserved;
+};
+
+struct exitprof_reason {
+	u64 count;
+	u64 cycles;
+	u32 hist[EXITPROF_BUCKETS]; /* hist[i]: 2^i <= cycles < 2^(i+1) */
+};
+
+struct exitprof_tag {
+	u32 type;
+	u32 reserved;
+	u64 value;
+	u64 count;
+	u64 cycles;
+};
+
+/* One per physical CPU, following the header */
+struct exitprof {
+	u32 cpunum;
+	u32 reserved;
+	u64 tag_overflow;
+	struct exitprof_reason reason[EXITPROF_REASONS];
+	struct exitprof_tag tag[EXITPROF_TAGS];
+};
+
+u64 exitprof_begin (void);
+void exitprof_end (u64 begin, uint reason);
+void exitprof_tag (enum exitprof_tag_type type, u64 value);
+
+#endif
@@ -33,10 +33,12 @@
 #include "types.h"
 
 #define GMM_GP2HP_2M_FAIL 0xFFFFFFFFFFFFFFFFULL
+#define GMM_GP2HP_1G_FAIL 0xFFFFFFFFFFFFFFFFULL
 
 struct gmm_func {
 	u64 (*gp2hp) (u64 gp, bool *fakerom);
 	u64 (*gp2hp_2m) (u64 gp);
+	u64 (*gp2hp_1g) (u64 gp);
 	u32 (*getforcemap) (u32 n, u64 *base, u64 *len);
 };
 
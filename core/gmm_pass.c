@@ -48,11 +48,13 @@
 static u64 phys_blank;
 
 u64 gmm_pass_gp2hp_2m (u64 gp);
+u64 gmm_pass_gp2hp_1g (u64 gp);
 u32 gmm_pass_getforcemap (u32 n, u64 *base, u64 *len);
 
 static struct gmm_func func = {
 	gmm_pass_gp2hp,
 	gmm_pass_gp2hp_2m,
+	gmm_pass_gp2hp_1g,
 	gmm_pass_getforcemap,
 };
 
@@ -90,6 +92,16 @@ gmm_pass_gp2hp_2m (u64 gp)
 	return gp;
 }
 
+u64
+gmm_pass_gp2hp_1g (u64 gp)
+{
+	if (gp & PAGESIZE1G_MASK)
+		return GMM_GP2HP_1G_FAIL;
+	if (phys_overlaps_vmm (gp, PAGESIZE1G))
+		return GMM_GP2HP_1G_FAIL;
+	return gp;
+}
+
 u32
 gmm_pass_getforcemap (u32 n, u64 *base, u64 *len)
 {
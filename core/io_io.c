@@ -32,6 +32,7 @@
 #include "cpu_interpreter.h"
 #include "cpu_mmu.h"
 #include "current.h"
+#include "exitprof.h"
 #include "initfunc.h"
 #include "io_io.h"
 #include "io_iopass.h"
@@ -92,6 +93,7 @@ enum ioact
 call_io (enum iotype type, u32 port, void *data)
 {
 	port &= 0xFFFF;
+	exitprof_tag (EXITPROF_TAG_IO, port);
 	return current->vcpu0->io.iofunc[port] (type, port, data);
 }
 
@@ -47,13 +47,14 @@
 #include "spinlock.h"
 #include "string.h"
 #include "uefi.h"
+#include "vmmcall_status.h"
 
 #define VMMSIZE_ALL		(128 * 1024 * 1024)
 #define NUM_OF_PAGES		(VMMSIZE_ALL >> PAGESIZE_SHIFT)
-#define NUM_OF_ALLOCSIZE	13
+#define NUM_OF_ALLOCSIZE	16 /* up to VMMSIZE_ALL */
 #define MAPMEM_ADDR_START	0xF0000000
 #define MAPMEM_ADDR_END		0xFF000000
-#define NUM_OF_ALLOCLIST	7
+#define NUM_OF_ALLOCLIST	MM_NUM_OF_ALLOCLIST
 #define ALLOCLIST_SIZE(n)	((1 << (n)) * 16)
 #define ALLOCLIST_DATABIT(n)	(PAGESIZE / ALLOCLIST_SIZE (n))
 #define ALLOCLIST_DATASIZE(n)	((ALLOCLIST_DATABIT (n) + 7) / 8)
@@ -138,6 +139,11 @@ static spinlock_t mm_lock_process_virt_to_phys;
 static LIST1_DEFINE_HEAD (struct page, list1_freepage[NUM_OF_ALLOCSIZE]);
 static LIST1_DEFINE_HEAD (struct allocdata, alloclist[NUM_OF_ALLOCLIST]);
 static int allocsize[NUM_OF_ALLOCSIZE];
+static int num_of_freepage[NUM_OF_ALLOCSIZE];
+static u32 stat_pagecache_refills, stat_pagecache_flushes;
+static struct {
+	u32 pages, used, slow, refills, flushes;
+} alloclist_stat[NUM_OF_ALLOCLIST];
 static struct page pagestruct[NUM_OF_PAGES];
 static spinlock_t mapmem_lock;
 static virt_t mapmem_lastvirt;
@@ -535,53 +541,52 @@ u32 vmm_term_inf()
         return vmm_start_phys+VMMSIZE_ALL ;
 }
 
+/* Take a free block of size n, splitting a larger one if necessary.
+ * mm_lock must be locked.  Returns NULL if no block is large
+ * enough. */
 static struct page *
-mm_page_alloc (int n)
+mm_page_alloc_locked (int n, enum page_type *old_type)
 {
-	int s;
-	virt_t virt;
+	int i;
 	struct page *p, *q;
-	enum page_type old_type;
 
-	ASSERT (n < NUM_OF_ALLOCSIZE);
-	s = allocsize[n];
-	spinlock_lock (&mm_lock);
-	while ((p = LIST1_POP (list1_freepage[n])) == NULL) {
-		spinlock_unlock (&mm_lock);
-		p = mm_page_alloc (n + 1);
-		spinlock_lock (&mm_lock);
-		virt = page_to_virt (p);
-		q = virt_to_page (virt ^ s);
-		p->allocsize = n;
-		p->type = PAGE_TYPE_FREE;
+	for (i = n; i < NUM_OF_ALLOCSIZE; i++) {
+		p = LIST1_POP (list1_freepage[i]);
+		if (p)
+			goto found;
+	}
+	return NULL;
+found:
+	num_of_freepage[i]--;
+	while (i > n) {
+		i--;
+		q = virt_to_page (page_to_virt (p) ^ allocsize[i]);
+		q->allocsize = i;
 		q->type = PAGE_TYPE_FREE;
-		LIST1_ADD (list1_freepage[n], p);
-		LIST1_ADD (list1_freepage[n], q);
+		LIST1_ADD (list1_freepage[i], q);
+		num_of_freepage[i]++;
 	}
+	p->allocsize = n;
 	/* p->type must be set before unlock, because the
 	 * mm_page_free() function may merge blocks if the type is
 	 * PAGE_TYPE_FREE. */
-	old_type = p->type;
+	*old_type = p->type;
 	p->type = PAGE_TYPE_ALLOCATED;
-	spinlock_unlock (&mm_lock);
-	/* The old_type must be PAGE_TYPE_FREE, or the memory will be
-	 * corrupted.  The ASSERT is called after unlock to avoid
-	 * deadlocks during panic. */
-	ASSERT (old_type == PAGE_TYPE_FREE);
 	return p;
 }
 
+/* mm_lock must be locked */
 static void
-mm_page_free (struct page *p)
+mm_page_free_locked (struct page *p)
 {
 	int s, n;
 	struct page *q, *tmp;
 	virt_t virt;
 
-	spinlock_lock (&mm_lock);
 	n = p->allocsize;
 	p->type = PAGE_TYPE_FREE;
 	LIST1_ADD (list1_freepage[n], p);
+	num_of_freepage[n]++;
 	s = allocsize[n];
 	virt = page_to_virt (p);
 	while (n < (NUM_OF_ALLOCSIZE - 1) &&
@@ -594,31 +599,144 @@ mm_page_free (struct page *p)
 		}
 		LIST1_DEL (list1_freepage[n], p);
 		LIST1_DEL (list1_freepage[n], q);
+		num_of_freepage[n] -= 2;
 		q->type = PAGE_TYPE_NOT_HEAD;
 		n = ++p->allocsize;
 		LIST1_ADD (list1_freepage[n], p);
+		num_of_freepage[n]++;
 		s = allocsize[n];
 		virt = page_to_virt (p);
 	}
+}
+
+/* Single pages are served from the cache of the current CPU.  The
+ * cache is refilled and flushed by halves under mm_lock.  Lock order:
+ * pagecache_lock -> mm_lock.  The pagecache_lock is not contended
+ * except while mm_pagecache_drain() runs on another CPU. */
+static void
+mm_pagecache_refill (struct mm_pcpu_data *c)
+{
+	struct page *p;
+	enum page_type old_type;
+
+	spinlock_lock (&mm_lock);
+	stat_pagecache_refills++;
+	while (c->npagecache < MM_PAGECACHE_SIZE / 2) {
+		p = mm_page_alloc_locked (0, &old_type);
+		if (!p)
+			break;
+		ASSERT (old_type == PAGE_TYPE_FREE);
+		c->pagecache[c->npagecache++] = p;
+	}
 	spinlock_unlock (&mm_lock);
 }
 
-/* returns number of available pages */
-int
-num_of_available_pages (void)
+static void
+mm_pagecache_flush (struct mm_pcpu_data *c)
+{
+	spinlock_lock (&mm_lock);
+	stat_pagecache_flushes++;
+	while (c->npagecache > MM_PAGECACHE_SIZE / 2)
+		mm_page_free_locked (c->pagecache[--c->npagecache]);
+	spinlock_unlock (&mm_lock);
+}
+
+/* Return all pages in the cache of a CPU to the buddy lists */
+static bool
+mm_pagecache_drain (struct pcpu *p, void *q)
+{
+	struct mm_pcpu_data *c = &p->mm;
+
+	spinlock_lock (&c->pagecache_lock);
+	spinlock_lock (&mm_lock);
+	while (c->npagecache > 0)
+		mm_page_free_locked (c->pagecache[--c->npagecache]);
+	spinlock_unlock (&mm_lock);
+	spinlock_unlock (&c->pagecache_lock);
+	return false;
+}
+
+static struct page *
+mm_page_alloc (int n)
 {
-	int i, r, n;
 	struct page *p;
+	struct mm_pcpu_data *c;
+	enum page_type old_type;
 
+	ASSERT (n < NUM_OF_ALLOCSIZE);
+	if (n == 0 && currentcpu_available ()) {
+		c = &currentcpu->mm;
+		spinlock_lock (&c->pagecache_lock);
+		if (c->npagecache)
+			c->pagecache_hits++;
+		else
+			mm_pagecache_refill (c);
+		if (c->npagecache) {
+			p = c->pagecache[--c->npagecache];
+			spinlock_unlock (&c->pagecache_lock);
+			return p;
+		}
+		spinlock_unlock (&c->pagecache_lock);
+	}
 	spinlock_lock (&mm_lock);
-	r = 0;
-	for (i = 0; i < NUM_OF_ALLOCSIZE; i++) {
-		n = 0;
-		LIST1_FOREACH (list1_freepage[i], p)
-			n++;
-		r += n * (allocsize[i] >> PAGESIZE_SHIFT);
+	p = mm_page_alloc_locked (n, &old_type);
+	spinlock_unlock (&mm_lock);
+	if (!p) {
+		/* Pages cached by CPUs may be enough, or may merge into
+		 * a block large enough */
+		pcpu_list_foreach (mm_pagecache_drain, NULL);
+		spinlock_lock (&mm_lock);
+		p = mm_page_alloc_locked (n, &old_type);
+		spinlock_unlock (&mm_lock);
+	}
+	if (!p)
+		panic ("mm_page_alloc (%d) failed: %d pages free", n,
+		       num_of_available_pages ());
+	/* The old_type must be PAGE_TYPE_FREE, or the memory will be
+	 * corrupted.  The ASSERT is called after unlock to avoid
+	 * deadlocks during panic. */
+	ASSERT (old_type == PAGE_TYPE_FREE);
+	return p;
+}
+
+static void
+mm_page_free (struct page *p)
+{
+	struct mm_pcpu_data *c;
+
+	if (p->allocsize == 0 && currentcpu_available ()) {
+		c = &currentcpu->mm;
+		spinlock_lock (&c->pagecache_lock);
+		if (c->npagecache == MM_PAGECACHE_SIZE)
+			mm_pagecache_flush (c);
+		c->pagecache[c->npagecache++] = p;
+		spinlock_unlock (&c->pagecache_lock);
+		return;
 	}
+	spinlock_lock (&mm_lock);
+	mm_page_free_locked (p);
 	spinlock_unlock (&mm_lock);
+}
+
+static bool
+mm_pagecache_count (struct pcpu *p, void *q)
+{
+	int *r = q;
+
+	*r += p->mm.npagecache;
+	return false;
+}
+
+/* returns number of available pages */
+int
+num_of_available_pages (void)
+{
+	int i, r;
+
+	r = 0;
+	for (i = 0; i < NUM_OF_ALLOCSIZE; i++)
+		r += num_of_freepage[i] * (allocsize[i] >> PAGESIZE_SHIFT);
+	pcpu_list_foreach (mm_pagecache_count, &r);
 	return r;
 }
 
@@ -829,6 +947,7 @@ mm_init_global (void)
 		LIST1_HEAD_INIT (alloclist[i]);
 	for (i = 0; i < NUM_OF_ALLOCSIZE; i++) {
 		allocsize[i] = 4096 << i;
+		num_of_freepage[i] = 0;
 		LIST1_HEAD_INIT (list1_freepage[i]);
 	}
 	for (i = 0; i < NUM_OF_PAGES; i++) {
@@ -924,6 +1043,7 @@ alloclist_new (int n)
 	r->n = n;
 	for (i = 0; i * ALLOCLIST_SIZE (n) < headlen; i++)
 		r->data[i / 8] |= 1 << (i % 8);
+	alloclist_stat[n].pages++;
 	return r;
 }
 
@@ -946,6 +1066,7 @@ found:
 	if (i * 8 + j >= ALLOCLIST_DATABIT (n))
 		return false;
 	p->data[i] |= (1 << j);
+	alloclist_stat[n].used++;
 	offset = (i * 8 + j) * ALLOCLIST_SIZE (n);
 	ASSERT (offset != 0);
 	ASSERT (offset < PAGESIZE);
@@ -963,16 +1084,77 @@ alloclist_free (struct allocdata *p, int n, uint offset)
 	j = bit % 8;
 	ASSERT (p->data[i] & (1 << j));	/* double free check */
 	p->data[i] &= ~(1 << j);
+	alloclist_stat[n].used--;
+}
+
+/* mm_lock2 must be locked */
+static void *
+alloclist_get (int n)
+{
+	struct allocdata *p;
+	void *r;
+
+	for (;;) {
+		p = LIST1_POP (alloclist[n]);
+		if (p == NULL)
+			p = alloclist_new (n);
+		if (alloclist_alloc (p, n, &r))
+			break;
+		p->n |= 0x80;
+	}
+	LIST1_PUSH (alloclist[n], p);
+	return r;
+}
+
+/* mm_lock2 must be locked */
+static void
+alloclist_put (void *virt)
+{
+	struct allocdata *p;
+	uint offset;
+
+	offset = (virt_t)virt & PAGESIZE_MASK;
+	p = (struct allocdata *)((virt_t)virt & ~PAGESIZE_MASK);
+	if (p->n & 0x80) {
+		p->n &= ~0x80;
+		LIST1_PUSH (alloclist[p->n], p);
+	}
+	alloclist_free (p, p->n, offset);
+}
+
+/* Objects are moved between a magazine and the lists by halves so
+   that a CPU alternating alloc() and free() at the boundary does
+   not take mm_lock2 every time. */
+static void
+alloclist_refill (int n, struct mm_magazine *mag)
+{
+	spinlock_lock (&mm_lock2);
+	alloclist_stat[n].refills++;
+	while (mag->n < MM_MAGAZINE_SIZE / 2)
+		mag->obj[mag->n++] = alloclist_get (n);
+	spinlock_unlock (&mm_lock2);
+}
+
+static void
+alloclist_flush (int n, struct mm_magazine *mag)
+{
+	spinlock_lock (&mm_lock2);
+	alloclist_stat[n].flushes++;
+	while (mag->n > MM_MAGAZINE_SIZE / 2)
+		alloclist_put (mag->obj[--mag->n]);
+	spinlock_unlock (&mm_lock2);
 }
 
 /* allocate n bytes */
-/* FIXME: bad implementation */
+/* Small objects are taken from the magazine of the current CPU
+   without locking.  The magazine is refilled from the per-size
+   lists under mm_lock2 only when it becomes empty. */
 void *
 alloc (uint len)
 {
 	void *r;
 	int i;
-	struct allocdata *p;
+	struct mm_magazine *mag;
 
 	for (i = 0; i < NUM_OF_ALLOCLIST; i++) {
 		if (len <= ALLOCLIST_SIZE (i))
@@ -982,16 +1164,17 @@ alloc (uint len)
 	alloc_pages (&r, NULL, (len + 4095) / 4096);
 	return r;
 found:
-	spinlock_lock (&mm_lock2);
-	for (;;) {
-		p = LIST1_POP (alloclist[i]);
-		if (p == NULL)
-			p = alloclist_new (i);
-		if (alloclist_alloc (p, i, &r))
-			break;
-		p->n |= 0x80;
+	if (currentcpu_available ()) {
+		mag = &currentcpu->mm.mag[i];
+		if (mag->n)
+			mag->hits++;
+		else
+			alloclist_refill (i, mag);
+		return mag->obj[--mag->n];
 	}
-	LIST1_PUSH (alloclist[i], p);
+	spinlock_lock (&mm_lock2);
+	alloclist_stat[i].slow++;
+	r = alloclist_get (i);
 	spinlock_unlock (&mm_lock2);
 	return r;
 }
@@ -1018,20 +1201,26 @@ void
 free (void *virt)
 {
 	struct allocdata *p;
+	struct mm_magazine *mag;
 	uint offset;
+	int n;
 
 	offset = (virt_t)virt & PAGESIZE_MASK;
 	if (offset == 0) {
 		mm_page_free (virt_to_page ((virt_t)virt));
 		return;
 	}
-	spinlock_lock (&mm_lock2);
-	p = (struct allocdata *)((virt_t)virt & ~PAGESIZE_MASK);
-	if (p->n & 0x80) {
-		p->n &= ~0x80;
-		LIST1_PUSH (alloclist[p->n], p);
+	if (currentcpu_available ()) {
+		p = (struct allocdata *)((virt_t)virt & ~PAGESIZE_MASK);
+		n = p->n & ~0x80;
+		mag = &currentcpu->mm.mag[n];
+		if (mag->n == MM_MAGAZINE_SIZE)
+			alloclist_flush (n, mag);
+		mag->obj[mag->n++] = virt;
+		return;
 	}
-	alloclist_free (p, p->n, offset);
+	spinlock_lock (&mm_lock2);
+	alloclist_put (virt);
 	spinlock_unlock (&mm_lock2);
 }
 
@@ -1278,6 +1467,13 @@ phys_in_vmm (u64 phys)
 	return phys >= vmm_start_phys && phys < vmm_start_phys + VMMSIZE_ALL;
 }
 
+bool
+phys_overlaps_vmm (u64 phys, u64 len)
+{
+	return phys < vmm_start_phys + VMMSIZE_ALL &&
+		vmm_start_phys < phys + len;
+}
+
 void
 mm_force_unlock (void)
 {
@@ -2197,6 +2393,48 @@ mapped_hphys_addr (u64 hphys, uint len, int flags)
 	return (void *)(virt_t)(hphys_addr + hphys);
 }
 
+/* Look up the 2MiB frame containing [gphys, gphys + len) in the
+ * per-CPU cache, translating it with gp2hp_2m() on a miss.  The
+ * whole frame is contiguous and outside of the VMM, so no per-page
+ * translation is needed.  Returns GMM_GP2HP_2M_FAIL if the range is
+ * not covered. */
+static u64
+mapcache_gphys (u64 gphys, uint len)
+{
+	struct mm_pcpu_data *c;
+	struct mm_mapcache e;
+	u64 frame;
+	int i;
+
+	frame = gphys & ~PAGESIZE2M_MASK;
+	if (((gphys + len - 1) & ~PAGESIZE2M_MASK) != frame)
+		return GMM_GP2HP_2M_FAIL;
+	if (!currentcpu_available ())
+		return GMM_GP2HP_2M_FAIL;
+	c = &currentcpu->mm;
+	for (i = 0; i < c->nmapcache; i++) {
+		if (c->mapcache[i].gphys == frame)
+			goto hit;
+	}
+	c->mapcache_misses++;
+	e.hphys = current->gmm.gp2hp_2m (frame);
+	if (e.hphys == GMM_GP2HP_2M_FAIL)
+		return GMM_GP2HP_2M_FAIL;
+	e.gphys = frame;
+	if (c->nmapcache < MM_MAPCACHE_SIZE)
+		c->nmapcache++;
+	i = c->nmapcache - 1;
+	goto insert;
+hit:
+	c->mapcache_hits++;
+	e = c->mapcache[i];
+insert:
+	for (; i > 0; i--)
+		c->mapcache[i] = c->mapcache[i - 1];
+	c->mapcache[0] = e;
+	return e.hphys + (gphys & PAGESIZE2M_MASK);
+}
+
 static void *
 mapped_gphys_addr (u64 gphys, uint len, int flags)
 {
@@ -2204,6 +2442,10 @@ mapped_gphys_addr (u64 gphys, uint len, int flags)
 	u64 hphys, hphys1;
 	bool fakerom = false, *f;
 
+	hphys = mapcache_gphys (gphys, len);
+	if (hphys != GMM_GP2HP_2M_FAIL)
+		return mapped_hphys_addr (hphys, len, flags);
+
 	if (flags & MAPMEM_WRITE)
 		f = &fakerom;
 	else
@@ -2388,5 +2630,64 @@ mm_flush_wb_cache (void)
 	asm_wbinvd ();		/* write back all caches */
 }
 
+static bool
+mm_status_hits (struct pcpu *p, void *q)
+{
+	u64 *hits = q;
+	int i;
+
+	for (i = 0; i < NUM_OF_ALLOCLIST; i++)
+		hits[i] += p->mm.mag[i].hits;
+	hits[NUM_OF_ALLOCLIST] += p->mm.pagecache_hits;
+	hits[NUM_OF_ALLOCLIST + 1] += p->mm.mapcache_hits;
+	hits[NUM_OF_ALLOCLIST + 2] += p->mm.mapcache_misses;
+	return false;
+}
+
+static char *
+mm_status (void)
+{
+	static char buf[2048];
+	u64 hits[NUM_OF_ALLOCLIST + 3];
+	u32 total;
+	int i, n;
+
+	for (i = 0; i < NUM_OF_ALLOCLIST + 3; i++)
+		hits[i] = 0;
+	pcpu_list_foreach (mm_status_hits, hits);
+	n = snprintf (buf, sizeof buf, "alloc:\n");
+	for (i = 0; i < NUM_OF_ALLOCLIST; i++) {
+		total = alloclist_stat[i].pages * ALLOCLIST_DATABIT (i);
+		n += snprintf (buf + n, sizeof buf - n,
+			       " %4d: pages %u used %u/%u frag %u%%"
+			       " hits %llu refills %u flushes %u slow %u\n",
+			       ALLOCLIST_SIZE (i), alloclist_stat[i].pages,
+			       alloclist_stat[i].used, total,
+			       total ? (total - alloclist_stat[i].used) * 100 /
+			       total : 0, hits[i], alloclist_stat[i].refills,
+			       alloclist_stat[i].flushes,
+			       alloclist_stat[i].slow);
+	}
+	n += snprintf (buf + n, sizeof buf - n, "pages: free");
+	for (i = 0; i < NUM_OF_ALLOCSIZE; i++)
+		n += snprintf (buf + n, sizeof buf - n, " %d",
+			       num_of_freepage[i]);
+	n += snprintf (buf + n, sizeof buf - n,
+		       "\n cache hits %llu refills %u flushes %u\n",
+		       hits[NUM_OF_ALLOCLIST], stat_pagecache_refills,
+		       stat_pagecache_flushes);
+	n += snprintf (buf + n, sizeof buf - n,
+		       "mapmem: 2MiB cache hits %llu misses %llu\n",
+		       hits[NUM_OF_ALLOCLIST + 1], hits[NUM_OF_ALLOCLIST + 2]);
+	return buf;
+}
+
+static void
+mm_init_status (void)
+{
+	register_status_callback (mm_status);
+}
+
 INITFUNC ("global2", mm_init_global);
+INITFUNC ("paral01", mm_init_status);
 INITFUNC ("ap0", unmap_user_area);
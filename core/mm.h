@@ -32,6 +32,7 @@
 
 #include <core/mm.h>
 #include "constants.h"
+#include "spinlock.h"
 #include "types.h"
 
 #ifdef USE_PAE
@@ -46,6 +47,11 @@
 
 #define VMM_START_VIRT			0x40000000
 
+#define MM_NUM_OF_ALLOCLIST		7
+#define MM_MAGAZINE_SIZE		32
+#define MM_PAGECACHE_SIZE		64
+#define MM_MAPCACHE_SIZE		8
+
 enum pmap_type {
 	PMAP_TYPE_VMM,
 	PMAP_TYPE_GUEST,
@@ -62,6 +68,31 @@ typedef struct {
 	enum pmap_type type;
 } pmap_t;
 
+/* per-CPU cache of free objects of an alloc() size class */
+struct mm_magazine {
+	int n;
+	void *obj[MM_MAGAZINE_SIZE];
+	u64 hits;
+};
+
+struct page;
+
+/* guest-physical 2MiB frame known to be contiguous in host-physical */
+struct mm_mapcache {
+	u64 gphys, hphys;
+};
+
+struct mm_pcpu_data {
+	struct mm_magazine mag[MM_NUM_OF_ALLOCLIST];
+	spinlock_t pagecache_lock; /* taken by the owner and a drain */
+	int npagecache;		/* per-CPU cache of single free pages */
+	struct page *pagecache[MM_PAGECACHE_SIZE];
+	u64 pagecache_hits;
+	int nmapcache;		/* most recently used first */
+	struct mm_mapcache mapcache[MM_MAPCACHE_SIZE];
+	u64 mapcache_hits, mapcache_misses;
+};
+
 struct uefi_mmio_space_struct {
 	u64 base, npages;
 };
@@ -73,6 +104,7 @@ extern struct uefi_mmio_space_struct *uefi_mmio_space;
 
 phys_t sym_to_phys (void *sym);
 bool phys_in_vmm (u64 phys);
+bool phys_overlaps_vmm (u64 phys, u64 len);
 virt_t phys_to_virt (phys_t phys);
 int num_of_available_pages (void);
 u32 getsysmemmap (u32 n, u64 *base, u64 *len, u32 *type);
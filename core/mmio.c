@@ -33,6 +33,7 @@
 #include "cpu_interpreter.h"
 #include "cpu_mmu.h"
 #include "current.h"
+#include "exitprof.h"
 #include "initfunc.h"
 #include "mm.h"
 #include "mmio.h"
@@ -160,10 +161,14 @@ mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len, u32 f)
 					unlocked_handler.len = len2;
 					unlocked_handler.flags = f;
 					unlocked_handler.found = true;
-				} else if (!h->handler (h->data, gphysaddr, wr,
-							q, len2, f)) {
-					mmio_gphys_access (gphysaddr, wr, q,
-							   len2, f);
+				} else {
+					exitprof_tag (EXITPROF_TAG_MMIO,
+						      (ulong)h->handler);
+					if (!h->handler (h->data, gphysaddr,
+							 wr, q, len2, f))
+						mmio_gphys_access (gphysaddr,
+								   wr, q,
+								   len2, f);
 				}
 				gphysaddr += len2;
 				q += len2;
@@ -180,6 +185,8 @@ out:
 		/* Unlocked handlers are called during unlocked state.
 		 * They can call mmio_register(). */
 		rw_spinlock_unlock_sh (&current->vcpu0->mmio.rwlock);
+		exitprof_tag (EXITPROF_TAG_MMIO,
+			      (ulong)unlocked_handler.handler);
 		/* The mmio_list may be modified here. Unlocked
 		 * handlers should take care of it. */
 		if (!unlocked_handler.handler (unlocked_handler.data,
@@ -33,6 +33,7 @@
 #include "asm.h"
 #include "cache.h"
 #include "desc.h"
+#include "mm.h"
 #include "panic.h"
 #include "seg.h"
 #include "spinlock.h"
@@ -44,6 +45,10 @@
 #define NUM_OF_SEGDESCTBL 32
 #define PCPU_GS_ALIGN  __attribute__ ((aligned (8)))
 
+struct exitprof_pcpu;
+struct timer_base;
+struct tty_log_ring;
+
 enum fullvirtualize_type {
 	FULLVIRTUALIZE_NONE,
 	FULLVIRTUALIZE_VT,
@@ -64,15 +69,22 @@ struct pcpu {
 	struct cache_pcpu_data cache;
 	struct panic_pcpu_data panic;
 	struct thread_pcpu_data thread;
+	struct mm_pcpu_data mm;
+	struct exitprof_pcpu *exitprof;
+	struct timer_base *timer;
+	struct tty_log_ring *ttylog;
 	enum fullvirtualize_type fullvirtualize;
 	int cpunum;
 	int pid;
 	void *stackaddr;
-	u64 tsc, hz, timediff;
+	u64 tsc, hz, timediff, lasttime;
+	u32 tsc_mul;
+	unsigned int tsc_shift;
 	spinlock_t suspend_lock;
 	phys_t cr3;
 	bool pass_vm_created;
 	bool use_invariant_tsc;
+	bool tsc_synced;
 	void (*release_process64_msrs) (void *release_process64_msrs_data);
 	void *release_process64_msrs_data;
 };
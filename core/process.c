@@ -45,6 +45,7 @@
 #include "spinlock.h"
 #include "string.h"
 #include "types.h"
+#include "vmmcall_status.h"
 
 #define NUM_OF_SYSCALLS 32
 #define NAMELEN 16
@@ -65,6 +66,7 @@ struct msgdsc_data {
 };
 
 struct process_data {
+	spinlock_t lock;	/* protects mm_phys mappings, running, setlimit */
 	bool valid;
 	phys_t mm_phys;
 	int gen;
@@ -76,9 +78,60 @@ struct process_data {
 };
 
 extern ulong volatile syscallstack asm ("%gs:gs_syscallstack");
+/* Lock order: process_lock -> process[pid].lock.
+   process_lock protects the process table and the message
+   descriptors.  Message calls take it shared only to look up the
+   callee and pin it by taking process[pid].lock before releasing
+   process_lock; mapping buffers and stacks is done under the callee's
+   own lock so that calls to different processes do not serialize
+   each other. */
 static struct process_data process[NUM_OF_PID];
-static spinlock_t process_lock;
+static rw_spinlock_t process_lock;
 static bool process_initialized = false;
+static u32 stat_tablecontendcnt, stat_mmcontendcnt;
+
+static void
+process_table_lock_sh (void)
+{
+	if ((int)*(volatile rw_spinlock_t *)&process_lock < 0)
+		STATUS_UPDATE (asm_lock_incl (&stat_tablecontendcnt));
+	rw_spinlock_lock_sh (&process_lock);
+}
+
+static void
+process_table_unlock_sh (void)
+{
+	rw_spinlock_unlock_sh (&process_lock);
+}
+
+static void
+process_table_lock_ex (void)
+{
+	if (!rw_spinlock_trylock_ex (&process_lock))
+		return;
+	STATUS_UPDATE (asm_lock_incl (&stat_tablecontendcnt));
+	rw_spinlock_lock_ex (&process_lock);
+}
+
+static void
+process_table_unlock_ex (void)
+{
+	rw_spinlock_unlock_ex (&process_lock);
+}
+
+static void
+process_mm_lock (int pid)
+{
+	if (*(volatile spinlock_t *)&process[pid].lock)
+		STATUS_UPDATE (asm_lock_incl (&stat_mmcontendcnt));
+	spinlock_lock (&process[pid].lock);
+}
+
+static void
+process_mm_unlock (int pid)
+{
+	spinlock_unlock (&process[pid].lock);
+}
 
 static bool
 is_range_valid (ulong addr, u32 len)
@@ -173,16 +226,36 @@ process_init_global (void)
 	int i;
 
 	for (i = 0; i < NUM_OF_PID; i++) {
+		spinlock_init (&process[i].lock);
 		process[i].valid = false;
 		process[i].gen = 1;
 	}
 	process[0].valid = true;
 	clearmsgdsc (process[0].msgdsc);
 	setup_syscallentry ();
-	spinlock_init (&process_lock);
+	rw_spinlock_init (&process_lock);
 	process_initialized = true;
 }
 
+static char *
+process_status (void)
+{
+	static char buf[1024];
+
+	snprintf (buf, 1024,
+		  "Process:\n"
+		  " Table lock contended: %u\n"
+		  " Address space lock contended: %u\n"
+		  , stat_tablecontendcnt, stat_mmcontendcnt);
+	return buf;
+}
+
+static void
+process_init_global_status (void)
+{
+	register_status_callback (process_status);
+}
+
 static void
 process_init_ap (void)
 {
@@ -233,7 +306,7 @@ _msgopen_2 (int pid, int mpid, int mgen, int mdesc)
 {
 	int i, r;
 
-	spinlock_lock (&process_lock);
+	process_table_lock_ex ();
 	for (i = 0; i < NUM_OF_MSGDSC; i++) {
 		if (process[pid].msgdsc[i].pid == 0 &&
 		    process[pid].msgdsc[i].gen == 0)
@@ -247,7 +320,7 @@ found:
 	process[pid].msgdsc[i].dsc = mdesc;
 	r = i;
 ret:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return r;
 }
 
@@ -259,13 +332,13 @@ process_new (int frompid, void *bin, int stacksize)
 	ulong rip;
 	phys_t mm_phys;
 
-	spinlock_lock (&process_lock);
+	process_table_lock_ex ();
 	for (pid = 1; pid < NUM_OF_PID; pid++) {
 		if (!process[pid].valid)
 			goto found;
 	}
 err:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return -1;
 found:
 	if (mm_process_alloc (&phys) < 0) /* alloc page directories and init */
@@ -305,7 +378,7 @@ found:
 #endif
 	process[pid].msgdsc[0].func = (void *)rip;
 	mm_process_switch (mm_phys);
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return _msgopen_2 (frompid, pid, gen, 0);
 }
 
@@ -330,7 +403,8 @@ process_kill (bool (*func) (void *data), void *data)
 
 /* free any resources of a process */
 /* CR3 must be the process's one */
-/* process_lock must be locked */
+/* process_lock must be locked exclusively and process[pid].lock must
+   be locked */
 static void
 cleanup (int pid, phys_t mm_phys)
 {
@@ -366,7 +440,7 @@ own_process64_msrs (void (*func) (void *data), void *data)
 
 /* pid, func=pointer to the function of the process,
    sp=stack pointer of the process */
-/* process_lock must be locked */
+/* the process must be pinned by process[pid].running */
 static int
 call_msgfunc0 (int pid, void *func, ulong sp)
 {
@@ -381,8 +455,6 @@ call_msgfunc0 (int pid, void *func, ulong sp)
 	}
 	oldpid = currentcpu->pid;
 	currentcpu->pid = pid;
-	process[pid].running++;
-	spinlock_unlock (&process_lock);
 	if (own_process64_msrs (release_process64_msrs, NULL))
 		set_process64_msrs ();
 	asm volatile (
@@ -420,12 +492,27 @@ call_msgfunc0 (int pid, void *func, ulong sp)
 		, "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"
 #endif
 		);
-	spinlock_lock (&process_lock);
-	process[pid].running--;
 	currentcpu->pid = oldpid;
 	return (int)ax;
 }
 
+/* free the process if it has exited and nobody is calling it */
+static void
+process_exit (int pid, int gen)
+{
+	phys_t mm_phys;
+
+	process_table_lock_ex ();
+	process_mm_lock (pid);
+	if (process[pid].valid && process[pid].gen == gen &&
+	    process[pid].running == 0 && process[pid].exitflag) {
+		mm_phys = mm_process_switch (process[pid].mm_phys);
+		cleanup (pid, mm_phys);
+	}
+	process_mm_unlock (pid);
+	process_table_unlock_ex ();
+}
+
 /* pid, gen, desc, arg=arguments, len=length of the arguments (bytes) */
 static int
 call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
@@ -440,13 +527,14 @@ call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
 	int i;
 	long tmp;
 	int stacksize;
+	bool exiting;
 
 	asm_rdrsp ((ulong *)&curstk);
 	if ((u8 *)curstk - (u8 *)currentcpu->stackaddr < VMM_MINSTACKSIZE) {
 		printf ("msg: not enough stack space available for VMM\n");
 		return r;
 	}
-	spinlock_lock (&process_lock);
+	process_table_lock_sh ();
 	ASSERT (pid >= 0);
 	ASSERT (pid < NUM_OF_PID);
 	if (!process[pid].valid)
@@ -455,18 +543,23 @@ call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
 	ASSERT (desc < NUM_OF_MSGDSC);
 	if (process[pid].gen != gen)	
 		goto ret;
-	if (process[pid].msgdsc[desc].func == NULL)
+	func = (int (*)(int, int, struct msgbuf *, int))
+		process[pid].msgdsc[desc].func;
+	if (func == NULL)
 		goto ret;
 	if (pid == 0) {
 		ASSERT (len == sizeof (long) * 2);
-		func = (int (*)(int, int, struct msgbuf *, int))
-			process[pid].msgdsc[desc].func;
-		spinlock_unlock (&process_lock);
+		process_table_unlock_sh ();
 		r = func (((long *)arg)[0], ((long *)arg)[1], buf, bufcnt);
 		return r;
 	}
 	if (bufcnt > MAXNUM_OF_MSGBUF)
 		goto ret;
+	/* pin the process so that it is not freed while the
+	   process_lock is released */
+	process_mm_lock (pid);
+	process_table_unlock_sh ();
+	process[pid].running++;
 	mm_phys = mm_process_switch (process[pid].mm_phys);
 	for (i = 0; i < bufcnt; i++) {
 		if (buf[i].premap_handle) {
@@ -514,7 +607,9 @@ call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
 	memcpy ((void *)sp, arg, len);
 	sp -= sizeof (ulong);
 	*(ulong *)sp = 0x3FFFF100;
-	r = call_msgfunc0 (pid, process[pid].msgdsc[desc].func, sp);
+	process_mm_unlock (pid);
+	r = call_msgfunc0 (pid, func, sp);
+	process_mm_lock (pid);
 	mm_process_unmap_stack (sp2, stacksize);
 mapfail:
 	for (i = 0; i < bufcnt; i++) {
@@ -522,11 +617,15 @@ mapfail:
 			continue;
 		mm_process_unmap ((virt_t)buf_user[i].base, buf_user[i].len);
 	}
-	if (process[pid].running == 0 && process[pid].exitflag)
-		cleanup (pid, mm_phys);
+	process[pid].running--;
+	exiting = process[pid].running == 0 && process[pid].exitflag;
 	mm_process_switch (mm_phys);
+	process_mm_unlock (pid);
+	if (exiting)
+		process_exit (pid, gen);
+	return r;
 ret:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_sh ();
 	return r;
 }
 
@@ -536,10 +635,10 @@ _msgsetfunc (int pid, int desc, void *func)
 {
 	void *oldfunc;
 
-	spinlock_lock (&process_lock);
+	process_table_lock_ex ();
 	oldfunc = process[pid].msgdsc[desc].func;
 	process[pid].msgdsc[desc].func = func;
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return oldfunc;
 }
 
@@ -567,7 +666,7 @@ _msgregister (int pid, char *name, void *func)
 {
 	int r, i;
 
-	spinlock_lock (&process_lock);
+	process_table_lock_ex ();
 	for (i = 0; i < NUM_OF_MSGDSC; i++) {
 		if (!process[pid].msgdsc[i].func)
 			goto found;
@@ -583,7 +682,7 @@ found:
 		r = i;
 	}
 ret:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return r;
 }
 
@@ -647,10 +746,10 @@ static int
 _msgclose (int pid, int desc)
 {
 	if (desc >= 0 && desc < NUM_OF_MSGDSC) {
-		spinlock_lock (&process_lock);
+		process_table_lock_ex ();
 		process[pid].msgdsc[desc].pid = 0;
 		process[pid].msgdsc[desc].gen = 0;
-		spinlock_unlock (&process_lock);
+		process_table_unlock_ex ();
 		return 0;
 	}
 	return -1;
@@ -679,11 +778,11 @@ _msgsendint (int pid, int desc, int data)
 
 	d[0] = MSG_INT;
 	d[1] = data;
-	spinlock_lock (&process_lock);
+	process_table_lock_sh ();
 	mpid = process[pid].msgdsc[desc].pid;
 	mgen = process[pid].msgdsc[desc].gen;
 	mdesc = process[pid].msgdsc[desc].dsc;
-	spinlock_unlock (&process_lock);
+	process_table_unlock_sh ();
 	return call_msgfunc1 (mpid, mgen, mdesc, d, sizeof (d), NULL, 0);
 }
 
@@ -719,7 +818,7 @@ _msgsenddesc (int frompid, int todesc, int senddesc)
 		return -1;
 	if (todesc < 0 || todesc >= NUM_OF_MSGDSC)
 		return -1;
-	spinlock_lock (&process_lock);
+	process_table_lock_ex ();
 	topid = process[frompid].msgdsc[todesc].pid;
 	togen = process[frompid].msgdsc[todesc].gen;
 	ASSERT (topid >= 0);
@@ -740,7 +839,7 @@ found:
 	process[topid].msgdsc[i].dsc = process[frompid].msgdsc[senddesc].dsc;
 	r = i;
 ret:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_ex ();
 	return r;
 }
 
@@ -815,11 +914,11 @@ _msgsendbuf (int pid, int desc, int data, struct msgbuf *buf, int bufcnt)
 
 	d[0] = MSG_BUF;
 	d[1] = data;
-	spinlock_lock (&process_lock);
+	process_table_lock_sh ();
 	mpid = process[pid].msgdsc[desc].pid;
 	mgen = process[pid].msgdsc[desc].gen;
 	mdesc = process[pid].msgdsc[desc].dsc;
-	spinlock_unlock (&process_lock);
+	process_table_unlock_sh ();
 	return call_msgfunc1 (mpid, mgen, mdesc, d, sizeof (d), buf, bufcnt);
 }
 
@@ -912,10 +1011,11 @@ static ulong
 sys_setlimit (ulong ip, ulong sp, ulong num, ulong si, ulong di)
 {
 	int r = -1;
+	int pid = currentcpu->pid;
 	virt_t tmp;
 
-	spinlock_lock (&process_lock);
-	if (process[currentcpu->pid].setlimit)
+	process_mm_lock (pid);
+	if (process[pid].setlimit)
 		goto ret;
 	if (si < PAGESIZE)
 		si = PAGESIZE;
@@ -926,13 +1026,13 @@ sys_setlimit (ulong ip, ulong sp, ulong num, ulong si, ulong di)
 		goto ret;
 	r = mm_process_unmap_stack (tmp, di);
 	if (r) {
-		spinlock_unlock (&process_lock);
+		process_mm_unlock (pid);
 		panic ("unmap stack failed");
 	}
-	process[currentcpu->pid].setlimit = true;
-	process[currentcpu->pid].stacksize = si;
+	process[pid].setlimit = true;
+	process[pid].stacksize = si;
 ret:
-	spinlock_unlock (&process_lock);
+	process_mm_unlock (pid);
 	return (ulong)r;
 }
 
@@ -943,7 +1043,7 @@ msgpremapbuf (int desc, struct msgbuf *buf)
 	int topid, togen;
 	void *base_user = NULL;
 
-	spinlock_lock (&process_lock);
+	process_table_lock_sh ();
 	topid = process[0].msgdsc[desc].pid;
 	togen = process[0].msgdsc[desc].gen;
 	if (topid == 0)
@@ -954,12 +1054,17 @@ msgpremapbuf (int desc, struct msgbuf *buf)
 		goto ret;
 	if (process[topid].gen != togen)	
 		goto ret;
+	process_mm_lock (topid);
+	process_table_unlock_sh ();
 	mm_phys = mm_process_switch (process[topid].mm_phys);
 	base_user = mm_process_map_shared (mm_phys, buf->base, buf->len,
 					   !!buf->rw, true);
 	mm_process_switch (mm_phys);
+	process_mm_unlock (topid);
+	goto mapped;
 ret:
-	spinlock_unlock (&process_lock);
+	process_table_unlock_sh ();
+mapped:
 	if (base_user)
 		return (long)buf->base - (long)base_user;
 	else
@@ -1049,5 +1154,6 @@ process_syscall (struct syscall_regs *regs)
 }
 
 INITFUNC ("global3", process_init_global);
+INITFUNC ("paral01", process_init_global_status);
 INITFUNC ("ap0", process_init_ap);
 INITFUNC ("wakeup0", process_wakeup);
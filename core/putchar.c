@@ -32,11 +32,18 @@
 #include "types.h"
 
 static putchar_func_t putchar_func;
+static putchar_func_t volatile putchar_unlocked_func;
 static spinlock_t putchar_lock = SPINLOCK_INITIALIZER;
 
+/* The unlocked function is called without putchar_lock and must be
+ * safe to be called on several processors at the same time. */
 void
 putchar (unsigned char c)
 {
+	putchar_func_t unlocked_func = putchar_unlocked_func;
+
+	if (unlocked_func != NULL)
+		unlocked_func (c);
 	spinlock_lock (&putchar_lock);
 	if (putchar_func != NULL)
 		putchar_func (c);
@@ -52,3 +59,9 @@ putchar_set_func (putchar_func_t newfunc, putchar_func_t *oldfunc)
 	putchar_func = newfunc;
 	spinlock_unlock (&putchar_lock);
 }
+
+void
+putchar_set_unlocked_func (putchar_func_t newfunc)
+{
+	putchar_unlocked_func = newfunc;
+}
@@ -34,5 +34,6 @@ typedef void (*putchar_func_t) (unsigned char);
 
 void putchar (unsigned char c);
 void putchar_set_func (putchar_func_t newfunc, putchar_func_t *oldfunc);
+void putchar_set_unlocked_func (putchar_func_t newfunc);
 
 #endif
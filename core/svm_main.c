@@ -34,6 +34,7 @@
 #include "cpu_mmu.h"
 #include "current.h"
 #include "exint_pass.h"
+#include "exitprof.h"
 #include "mm.h"
 #include "panic.h"
 #include "pcpu.h"
@@ -46,6 +47,7 @@
 #include "svm_regs.h"
 #include "tresor.h"
 #include "thread.h"
+#include "timer.h"
 #include "vmmerr.h"
 #include "vmmcall.h"
 
@@ -487,8 +489,20 @@ do_invlpga (void)
 	current->u.svm.vi.vmcb->rip += 3;
 }
 
+/* Exit codes 0x400 and above (NPF, AVIC, VMGEXIT) are folded into the
+ * top of the exit profile table. */
+static uint
+svm_exitprof_reason (u64 exitcode)
+{
+	if (exitcode < EXITPROF_REASONS - 0x10)
+		return exitcode;
+	if (exitcode >= 0x400 && exitcode < 0x40F)
+		return EXITPROF_REASONS - 0x10 + (exitcode - 0x400);
+	return EXITPROF_REASONS - 1;
+}
+
 static void
-svm_exit_code (void)
+svm_exit_code_sub (void)
 {
 	switch (current->u.svm.vi.vmcb->exitcode) {
 	case VMEXIT_EXCP14:	/* Page fault */
@@ -612,6 +626,17 @@ svm_exit_code (void)
 	}
 }
 
+static void
+svm_exit_code (void)
+{
+	u64 exitprof;
+
+	exitprof = exitprof_begin ();
+	svm_exit_code_sub ();
+	exitprof_end (exitprof,
+		      svm_exitprof_reason (current->u.svm.vi.vmcb->exitcode));
+}
+
 static void
 svm_tlbflush (void)
 {
@@ -649,6 +674,7 @@ svm_mainloop (void)
         if (currentcpu->cpunum != 0)
         tresor_init_ap();
 #endif
+		timer_poll ();
 		schedule ();
 		panic_test ();
 		if (current->sx_init.get_init_count ())
@@ -27,9 +27,13 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "asm.h"
 #include "cache.h"
+#include "callrealmode.h"
+#include "config.h"
 #include "constants.h"
 #include "current.h"
+#include "exitprof.h"
 #include "mm.h"
 #include "panic.h"
 #include "printf.h"
@@ -42,10 +46,13 @@
 struct svm_np {
 	int cnt;
 	int cleared;
+	bool eager;
+	bool page1g;
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
 	void *tbl[NUM_OF_NPTBL];
 	phys_t tbl_phys[NUM_OF_NPTBL];
+	int tbl_level[NUM_OF_NPTBL];
 	struct {
 		int level;
 		phys_t gphys;
@@ -53,6 +60,22 @@ struct svm_np {
 	} cur;
 };
 
+static bool
+svm_np_page1g_available (void)
+{
+	u32 a, b, c, d;
+
+	if (PMAP_LEVELS != 4)
+		return false;
+	asm_cpuid (CPUID_EXT_0, 0, &a, &b, &c, &d);
+	if (a < CPUID_EXT_1)
+		return false;
+	asm_cpuid (CPUID_EXT_1, 0, &a, &b, &c, &d);
+	if (!(d & CPUID_EXT_1_EDX_PAGE1GB_BIT))
+		return false;
+	return true;
+}
+
 void
 svm_np_init (void)
 {
@@ -66,6 +89,8 @@ svm_np_init (void)
 	for (i = 0; i < NUM_OF_NPTBL; i++)
 		alloc_page (&np->tbl[i], &np->tbl_phys[i]);
 	np->cnt = 0;
+	np->eager = !!config.vmm.eager_nested_paging;
+	np->page1g = svm_np_page1g_available ();
 	np->cur.level = PMAP_LEVELS;
 	current->u.svm.np = np;
 	current->u.svm.vi.vmcb->n_cr3 = np->ncr3tbl_phys;
@@ -126,6 +151,7 @@ cur_fill (struct svm_np *np, u64 gphys, int level)
 		if (PMAP_LEVELS != 3 || l != 2)
 			e |= PDE_RW_BIT | PDE_US_BIT | PDE_A_BIT;
 		*p = e;
+		np->tbl_level[np->cnt] = l - 1;
 		p = np->tbl[np->cnt++];
 		memset (p, 0, PAGESIZE);
 		p += (gphys >> (9 * l + 3)) & 0x1FF;
@@ -177,6 +203,29 @@ svm_np_map_2mpage (struct svm_np *np, u64 gphys)
 	return false;
 }
 
+static bool
+svm_np_map_1gpage (struct svm_np *np, u64 gphys)
+{
+	u64 hphys;
+	u32 hattr;
+	u64 *p;
+
+	cur_move (np, gphys);
+	if (np->cur.level < 2)
+		return true;
+	hphys = current->gmm.gp2hp_1g (gphys);
+	if (hphys == GMM_GP2HP_1G_FAIL)
+		return true;
+	if (!cache_gmtrr_type_equal (gphys, PAGESIZE1G_MASK))
+		return true;
+	hattr = cache_get_gmtrr_attr (gphys) | PDE_P_BIT | PDE_RW_BIT |
+		PDE_US_BIT | PDE_A_BIT | PDE_D_BIT | PDE_PS_BIT |
+		PDE_AVAILABLE1_BIT;
+	p = cur_fill (np, gphys, 2);
+	*p = hphys | hattr;
+	return false;
+}
+
 static int
 svm_np_level (struct svm_np *np, u64 gphys)
 {
@@ -184,6 +233,50 @@ svm_np_level (struct svm_np *np, u64 gphys)
 	return np->cur.level;
 }
 
+static u64
+svm_np_prebuild_sub (struct svm_np *np, u64 base, u64 end)
+{
+	if (np->page1g && !(base & PAGESIZE1G_MASK) &&
+	    end - base >= PAGESIZE1G && !mmio_range (base, PAGESIZE1G) &&
+	    !svm_np_map_1gpage (np, base))
+		return PAGESIZE1G;
+	if (!(base & PAGESIZE2M_MASK) && end - base >= PAGESIZE2M &&
+	    svm_np_level (np, base) > 0 && !mmio_range (base, PAGESIZE2M) &&
+	    !svm_np_map_2mpage (np, base))
+		return PAGESIZE2M;
+	if (!mmio_range (base, PAGESIZE))
+		svm_np_map_page_sub (np, false, base);
+	return PAGESIZE;
+}
+
+/* Map the memory ranges of the guest system memory map eagerly, like
+ * vt_ept_prebuild().  Stop before the fixed table pool would have to
+ * be wiped. */
+static void
+svm_np_prebuild (struct svm_np *np)
+{
+	u32 n, nn, type;
+	u64 base, len, end;
+
+	n = 0;
+	for (nn = 1; nn; n = nn) {
+		nn = getfakesysmemmap (n, &base, &len, &type);
+		if (!len)
+			continue;
+		if (type != SYSMEMMAP_TYPE_AVAILABLE &&
+		    type != SYSMEMMAP_TYPE_ACPI_RECLAIM &&
+		    type != SYSMEMMAP_TYPE_ACPI_NVS)
+			continue;
+		end = (base + len) & ~PAGESIZE_MASK;
+		base = (base + PAGESIZE_MASK) & ~PAGESIZE_MASK;
+		for (; base < end; base += len) {
+			if (np->cnt + PMAP_LEVELS > NUM_OF_NPTBL)
+				return;
+			len = svm_np_prebuild_sub (np, base, end);
+		}
+	}
+}
+
 static void
 svm_np_map_page_clear_cleared (struct svm_np *np)
 {
@@ -216,6 +309,8 @@ svm_np_map_page_clear_cleared (struct svm_np *np)
 			len -= size;
 		}
 	}
+	if (np->eager)
+		svm_np_prebuild (np);
 	if (np->cleared)
 		panic ("%s: error", __func__);
 }
@@ -236,7 +331,14 @@ svm_np_pagefault (bool write, u64 gphys)
 	struct svm_np *np;
 
 	np = current->u.svm.np;
+	exitprof_tag (EXITPROF_TAG_EPT, gphys & ~PAGESIZE1G_MASK);
 	mmio_lock ();
+	if (np->eager && np->cleared) {
+		/* The access is retried after the map is rebuilt */
+		svm_np_map_page_clear_cleared (np);
+		mmio_unlock ();
+		return;
+	}
 	if (svm_np_level (np, gphys) > 0 &&
 	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
 	    !svm_np_map_2mpage (np, gphys))
@@ -286,7 +388,11 @@ svm_np_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 				continue;
 			tmp1 = e[j] & mask;
 			tmp2 = tmp1 | 07777;
-			if (e[j] & PDE_AVAILABLE1_BIT) {
+			if ((e[j] & PDE_AVAILABLE1_BIT) &&
+			    np->tbl_level[i] == 2) {
+				tmp1 &= ~PAGESIZE1G_MASK;
+				tmp2 |= PAGESIZE1G_MASK;
+			} else if (e[j] & PDE_AVAILABLE1_BIT) {
 				tmp1 &= ~07777777;
 				tmp2 |= 07777777;
 			}
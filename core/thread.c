@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "asm.h"
 #include "assert.h"
 #include "cpu.h"
 #include "initfunc.h"
@@ -40,6 +41,7 @@
 #include "string.h"
 #include "thread.h"
 #include "thread_switch.h"
+#include "vmmcall_status.h"
 
 #define MAXNUM_OF_THREADS	256
 #define CPUNUM_ANY		-1
@@ -68,24 +70,124 @@ struct thread_context {
 	ulong r12, r13, r14_edi, r15_esi, rbx, rbp, rip;
 };
 
+struct thread_event_waiter {
+	struct thread_event_waiter *next;
+	tid_t tid;
+	bool volatile woken;
+};
+
 struct thread_data {
 	LIST1_DEFINE (struct thread_data);
 	struct thread_context *context;
 	tid_t tid;
-	enum thread_state state;
+	u32 volatile state;
 	int cpunum;
 	bool boot;
 	void *stack;
 	int pid;
 	ulong syscallstack;
 	phys_t process_switch;
+	struct thread_runq *home;
+	u64 run_start, runtime;
+	u64 wakeup_time, latency, latency_max;
+	u32 switches, wakeups;
+	struct thread_event_waiter waiter;
+};
+
+/* Each physical CPU has its own run queue.  A thread pinned to a CPU
+ * is only ever queued on that CPU's run queue.  A CPUNUM_ANY thread
+ * is queued where it was created or woken up, and an idle CPU steals
+ * it from other run queues.  runq_global holds threads created or
+ * woken up on a CPU whose run queue is not ready yet.  Pinned ones
+ * among them are moved to their CPU's run queue when it is set up. */
+struct thread_runq {
+	LIST1_DEFINE_HEAD (struct thread_data, list);
+	LOCK_DEFINE (lock);
+	int volatile n, nany;
+	struct thread_runq *next;
 };
 
 static struct thread_data td[MAXNUM_OF_THREADS];
 static LIST1_DEFINE_HEAD (struct thread_data, td_free);
-static LIST1_DEFINE_HEAD (struct thread_data, td_runnable);
 static LOCK_DEFINE (thread_lock);
-static void *old_stack;
+static struct thread_runq runq_global;
+static u32 volatile runq_nany;
+static u32 stat_steal;
+
+static u64
+thread_rdtsc (void)
+{
+	u32 a, d;
+
+	asm_rdtsc (&a, &d);
+	return ((u64)d << 32) | a;
+}
+
+static void
+thread_runq_init (struct thread_runq *rq)
+{
+	LIST1_HEAD_INIT (rq->list);
+	LOCK_INIT (&rq->lock);
+	rq->n = 0;
+	rq->nany = 0;
+	rq->next = NULL;
+}
+
+/* rq->lock must be held */
+static void
+thread_runq_add (struct thread_runq *rq, struct thread_data *d)
+{
+	LIST1_ADD (rq->list, d);
+	rq->n++;
+	if (d->cpunum == CPUNUM_ANY) {
+		rq->nany++;
+		asm_lock_incl ((u32 *)&runq_nany);
+	}
+}
+
+/* rq->lock must be held */
+static void
+thread_runq_del (struct thread_runq *rq, struct thread_data *d)
+{
+	LIST1_DEL (rq->list, d);
+	rq->n--;
+	if (d->cpunum == CPUNUM_ANY) {
+		rq->nany--;
+		asm_lock_decl ((u32 *)&runq_nany);
+	}
+}
+
+static struct thread_runq *
+thread_runq_local (void)
+{
+	struct thread_runq *rq;
+
+	if (currentcpu_available ()) {
+		rq = currentcpu->thread.runq;
+		if (rq)
+			return rq;
+	}
+	return &runq_global;
+}
+
+static void
+thread_enqueue (struct thread_data *d)
+{
+	struct thread_runq *rq;
+
+retry:
+	rq = d->home;
+	if (!rq)
+		rq = thread_runq_local ();
+	LOCK_LOCK (&rq->lock);
+	if (rq == &runq_global && d->home) {
+		/* thread_init_pcpu() has just set the home */
+		LOCK_UNLOCK (&rq->lock);
+		goto retry;
+	}
+	thread_runq_add (rq, d);
+	LOCK_UNLOCK (&rq->lock);
+}
 
 static void
 thread_data_init (struct thread_data *d, struct thread_context *c, void *stack,
@@ -98,6 +200,16 @@ thread_data_init (struct thread_data *d, struct thread_context *c, void *stack,
 	d->pid = 0;
 	d->syscallstack = 0;
 	d->process_switch = 1;
+	d->home = NULL;
+	if (cpunum != CPUNUM_ANY)
+		d->home = currentcpu->thread.runq;
+	d->run_start = 0;
+	d->runtime = 0;
+	d->wakeup_time = 0;
+	d->latency = 0;
+	d->latency_max = 0;
+	d->switches = 0;
+	d->wakeups = 0;
 	d->state = THREAD_RUN;
 }
 
@@ -119,10 +231,41 @@ thread_gettid (void)
 	return currentcpu->thread.tid;
 }
 
+/* Called on the new thread's stack with the run queue lock held.
+ * The previous thread's context has been saved at this point, so it
+ * is now safe to make it visible to other CPUs. */
 static void
 switched (void)
 {
-	LOCK_UNLOCK (&thread_lock);
+	struct thread_runq *rq = currentcpu->thread.runq;
+	struct thread_data *d = &td[currentcpu->thread.prev];
+	void *stack = NULL;
+	u32 state;
+
+	switch (d->state) {
+	case THREAD_EXIT:
+		stack = d->stack;
+		LOCK_LOCK (&thread_lock);
+		LIST1_ADD (td_free, d);
+		LOCK_UNLOCK (&thread_lock);
+		break;
+	case THREAD_RUN:
+		thread_runq_add (rq, d);
+		break;
+	case THREAD_WILL_STOP:
+		state = THREAD_WILL_STOP;
+		if (asm_lock_cmpxchgl ((u32 *)&d->state, &state, THREAD_STOP))
+			/* Woken up before it stopped */
+			thread_runq_add (rq, d);
+		break;
+	case THREAD_STOP:
+	default:
+		panic ("schedule: bad state tid=%d state=%d",
+		       d->tid, d->state);
+	}
+	LOCK_UNLOCK (&rq->lock);
+	if (stack)
+		free (stack);
 }
 
 static bool
@@ -143,53 +286,84 @@ schedule_skip (bool start)
 	return false;
 }
 
+/* Take a CPUNUM_ANY thread from another run queue.  The run queue
+ * lock of the current CPU must not be held. */
+static struct thread_data *
+thread_steal (struct thread_runq *self)
+{
+	struct thread_runq *rq;
+	struct thread_data *d;
+
+	for (rq = &runq_global; rq; rq = rq->next) {
+		if (rq == self || !rq->nany)
+			continue;
+		LOCK_LOCK (&rq->lock);
+		LIST1_FOREACH (rq->list, d) {
+			if (d->cpunum == CPUNUM_ANY) {
+				thread_runq_del (rq, d);
+				LOCK_UNLOCK (&rq->lock);
+				STATUS_UPDATE (asm_lock_incl (&stat_steal));
+				return d;
+			}
+		}
+		LOCK_UNLOCK (&rq->lock);
+	}
+	return NULL;
+}
+
 void
 schedule (void)
 {
-	struct thread_data *d;
-	tid_t oldtid, newtid;
+	struct thread_runq *rq;
+	struct thread_data *d, *old;
+	u64 now, lat;
 
+	rq = currentcpu->thread.runq;
+	if (!rq)
+		return;
 	if (schedule_skip (true))
 		return;
-	LOCK_LOCK (&thread_lock);
-	if (old_stack) {
-		free (old_stack);
-		old_stack = NULL;
-	}
-	LIST1_FOREACH (td_runnable, d) {
-		if (d->cpunum == CPUNUM_ANY ||
-		    d->cpunum == currentcpu->cpunum)
-			goto found;
+	/* Fast path: nothing to run here and nothing to steal */
+	if (!rq->n && !runq_nany)
+		goto skip;
+	d = NULL;
+	if (!rq->n)
+		d = thread_steal (rq);
+	LOCK_LOCK (&rq->lock);
+	if (!d) {
+		d = LIST1_POP (rq->list);
+		if (!d) {
+			LOCK_UNLOCK (&rq->lock);
+			goto skip;
+		}
+		rq->n--;
+		if (d->cpunum == CPUNUM_ANY) {
+			rq->nany--;
+			asm_lock_decl ((u32 *)&runq_nany);
+		}
 	}
-	LOCK_UNLOCK (&thread_lock);
-	schedule_skip (false);
-	return;
-found:
-	LIST1_DEL (td_runnable, d);
-	oldtid = currentcpu->thread.tid;
-	newtid = d->tid;
-	currentcpu->thread.tid = newtid;
-	thread_data_save_and_load (&td[oldtid], d);
-	switch (td[oldtid].state) {
-	case THREAD_EXIT:
-		old_stack = td[oldtid].stack;
-		LIST1_ADD (td_free, &td[oldtid]);
-		break;
-	case THREAD_RUN:
-		LIST1_ADD (td_runnable, &td[oldtid]);
-		break;
-	case THREAD_WILL_STOP:
-		td[oldtid].state = THREAD_STOP;
-		break;
-	case THREAD_STOP:
-	default:
-		panic ("schedule: bad state tid=%d state=%d",
-		       oldtid, td[oldtid].state);
+	old = &td[currentcpu->thread.tid];
+	now = thread_rdtsc ();
+	old->runtime += now - old->run_start;
+	d->run_start = now;
+	d->switches++;
+	if (d->wakeup_time) {
+		lat = now - d->wakeup_time;
+		d->latency += lat;
+		if (d->latency_max < lat)
+			d->latency_max = lat;
+		d->wakeup_time = 0;
 	}
+	currentcpu->thread.prev = old->tid;
+	currentcpu->thread.tid = d->tid;
+	thread_data_save_and_load (old, d);
 	if (d->cpunum != CPUNUM_ANY)
 		schedule_skip (false);
-	thread_switch (&td[oldtid].context, d->context, 0);
+	thread_switch (&old->context, d->context, 0);
 	switched ();
+	return;
+skip:
+	schedule_skip (false);
 }
 
 asmlinkage void
@@ -201,23 +375,21 @@ thread_start1 (void (*func) (void *), void *arg)
 }
 
 static tid_t
-thread_new0 (struct thread_context *c, void *stack)
+thread_new0 (struct thread_context *c, void *stack, int cpunum)
 {
 	struct thread_data *d;
-	tid_t r;
 
 	LOCK_LOCK (&thread_lock);
 	d = LIST1_POP (td_free);
-	ASSERT (d);
-	thread_data_init (d, c, stack, CPUNUM_ANY);
-	LIST1_ADD (td_runnable, d);
-	r = d->tid;
 	LOCK_UNLOCK (&thread_lock);
-	return r;
+	ASSERT (d);
+	thread_data_init (d, c, stack, cpunum);
+	thread_enqueue (d);
+	return d->tid;
 }
 
-tid_t
-thread_new (void (*func) (void *), void *arg, int stacksize)
+static tid_t
+thread_new1 (void (*func) (void *), void *arg, int stacksize, int cpunum)
 {
 	u8 *stack, *q;
 	struct thread_context c;
@@ -231,19 +403,26 @@ thread_new (void (*func) (void *), void *arg, int stacksize)
 	PUSH (func);
 	PUSH (c);
 #undef PUSH
-	return thread_new0 ((struct thread_context *)q, stack);
+	return thread_new0 ((struct thread_context *)q, stack, cpunum);
+}
+
+tid_t
+thread_new (void (*func) (void *), void *arg, int stacksize)
+{
+	return thread_new1 (func, arg, stacksize, CPUNUM_ANY);
+}
+
+/* create a thread which runs on the current physical CPU only */
+tid_t
+thread_new_pcpu (void (*func) (void *), void *arg, int stacksize)
+{
+	return thread_new1 (func, arg, stacksize, currentcpu->cpunum);
 }
 
 static enum thread_state
 thread_set_state (tid_t tid, enum thread_state state)
 {
-	enum thread_state oldstate;
-
-	LOCK_LOCK (&thread_lock);
-	oldstate = td[tid].state;
-	td[tid].state = state;
-	LOCK_UNLOCK (&thread_lock);
-	return oldstate;
+	return asm_lock_xchgl ((u32 *)&td[tid].state, state);
 }
 
 void
@@ -256,9 +435,9 @@ thread_wakeup (tid_t tid)
 	case THREAD_WILL_STOP:
 		break;
 	case THREAD_STOP:
-		LOCK_LOCK (&thread_lock);
-		LIST1_ADD (td_runnable, &td[tid]);
-		LOCK_UNLOCK (&thread_lock);
+		td[tid].wakeups++;
+		td[tid].wakeup_time = thread_rdtsc ();
+		thread_enqueue (&td[tid]);
 		break;
 	case THREAD_EXIT:
 	default:
@@ -309,15 +488,72 @@ thread_exit (void)
 	schedule ();
 }
 
+void
+thread_event_init (struct thread_event *ev)
+{
+	spinlock_init (&ev->lock);
+	ev->signaled = false;
+	ev->waiter = NULL;
+}
+
+/* Sleep until the event is signaled.  A signal sent while nobody is
+ * waiting is remembered and consumed by the next wait. */
+void
+thread_event_wait (struct thread_event *ev)
+{
+	tid_t tid = currentcpu->thread.tid;
+	struct thread_event_waiter *w = &td[tid].waiter;
+
+	spinlock_lock (&ev->lock);
+	if (ev->signaled) {
+		ev->signaled = false;
+		spinlock_unlock (&ev->lock);
+		return;
+	}
+	w->tid = tid;
+	w->woken = false;
+	w->next = ev->waiter;
+	ev->waiter = w;
+	while (!w->woken) {
+		if (td[tid].state == THREAD_RUN)
+			thread_will_stop ();
+		spinlock_unlock (&ev->lock);
+		schedule ();
+		spinlock_lock (&ev->lock);
+	}
+	spinlock_unlock (&ev->lock);
+}
+
+/* Wake up all threads waiting for the event */
+void
+thread_event_signal (struct thread_event *ev)
+{
+	struct thread_event_waiter *w, *next;
+	tid_t tid;
+
+	spinlock_lock (&ev->lock);
+	w = ev->waiter;
+	ev->waiter = NULL;
+	if (!w)
+		ev->signaled = true;
+	for (; w; w = next) {
+		next = w->next;
+		tid = w->tid;
+		w->woken = true;
+		thread_wakeup (tid);
+	}
+	spinlock_unlock (&ev->lock);
+}
+
 static void
 thread_init_global (void)
 {
 	int i;
 
 	LIST1_HEAD_INIT (td_free);
-	LIST1_HEAD_INIT (td_runnable);
 	LOCK_INIT (&thread_lock);
-	old_stack = NULL;
+	thread_runq_init (&runq_global);
+	runq_nany = 0;
 	for (i = 0; i < MAXNUM_OF_THREADS; i++) {
 		td[i].tid = i;
 		td[i].state = THREAD_EXIT;
@@ -325,19 +561,83 @@ thread_init_global (void)
 	}
 }
 
+/* Give threads pinned to the current CPU before its run queue existed
+ * their home, and move the queued ones from runq_global */
+static void
+thread_adopt_pinned (struct thread_runq *rq)
+{
+	struct thread_data *d, *next;
+	int i;
+
+	LOCK_LOCK (&runq_global.lock);
+	for (i = 0; i < MAXNUM_OF_THREADS; i++) {
+		d = &td[i];
+		if (d->state != THREAD_EXIT && !d->home &&
+		    d->cpunum == currentcpu->cpunum)
+			d->home = rq;
+	}
+	LIST1_FOREACH_DELETABLE (runq_global.list, d, next) {
+		if (d->home != rq)
+			continue;
+		thread_runq_del (&runq_global, d);
+		LOCK_LOCK (&rq->lock);
+		thread_runq_add (rq, d);
+		LOCK_UNLOCK (&rq->lock);
+	}
+	LOCK_UNLOCK (&runq_global.lock);
+}
+
 static void
 thread_init_pcpu (void)
 {
 	struct thread_data *d;
+	struct thread_runq *rq;
 
+	rq = alloc (sizeof *rq);
+	thread_runq_init (rq);
+	currentcpu->thread.runq = rq;
 	LOCK_LOCK (&thread_lock);
 	d = LIST1_POP (td_free);
 	ASSERT (d);
 	thread_data_init (d, NULL, NULL, currentcpu->cpunum);
 	d->boot = true;
+	d->run_start = thread_rdtsc ();
 	currentcpu->thread.tid = d->tid;
+	rq->next = runq_global.next;
+	runq_global.next = rq;
 	LOCK_UNLOCK (&thread_lock);
+	thread_adopt_pinned (rq);
+}
+
+static char *
+thread_status (void)
+{
+	static char buf[4096];
+	static const char statechar[] = "XRWS";
+	struct thread_data *d;
+	int i, n;
+
+	n = snprintf (buf, sizeof buf, "threads: steals %u\n", stat_steal);
+	for (i = 0; i < MAXNUM_OF_THREADS && n < sizeof buf; i++) {
+		d = &td[i];
+		if (d->state == THREAD_EXIT)
+			continue;
+		n += snprintf (buf + n, sizeof buf - n,
+			       " %3d cpu %2d %c run %llu switches %u"
+			       " wakeups %u latency %llu max %llu\n",
+			       d->tid, d->cpunum, statechar[d->state],
+			       d->runtime, d->switches, d->wakeups,
+			       d->latency, d->latency_max);
+	}
+	return buf;
+}
+
+static void
+thread_init_status (void)
+{
+	register_status_callback (thread_status);
 }
 
 INITFUNC ("global3", thread_init_global);
 INITFUNC ("pcpu0", thread_init_pcpu);
+INITFUNC ("paral01", thread_init_status);
@@ -32,8 +32,12 @@
 
 #include <core/thread.h>
 
+struct thread_runq;
+
 struct thread_pcpu_data {
 	tid_t tid;
+	tid_t prev;
+	struct thread_runq *runq;
 };
 
 #endif
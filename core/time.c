@@ -45,21 +45,63 @@
 #include "time.h"
 #include "vmmcall_status.h"
 
+#define ACPI_TIMER_HZ		3579545
+#define TSC_SYNC_LOOPS		1000
+#define TIME_BENCH_LOOPS	100000
+
 static u64 lastcputime;
 static u64 lastacpitime;
+static u32 acpi_mul;
+static unsigned int acpi_shift;
+static spinlock_t tsc_sync_lock;
+static u64 tsc_sync_last, tsc_sync_warp;
+static u64 tsc_sync_base, tsc_sync_hz;
+static bool tsc_sync_fail;
 
-static u64
-tsc_to_time (u64 tsc, u64 hz)
+/* Calculate mul and shift so that (count * mul) >> shift
+ * approximates count * 1000000 / hz.  The shift is at least 32 and
+ * is made as large as possible while mul fits in 32 bits.  Only
+ * shifts and subtractions are used since there is no 64-bit
+ * division in the 32-bit VMM. */
+static void
+time_calc_scale (u64 hz, u32 *mul, unsigned int *shift)
 {
-	u64 tmp[2];
+	u64 q, r;
+	unsigned int s;
+	int i;
 
-	while (hz > 0xFFFFFFFFULL) {
-		tsc >>= 1;
-		hz >>= 1;
+	q = 0;
+	r = 0;
+	for (i = 19; i >= 0; i--) { /* 1000000 < 2^20 */
+		r = (r << 1) | ((1000000 >> i) & 1);
+		q <<= 1;
+		if (r >= hz) {
+			r -= hz;
+			q |= 1;
+		}
+	}
+	for (s = 0; s < 63 && (s < 32 || q < 0x80000000ULL); s++) {
+		r <<= 1;
+		q <<= 1;
+		if (r >= hz) {
+			r -= hz;
+			q |= 1;
+		}
 	}
-	mpumul_64_64 (tsc, 1000000ULL, tmp); /* tmp = tsc * 1000000 */
-	mpudiv_128_32 (tmp, (u32)hz, tmp); /* tmp = tmp / hz */
-	return tmp[0];
+	if (q > 0xFFFFFFFFULL)
+		panic ("Frequency %llu Hz too low", hz);
+	*mul = q;
+	*shift = s;
+}
+
+/* (count * mul) >> shift without a 64x32 bit multiplication.  The
+ * result does not decrease when count increases. */
+static u64
+time_scale (u64 count, u32 mul, unsigned int shift)
+{
+	u64 lo = (u32)count, hi = count >> 32;
+
+	return ((lo * mul) >> shift) + ((hi * mul) >> (shift - 32));
 }
 
 static u64
@@ -76,19 +118,28 @@ get_cpu_time_raw (void)
 u64
 get_cpu_time (void)
 {
+	struct pcpu *cpu = currentcpu;
 	u64 tsc, time;
 	u64 lasttime = lasttime;
 
-	asm_lock_cmpxchgq (&lastcputime, &lasttime, lasttime);
 	tsc = get_cpu_time_raw ();
-	time = tsc_to_time (tsc - currentcpu->tsc, currentcpu->hz);
-	time += currentcpu->timediff;
-	if (lasttime <= time) {
+	time = time_scale (tsc - cpu->tsc, cpu->tsc_mul, cpu->tsc_shift);
+	time += cpu->timediff;
+	/* If the TSCs of all processors are synchronized, every
+	 * processor uses the same base and scale and the time is
+	 * monotonic without touching the global variable. */
+	if (cpu->tsc_synced) {
+		cpu->lasttime = time;
+		return time;
+	}
+	asm_lock_cmpxchgq (&lastcputime, &lasttime, lasttime);
+	if (lasttime < time) {
 		asm_lock_cmpxchgq (&lastcputime, &lasttime, time);
 	} else {
-		currentcpu->timediff += lasttime - time;
+		cpu->timediff += lasttime - time;
 		time = lasttime;
 	}
+	cpu->lasttime = time;
 	return time;
 }
 
@@ -96,7 +147,7 @@ bool
 get_acpi_time (u64 *r)
 {
 	u32 tmr, oldtmr;
-	u64 now, tmp[2], oldnow;
+	u64 now, oldnow;
 
 	VAR_IS_INITIALIZED (oldnow);
 	asm_lock_cmpxchgq (&lastacpitime, &oldnow, oldnow);
@@ -110,9 +161,7 @@ get_acpi_time (u64 *r)
 		now += tmr - oldtmr;
 		asm_lock_cmpxchgq (&lastacpitime, &oldnow, now);
 	}
-	mpumul_64_64 (now, 1000000ULL, tmp); /* tmp = now * 1000000 */
-	mpudiv_128_32 (tmp, 3579545U, tmp); /* tmp = tmp / 3579545 */
-	*r = tmp[0];
+	*r = time_scale (now, acpi_mul, acpi_shift);
 	return true;
 }
 
@@ -133,12 +182,54 @@ get_time (void)
 	return ret;
 }
 
+/* Check whether the TSCs of all processors are synchronized.  Every
+ * processor reads its TSC in turn under a lock and a TSC value
+ * smaller than the previous one, which may be read by another
+ * processor, means that the TSCs are not synchronized.  If they are,
+ * all processors use the base and the frequency of the BSP.  When the
+ * APs are started after the BSP, the BSP joins the check again from
+ * time_init_dbsp() and drops tsc_synced if the check fails. */
 static void
-time_init_dbsp (void)
+time_check_tsc_sync (void)
 {
+	u32 tsc_l, tsc_h;
+	u64 tsc;
+	int i;
+
+	if (!currentcpu->use_invariant_tsc)
+		tsc_sync_fail = true;
+	if (currentcpu->cpunum == 0) {
+		tsc_sync_base = currentcpu->tsc;
+		tsc_sync_hz = currentcpu->hz;
+	}
 	sync_all_processors ();
-	usleep (1000000 >> 4);
+	for (i = 0; i < TSC_SYNC_LOOPS && !tsc_sync_fail; i++) {
+		spinlock_lock (&tsc_sync_lock);
+		/* Invariant TSC implies SSE2.  LFENCE prevents RDTSC
+		 * from being executed before getting the lock. */
+		asm volatile ("lfence");
+		asm_rdtsc (&tsc_l, &tsc_h);
+		conv32to64 (tsc_l, tsc_h, &tsc);
+		if (tsc < tsc_sync_last && tsc_sync_warp < tsc_sync_last - tsc)
+			tsc_sync_warp = tsc_sync_last - tsc;
+		tsc_sync_last = tsc;
+		spinlock_unlock (&tsc_sync_lock);
+	}
 	sync_all_processors ();
+	if (!tsc_sync_fail && !tsc_sync_warp) {
+		currentcpu->tsc = tsc_sync_base;
+		currentcpu->hz = tsc_sync_hz;
+		currentcpu->tsc_synced = true;
+	} else {
+		currentcpu->tsc_synced = false;
+	}
+	if (currentcpu->cpunum == 0 && num_of_processors > 0) {
+		if (currentcpu->tsc_synced)
+			printf ("TSCs are synchronized\n");
+		else if (tsc_sync_warp)
+			printf ("TSCs are not synchronized (warp %llu)\n",
+				tsc_sync_warp);
+	}
 }
 
 static void
@@ -176,16 +267,49 @@ time_init_pcpu (void)
 	currentcpu->tsc = tsc1;
 	currentcpu->hz = count;
 	currentcpu->timediff = 0;
+	currentcpu->lasttime = 0;
+	time_check_tsc_sync ();
+	time_calc_scale (currentcpu->hz, &currentcpu->tsc_mul,
+			 &currentcpu->tsc_shift);
+}
+
+/* On UEFI boot the APs are started after the BSP has been initialized.
+ * Do the BSP part of the calibration and the TSC check in
+ * time_init_pcpu() to match the APs. */
+static void
+time_init_dbsp (void)
+{
+	sync_all_processors ();
+	usleep (1000000 >> 4);
+	sync_all_processors ();
+	time_check_tsc_sync ();
+}
+
+static bool
+time_wakeup_lasttime (struct pcpu *cpu, void *data)
+{
+	u64 *lasttime = data;
+
+	if (*lasttime < cpu->lasttime)
+		*lasttime = cpu->lasttime;
+	return false;
 }
 
 static void
 time_wakeup (void)
 {
 	u32 tsc_l, tsc_h;
+	u64 lasttime = 0;
 
 	/* Read current TSC again to keep TSC >= currentcpu->tsc */
 	asm_rdtsc (&tsc_l, &tsc_h);
 	conv32to64 (tsc_l, tsc_h, &currentcpu->tsc);
+	/* The TSCs have been reset.  Continue from the latest time
+	 * of all processors and keep the time monotonic with the
+	 * global variable. */
+	pcpu_list_foreach (time_wakeup_lasttime, &lasttime);
+	currentcpu->timediff = lasttime;
+	currentcpu->tsc_synced = false;
 }
 
 static int
@@ -196,11 +320,42 @@ time_msghandler (int m, int c)
 	return 0;
 }
 
+/* Measure the cost of get_time().  Use "sendint timebench <count>"
+ * in dbgsh. */
+static int
+time_bench_msghandler (int m, int c)
+{
+	u32 tsc_l, tsc_h;
+	u64 tsc1, tsc2, time1, time2, tmp[2];
+	int i, n;
+
+	if (m != 0)
+		return 0;
+	n = c > 0 ? c : TIME_BENCH_LOOPS;
+	time1 = get_time ();
+	asm_rdtsc (&tsc_l, &tsc_h);
+	conv32to64 (tsc_l, tsc_h, &tsc1);
+	for (i = 0; i < n; i++)
+		get_time ();
+	asm_rdtsc (&tsc_l, &tsc_h);
+	conv32to64 (tsc_l, tsc_h, &tsc2);
+	time2 = get_time ();
+	tmp[0] = tsc2 - tsc1;
+	tmp[1] = 0;
+	mpudiv_128_32 (tmp, n, tmp);
+	printf ("get_time: %d calls %llu us %llu cycles/call cpu %d%s\n",
+		n, time2 - time1, tmp[0], currentcpu->cpunum,
+		currentcpu->tsc_synced ? " (synchronized TSC)" : "");
+	return 0;
+}
+
 static void
 time_init_msg (void)
 {
-	if (false)		/* DEBUG */
+	if (false) {		/* DEBUG */
 		msgregister ("time", time_msghandler);
+		msgregister ("timebench", time_bench_msghandler);
+	}
 }
 
 static char *
@@ -215,11 +370,15 @@ time_status (void)
 		  " tsc: %llu\n"
 		  " lastcputime: %llu\n"
 		  " timediff: %llu\n"
+		  " mul: %u shift: %u\n"
+		  " synced: %d\n"
 		  , currentcpu->cpunum
 		  , currentcpu->hz
 		  , currentcpu->tsc
 		  , lastcputime
-		  , currentcpu->timediff);
+		  , currentcpu->timediff
+		  , currentcpu->tsc_mul, currentcpu->tsc_shift
+		  , currentcpu->tsc_synced);
 	return buf;
 }
 
@@ -234,6 +393,11 @@ time_init_global (void)
 {
 	lastcputime = 0;
 	lastacpitime = 0;
+	spinlock_init (&tsc_sync_lock);
+	tsc_sync_last = 0;
+	tsc_sync_warp = 0;
+	tsc_sync_fail = false;
+	time_calc_scale (ACPI_TIMER_HZ, &acpi_mul, &acpi_shift);
 }
 
 INITFUNC ("global3", time_init_global);
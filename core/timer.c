@@ -27,35 +27,254 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include "comphappy.h"
-#include "constants.h"
+/* Timers are kept in a hierarchical timing wheel per physical CPU.
+ * A timer is queued on the wheel of the CPU that armed it and its
+ * callback is called by the timer thread of that CPU.  The wheel
+ * advances in ticks of 2^TIMER_TICK_SHIFT microseconds.  Level 0
+ * has one slot per tick and each upper level has slots
+ * TIMER_WHEEL_SIZE times wider; timers in an upper level are moved
+ * down when the wheel reaches their slot.  Insert and cancel are
+ * O(1).  The TSC deadline of the earliest possible expiry is checked
+ * by timer_poll() before every VM entry and is also used to program
+ * the VMX-preemption timer, so that a halted guest does not delay
+ * the timers. */
+
+#include "arith.h"
+#include "asm.h"
 #include "initfunc.h"
 #include "list.h"
 #include "mm.h"
+#include "panic.h"
+#include "pcpu.h"
 #include "spinlock.h"
 #include "thread.h"
 #include "time.h"
 #include "timer.h"
 #include "types.h"
 
-#define MAX_TIMER 128
-
-static spinlock_t timer_lock;
+#define MAX_TIMER		128
+#define TIMER_TICK_SHIFT	8
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_NONE		(~0ULL)
 
 struct timer_data {
 	LIST1_DEFINE (struct timer_data);
-	bool enable;
-	u64 settime;
-	u64 interval;
+	struct timer_base *base; /* NULL if not armed */
+	u64 expire;		 /* in ticks */
+	int level, slot;
 	void (*callback) (void *handle, void *data);
 	void *data;
 };
 
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_on);
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_off);
+struct timer_base {
+	spinlock_t lock;
+	u64 clk;		/* next tick to be processed */
+	u64 next;		/* earliest tick that needs processing */
+	u64 volatile next_tsc;	/* TSC value corresponding to next */
+	u64 pending[TIMER_WHEEL_LEVELS];
+	int count;
+	LIST1_DEFINE_HEAD (struct timer_data,
+			   wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE]);
+	struct thread_event event;
+};
+
+static spinlock_t timer_lock;
 static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_free);
-static void timer_thread (void *thread_data);
-static bool timer_thread_run = false;
+static struct timer_base *timer_base_boot;
+
+static u64
+timer_rdtsc (void)
+{
+	u32 a, d;
+
+	asm_rdtsc (&a, &d);
+	return ((u64)d << 32) | a;
+}
+
+static struct timer_base *
+timer_base_local (void)
+{
+	struct timer_base *b = NULL;
+
+	if (currentcpu_available ())
+		b = currentcpu->timer;
+	if (!b)
+		b = timer_base_boot;
+	if (!b)
+		panic ("timer_set: called before timer initialization");
+	return b;
+}
+
+static int
+timer_ffs (u64 v)
+{
+	int i;
+
+	for (i = 0; !(v & 1); i++)
+		v >>= 1;
+	return i;
+}
+
+/* Earliest tick at which the wheel needs to be processed: the first
+ * non-empty level 0 slot or the first tick at which an upper level
+ * slot with timers is moved down.  The current upper level slot has
+ * been moved down already unless clk is on its boundary, in which
+ * case it is moved down at clk. */
+static u64
+timer_base_next (struct timer_base *b)
+{
+	u64 next = TIMER_NONE, t, m, cur;
+	int level, shift, idx;
+
+	if (!b->count)
+		return TIMER_NONE;
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (!b->pending[level])
+			continue;
+		shift = TIMER_WHEEL_BITS * level;
+		cur = b->clk >> shift;
+		idx = cur & TIMER_WHEEL_MASK;
+		m = b->pending[level] >> idx;
+		if (level && (b->clk & ((1ULL << shift) - 1)))
+			m &= ~1ULL;
+		if (m)
+			t = (cur + timer_ffs (m)) << shift;
+		else
+			t = ((cur | TIMER_WHEEL_MASK) + 1) << shift;
+		if (next > t)
+			next = t;
+	}
+	return next;
+}
+
+static void
+timer_base_set_tsc (struct timer_base *b, u64 time)
+{
+	u64 deadline, tmp[2];
+
+	if (b->next == TIMER_NONE) {
+		b->next_tsc = TIMER_NONE;
+		return;
+	}
+	deadline = b->next << TIMER_TICK_SHIFT;
+	if (deadline <= time) {
+		b->next_tsc = 0;
+		return;
+	}
+	mpumul_64_64 (deadline - time, currentcpu->hz, tmp);
+	mpudiv_128_32 (tmp, 1000000, tmp);
+	b->next_tsc = timer_rdtsc () + tmp[0];
+}
+
+static void
+timer_base_add (struct timer_base *b, struct timer_data *p)
+{
+	u64 expire, delta;
+	int level;
+
+	expire = p->expire;
+	if (expire < b->clk)
+		expire = b->clk;
+	delta = expire - b->clk;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+		if (delta < 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+			break;
+	if (delta >= 1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+		expire = b->clk +
+			(1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	p->base = b;
+	p->level = level;
+	p->slot = (expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	LIST1_ADD (b->wheel[p->level][p->slot], p);
+	b->pending[p->level] |= 1ULL << p->slot;
+	b->count++;
+}
+
+static void
+timer_base_del (struct timer_base *b, struct timer_data *p)
+{
+	LIST1_DEL (b->wheel[p->level][p->slot], p);
+	if (!b->wheel[p->level][p->slot].next)
+		b->pending[p->level] &= ~(1ULL << p->slot);
+	b->count--;
+	p->base = NULL;
+}
+
+static void
+timer_base_cascade (struct timer_base *b)
+{
+	struct timer_data *p;
+	int level, idx;
+
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		idx = (b->clk >> (TIMER_WHEEL_BITS * level)) &
+			TIMER_WHEEL_MASK;
+		while ((p = b->wheel[level][idx].next)) {
+			timer_base_del (b, p);
+			timer_base_add (b, p);
+		}
+		if (idx)
+			break;
+	}
+}
+
+static void
+timer_base_run (struct timer_base *b)
+{
+	struct timer_data *p;
+	u64 time, now, next;
+	void (*callback) (void *handle, void *data);
+	void *data;
+	int idx;
+
+	time = get_time ();
+	now = time >> TIMER_TICK_SHIFT;
+	spinlock_lock (&b->lock);
+	while (b->clk <= now) {
+		next = timer_base_next (b);
+		if (next > now) {
+			b->clk = now + 1;
+			break;
+		}
+		b->clk = next;
+		if (!(b->clk & TIMER_WHEEL_MASK))
+			timer_base_cascade (b);
+		idx = b->clk & TIMER_WHEEL_MASK;
+		while ((p = b->wheel[0][idx].next)) {
+			timer_base_del (b, p);
+			callback = p->callback;
+			data = p->data;
+			spinlock_unlock (&b->lock);
+			callback (p, data);
+			spinlock_lock (&b->lock);
+		}
+		b->clk++;
+	}
+	b->next = timer_base_next (b);
+	timer_base_set_tsc (b, time);
+	spinlock_unlock (&b->lock);
+}
+
+/* Remove the timer from the wheel it is queued on, if any.  Retry
+ * because the timer may be moved to another CPU concurrently. */
+static void
+timer_cancel (struct timer_data *p)
+{
+	struct timer_base *b;
+
+	while ((b = p->base)) {
+		spinlock_lock (&b->lock);
+		if (p->base == b) {
+			timer_base_del (b, p);
+			spinlock_unlock (&b->lock);
+			break;
+		}
+		spinlock_unlock (&b->lock);
+	}
+}
 
 void *
 timer_new (void (*callback) (void *handle, void *data), void *data)
@@ -64,44 +283,40 @@ timer_new (void (*callback) (void *handle, void *data), void *data)
 
 	spinlock_lock (&timer_lock);
 	p = LIST1_POP (list1_timer_free);
+	spinlock_unlock (&timer_lock);
 	if (p == NULL)
 		return NULL;
-	p->enable = false;
+	p->base = NULL;
 	p->callback = callback;
 	p->data = data;
-	LIST1_ADD (list1_timer_off, p);
-	spinlock_unlock (&timer_lock);
 	return p;
 }
 
 void
 timer_set (void *handle, u64 interval_usec)
 {
-	struct timer_data *p, *d;
+	struct timer_data *p;
+	struct timer_base *b;
 	u64 time;
 
-	spinlock_lock (&timer_lock);
-	time = get_time ();
 	p = handle;
-	if (!p->enable) {
-		LIST1_DEL (list1_timer_off, p);
-		p->enable = true;
-	} else {
-		LIST1_DEL (list1_timer_on, p);
-	}
-	p->settime = time;
-	p->interval = interval_usec;
-	LIST1_FOREACH (list1_timer_on, d)
-		if (d->interval > (time - d->settime) &&
-		    d->interval - (time - d->settime) > interval_usec)
+	b = timer_base_local ();
+	for (;;) {
+		timer_cancel (p);
+		spinlock_lock (&b->lock);
+		if (!p->base)
 			break;
-	LIST1_INSERT (list1_timer_on, d, p);
-	if (!timer_thread_run) {
-		thread_new (timer_thread, NULL, VMM_STACKSIZE);
-		timer_thread_run = true;
-		/* FIXME: Stop thread when no timers are active. */
+		spinlock_unlock (&b->lock);
 	}
-	spinlock_unlock (&timer_lock);
+	time = get_time ();
+	p->expire = (time + interval_usec + (1 << TIMER_TICK_SHIFT) - 1) >>
+		TIMER_TICK_SHIFT;
+	timer_base_add (b, p);
+	if (b->next > p->expire) {
+		b->next = p->expire < b->clk ? b->clk : p->expire;
+		timer_base_set_tsc (b, time);
+	}
+	spinlock_unlock (&b->lock);
 }
 
 void
@@ -109,50 +324,48 @@ timer_free (void *handle)
 {
 	struct timer_data *p;
 
-	spinlock_lock (&timer_lock);
 	p = handle;
-	if (p->enable)
-		LIST1_DEL (list1_timer_on, p);
-	else
-		LIST1_DEL (list1_timer_off, p);
-	p->enable = false;
+	timer_cancel (p);
+	spinlock_lock (&timer_lock);
 	LIST1_ADD (list1_timer_free, p);
 	spinlock_unlock (&timer_lock);
 }
 
+/* Called before every VM entry: wake up the timer thread of this CPU
+ * if the earliest timer may have expired. */
+void
+timer_poll (void)
+{
+	struct timer_base *b = currentcpu->timer;
+
+	if (!b || b->next_tsc == TIMER_NONE)
+		return;
+	if (timer_rdtsc () < b->next_tsc)
+		return;
+	b->next_tsc = TIMER_NONE;
+	thread_event_signal (&b->event);
+}
+
+/* Get the TSC value at which timer_poll() needs to be called next */
+bool
+timer_deadline (u64 *tsc)
+{
+	struct timer_base *b = currentcpu->timer;
+
+	if (!b || b->next_tsc == TIMER_NONE)
+		return false;
+	*tsc = b->next_tsc;
+	return true;
+}
+
 static void
 timer_thread (void *thread_data)
 {
-	struct timer_data *p;
-	u64 time;
-	bool call;
-	void (*callback) (void *handle, void *data);
-	void *data;
+	struct timer_base *b = thread_data;
 
-	VAR_IS_INITIALIZED (callback);
-	VAR_IS_INITIALIZED (data);
 	for (;;) {
-		call = false;
-		spinlock_lock (&timer_lock);
-		p = LIST1_POP (list1_timer_on);
-		if (p) {
-			time = get_time ();
-			if (p->enable && (time - p->settime) >= p->interval) {
-				p->enable = false;
-				call = true;
-				callback = p->callback;
-				data = p->data;
-			}
-			if (p->enable)
-				LIST1_PUSH (list1_timer_on, p);
-			else
-				LIST1_ADD (list1_timer_off, p);
-		}
-		spinlock_unlock (&timer_lock);
-		if (call)
-			callback (p, data);
-		else
-			schedule ();
+		thread_event_wait (&b->event);
+		timer_base_run (b);
 	}
 }
 
@@ -162,13 +375,39 @@ timer_init_global (void)
 	struct timer_data *p;
 	int i;
 
-	LIST1_HEAD_INIT (list1_timer_on);
-	LIST1_HEAD_INIT (list1_timer_off);
 	LIST1_HEAD_INIT (list1_timer_free);
 	p = alloc (MAX_TIMER * sizeof (struct timer_data));
 	for (i = 0; i < MAX_TIMER; i++)
 		LIST1_PUSH (list1_timer_free, &p[i]);
 	spinlock_init (&timer_lock);
+	timer_base_boot = NULL;
+}
+
+static void
+timer_init_pcpu (void)
+{
+	struct timer_base *b;
+	int i, j;
+
+	b = alloc (sizeof *b);
+	spinlock_init (&b->lock);
+	b->clk = get_time () >> TIMER_TICK_SHIFT;
+	b->next = TIMER_NONE;
+	b->next_tsc = TIMER_NONE;
+	b->count = 0;
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		b->pending[i] = 0;
+		for (j = 0; j < TIMER_WHEEL_SIZE; j++)
+			LIST1_HEAD_INIT (b->wheel[i][j]);
+	}
+	thread_event_init (&b->event);
+	thread_new_pcpu (timer_thread, b, VMM_STACKSIZE);
+	currentcpu->timer = b;
+	spinlock_lock (&timer_lock);
+	if (!timer_base_boot)
+		timer_base_boot = b;
+	spinlock_unlock (&timer_lock);
 }
 
 INITFUNC ("paral20", timer_init_global);
+INITFUNC ("pcpu41", timer_init_pcpu);
@@ -32,4 +32,7 @@
 
 #include <core/timer.h>
 
+void timer_poll (void);
+bool timer_deadline (u64 *tsc);
+
 #endif
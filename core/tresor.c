@@ -110,7 +110,7 @@ void tresor_init_bsp(void) {
     
     // Find the tresor key in the configuration
     for (j = 0; j < 32; j++) {
-        if (!strcmp(config.storage.keys_conf[j].crypto_name,"tresor")) {
+        if (!memcmp(config.storage.keys_conf[j].crypto_name,"tresor",6)) {
             int idx=config.storage.keys_conf[j].keyindex;
             u8* key = config.storage.keys[idx];
 
@@ -177,7 +177,7 @@ tresor_wakeup() {
     
     // Find hash over key in config
     for (i = 0; i < 32; i++) {
-        if (!strcmp(config.storage.keys_conf[i].crypto_name,"tresor")) {
+        if (!memcmp(config.storage.keys_conf[i].crypto_name,"tresor",6)) {
             int idx=config.storage.keys_conf[i].keyindex;
             key = config.storage.keys[idx];
             salt = config.storage.keys_conf[i].salt;
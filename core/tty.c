@@ -41,11 +41,19 @@
 #include "serial.h"
 #include "spinlock.h"
 #include "string.h"
+#include "time.h"
+#include "timer.h"
 #include "tty.h"
 #include "uefi.h"
 #include "vramwrite.h"
 
 #define PANICMEM_KEY_INVERT "bitvisor panic log"
+#define TTY_LOG_RING_SIZE	8192 /* power of 2 */
+#define TTY_LOG_FLUSH_USEC	10000
+#define TTY_LOG_PANIC_WAIT_USEC	100000
+#define TTY_UDP_PAYLOAD		1472
+#define TTY_SYSLOG_PAYLOAD	1024
+#define TTY_SYSLOG_PREFIX	"bitvisor:"
 
 struct tty_udp_data {
 	LIST1_DEFINE (struct tty_udp_data);
@@ -54,6 +62,33 @@ struct tty_udp_data {
 	void *handle;
 };
 
+/* Characters for the network log are queued in a ring per physical
+ * CPU without taking a lock: head is only written by the CPU that
+ * owns the ring and tail only by the flusher, which is either the
+ * flush timer or the panic handler (see tty_log_flush_begin()).
+ * Before the per-CPU rings are allocated the boot ring, which is
+ * protected by tty_log_boot_lock, is used. */
+struct tty_log_ring {
+	unsigned int volatile head, tail;
+	unsigned int volatile dropped;
+	unsigned int dropped_reported;
+	unsigned int last_head;
+	unsigned char buf[TTY_LOG_RING_SIZE];
+};
+
+struct tty_log_packet {
+	char pkt[14 + 28 + TTY_UDP_PAYLOAD];
+	char data[TTY_UDP_PAYLOAD];
+	int len;
+	int budget;
+};
+
+struct tty_log_flush_data {
+	struct tty_log_packet *p;
+	unsigned int dropped;
+	bool all;
+};
+
 struct ttylog_in_panicmem {
 	u8 key[24];
 	u32 crc;
@@ -66,11 +101,17 @@ static struct {
 	unsigned char log[65536];
 }  __attribute__ ((aligned (0x1000), packed)) logbuf;
 static int ttyin, ttyout;
-static spinlock_t putchar_lock;
 static bool logflag;
 static LIST1_DEFINE_HEAD (struct tty_udp_data, tty_udp_list);
 static unsigned char uefi_log[1024];
 static int uefi_logoffset;
+static struct tty_log_ring tty_log_boot;
+static spinlock_t tty_log_boot_lock;
+static struct tty_log_packet tty_log_pkt;
+static unsigned int tty_log_credit;
+static spinlock_t tty_log_timer_lock;
+static bool tty_log_timer_started;
+static bool tty_log_flushing;
 
 static int
 ttyin_msghandler (int m, int c)
@@ -84,7 +125,7 @@ static int
 ttyout_msghandler (int m, int c)
 {
 	if (m == 0)
-		tty_putchar ((unsigned char)c);
+		putchar ((unsigned char)c);
 	return 0;
 }
 
@@ -142,65 +183,206 @@ mkudp (char *buf, char *src, int sport, char *dst, int dport,
 }
 
 static void
-tty_syslog_putchar (unsigned char c)
+tty_log_packet_send (struct tty_log_packet *p)
 {
-	struct tty_udp_data *p;
-	unsigned int pktsiz = 0;
-	char pkt[64 + 80 + 9];
-	static char buf[80 + 9];
-	static int len;
+	struct tty_udp_data *q;
+	unsigned int pktsiz;
 
-	if ((c < ' ' && c != '\n') || c > '~')
-		return;
-	spinlock_lock (&putchar_lock);
-	if (!len)
-		len = snprintf (buf, sizeof buf, "bitvisor:");
-	buf[len++] = c;
-	if (len == sizeof buf || c == '\n') {
-		memcpy (pkt + 12, "\x08\x00", 2);
-		pktsiz = mkudp (pkt + 14,
+	memcpy (p->pkt + 12, "\x08\x00", 2);
+	if (config.vmm.tty_syslog.enable)
+		pktsiz = mkudp (p->pkt + 14,
 				(char *)config.vmm.tty_syslog.src_ipaddr, 514,
 				(char *)config.vmm.tty_syslog.dst_ipaddr, 514,
-				buf, len) + 14;
-		len = 0;
+				p->data, p->len) + 14;
+	else
+		pktsiz = mkudp (p->pkt + 14, "\x00\x00\x00\x00", 10,
+				"\xE0\x00\x00\x01", 10101, p->data,
+				p->len) + 14;
+	LIST1_FOREACH (tty_udp_list, q)
+		q->tty_send (q->handle, p->pkt, pktsiz);
+	p->len = 0;
+	p->budget--;
+}
+
+/* A syslog packet carries one line; a raw UDP packet is filled up to
+ * the MTU. */
+static void
+tty_log_packet_putchar (struct tty_log_packet *p, unsigned char c)
+{
+	if (config.vmm.tty_syslog.enable) {
+		if ((c < ' ' && c != '\n') || c > '~')
+			return;
+		if (!p->len)
+			p->len = snprintf (p->data, sizeof p->data,
+					   TTY_SYSLOG_PREFIX);
+		p->data[p->len++] = c;
+		if (p->len == TTY_SYSLOG_PAYLOAD || c == '\n')
+			tty_log_packet_send (p);
+	} else {
+		p->data[p->len++] = c;
+		if (p->len == TTY_UDP_PAYLOAD)
+			tty_log_packet_send (p);
+	}
+}
+
+/* Move characters of a ring to the packet.  Only complete lines are
+ * taken so that lines of different CPUs are not mixed, unless nothing
+ * has been added since the last flush, the ring is getting full or
+ * all is set. */
+static unsigned int
+tty_log_ring_flush (struct tty_log_ring *r, struct tty_log_packet *p,
+		    bool all)
+{
+	unsigned int head, tail, end, dropped;
+
+	head = r->head;
+	tail = r->tail;
+	asm volatile ("" : : : "memory");
+	end = head;
+	if (!all && head != r->last_head &&
+	    head - tail < TTY_LOG_RING_SIZE / 2)
+		while (end != tail &&
+		       r->buf[(end - 1) % TTY_LOG_RING_SIZE] != '\n')
+			end--;
+	r->last_head = head;
+	while (tail != end && p->budget > 0)
+		tty_log_packet_putchar (p, r->buf[tail++ % TTY_LOG_RING_SIZE]);
+	asm volatile ("" : : : "memory");
+	r->tail = tail;
+	dropped = r->dropped - r->dropped_reported;
+	r->dropped_reported += dropped;
+	return dropped;
+}
+
+static bool
+tty_log_flush_pcpu (struct pcpu *cpu, void *q)
+{
+	struct tty_log_flush_data *d = q;
+
+	if (cpu->ttylog)
+		d->dropped += tty_log_ring_flush (cpu->ttylog, d->p, d->all);
+	return false;
+}
+
+/* Only one CPU may flush the rings at a time.  The timer skips a tick
+ * if a flush is in progress. */
+static bool
+tty_log_flush_begin (void)
+{
+	bool busy;
+
+	spinlock_lock (&tty_log_timer_lock);
+	busy = tty_log_flushing;
+	tty_log_flushing = true;
+	spinlock_unlock (&tty_log_timer_lock);
+	return !busy;
+}
+
+static void
+tty_log_flush_end (void)
+{
+	spinlock_lock (&tty_log_timer_lock);
+	tty_log_flushing = false;
+	spinlock_unlock (&tty_log_timer_lock);
+}
+
+/* The rate limit is not applied and partial lines are sent if all is
+ * set. */
+static void
+tty_log_flush (struct tty_log_packet *p, bool all)
+{
+	static unsigned int dropped;
+	unsigned int rate = all ? 0 : config.vmm.tty_log_rate;
+	struct tty_log_flush_data d;
+	char msg[64];
+	int i, n;
+
+	/* tty_log_rate is in packets per second; the credit is counted
+	 * in hundredths of a packet and is limited to 100ms worth of
+	 * packets. */
+	if (rate) {
+		tty_log_credit += rate * TTY_LOG_FLUSH_USEC / 10000;
+		if (tty_log_credit > (rate > 10 ? rate * 10 : 100))
+			tty_log_credit = rate > 10 ? rate * 10 : 100;
+		p->budget = tty_log_credit / 100;
+	} else {
+		p->budget = 0x7FFFFFFF;
+	}
+	n = p->budget;
+	d.p = p;
+	d.all = all;
+	d.dropped = tty_log_ring_flush (&tty_log_boot, p, all);
+	pcpu_list_foreach (tty_log_flush_pcpu, &d);
+	dropped += d.dropped;
+	if (dropped && p->budget > 0) {
+		snprintf (msg, sizeof msg, "[%u characters of log dropped]\n",
+			  dropped);
+		for (i = 0; msg[i]; i++)
+			tty_log_packet_putchar (p, msg[i]);
+		dropped = 0;
+	}
+	if (p->len && p->budget > 0)
+		tty_log_packet_send (p);
+	if (rate)
+		tty_log_credit -= (n - p->budget) * 100;
+}
+
+static void
+tty_log_timer (void *handle, void *data)
+{
+	if (tty_log_flush_begin ()) {
+		tty_log_flush (&tty_log_pkt, false);
+		tty_log_flush_end ();
+	}
+	timer_set (handle, TTY_LOG_FLUSH_USEC);
+}
+
+static void
+tty_log_ring_putchar (struct tty_log_ring *r, unsigned char c)
+{
+	unsigned int head = r->head;
+
+	if (head - r->tail >= TTY_LOG_RING_SIZE) {
+		r->dropped++;
+		return;
 	}
-	spinlock_unlock (&putchar_lock);
-	if (pktsiz)
-		LIST1_FOREACH (tty_udp_list, p)
-			p->tty_send (p->handle, pkt, pktsiz);
+	r->buf[head % TTY_LOG_RING_SIZE] = c;
+	asm volatile ("" : : : "memory");
+	r->head = head + 1;
 }
 
 /* how to receive the messages:
    perl -e '$|=1;use Socket;
    socket(S, PF_INET, SOCK_DGRAM, 0);
    bind(S, pack_sockaddr_in(10101,INADDR_ANY));
-   while(recv(S,$buf,1,0)){print $buf;}' */
+   while(recv(S,$buf,1500,0)){print $buf;}' */
 static void
 tty_udp_putchar (unsigned char c)
 {
-	struct tty_udp_data *p;
-	unsigned int pktsiz;
-	char pkt[64];
+	struct tty_log_ring *r = NULL;
 
-	if (config.vmm.tty_syslog.enable) {
-		tty_syslog_putchar (c);
+	if (!tty_udp_list.next)
+		return;
+	if (currentcpu_available ())
+		r = currentcpu->ttylog;
+	if (r) {
+		tty_log_ring_putchar (r, c);
 		return;
 	}
-	LIST1_FOREACH (tty_udp_list, p) {
-		memcpy (pkt + 12, "\x08\x00", 2);
-		pktsiz = mkudp (pkt + 14, "\x00\x00\x00\x00", 10,
-				"\xE0\x00\x00\x01", 10101, (char *)&c, 1) + 14;
-		p->tty_send (p->handle, pkt, pktsiz);
-	}
+	spinlock_lock (&tty_log_boot_lock);
+	tty_log_ring_putchar (&tty_log_boot, c);
+	spinlock_unlock (&tty_log_boot_lock);
 }
 
+/* Called through putchar(), which serializes the callers, so no lock
+ * is taken here.  Characters for the network log are queued by
+ * tty_udp_putchar(), which putchar() calls before taking its lock. */
 void
 tty_putchar (unsigned char c)
 {
 	int i;
 
 	if (logflag) {
-		spinlock_lock (&putchar_lock);
 		logbuf.log[(logbuf.logoffset + logbuf.loglen) %
 			   sizeof logbuf.log] = c;
 		if (logbuf.loglen == sizeof logbuf.log)
@@ -208,32 +390,24 @@ tty_putchar (unsigned char c)
 				sizeof logbuf.log;
 		else
 			logbuf.loglen++;
-		spinlock_unlock (&putchar_lock);
 	}
-	tty_udp_putchar (c);
 #ifdef TTY_SERIAL
 	serial_putchar (c);
 #else
 	if (uefi_booted) {
 		if (currentcpu_available () && currentcpu->pass_vm_created) {
-			spinlock_lock (&putchar_lock);
 			for (i = 0; i < uefi_logoffset; i++)
 				vramwrite_putchar (uefi_log[i]);
 			uefi_logoffset = 0;
-			spinlock_unlock (&putchar_lock);
 			vramwrite_putchar (c);
 		} else if (currentcpu_available () && get_cpu_id () == 0) {
-			spinlock_lock (&putchar_lock);
 			for (i = 0; i < uefi_logoffset; i++)
 				call_uefi_putchar (uefi_log[i]);
 			uefi_logoffset = 0;
 			call_uefi_putchar (c);
-			spinlock_unlock (&putchar_lock);
 		} else {
-			spinlock_lock (&putchar_lock);
 			if (uefi_logoffset < sizeof uefi_log)
 				uefi_log[uefi_logoffset++] = c;
-			spinlock_unlock (&putchar_lock);
 		}
 	} else {
 		vramwrite_putchar (c);
@@ -354,22 +528,60 @@ ttylog_copy_from_panicmem (void)
 	ttylog_copy_panicmem (ttylog_copy_from_panicmem_one);
 }
 
+/* Send what is left in the rings synchronously: the timer will not
+ * run any more.  If another CPU is flushing, wait for it for a while,
+ * and then flush anyway because the flushing CPU may be the one that
+ * panicked. */
+static void
+tty_panic (void)
+{
+	u64 start;
+
+	if (!tty_udp_list.next)
+		return;
+	start = get_time ();
+	while (!tty_log_flush_begin ())
+		if (get_time () - start >= TTY_LOG_PANIC_WAIT_USEC)
+			break;
+	tty_log_flush (&tty_log_pkt, true);
+	tty_log_flush_end ();
+}
+
 static void
 tty_init_global2 (void)
 {
 	LIST1_HEAD_INIT (tty_udp_list);
 }
 
+static void
+tty_init_pcpu (void)
+{
+	struct tty_log_ring *r;
+	bool start;
+
+	r = alloc (sizeof *r);
+	memset (r, 0, sizeof *r);
+	currentcpu->ttylog = r;
+	spinlock_lock (&tty_log_timer_lock);
+	start = !tty_log_timer_started;
+	tty_log_timer_started = true;
+	spinlock_unlock (&tty_log_timer_lock);
+	if (start)
+		timer_set (timer_new (tty_log_timer, NULL), TTY_LOG_FLUSH_USEC);
+}
+
 static void
 tty_init_global (void)
 {
 	logbuf.logoffset = 0;
 	logbuf.loglen = 0;
 	logflag = true;
-	spinlock_init (&putchar_lock);
+	spinlock_init (&tty_log_boot_lock);
+	spinlock_init (&tty_log_timer_lock);
 	if (!uefi_booted)
 		vramwrite_init_global ((void *)0x800B8000);
 	putchar_set_func (tty_putchar, NULL);
+	putchar_set_unlocked_func (tty_udp_putchar);
 }
 
 void
@@ -398,3 +610,5 @@ tty_init_msg (void)
 INITFUNC ("global0", tty_init_global);
 INITFUNC ("global3", tty_init_global2);
 INITFUNC ("msg1", tty_init_msg);
+INITFUNC ("panic0", tty_panic);
+INITFUNC ("pcpu42", tty_init_pcpu);
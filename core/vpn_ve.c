@@ -42,9 +42,14 @@
 #include "string.h"
 #include "time.h"
 #include "vmmcall.h"
+#include "vmmcall_status.h"
 #include "vpn_ve.h"
 #include <net/netapi.h>
 
+/* Number of packet slots of the rings (power of 2) */
+#define VE_RING_SEND_SLOTS	128
+#define VE_RING_RECV_SLOTS	64
+
 struct pqueue_list {
 	LIST1_DEFINE (struct pqueue_list);
 	void *data;
@@ -56,6 +61,24 @@ struct pqueue {
 	int num_item;
 };
 
+struct ve_ring_slot {
+	u64 time;
+	unsigned int len;
+	unsigned char data[VE_MAX_PACKET_SIZE];
+};
+
+/* Single-producer single-consumer ring of preallocated packet slots.
+ * head is written only by the producer and tail only by the
+ * consumer, so no lock is needed as long as each side is serialized
+ * by itself. */
+struct ve_ring {
+	unsigned int volatile head, tail;
+	unsigned int nslots;
+	unsigned int overflow;	/* dropped because the ring was full */
+	unsigned int expired;	/* dropped because they were too old */
+	struct ve_ring_slot *slots;
+};
+
 static void *
 pqueue_getnext (struct pqueue *q, unsigned int *len)
 {
@@ -73,20 +96,6 @@ pqueue_getnext (struct pqueue *q, unsigned int *len)
 	return r;
 }
 
-static void *
-pqueue_peeknext (struct pqueue *q)
-{
-	struct pqueue_list *l;
-	void *r = NULL;
-
-	l = LIST1_POP (q->list);
-	if (l) {
-		r = l->data;
-		LIST1_PUSH (q->list, l);
-	}
-	return r;
-}
-
 static void
 pqueue_insert (struct pqueue *q, void *data, unsigned int len)
 {
@@ -110,6 +119,86 @@ pqueue_new (void)
 	return q;
 }
 
+static void
+ve_ring_init (struct ve_ring *r, unsigned int nslots)
+{
+	r->head = 0;
+	r->tail = 0;
+	r->nslots = nslots;
+	r->overflow = 0;
+	r->expired = 0;
+	r->slots = alloc (sizeof *r->slots * nslots);
+}
+
+static unsigned int
+ve_ring_num (struct ve_ring *r)
+{
+	return r->head - r->tail;
+}
+
+/* Producer: copy packets to the ring and publish them at once.
+ * Packets which do not fit are dropped and counted. */
+static unsigned int
+ve_ring_put (struct ve_ring *r, unsigned int num_packets, void **packets,
+	     unsigned int *packet_sizes, u64 time)
+{
+	struct ve_ring_slot *slot;
+	unsigned int head = r->head;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < num_packets; i++) {
+		if (!packet_sizes[i] || packet_sizes[i] > VE_MAX_PACKET_SIZE)
+			continue;
+		if (head - r->tail >= r->nslots) {
+			r->overflow += num_packets - i;
+			break;
+		}
+		slot = &r->slots[head % r->nslots];
+		memcpy (slot->data, packets[i], packet_sizes[i]);
+		slot->len = packet_sizes[i];
+		slot->time = time;
+		head++;
+		n++;
+	}
+	asm volatile ("" : : : "memory");
+	r->head = head;
+	return n;
+}
+
+/* Consumer: drop packets queued before expire and return up to
+ * max_packets of the following ones without removing them.  Since
+ * the packets are in time order, only the oldest packet has to be
+ * looked at to decide whether to drop. */
+static unsigned int
+ve_ring_get (struct ve_ring *r, unsigned int max_packets, void **packets,
+	     unsigned int *packet_sizes, u64 expire)
+{
+	struct ve_ring_slot *slot;
+	unsigned int head = r->head, tail = r->tail;
+	unsigned int n;
+
+	asm volatile ("" : : : "memory");
+	while (tail != head && r->slots[tail % r->nslots].time < expire) {
+		tail++;
+		r->expired++;
+	}
+	r->tail = tail;
+	for (n = 0; n < max_packets && tail != head; n++, tail++) {
+		slot = &r->slots[tail % r->nslots];
+		packets[n] = slot->data;
+		packet_sizes[n] = slot->len;
+	}
+	return n;
+}
+
+/* Consumer: release packets returned by ve_ring_get(). */
+static void
+ve_ring_pop (struct ve_ring *r, unsigned int num_packets)
+{
+	asm volatile ("" : : : "memory");
+	r->tail += num_packets;
+}
+
 static void *
 memdup (void *p, int len)
 {
@@ -119,7 +208,6 @@ memdup (void *p, int len)
 #define SE_QUEUE		struct pqueue
 #define SeGetNext(q)		pqueue_getnext ((q), NULL)
 #define SeGetNext2(q, l)	pqueue_getnext ((q), (l))
-#define SePeekNext(q)		pqueue_peeknext ((q))
 #define SeInsertQueue(q, data)	pqueue_insert ((q), (data), 0)
 #define SeInsertQueue2(q, d, l)	pqueue_insert ((q), (d), (l))
 #define SeNewQueue()		pqueue_new ()
@@ -141,10 +229,9 @@ struct VPN_NIC
 	SE_NICINFO NicInfo;					// NIC 情報
 	net_recv_callback_t *RecvCallback;	// パケット受信時のコールバック
 	void *RecvCallbackParam;			// コールバックパラメータ
-	SE_QUEUE *SendPacketQueue;			// 送信パケットキュー
-	SE_QUEUE *RecvPacketQueue;			// 受信パケットキュー
+	struct ve_ring SendRing;			// 送信パケットリング (vpn -> guest)
+	struct ve_ring RecvRing;			// 受信パケットリング (guest -> vpn)
 	bool IsVirtual;						// 仮想 NIC かどうか
-	spinlock_t Lock;					// ロック
 };
 // VPN クライアントコンテキスト
 struct VPN_CTX
@@ -168,7 +255,7 @@ void crypt_sys_set_virtual_nic_recv_callback(SE_HANDLE nic_handle, net_recv_call
 void crypt_nic_recv_packet(VPN_NIC *n, UINT num_packets, void **packets, UINT *packet_sizes);
 VPN_NIC *crypt_init_physical_nic(VPN_CTX *ctx);
 VPN_NIC *crypt_init_virtual_nic(VPN_CTX *ctx);
-void crypt_flush_old_packet_from_queue(SE_QUEUE *q);
+void crypt_nic_recv_ring(VPN_NIC *n);
 
 static VPN_CTX *vpn_ctx = NULL;			// VPN クライアントコンテキスト
 
@@ -228,107 +315,56 @@ void crypt_ve_main(UCHAR *in, UCHAR *out)
 		else if (cin->Operation == VE_OP_GET_NEXT_SEND_PACKET)
 		{
 			// 次に送信すべきパケットの取得 (vpn -> vmm -> guest)
-			spinlock_lock (&nic->Lock);
-			{
-				// 古いパケットがある場合は破棄
-				crypt_flush_old_packet_from_queue(nic->SendPacketQueue);
-
-				// パケットが 1 つ以上キューにあるかどうか
-				if (nic->SendPacketQueue->num_item >= 1)
-				{
-					// キューから次のパケットをとる
-					UINT packet_data_size;
-					void *packet_data = SeGetNext2(nic->SendPacketQueue, &packet_data_size);
-					UINT packet_size_real = packet_data_size - sizeof(UINT64);
-					void *packet_data_real = ((UCHAR *)packet_data) + sizeof(UINT64);
+			UINT64 now = get_time ();
+			UINT64 expire = 0;
+			void *packet_data;
+			UINT packet_size;
 
-					memcpy(cout->PacketData, packet_data_real, packet_size_real);
-					cout->PacketSize = packet_size_real;
+			// 古いパケットは破棄する
+			if (now >= CRYPT_SEND_PACKET_LIFETIME * 1000)
+			{
+				expire = now - CRYPT_SEND_PACKET_LIFETIME * 1000;
+			}
 
-					cout->NumQueue = nic->SendPacketQueue->num_item;
+			if (ve_ring_get(&nic->SendRing, 1, &packet_data, &packet_size, expire) == 1)
+			{
+				memcpy(cout->PacketData, packet_data, packet_size);
+				cout->PacketSize = packet_size;
 
-					// メモリ解放
-					SeFree(packet_data);
-				}
+				ve_ring_pop(&nic->SendRing, 1);
 
-				cout->RetValue = 1;
+				cout->NumQueue = ve_ring_num(&nic->SendRing);
 			}
-			spinlock_unlock (&nic->Lock);
+
+			cout->RetValue = 1;
 		}
 		else if (cin->Operation == VE_OP_PUT_RECV_PACKET)
 		{
-			bool flush = false;
-			UINT num_packets = 0;
-			void **packets = NULL;
-			UINT *packet_sizes = NULL;
-
 			// 受信したパケットの書き込み (guest -> vmm -> vpn)
-			spinlock_lock (&nic->Lock);
-			{
-				// 受信パケットは、パフォーマンス向上のため
-				// すぐに vpn に渡さずにいったん受信キューにためる
-				void *packet_data;
-				UINT packet_size = cin->PacketSize;
+			// 受信パケットは、パフォーマンス向上のため
+			// すぐに vpn に渡さずにいったん受信リングにためる
+			UINT packet_size = cin->PacketSize;
+			void *packet_data = cin->PacketData;
 
-				if (packet_size >= 1)
-				{
-					packet_data = SeClone(cin->PacketData, packet_size);
-
-					SeInsertQueue2(nic->RecvPacketQueue, packet_data, packet_size);
-				}
-
-				if (cin->NumQueue == 0)
+			if (packet_size >= 1)
+			{
+				if (ve_ring_num(&nic->RecvRing) >= nic->RecvRing.nslots)
 				{
-					// もうこれ以上受信パケットが無い場合は
-					// flush する (vpn に一気に渡す)
-					flush = true;
+					// リングが一杯の場合は先に vpn に渡す
+					crypt_nic_recv_ring(nic);
 				}
 
-				cout->RetValue = 1;
-
-				if (flush)
-				{
-					UINT i;
-					void *p;
-
-					num_packets = nic->RecvPacketQueue->num_item;
-					packets = SeMalloc(sizeof(void *) * num_packets);
-					packet_sizes = SeMalloc(sizeof(UINT *) * num_packets);
-
-					i = 0;
-
-					while (true)
-					{
-						UINT size;
-						p = SeGetNext2(nic->RecvPacketQueue, &size);
-						if (p == NULL)
-						{
-							break;
-						}
-
-						packets[i] = p;
-						packet_sizes[i] = size;
-
-						i++;
-					}
-				}
+				ve_ring_put(&nic->RecvRing, 1, &packet_data, &packet_size, 0);
 			}
-			spinlock_unlock (&nic->Lock);
 
-			if (flush)
+			if (cin->NumQueue == 0)
 			{
-				UINT i;
-
-				crypt_nic_recv_packet(nic, num_packets, packets, packet_sizes);
-
-				for (i = 0;i < num_packets;i++)
-				{
-					SeFree(packets[i]);
-				}
-
-				SeFree(packets);
-				SeFree(packet_sizes);
+				// もうこれ以上受信パケットが無い場合は
+				// flush する (vpn に一気に渡す)
+				crypt_nic_recv_ring(nic);
 			}
+
+			cout->RetValue = 1;
 		}
 	}
 }
@@ -417,15 +453,13 @@ VPN_NIC *crypt_init_physical_nic(VPN_CTX *ctx)
 	n->NicInfo.MediaType = SE_MEDIA_TYPE_ETHERNET;
 	n->NicInfo.Mtu = 1500;
 
-	n->RecvPacketQueue = SeNewQueue();
-	n->SendPacketQueue = SeNewQueue();
+	ve_ring_init(&n->RecvRing, VE_RING_RECV_SLOTS);
+	ve_ring_init(&n->SendRing, VE_RING_SEND_SLOTS);
 
 	n->VpnCtx = ctx;
 
 	n->IsVirtual = false;
 
-	spinlock_init (&n->Lock);
-
 	return n;
 }
 
@@ -446,15 +480,13 @@ VPN_NIC *crypt_init_virtual_nic(VPN_CTX *ctx)
 	n->NicInfo.MediaType = SE_MEDIA_TYPE_ETHERNET;
 	n->NicInfo.Mtu = 1500;
 
-	n->RecvPacketQueue = SeNewQueue();
-	n->SendPacketQueue = SeNewQueue();
+	ve_ring_init(&n->RecvRing, VE_RING_RECV_SLOTS);
+	ve_ring_init(&n->SendRing, VE_RING_SEND_SLOTS);
 
 	n->VpnCtx = ctx;
 
 	n->IsVirtual = true;
 
-	spinlock_init (&n->Lock);
-
 	return n;
 }
 
@@ -641,67 +673,19 @@ void crypt_sys_get_physical_nic_info(SE_HANDLE nic_handle, SE_NICINFO *info)
 	SeCopy(info, &n->NicInfo, sizeof(SE_NICINFO));
 }
 
-// 送信パケットキューから古いパケットを削除する
-void crypt_flush_old_packet_from_queue(SE_QUEUE *q)
-{
-	UINT64 now = get_time ();
-	UINT num = 0;
-
-	while (true)
-	{
-		void *data = SePeekNext(q);
-		UINT64 *time_stamp;
-
-		if (data == NULL)
-		{
-			break;
-		}
-
-		time_stamp = (UINT64 *)data;
-
-		if (now <= ((*time_stamp) + CRYPT_SEND_PACKET_LIFETIME * 1000))
-		{
-			break;
-		}
-
-		data = SeGetNext(q);
-
-		SeFree(data);
-
-		num++;
-	}
-}
-
 // 提供システムコール: 物理 NIC を用いてパケットを送信
 void crypt_sys_send_physical_nic(SE_HANDLE nic_handle, UINT num_packets, void **packets, UINT *packet_sizes)
 {
 	VPN_NIC	*n = (VPN_NIC *)nic_handle;
-	UINT i;
 	// 引数チェック
 	if (n == NULL || num_packets == 0 || packets == NULL || packet_sizes == NULL)
 	{
 		return;
 	}
 
-	spinlock_lock (&n->Lock);
-	{
-		// パケットをキューに格納する
-		for (i = 0;i < num_packets;i++)
-		{
-			void *packet = packets[i];
-			UINT size = packet_sizes[i];
-
-			UCHAR *packet_copy = SeMalloc(size + sizeof(UINT64));
-			SeCopy(packet_copy + sizeof(UINT64), packet, size);
-			*((UINT64 *)packet_copy) = get_time ();
-
-			SeInsertQueue2(n->SendPacketQueue, packet_copy, size + sizeof(UINT64));
-		}
-
-		// 古いパケットを送信キューから削除する
-		crypt_flush_old_packet_from_queue(n->SendPacketQueue);
-	}
-	spinlock_unlock (&n->Lock);
+	// パケットをリングに格納する
+	// (送信は VPN のメインロックの中で行われるので producer は 1 つ)
+	ve_ring_put(&n->SendRing, num_packets, packets, packet_sizes, get_time ());
 }
 
 // 提供システムコール: 物理 NIC からパケットを受信した際のコールバックを設定
@@ -730,32 +714,14 @@ void crypt_sys_get_virtual_nic_info(SE_HANDLE nic_handle, SE_NICINFO *info)
 void crypt_sys_send_virtual_nic(SE_HANDLE nic_handle, UINT num_packets, void **packets, UINT *packet_sizes)
 {
 	VPN_NIC	*n = (VPN_NIC *)nic_handle;
-	UINT i;
 	// 引数チェック
 	if (n == NULL || num_packets == 0 || packets == NULL || packet_sizes == NULL)
 	{
 		return;
 	}
 
-	spinlock_lock (&n->Lock);
-	{
-		// パケットをキューに格納する
-		for (i = 0;i < num_packets;i++)
-		{
-			void *packet = packets[i];
-			UINT size = packet_sizes[i];
-
-			UCHAR *packet_copy = SeMalloc(size + sizeof(UINT64));
-			SeCopy(packet_copy + sizeof(UINT64), packet, size);
-			*((UINT64 *)packet_copy) = get_time ();
-
-			SeInsertQueue2(n->SendPacketQueue, packet_copy, size + sizeof(UINT64));
-		}
-
-		// 古いパケットを送信キューから削除する
-		crypt_flush_old_packet_from_queue(n->SendPacketQueue);
-	}
-	spinlock_unlock (&n->Lock);
+	// パケットをリングに格納する
+	ve_ring_put(&n->SendRing, num_packets, packets, packet_sizes, get_time ());
 }
 
 // 提供システムコール: 仮想 NIC からパケットを受信した際のコールバックを設定
@@ -784,12 +750,51 @@ void crypt_nic_recv_packet(VPN_NIC *n, UINT num_packets, void **packets, UINT *p
 	n->RecvCallback((SE_HANDLE)n, num_packets, packets, packet_sizes, n->RecvCallbackParam, NULL);
 }
 
+// 受信リングにたまったパケットを vpn に一気に渡す
+void crypt_nic_recv_ring(VPN_NIC *n)
+{
+	void *packets[VE_RING_RECV_SLOTS];
+	UINT packet_sizes[VE_RING_RECV_SLOTS];
+	UINT num_packets;
+
+	num_packets = ve_ring_get(&n->RecvRing, VE_RING_RECV_SLOTS, packets, packet_sizes, 0);
+
+	if (num_packets != 0)
+	{
+		crypt_nic_recv_packet(n, num_packets, packets, packet_sizes);
+
+		ve_ring_pop(&n->RecvRing, num_packets);
+	}
+}
+
+static char *
+vpn_ve_status (void)
+{
+	static char buf[1024];
+	VPN_NIC *p = vpn_ctx->PhysicalNic, *v = vpn_ctx->VirtualNic;
+
+	snprintf (buf, sizeof buf,
+		  "vpn_ve:\n"
+		  " physical send: %u queued %u overflow %u expired\n"
+		  " physical recv: %u queued %u overflow\n"
+		  " virtual send: %u queued %u overflow %u expired\n"
+		  " virtual recv: %u queued %u overflow\n"
+		  , ve_ring_num (&p->SendRing), p->SendRing.overflow
+		  , p->SendRing.expired
+		  , ve_ring_num (&p->RecvRing), p->RecvRing.overflow
+		  , ve_ring_num (&v->SendRing), v->SendRing.overflow
+		  , v->SendRing.expired
+		  , ve_ring_num (&v->RecvRing), v->RecvRing.overflow);
+	return buf;
+}
+
 static void
 vpn_ve_init (void)
 {
 	if (!config.vmm.driver.vpn.ve)
 		return;
 	crypt_init_vpn ();
+	register_status_callback (vpn_ve_status);
 }
 
 INITFUNC ("driver1", vpn_ve_init);
@@ -79,10 +79,14 @@ struct vt {
 	bool handle_pagefault;
 	bool ept_available;
 	bool invept_available;
+	bool ept_ad_available;
+	bool ept_1g_available;
 	bool unrestricted_guest_available, unrestricted_guest;
 	bool save_load_efer_enable;
 	bool exint_pass, exint_pending, exint_update, exint_re_pending;
 	bool cr3exit_controllable, cr3exit_off;
+	bool preempt_timer, preempt_timer_armed;
+	u8 preempt_timer_rate;
 };
 
 struct vt_pcpu_data {
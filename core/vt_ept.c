@@ -28,34 +28,63 @@
  */
 
 #include "asm.h"
+#include "callrealmode.h"
+#include "config.h"
 #include "constants.h"
 #include "convert.h"
 #include "current.h"
+#include "exitprof.h"
 #include "gmm_access.h"
 #include "mm.h"
 #include "panic.h"
 #include "string.h"
+#include "vmmcall_status.h"
 #include "vt_ept.h"
 #include "vt_main.h"
 #include "vt_paging.h"
 #include "vt_regs.h"
 
 #define NUM_OF_EPTBL	1024
+#define MIN_OF_EPTBL	16
+#define EPTBL_HEAP_SHARE	32	/* at most 1/32 of free VMM memory */
+#define EPTBL_HEAP_RESERVE	1024	/* pages left for the rest */
+#define EPT_RECLAIM_BATCH	16
 #define EPTE_READ	0x1
 #define EPTE_READEXEC	0x5
 #define EPTE_WRITE	0x2
 #define EPTE_LARGE	0x80
+#define EPTE_ACCESSED	0x100
 #define EPTE_ATTR_MASK	0xFFF
 #define EPTE_MT_SHIFT	3
 #define EPT_LEVELS	4
 
+struct vt_ept_tbl {
+	void *virt;
+	phys_t phys;
+	u64 *parent;		/* NULL if the table is free */
+	u64 gphys;
+	int level;
+};
+
+/* Tables are allocated on demand up to max, or until the VMM heap
+ * runs low.  When the pool is exhausted, a clock hand sweeps the page
+ * tables (level 0) and reclaims the ones whose accessed bit in the
+ * parent entry is clear.  MIN_OF_EPTBL tables are allocated at init
+ * so that a full wipe always makes enough room.
+ * The accessed bit is set by hardware if EPT A/D is available and by
+ * cur_move() on every EPT violation walking through it. */
 struct vt_ept {
 	int cnt;
+	int max;
+	int nfree;
+	int hand;
 	int cleared;
+	bool eager;
+	bool page1g;
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
-	void *tbl[NUM_OF_EPTBL];
-	phys_t tbl_phys[NUM_OF_EPTBL];
+	struct vt_ept_tbl *tbl;
+	int *freelist;
 	struct {
 		int level;
 		phys_t gphys;
@@ -63,23 +92,165 @@ struct vt_ept {
 	} cur;
 };
 
+static u32 stat_violation, stat_tables, stat_reclaim, stat_wipe;
+
+#ifdef VMMCALL_STATUS_ENABLE
+static void
+ept_stat_add (u32 *d, int n)
+{
+	u32 old;
+
+	old = *d;
+	while (asm_lock_cmpxchgl (d, &old, old + n));
+}
+#endif
+
 void
 vt_ept_init (void)
 {
 	struct vt_ept *ept;
-	int i;
+	int i, limit;
 
 	ept = alloc (sizeof *ept);
 	alloc_page (&ept->ncr3tbl, &ept->ncr3tbl_phys);
 	memset (ept->ncr3tbl, 0, PAGESIZE);
 	ept->cleared = 1;
-	for (i = 0; i < NUM_OF_EPTBL; i++)
-		alloc_page (&ept->tbl[i], &ept->tbl_phys[i]);
-	ept->cnt = 0;
+	ept->max = config.vmm.ept_tables;
+	if (!ept->max)
+		ept->max = NUM_OF_EPTBL;
+	limit = num_of_available_pages () / EPTBL_HEAP_SHARE;
+	if (ept->max > limit)
+		ept->max = limit;
+	if (ept->max < MIN_OF_EPTBL)
+		ept->max = MIN_OF_EPTBL;
+	ept->tbl = alloc (sizeof *ept->tbl * ept->max);
+	ept->freelist = alloc (sizeof *ept->freelist * ept->max);
+	for (i = 0; i < MIN_OF_EPTBL; i++) {
+		alloc_page (&ept->tbl[i].virt, &ept->tbl[i].phys);
+		ept->tbl[i].parent = NULL;
+		ept->freelist[i] = i;
+	}
+	ept->cnt = MIN_OF_EPTBL;
+	ept->nfree = MIN_OF_EPTBL;
+	ept->hand = 0;
+	ept->eager = !!config.vmm.eager_nested_paging;
+	ept->page1g = current->u.vt.ept_1g_available;
 	ept->cur.level = EPT_LEVELS;
 	current->u.vt.ept = ept;
 	asm_vmwrite64 (VMCS_EPT_POINTER, ept->ncr3tbl_phys |
-		       VMCS_EPT_POINTER_EPT_WB | VMCS_EPT_PAGEWALK_LENGTH_4);
+		       VMCS_EPT_POINTER_EPT_WB | VMCS_EPT_PAGEWALK_LENGTH_4 |
+		       (current->u.vt.ept_ad_available ?
+			VMCS_EPT_POINTER_EPT_AD : 0));
+}
+
+/* Returns true if n tables can be taken without reclaiming.  The
+ * pool grows only while the VMM heap keeps EPTBL_HEAP_RESERVE pages
+ * free, so that a large guest cannot exhaust it. */
+static bool
+ept_tbl_enough (struct vt_ept *ept, int n)
+{
+	int grow, heap;
+
+	if (n <= ept->nfree)
+		return true;
+	grow = ept->max - ept->cnt;
+	heap = num_of_available_pages () - EPTBL_HEAP_RESERVE;
+	if (grow > heap)
+		grow = heap;
+	return n <= ept->nfree + grow;
+}
+
+static struct vt_ept_tbl *
+ept_tbl_get (struct vt_ept *ept)
+{
+	struct vt_ept_tbl *t;
+
+	if (ept->nfree) {
+		t = &ept->tbl[ept->freelist[--ept->nfree]];
+	} else {
+		if (ept->cnt >= ept->max)
+			panic ("%s: no free table", __func__);
+		t = &ept->tbl[ept->cnt++];
+		alloc_page (&t->virt, &t->phys);
+	}
+	STATUS_UPDATE (asm_lock_incl (&stat_tables));
+	return t;
+}
+
+static void
+ept_tbl_put (struct vt_ept *ept, struct vt_ept_tbl *t)
+{
+	t->parent = NULL;
+	ept->freelist[ept->nfree++] = t - ept->tbl;
+	STATUS_UPDATE (ept_stat_add (&stat_tables, -1));
+}
+
+static void
+ept_wipe (struct vt_ept *ept)
+{
+	int i, n;
+
+	memset (ept->ncr3tbl, 0, PAGESIZE);
+	ept->cleared = 1;
+	n = 0;
+	for (i = 0; i < ept->cnt; i++) {
+		if (ept->tbl[i].parent)
+			n++;
+		ept->tbl[i].parent = NULL;
+		ept->freelist[i] = i;
+	}
+	ept->nfree = ept->cnt;
+	ept->hand = 0;
+	ept->cur.level = EPT_LEVELS;
+	STATUS_UPDATE (ept_stat_add (&stat_tables, -n));
+}
+
+static bool
+ept_forcemapped (u64 base, u64 len)
+{
+	u32 n, nn;
+	u64 fbase, flen;
+
+	n = 0;
+	for (nn = 1; nn; n = nn) {
+		nn = current->gmm.getforcemap (n, &fbase, &flen);
+		if (flen && fbase < base + len && base < fbase + flen)
+			return true;
+	}
+	return false;
+}
+
+/* Sweep the clock hand over the page tables and reclaim up to
+ * EPT_RECLAIM_BATCH cold ones.  Returns false if nothing could be
+ * reclaimed. */
+static bool
+ept_reclaim (struct vt_ept *ept)
+{
+	struct vt_ept_tbl *t;
+	int i, n;
+
+	n = 0;
+	for (i = 2 * ept->cnt; i > 0 && n < EPT_RECLAIM_BATCH; i--) {
+		t = &ept->tbl[ept->hand];
+		if (++ept->hand >= ept->cnt)
+			ept->hand = 0;
+		if (!t->parent || t->level)
+			continue;
+		if (*t->parent & EPTE_ACCESSED) {
+			*t->parent &= ~EPTE_ACCESSED;
+			continue;
+		}
+		if (ept_forcemapped (t->gphys, PAGESIZE2M))
+			continue;
+		*t->parent = 0;
+		ept_tbl_put (ept, t);
+		n++;
+	}
+	if (!n)
+		return false;
+	STATUS_UPDATE (ept_stat_add (&stat_reclaim, n));
+	vt_paging_flush_guest_tlb ();
+	return true;
 }
 
 static void
@@ -110,6 +281,8 @@ cur_move (struct vt_ept *ept, u64 gphys)
 		e = *p;
 		if (!(e & EPTE_READ) || (e & EPTE_LARGE))
 			break;
+		if (!(e & EPTE_ACCESSED))
+			*p = e | EPTE_ACCESSED;
 		e &= ~PAGESIZE_MASK;
 		e |= (gphys >> (9 * ept->cur.level)) & 0xFF8;
 		p = (u64 *)phys_to_virt (e);
@@ -123,18 +296,25 @@ cur_fill (struct vt_ept *ept, u64 gphys, int level)
 {
 	int l;
 	u64 *p;
+	struct vt_ept_tbl *t;
 
-	if (ept->cnt + ept->cur.level - level > NUM_OF_EPTBL) {
-		memset (ept->ncr3tbl, 0, PAGESIZE);
-		ept->cleared = 1;
-		ept->cnt = 0;
-		vt_paging_flush_guest_tlb ();
-		ept->cur.level = EPT_LEVELS - 1;
+	while (!ept_tbl_enough (ept, ept->cur.level - level)) {
+		if (!ept_reclaim (ept)) {
+			ept_wipe (ept);
+			STATUS_UPDATE (asm_lock_incl (&stat_wipe));
+			vt_paging_flush_guest_tlb ();
+		}
+		ept->cur.level = EPT_LEVELS;
+		cur_move (ept, gphys);
 	}
 	l = ept->cur.level;
 	for (p = ept->cur.entry[l]; l > level; l--) {
-		*p = ept->tbl_phys[ept->cnt] | EPTE_READEXEC | EPTE_WRITE;
-		p = ept->tbl[ept->cnt++];
+		t = ept_tbl_get (ept);
+		*p = t->phys | EPTE_READEXEC | EPTE_WRITE | EPTE_ACCESSED;
+		t->parent = p;
+		t->level = l - 1;
+		t->gphys = gphys & ~((PAGESIZE << (9 * l)) - 1);
+		p = t->virt;
 		memset (p, 0, PAGESIZE);
 		p += (gphys >> (9 * l + 3)) & 0x1FF;
 	}
@@ -184,6 +364,28 @@ vt_ept_map_2mpage (struct vt_ept *ept, u64 gphys)
 	return false;
 }
 
+static bool
+vt_ept_map_1gpage (struct vt_ept *ept, u64 gphys)
+{
+	u64 hphys;
+	u32 hattr;
+	u64 *p;
+
+	cur_move (ept, gphys);
+	if (ept->cur.level < 2)
+		return true;
+	hphys = current->gmm.gp2hp_1g (gphys);
+	if (hphys == GMM_GP2HP_1G_FAIL)
+		return true;
+	if (!cache_gmtrr_type_equal (gphys, PAGESIZE1G_MASK))
+		return true;
+	hattr = (cache_get_gmtrr_type (gphys) << EPTE_MT_SHIFT) |
+		EPTE_READEXEC | EPTE_WRITE | EPTE_LARGE;
+	p = cur_fill (ept, gphys, 2);
+	*p = hphys | hattr;
+	return false;
+}
+
 static int
 vt_ept_level (struct vt_ept *ept, u64 gphys)
 {
@@ -191,6 +393,53 @@ vt_ept_level (struct vt_ept *ept, u64 gphys)
 	return ept->cur.level;
 }
 
+static u64
+vt_ept_prebuild_sub (struct vt_ept *ept, u64 base, u64 end)
+{
+	if (ept->page1g && !(base & PAGESIZE1G_MASK) &&
+	    end - base >= PAGESIZE1G && !mmio_range (base, PAGESIZE1G) &&
+	    !vt_ept_map_1gpage (ept, base))
+		return PAGESIZE1G;
+	if (!(base & PAGESIZE2M_MASK) && end - base >= PAGESIZE2M &&
+	    vt_ept_level (ept, base) > 0 && !mmio_range (base, PAGESIZE2M) &&
+	    !vt_ept_map_2mpage (ept, base))
+		return PAGESIZE2M;
+	if (!mmio_range (base, PAGESIZE))
+		vt_ept_map_page_sub (ept, false, base);
+	return PAGESIZE;
+}
+
+/* Map the memory ranges that the guest sees in the system memory map
+ * with the largest pages possible, so that a pass-through guest does
+ * not take an EPT violation for each of them.  The rest of the guest
+ * physical address space, and anything dropped later by mmio_register()
+ * or reclamation, is still mapped on demand.  Stop early rather than
+ * reclaiming if the table pool is running out. */
+static void
+vt_ept_prebuild (struct vt_ept *ept)
+{
+	u32 n, nn, type;
+	u64 base, len, end;
+
+	n = 0;
+	for (nn = 1; nn; n = nn) {
+		nn = getfakesysmemmap (n, &base, &len, &type);
+		if (!len)
+			continue;
+		if (type != SYSMEMMAP_TYPE_AVAILABLE &&
+		    type != SYSMEMMAP_TYPE_ACPI_RECLAIM &&
+		    type != SYSMEMMAP_TYPE_ACPI_NVS)
+			continue;
+		end = (base + len) & ~PAGESIZE_MASK;
+		base = (base + PAGESIZE_MASK) & ~PAGESIZE_MASK;
+		for (; base < end; base += len) {
+			if (!ept_tbl_enough (ept, EPT_LEVELS))
+				return;
+			len = vt_ept_prebuild_sub (ept, base, end);
+		}
+	}
+}
+
 static void
 vt_ept_map_page_clear_cleared (struct vt_ept *ept)
 {
@@ -223,6 +472,8 @@ vt_ept_map_page_clear_cleared (struct vt_ept *ept)
 			len -= size;
 		}
 	}
+	if (ept->eager)
+		vt_ept_prebuild (ept);
 	if (ept->cleared)
 		panic ("%s: error", __func__);
 }
@@ -243,7 +494,15 @@ vt_ept_violation (bool write, u64 gphys)
 	struct vt_ept *ept;
 
 	ept = current->u.vt.ept;
+	STATUS_UPDATE (asm_lock_incl (&stat_violation));
+	exitprof_tag (EXITPROF_TAG_EPT, gphys & ~PAGESIZE1G_MASK);
 	mmio_lock ();
+	if (ept->eager && ept->cleared) {
+		/* The access is retried after the map is rebuilt */
+		vt_ept_map_page_clear_cleared (ept);
+		mmio_unlock ();
+		return;
+	}
 	if (vt_ept_level (ept, gphys) > 0 &&
 	    !mmio_range (gphys & ~PAGESIZE2M_MASK, PAGESIZE2M) &&
 	    !vt_ept_map_2mpage (ept, gphys))
@@ -288,10 +547,7 @@ vt_ept_clear_all (void)
 	struct vt_ept *ept;
 
 	ept = current->u.vt.ept;
-	memset (ept->ncr3tbl, 0, PAGESIZE);
-	ept->cleared = 1;
-	ept->cnt = 0;
-	ept->cur.level = EPT_LEVELS;
+	ept_wipe (ept);
 	vt_paging_flush_guest_tlb ();
 }
 
@@ -305,13 +561,18 @@ vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 	ept = p->u.vt.ept;
 	cnt = ept->cnt;
 	for (i = 0; i < cnt; i++) {
-		e = ept->tbl[i];
+		if (!ept->tbl[i].parent)
+			continue;
+		e = ept->tbl[i].virt;
 		for (j = 0; j < n; j++) {
 			if (!(e[j] & EPTE_READ))
 				continue;
 			tmp1 = e[j] & mask;
 			tmp2 = tmp1 | 07777;
-			if (e[j] & EPTE_LARGE) {
+			if ((e[j] & EPTE_LARGE) && ept->tbl[i].level == 2) {
+				tmp1 &= ~PAGESIZE1G_MASK;
+				tmp2 |= PAGESIZE1G_MASK;
+			} else if (e[j] & EPTE_LARGE) {
 				tmp1 &= ~07777777;
 				tmp2 |= 07777777;
 			}
@@ -325,6 +586,15 @@ vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 	return false;
 }
 
+void
+vt_ept_get_stat (u32 *violation, u32 *tables, u32 *reclaim, u32 *wipe)
+{
+	*violation = stat_violation;
+	*tables = stat_tables;
+	*reclaim = stat_reclaim;
+	*wipe = stat_wipe;
+}
+
 void
 vt_ept_map_1mb (void)
 {
@@ -41,5 +41,7 @@ void vt_ept_updatecr3 (void);
 void vt_ept_clear_all (void);
 bool vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end);
 void vt_ept_map_1mb (void);
+void vt_ept_get_stat (u32 *violation, u32 *tables, u32 *reclaim,
+		      u32 *wipe);
 
 #endif
@@ -170,6 +170,10 @@ ept_init (void)
 	if (!(ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_EPTSTRUCT_WB_BIT))
 		return;
 	current->u.vt.ept_available = true;
+	if (ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_AD_BIT)
+		current->u.vt.ept_ad_available = true;
+	if (ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_1GB_PAGE_BIT)
+		current->u.vt.ept_1g_available = true;
 	if (!(ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_BIT))
 		return;
 	if (!(ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_INVEPT_ALL_CONTEXT_BIT))
@@ -214,6 +218,8 @@ vt__vmcs_init (void)
 	ulong exitctl64;
 	ulong exitctl_efer = 0, entryctl_efer = 0;
 	u64 host_efer;
+	u64 vmx_misc;
+	ulong pinctl_preempt = 0;
 	u32 procbased_ctls2_or, procbased_ctls2_and = 0;
 	ulong procbased_ctls2 = 0;
 	struct vt_io_data *io;
@@ -256,6 +262,8 @@ vt__vmcs_init (void)
 	current->u.vt.exint_pending = false;
 	current->u.vt.cr3exit_controllable = vt_cr3exit_controllable ();
 	current->u.vt.cr3exit_off = false;
+	current->u.vt.preempt_timer = false;
+	current->u.vt.preempt_timer_armed = false;
 	alloc_page (&current->u.vt.vi.vmcs_region_virt,
 		    &current->u.vt.vi.vmcs_region_phys);
 	current->u.vt.intr.vmcs_intr_info.s.valid = INTR_INFO_VALID_INVALID;
@@ -316,6 +324,13 @@ vt__vmcs_init (void)
 		exitctl_efer |= VMCS_VMEXIT_CTL_LOAD_IA32_EFER_BIT;
 		entryctl_efer |= VMCS_VMENTRY_CTL_LOAD_IA32_EFER_BIT;
 	}
+	if (pinbased_ctls_and & VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER_BIT) {
+		asm_rdmsr64 (MSR_IA32_VMX_MISC, &vmx_misc);
+		current->u.vt.preempt_timer = true;
+		current->u.vt.preempt_timer_rate = vmx_misc &
+			MSR_IA32_VMX_MISC_PREEMPT_TIMER_RATE_MASK;
+		pinctl_preempt = VMCS_PIN_BASED_VMEXEC_CTL_PREEMPT_TIMER_BIT;
+	}
 
 	/* get current information */
 	vt_get_current_regs_in_vmcs (&host_riv);
@@ -363,7 +378,10 @@ vt__vmcs_init (void)
 		     (/* VMCS_PIN_BASED_VMEXEC_CTL_EXINTEXIT_BIT */0 |
 		      VMCS_PIN_BASED_VMEXEC_CTL_NMIEXIT_BIT |
 		      VMCS_PIN_BASED_VMEXEC_CTL_VIRTNMIS_BIT |
+		      pinctl_preempt |
 		      pinbased_ctls_or) & pinbased_ctls_and);
+	if (current->u.vt.preempt_timer)
+		asm_vmwrite (VMCS_VMX_PREEMPT_TIMER_VALUE, 0xFFFFFFFF);
 	asm_vmwrite (VMCS_PROC_BASED_VMEXEC_CTL,
 		     (/* XXX: VMCS_PROC_BASED_VMEXEC_CTL_HLTEXIT_BIT */0 |
 		      VMCS_PROC_BASED_VMEXEC_CTL_INVLPGEXIT_BIT |
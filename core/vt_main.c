@@ -34,6 +34,7 @@
 #include "cpu_mmu.h"
 #include "current.h"
 #include "exint_pass.h"
+#include "exitprof.h"
 #include "gmm_pass.h"
 #include "initfunc.h"
 #include "int.h"
@@ -44,11 +45,13 @@
 #include "reboot.h"
 #include "string.h"
 #include "thread.h"
+#include "timer.h"
 #include "tresor.h"
 #include "vmmcall.h"
 #include "vmmcall_status.h"
 #include "vt.h"
 #include "vt_addip.h"
+#include "vt_ept.h"
 #include "vt_exitreason.h"
 #include "vt_init.h"
 #include "vt_io.h"
@@ -436,12 +439,41 @@ vt__vm_run_first (void)
 	}
 }
 
+/* Program the VMX-preemption timer so that the guest exits when the
+ * earliest VMM timer expires */
+static void
+vt_update_preempt_timer (void)
+{
+	u32 a, d;
+	u64 deadline, now, ticks;
+
+	if (!current->u.vt.preempt_timer)
+		return;
+	if (!timer_deadline (&deadline)) {
+		if (current->u.vt.preempt_timer_armed) {
+			asm_vmwrite (VMCS_VMX_PREEMPT_TIMER_VALUE, 0xFFFFFFFF);
+			current->u.vt.preempt_timer_armed = false;
+		}
+		return;
+	}
+	asm_rdtsc (&a, &d);
+	now = ((u64)d << 32) | a;
+	ticks = 0;
+	if (deadline > now)
+		ticks = (deadline - now) >> current->u.vt.preempt_timer_rate;
+	if (ticks > 0xFFFFFFFF)
+		ticks = 0xFFFFFFFF;
+	asm_vmwrite (VMCS_VMX_PREEMPT_TIMER_VALUE, ticks);
+	current->u.vt.preempt_timer_armed = true;
+}
+
 static void
 vt__vm_run (void)
 {
 	enum vt__status status;
 	ulong errnum;
 
+	vt_update_preempt_timer ();
 	if (current->u.vt.first) {
 		vt__vm_run_first ();
 		current->u.vt.first = false;
@@ -873,7 +905,9 @@ static void
 vt__exit_reason (void)
 {
 	ulong exit_reason;
+	u64 exitprof;
 
+	exitprof = exitprof_begin ();
 	asm_vmread (VMCS_EXIT_REASON, &exit_reason);
 	if (exit_reason & EXIT_REASON_VMENTRY_FAILURE_BIT)
 		panic ("Fatal error: VM Entry failure.");
@@ -937,6 +971,9 @@ vt__exit_reason (void)
 	case EXIT_REASON_NMI_WINDOW:
 		do_nmi_window ();
 		break;
+	case EXIT_REASON_VMX_PREEMPT_TIMER:
+		/* Expired timers are handled by timer_poll() */
+		break;
 	default:
 		printf ("Fatal error: handler not implemented.\n");
 		printexitreason (exit_reason);
@@ -947,6 +984,7 @@ vt__exit_reason (void)
 			[(exit_reason & EXIT_REASON_MASK) >
 			 STAT_EXIT_REASON_MAX ? STAT_EXIT_REASON_MAX :
 			 (exit_reason & EXIT_REASON_MASK)]));
+	exitprof_end (exitprof, exit_reason & EXIT_REASON_MASK);
 }
 
 static void
@@ -1048,6 +1086,7 @@ vt_mainloop (void)
                 tresor_init_ap();
 #endif
 		
+		timer_poll ();
         schedule ();
 		vt_vmptrld (current->u.vt.vi.vmcs_region_phys);
 		panic_test ();
@@ -1133,6 +1172,7 @@ vt_status (void)
 {
 	static char buf[4096];
 	int i, n;
+	u32 eptviol, epttbl, eptreclaim, eptwipe;
 
 	n = snprintf (buf, 4096, "Exit Reason:\n");
 	for (i = 0; i + 7 <= STAT_EXIT_REASON_MAX; i += 8) {
@@ -1156,7 +1196,7 @@ vt_status (void)
 		n += snprintf (buf + n, 4096 - n, " %04X\n",
 			       stat_exit_reason[i] & 0xFFFF);
 	}
-	snprintf (buf + n, 4096 - n,
+	n += snprintf (buf + n, 4096 - n,
 		  "Interrupts: %u\n"
 		  "Hardware exceptions: %u\n"
 		  " Page fault: %u\n"
@@ -1167,6 +1207,13 @@ vt_status (void)
 		  , stat_intcnt, stat_hwexcnt, stat_pfcnt
 		  , stat_hwexcnt - stat_pfcnt, stat_swexcnt
 		  , stat_iocnt, stat_hltcnt);
+	vt_ept_get_stat (&eptviol, &epttbl, &eptreclaim, &eptwipe);
+	snprintf (buf + n, 4096 - n,
+		  "EPT violations: %u\n"
+		  "EPT tables in use: %u\n"
+		  "EPT tables reclaimed: %u\n"
+		  "EPT full wipes: %u\n"
+		  , eptviol, epttbl, eptreclaim, eptwipe);
 	return buf;
 }
 
@@ -60,6 +60,10 @@
    reserved, but 88SE91xx is different. */
 #define CTBA_MASK		0x3F /* for supporting 88SE91xx */
 
+/* Size of the preallocated shadow buffer of each command slot.
+   Larger transfers fall back to alloc2(). */
+#define AHCI_SLAB_BUFSIZE	(128 * 1024)
+
 static const char driver_name[] = "ahci_driver";
 static int ahci_host_id = 0;
 
@@ -199,13 +203,26 @@ struct ahci_port {
 		phys_t cmdtbl_p;
 		void *dmabuf;
 		phys_t dmabuf_p;
+		long dmabuf_premap;
+		void *slabbuf;
+		phys_t slabbuf_p;
+		long slabbuf_premap;
 		u32 dmabuflen;
 		u64 dmabuf_lba;
 		u32 dmabuf_nsec;
 		u32 dmabuf_ssiz;
 		int dmabuf_rwflag;
+		bool dmabuf_ncq;
 		enum identify_type dmabuf_identify;
 	} my[NUM_OF_COMMAND_HEADER];
+	u32 busybit;		/* NCQ completions running on workers */
+	struct ahci_completion {
+		struct storage_task task;
+		struct ahci_port *port;
+		int cmdhdr_index;
+		struct command_table *cmdtbl;
+		u16 prdtl;
+	} comp[NUM_OF_COMMAND_HEADER];
 };
 
 struct d2hrfis_0x34 {
@@ -438,6 +455,146 @@ ahci_copy_dmabuf (struct ahci_port *port, int cmdhdr_index, bool wr,
 	ASSERT (remain == 0);
 }
 
+/* encrypt or decrypt sectors of the shadow buffer in place */
+static void
+ahci_crypt_inplace (struct ahci_port *port, int cmdhdr_index, bool wr,
+		    u32 off, u32 nsec)
+{
+	struct storage_access access;
+	u8 *mybuf = (u8 *)port->my[cmdhdr_index].dmabuf + off;
+	long premap = port->my[cmdhdr_index].dmabuf_premap;
+
+	access.rw = wr ? STORAGE_WRITE : STORAGE_READ;
+	access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
+	access.lba = port->my[cmdhdr_index].dmabuf_lba +
+		off / access.sector_size;
+	access.count = nsec;
+	storage_premap_handle_sectors (port->storage_device, &access, mybuf,
+				       mybuf, premap, premap);
+}
+
+/* Copy between guest buffers and the shadow buffer and encrypt
+   (wr) or decrypt (!wr) the sectors on the way.  Whole sectors in
+   a PRD segment are processed directly between the guest page and
+   the shadow buffer so that the data is touched only once.  A
+   sector split across segments is gathered in the shadow buffer
+   and processed in place. */
+static void
+ahci_crypt_dmabuf (struct ahci_port *port, int cmdhdr_index, bool wr,
+		   struct command_table *cmdtbl, u16 prdtl)
+{
+	u8 *mybuf = port->my[cmdhdr_index].dmabuf;
+	long premap = port->my[cmdhdr_index].dmabuf_premap;
+	struct storage_access access;
+	u32 dba, dbau, dbc, pos, len, ssiz, off, cryptlen;
+	phys_t db_phys;
+	u8 *gbuf;
+	int i;
+
+	ASSERT (mybuf);
+	ssiz = port->my[cmdhdr_index].dmabuf_ssiz;
+	cryptlen = port->my[cmdhdr_index].dmabuf_nsec * ssiz;
+	if (cryptlen > port->my[cmdhdr_index].dmabuflen)
+		cryptlen = port->my[cmdhdr_index].dmabuflen -
+			port->my[cmdhdr_index].dmabuflen % ssiz;
+	access.rw = wr ? STORAGE_WRITE : STORAGE_READ;
+	access.sector_size = ssiz;
+	off = 0;
+	for (i = 0; i < prdtl; i++) {
+		dba = cmdtbl->prdt[i].dba;
+		dbau = cmdtbl->prdt[i].dbau;
+		dbc = (cmdtbl->prdt[i].dbc & 0x3FFFFE) + 2;
+		ASSERT (port->my[cmdhdr_index].dmabuflen - off >= dbc);
+		db_phys = ahci_get_phys (dba & ~1, dbau);
+		gbuf = mapmem_gphys (db_phys, dbc, wr ? 0 : MAPMEM_WRITE);
+		for (pos = 0; pos < dbc; pos += len, off += len) {
+			if (off >= cryptlen) {
+				/* not a sector to be processed */
+				len = dbc - pos;
+				if (wr)
+					memcpy (mybuf + off, gbuf + pos, len);
+				else
+					memcpy (gbuf + pos, mybuf + off, len);
+				continue;
+			}
+			if (!(off % ssiz) && dbc - pos >= ssiz) {
+				len = (dbc - pos) / ssiz * ssiz;
+				if (len > cryptlen - off)
+					len = cryptlen - off;
+				access.lba = port->my[cmdhdr_index].dmabuf_lba
+					+ off / ssiz;
+				access.count = len / ssiz;
+				if (wr)
+					storage_premap_handle_sectors
+						(port->storage_device, &access,
+						 gbuf + pos, mybuf + off, 0,
+						 premap);
+				else
+					storage_premap_handle_sectors
+						(port->storage_device, &access,
+						 mybuf + off, gbuf + pos,
+						 premap, 0);
+				continue;
+			}
+			/* a sector split across PRD segments */
+			len = ssiz - off % ssiz;
+			if (len > dbc - pos)
+				len = dbc - pos;
+			if (wr) {
+				memcpy (mybuf + off, gbuf + pos, len);
+				if (!((off + len) % ssiz))
+					ahci_crypt_inplace (port, cmdhdr_index,
+							    true,
+							    off + len - ssiz,
+							    1);
+			} else {
+				if (!(off % ssiz))
+					ahci_crypt_inplace (port, cmdhdr_index,
+							    false, off, 1);
+				memcpy (gbuf + pos, mybuf + off, len);
+			}
+		}
+		unmapmem (gbuf, dbc);
+	}
+	ASSERT (off == port->my[cmdhdr_index].dmabuflen);
+}
+
+/* take a shadow buffer from the slab of the port if it fits.  The
+ * slab buffer of a command slot is allocated when the slot is used
+ * first, so that ports without a device and slots the guest never
+ * uses do not take memory. */
+static void
+ahci_dmabuf_alloc (struct ahci_port *port, int cmdhdr_index, u32 len)
+{
+	if (!port->my[cmdhdr_index].slabbuf && len <= AHCI_SLAB_BUFSIZE) {
+		port->my[cmdhdr_index].slabbuf =
+			alloc2 (AHCI_SLAB_BUFSIZE,
+				&port->my[cmdhdr_index].slabbuf_p);
+		port->my[cmdhdr_index].slabbuf_premap = storage_premap_buf
+			(port->my[cmdhdr_index].slabbuf, AHCI_SLAB_BUFSIZE);
+	}
+	if (port->my[cmdhdr_index].slabbuf && len <= AHCI_SLAB_BUFSIZE) {
+		port->my[cmdhdr_index].dmabuf = port->my[cmdhdr_index].slabbuf;
+		port->my[cmdhdr_index].dmabuf_p =
+			port->my[cmdhdr_index].slabbuf_p;
+		port->my[cmdhdr_index].dmabuf_premap =
+			port->my[cmdhdr_index].slabbuf_premap;
+		return;
+	}
+	port->my[cmdhdr_index].dmabuf = alloc2 (len,
+						&port->my[cmdhdr_index].
+						dmabuf_p);
+	port->my[cmdhdr_index].dmabuf_premap = 0;
+}
+
+static void
+ahci_dmabuf_free (struct ahci_port *port, int cmdhdr_index)
+{
+	if (port->my[cmdhdr_index].dmabuf != port->my[cmdhdr_index].slabbuf)
+		free (port->my[cmdhdr_index].dmabuf);
+	port->my[cmdhdr_index].dmabuf = NULL;
+}
+
 static bool
 ahci_port_eq (int port_off, unsigned int len, int eq_port_off)
 {
@@ -767,6 +924,7 @@ ahci_handle_cmd_rw_ncq (struct ahci_data *ad, struct ahci_port *port,
 	port->my[cmdhdr_index].dmabuf_lba = lba;
 	port->my[cmdhdr_index].dmabuf_nsec = nsec;
 	port->my[cmdhdr_index].dmabuf_ssiz = 512;
+	port->my[cmdhdr_index].dmabuf_ncq = true;
 	port->my[cmdhdr_index].dmabuf_identify = IDENTIFY_NONE;
 }
 
@@ -817,15 +975,15 @@ ahci_handle_packet (struct ahci_data *ad, struct ahci_port *port,
 
 static void
 ahci_cmd_prehook (struct ahci_data *ad, struct ahci_port *port,
-		  int cmdhdr_index)
+		  int cmdhdr_index, struct command_table *cmdtbl, u16 prdtl)
 {
 	u8 *acmd;
 	union cmdfis *cfis;
 	ata_cmd_type_t type;
-	struct storage_access access;
 
 	cfis = &port->my[cmdhdr_index].cmdtbl->cfis;
 	acmd = port->my[cmdhdr_index].cmdtbl->acmd;
+	port->my[cmdhdr_index].dmabuf_ncq = false;
 	if (port->mycmdlist->cmdhdr[cmdhdr_index].a) {
 		ASSERT (cfis->fis_type == 0x27);
 		type = ata_get_cmd_type (cfis->fis_0x27.command);
@@ -841,41 +999,28 @@ ahci_cmd_prehook (struct ahci_data *ad, struct ahci_port *port,
 							    type.rw, type.ext);
 		ASSERT (!port->my[cmdhdr_index].dmabuf_rwflag || !port->atapi);
 	}
-	if (!port->my[cmdhdr_index].dmabuf_rwflag)
-		return;
 	if (!port->mycmdlist->cmdhdr[cmdhdr_index].w) /* read */
 		return;
-	access.rw = 1;
-	access.lba = port->my[cmdhdr_index].dmabuf_lba;
-	access.count = port->my[cmdhdr_index].dmabuf_nsec;
-	access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
-	storage_handle_sectors (port->storage_device, &access,
-				port->my[cmdhdr_index].dmabuf,
-				port->my[cmdhdr_index].dmabuf);
+	if (port->my[cmdhdr_index].dmabuf_rwflag)
+		ahci_crypt_dmabuf (port, cmdhdr_index, true, cmdtbl, prdtl);
+	else
+		ahci_copy_dmabuf (port, cmdhdr_index, true, cmdtbl, prdtl);
 }
 
 static void
 ahci_cmd_posthook (struct ahci_data *ad, struct ahci_port *port,
-		   int cmdhdr_index)
+		   int cmdhdr_index, struct command_table *cmdtbl, u16 prdtl)
 {
-	struct storage_access access;
-
 	if (port->my[cmdhdr_index].dmabuf_identify) {
 		/* check atapi or not */
 		ahci_identity_check (ad, port, cmdhdr_index);
-		return;
 	}
-	if (!port->my[cmdhdr_index].dmabuf_rwflag)
-		return;
 	if (port->mycmdlist->cmdhdr[cmdhdr_index].w) /* write */
 		return;
-	access.rw = 0;
-	access.lba = port->my[cmdhdr_index].dmabuf_lba;
-	access.count = port->my[cmdhdr_index].dmabuf_nsec;
-	access.sector_size = port->my[cmdhdr_index].dmabuf_ssiz;
-	storage_handle_sectors (port->storage_device, &access,
-				port->my[cmdhdr_index].dmabuf,
-				port->my[cmdhdr_index].dmabuf);
+	if (port->my[cmdhdr_index].dmabuf_rwflag)
+		ahci_crypt_dmabuf (port, cmdhdr_index, false, cmdtbl, prdtl);
+	else
+		ahci_copy_dmabuf (port, cmdhdr_index, false, cmdtbl, prdtl);
 }
 
 /************************************************************/
@@ -892,21 +1037,49 @@ ahci_cmd_cancel (struct ahci_port *port)
 		if (!(port->shadowbit & (1 << i)))
 			continue;
 		port->shadowbit &= ~(1 << i);
-		if (port->my[i].dmabuf) {
-			free (port->my[i].dmabuf);
-			port->my[i].dmabuf = NULL;
+		if (port->busybit & (1 << i)) {
+			storage_task_wait (&port->comp[i].task);
+			port->busybit &= ~(1 << i);
+			unmapmem (port->comp[i].cmdtbl,
+				  cmdtbl_size (port->comp[i].prdtl));
 		}
+		if (port->my[i].dmabuf)
+			ahci_dmabuf_free (port, i);
 		if (!port->shadowbit)
 			break;
 	}
 }
 
+/* Decrypting data of an NCQ read command.  This may run on another
+   CPU while the other slots of the port are completed. */
+static void
+ahci_cmd_complete_task (void *arg)
+{
+	struct ahci_completion *c = arg;
+
+	ahci_crypt_dmabuf (c->port, c->cmdhdr_index, false, c->cmdtbl,
+			   c->prdtl);
+}
+
+static void
+ahci_cmd_finish (struct ahci_port *port, struct command_list *cmdlist,
+		 int i)
+{
+	cmdlist->cmdhdr[i].prdbc = port->mycmdlist->cmdhdr[i].prdbc;
+	port->shadowbit &= ~(1 << i);
+}
+
+/* Each finished slot is completed independently.  Decryption of a
+   finished NCQ read is handed to the storage workers and the slot
+   stays busy, i.e. its PxSACT bit stays set for the guest, until
+   its own data is ready.  Other slots are not delayed by it. */
 static void
 ahci_cmd_complete (struct ahci_data *ad, struct ahci_port *port, u32 pxsact,
 		   u32 pxci)
 {
 	struct command_list *cmdlist;
 	struct command_table *cmdtbl;
+	struct ahci_completion *c;
 	int i;
 	u16 prdtl;
 	phys_t ctphys;
@@ -916,11 +1089,20 @@ ahci_cmd_complete (struct ahci_data *ad, struct ahci_port *port, u32 pxsact,
 	for (i = 0; i < NUM_OF_COMMAND_HEADER; i++) {
 		if (!(port->shadowbit & (1 << i)))
 			continue;
+		c = &port->comp[i];
+		if (port->busybit & (1 << i)) {
+			if (!storage_task_done (&c->task))
+				continue;
+			port->busybit &= ~(1 << i);
+			unmapmem (c->cmdtbl, cmdtbl_size (c->prdtl));
+			ahci_dmabuf_free (port, i);
+			ahci_cmd_finish (port, cmdlist, i);
+			continue;
+		}
 		if (pxci & (1 << i))
 			continue;
 		if (pxsact & (1 << i))
 			continue;
-		port->shadowbit &= ~(1 << i);
 		prdtl = cmdlist->cmdhdr[i].prdtl;
 		if (prdtl > 0) {
 			ctphys = ahci_get_phys
@@ -928,21 +1110,45 @@ ahci_cmd_complete (struct ahci_data *ad, struct ahci_port *port, u32 pxsact,
 				 cmdlist->cmdhdr[i].ctbau);
 			cmdtbl = mapmem_gphys (ctphys, cmdtbl_size (prdtl),
 					       MAPMEM_WRITE);
-			ahci_cmd_posthook (ad, port, i);
-			if (!(port->mycmdlist->cmdhdr[i].w)) /* read */
-				ahci_copy_dmabuf (port, i, false, cmdtbl,
-						  prdtl);
+			if (port->my[i].dmabuf_ncq &&
+			    port->my[i].dmabuf_rwflag &&
+			    !port->mycmdlist->cmdhdr[i].w) { /* read */
+				c->port = port;
+				c->cmdhdr_index = i;
+				c->cmdtbl = cmdtbl;
+				c->prdtl = prdtl;
+				port->busybit |= 1 << i;
+				storage_task_submit (&c->task,
+						     ahci_cmd_complete_task, c);
+				if (!storage_task_done (&c->task))
+					continue;
+				port->busybit &= ~(1 << i);
+			} else {
+				ahci_cmd_posthook (ad, port, i, cmdtbl, prdtl);
+			}
 			unmapmem (cmdtbl, cmdtbl_size (prdtl));
-			free (port->my[i].dmabuf);
-			port->my[i].dmabuf = NULL;
+			ahci_dmabuf_free (port, i);
 		} else {
 			ASSERT (port->my[i].dmabuf == NULL);
 		}
-		cmdlist->cmdhdr[i].prdbc = port->mycmdlist->cmdhdr[i].prdbc;
+		ahci_cmd_finish (port, cmdlist, i);
 	}
 	unmapmem (cmdlist, sizeof *cmdlist);
 }
 
+/* wait for the NCQ completions running on workers */
+static void
+ahci_cmd_complete_wait (struct ahci_data *ad, struct ahci_port *port,
+			u32 pxsact, u32 pxci)
+{
+	int i;
+
+	for (i = 0; i < NUM_OF_COMMAND_HEADER; i++)
+		if (port->busybit & (1 << i))
+			storage_task_wait (&port->comp[i].task);
+	ahci_cmd_complete (ad, port, pxsact, pxci);
+}
+
 static void
 ahci_cmd_start (struct ahci_data *ad, struct ahci_port *pt, u32 pxci)
 {
@@ -973,8 +1179,7 @@ ahci_cmd_start (struct ahci_data *ad, struct ahci_port *pt, u32 pxci)
 			if (pt->my[i].dmabuf != NULL)
 				panic ("pt->my[i].dmabuf=%p is not NULL!",
 				       pt->my[i].dmabuf);
-			pt->my[i].dmabuf = alloc2 (totalsize,
-						   &pt->my[i].dmabuf_p);
+			ahci_dmabuf_alloc (pt, i, totalsize);
 			pt->my[i].dmabuflen = totalsize;
 			pt->mycmdlist->cmdhdr[i].ctba = pt->my[i].cmdtbl_p;
 			pt->mycmdlist->cmdhdr[i].ctbau =
@@ -988,9 +1193,7 @@ ahci_cmd_start (struct ahci_data *ad, struct ahci_port *pt, u32 pxci)
 			pt->my[i].cmdtbl->prdt[0].dbc = (totalsize - 2) | 1;
 			pt->my[i].cmdtbl->prdt[0].i = intrflag;
 			pt->mycmdlist->cmdhdr[i].prdtl = 1;
-			if (pt->mycmdlist->cmdhdr[i].w) /* write */
-				ahci_copy_dmabuf (pt, i, true, cmdtbl, prdtl);
-			ahci_cmd_prehook (ad, pt, i);
+			ahci_cmd_prehook (ad, pt, i, cmdtbl, prdtl);
 			unmapmem (cmdtbl, cmdtbl_size (prdtl));
 		} else {
 			ASSERT (pt->my[i].dmabuf == NULL);
@@ -1047,10 +1250,14 @@ mmhandler2 (struct ahci_data *ad, u32 offset, bool wr, u32 *buf32, uint len,
 		pxsact = ahci_port_read (ad, i, PxSACT);
 		pxci = ahci_port_read (ad, i, PxCI);
 		ahci_cmd_complete (ad, port, pxsact, pxci);
+		/* If the device has nothing left to do, no completion
+		 * interrupt will tell the guest to look again. */
+		if (port->busybit && !pxsact && !pxci)
+			ahci_cmd_complete_wait (ad, port, pxsact, pxci);
 		if (!wr && port_num == i) {
 			/* Read */
 			if (ahci_port_eq (port_off, len, PxSACT)) {
-				*buf32 = pxsact;
+				*buf32 = pxsact | port->busybit;
 				r = 1;
 			} else if (ahci_port_eq (port_off, len, PxCI)) {
 				*buf32 = pxci;
@@ -1233,8 +1440,7 @@ ahci_command_fill (struct ahci_port *port, int slot,
 		port->my[slot].dmabuf = NULL;
 		port->my[slot].dmabuf_p = cmd->buf_phys;
 	} else {
-		port->my[slot].dmabuf = alloc2 ((cmd->buf_len + 0x7F) & ~0x7F,
-						&port->my[slot].dmabuf_p);
+		ahci_dmabuf_alloc (port, slot, (cmd->buf_len + 0x7F) & ~0x7F);
 		if (cmd->write)
 			memcpy (port->my[slot].dmabuf, cmd->buf, cmd->buf_len);
 	}
@@ -1399,8 +1605,7 @@ ahci_command_completion (struct ahci_data *ad, struct ahci_command_list *p,
 	if (port->my[slot].dmabuf) {
 		if (!cmd->write)
 			memcpy (cmd->buf, port->my[slot].dmabuf, cmd->buf_len);
-		free (port->my[slot].dmabuf);
-		port->my[slot].dmabuf = NULL;
+		ahci_dmabuf_free (port, slot);
 	}
 	fis = data->port[pno].fis;
 	if (fis) {
@@ -102,6 +102,23 @@ static void clflush_seq(struct iommu *iommu, void *addr, int size)
 #define inval_cache_dw(iommu, addr) clflush_seq(iommu, addr, 8)
 #define inval_cache_pg(iommu, addr) clflush_seq(iommu, addr, PAGESIZE)
 
+// IO page tables are shared by all DRHDs and accessed through
+// write-back mappings.  Cache lines are flushed only if any of the
+// DRHDs does not snoop them.
+static bool iopt_noncoherent;
+static bool dma_remapping_enabled;
+
+static void iopt_flush(void *addr, int size)
+{
+	ulong p, end;
+	
+	if (!iopt_noncoherent)
+		return;
+	end = (ulong)addr + size;
+	for (p = (ulong)addr & ~(ulong)(clflush_size - 1); p < end; p += clflush_size)
+		clflush(p);
+}
+
 /* Setup device context information */
 static struct context_entry *devid_to_context(struct iommu *iommu, u8 bus, u8 devfn)
 {
@@ -127,96 +144,12 @@ static struct context_entry *devid_to_context(struct iommu *iommu, u8 bus, u8 de
 		set_root_present(*root);
 		inval_cache_dw(iommu, root);
 	}
-	context = (struct context_entry *)mapmem_hphys((unsigned long) root_entry_ctp(*root), PAGESIZE, MAPMEM_PCD);
+	context = (struct context_entry *)mapmem_hphys((unsigned long) root_entry_ctp(*root), PAGESIZE, 0);
 	spinlock_unlock(&iommu->unit_lock);
 	
 	return &context[devfn];
 }
 
-static phys_t buildup_iopt(struct domain *dom, u64 addr)
-{
-	struct acpi_drhd_u *drhd;
-	struct iommu *iommu;
-	int addr_width;
-	struct iopt_entry *parent, *pte = NULL;
-	int level;
-	int offset;
-	phys_t pgaddr ;
-	u64 *vaddr = NULL;
-	
-	void *virt; 
-	phys_t phys;
-	int ret;
-	
-	level = dom->agaw + 2; // level of iommu page table
-	addr_width = level * IOPT_LEVEL_STRIDE + 12; // guest address width
-	
-	drhd = drhd_list_head.next;
-	iommu = drhd->iommu;
-	
-	addr &= (((typeof(addr))1) << addr_width) - 1;
-	
-	spinlock_lock(&dom->iopt_lock);
-	
-	if (!dom->pgd) // if NOT prepared ...
-	{
-		ret = alloc_page(&virt, &phys);
-		if (ret!=0) {
-			spinlock_unlock(&dom->iopt_lock);
-			return 0x0;
-		}
-		
-		vaddr = (u64 *)virt;
-		memset(vaddr, 0, PAGESIZE);
-		dom->pgd = (void *)(long)phys;
-	}
-	
-	parent = mapmem_hphys((unsigned long)dom->pgd, PAGESIZE, MAPMEM_PCD);
-	
-	do {
-		offset = iopt_level_offset(addr, level);
-		pte = &parent[offset];
-		
-		if (get_pte_addr(*pte) == 0) { // if iommu page table NOT prepared ...
-			ret = alloc_page(&virt, &phys);
-			pgaddr = phys;
-			vaddr = (u64 *)virt;
-			if (ret!=0) {
-				spinlock_unlock(&dom->iopt_lock);
-				return 0x0;
-			}
-			
-			memset(vaddr, 0, PAGESIZE);
-			inval_cache_pg(iommu, vaddr);
-			
-			set_pte_addr(*pte, (pgaddr & PAGE_MASK));
-			set_pte_perm(*pte, PERM_DMA_RW);
-			
-			inval_cache_dw(iommu, pte);
-		} else { // if iommu page table ALREADY prepared ...
-			pgaddr = get_pte_addr(*pte);
-			vaddr = mapmem_hphys(pgaddr, PAGESIZE, MAPMEM_PCD);
-			if (!vaddr) {
-				spinlock_unlock(&dom->iopt_lock);
-				return 0x0;
-			}
-		}
-		
-		if (parent != dom->pgd)
-			unmapmem(parent, PAGESIZE);
-		
-		if (level == 2 && vaddr) {
-			unmapmem(vaddr, PAGESIZE);
-			break;
-		}
-		
-		parent = (struct iopt_entry *)vaddr;
-		vaddr = NULL;
-	} while (--level > 1) ;
-	spinlock_unlock(&dom->iopt_lock);
-	return pgaddr;
-}
-
 static void gcmd_wbf(struct iommu *iommu)
 {
 	u32 val;
@@ -262,17 +195,18 @@ static int invalidate_context_cache(struct iommu *iommu)
 	return 0;
 }
 
-// IOTLB global invalidation
-static int flush_iotlb_global(struct iommu *iommu)
+// IOTLB invalidation of the granularity given by val
+// iva is written to the Invalidate Address Register for page-selective one
+static int flush_iotlb(struct iommu *iommu, u64 val, u64 iva)
 {
 	int iotlb_reg_offset = ecap_iro(iommu->ecap);
-	u64 val = 0 ;
 	
-	// IOTLB global invalidation
 	// Also DMA draining will be applied, if supported
-	val = IOTLB_FLUSH_GLOBAL|IOTLB_IVT|IOTLB_DRAIN_READ|IOTLB_DRAIN_WRITE;
+	val |= IOTLB_IVT|IOTLB_DRAIN_READ|IOTLB_DRAIN_WRITE;
 	
 	spinlock_lock(&iommu->reg_lock);
+	if ((val & IOTLB_FLUSH_PAGE) == IOTLB_FLUSH_PAGE)
+		write_hphys_q(iommu->reg+ iotlb_reg_offset, iva, MAPMEM_PCD);
 	write_hphys_q(iommu->reg+ iotlb_reg_offset + 8, val, MAPMEM_PCD);
 	
 	// wait until completion
@@ -287,6 +221,35 @@ static int flush_iotlb_global(struct iommu *iommu)
 	return 0;
 }
 
+// IOTLB global invalidation
+static int flush_iotlb_global(struct iommu *iommu)
+{
+	return flush_iotlb(iommu, IOTLB_FLUSH_GLOBAL, 0);
+}
+
+// IOTLB domain-selective invalidation
+static int flush_iotlb_domain(struct iommu *iommu, u16 did)
+{
+	return flush_iotlb(iommu, IOTLB_FLUSH_DOMAIN|IOTLB_DID(did), 0);
+}
+
+// IOTLB page-selective invalidation of the smallest naturally aligned
+// block covering the range.  Falls back to domain-selective one if the
+// block is larger than the DRHD supports.
+static int flush_iotlb_pages(struct iommu *iommu, u16 did, u64 pfn, u64 npages)
+{
+	u64 last = pfn + npages - 1;
+	unsigned int am = 0;
+	
+	while ((pfn >> am) != (last >> am))
+		am++;
+	if (!cap_psi(iommu->cap) || am > cap_mamv(iommu->cap))
+		return flush_iotlb_domain(iommu, did);
+	pfn = (pfn >> am) << am;
+	return flush_iotlb(iommu, IOTLB_FLUSH_PAGE|IOTLB_DID(did),
+			   (pfn << PAGE_SHIFT) | am);
+}
+
 static void flush_all(void)
 {
 	struct acpi_drhd_u *drhd;
@@ -377,6 +340,9 @@ static struct iommu *alloc_iommu(struct acpi_drhd_u *drhd)
 	spinlock_init(&iommu->unit_lock);
 	spinlock_init(&iommu->reg_lock);
 	
+	if (!ecap_c(iommu->ecap))
+		iopt_noncoherent = true;
+	
 	drhd->iommu = iommu;
 	return iommu;
 }
@@ -404,6 +370,7 @@ int iodom_init(struct domain *dom)
 	int adjust_width ;
 	int agaw ;
 	u64 sagaw;
+	int sllps = 0xf;
 	struct acpi_drhd_u *drhd;
 	
 	if (!iommu_detected || (drhd_list_head.next==NULL))
@@ -414,6 +381,7 @@ int iodom_init(struct domain *dom)
 			iommu = drhd->iommu ;
 		else 
 			iommu = alloc_iommu(drhd) ;
+		sllps &= cap_sllps(iommu->cap);
 	}
 	
 	/* determine AGAW */
@@ -428,6 +396,7 @@ int iodom_init(struct domain *dom)
 	}
 	
 	dom->agaw = agaw;
+	dom->sllps = sllps;
 	
 	spinlock_init(&dom->iopt_lock);
 	
@@ -478,42 +447,138 @@ static int reg_context_entry(struct domain *dom, struct iommu *iommu, u8 bus, u8
 	return ret;
 }
 
-static int dmar_map_page(struct domain *dom, unsigned long gfn, int perm)
+#define iopt_table_present(p) (!(p).sp && get_pte_addr(p) != 0)
+
+static int iopt_alloc_table(phys_t *phys)
 {
-	struct acpi_drhd_u *drhd;
-	struct iommu *iommu;
-	struct iopt_entry *pte = NULL;
-	phys_t pgaddr=0x0 ;
+	void *virt;
+	int ret;
 	
-	drhd = drhd_list_head.next;
-	iommu = drhd->iommu;
+	ret = alloc_page(&virt, phys);
+	if (ret != 0)
+		return -ENOMEM;
+	memset(virt, 0, PAGESIZE);
+	iopt_flush(virt, PAGESIZE);
+	return 0;
+}
+
+// Replace a superpage entry by a table of smaller pages with the
+// same translation, so that a part of it can be changed.
+static int iopt_split(struct iopt_entry *pte, int level)
+{
+	struct iopt_entry *pt;
+	phys_t phys, base;
+	u64 size;
+	int i;
 	
-	pgaddr = buildup_iopt(dom, (phys_t)gfn << PAGE_SHIFT);
-	if (pgaddr==0x0)
+	if (iopt_alloc_table(&phys))
 		return -ENOMEM;
-	pte = mapmem_hphys(pgaddr, PAGESIZE, MAPMEM_PCD);
-	pte += gfn & IOPT_LEVEL_MASK;
-	set_pte_addr(*pte, (phys_t)gfn << PAGE_SHIFT);
-	switch (perm) {
-	case PERM_DMA_NO:
-	case PERM_DMA_RO:
-	case PERM_DMA_WO:
-	case PERM_DMA_RW:
-		set_pte_perm(*pte, perm);
-		break;
-	default:
-		break;
+	if (pte->sp) {
+		base = get_pte_addr(*pte);
+		size = (u64)PAGESIZE << ((level - 2) * IOPT_LEVEL_STRIDE);
+		pt = mapmem_hphys(phys, PAGESIZE, 0);
+		for (i = 0; i <= IOPT_LEVEL_MASK; i++) {
+			set_pte_addr(pt[i], base + i * size);
+			pt[i].r = pte->r;
+			pt[i].w = pte->w;
+			pt[i].sp = level > 2;
+		}
+		iopt_flush(pt, PAGESIZE);
+		unmapmem(pt, PAGESIZE);
 	}
+	memset(pte, 0, sizeof *pte);
+	set_pte_addr(*pte, phys);
+	set_pte_perm(*pte, PERM_DMA_RW);
+	return 0;
+}
+
+// Map npages page frames from pfn 1:1 with perm in the table at the
+// given level.  Whole aligned blocks are mapped by a single superpage
+// entry when all DRHDs support that size, and the modified entries of
+// each table are written back once.
+static int iopt_map(struct domain *dom, phys_t table, int level, u64 pfn, u64 npages, int perm)
+{
+	struct iopt_entry *pt, *pte;
+	int shift = (level - 1) * IOPT_LEVEL_STRIDE;
+	u64 span = (u64)1 << shift;
+	u64 n;
+	int i, first, last;
+	int ret = 0;
 	
-	inval_cache_dw(iommu, pte);
-	unmapmem(pte, PAGESIZE);
+	pt = mapmem_hphys(table, PAGESIZE, 0);
+	first = (pfn >> shift) & IOPT_LEVEL_MASK;
+	last = first - 1;
+	while (npages > 0) {
+		i = (pfn >> shift) & IOPT_LEVEL_MASK;
+		pte = &pt[i];
+		n = span - (pfn & (span - 1));
+		if (n > npages)
+			n = npages;
+		if (level == 1 || (n == span && !iopt_table_present(*pte) &&
+				   (perm == PERM_DMA_NO ||
+				    (dom->sllps & (1 << (level - 2)))))) {
+			memset(pte, 0, sizeof *pte);
+			if (perm != PERM_DMA_NO) {
+				set_pte_addr(*pte, pfn << PAGE_SHIFT);
+				set_pte_perm(*pte, perm);
+				pte->sp = level > 1;
+			}
+		} else {
+			if (!iopt_table_present(*pte)) {
+				ret = iopt_split(pte, level);
+				if (ret)
+					break;
+			}
+			ret = iopt_map(dom, get_pte_addr(*pte), level - 1, pfn, n, perm);
+			if (ret)
+				break;
+		}
+		last = i;
+		pfn += n;
+		npages -= n;
+	}
+	if (last >= first)
+		iopt_flush(&pt[first], (last - first + 1) * sizeof *pt);
+	unmapmem(pt, PAGESIZE);
+	return ret;
+}
+
+static int dmar_map_range(struct domain *dom, u64 pfn, u64 npages, int perm)
+{
+	struct acpi_drhd_u *drhd;
+	int level;
+	u64 maxpfn;
+	phys_t phys;
+	int ret;
+	
+	level = dom->agaw + 2; // level of iommu page table
+	maxpfn = (u64)1 << (level * IOPT_LEVEL_STRIDE);
+	if (pfn >= maxpfn)
+		return -EINVAL;
+	if (npages > maxpfn - pfn)
+		npages = maxpfn - pfn;
+	if (npages == 0)
+		return 0;
+	
+	spinlock_lock(&dom->iopt_lock);
+	if (!dom->pgd) { // if NOT prepared ...
+		ret = iopt_alloc_table(&phys);
+		if (ret) {
+			spinlock_unlock(&dom->iopt_lock);
+			return ret;
+		}
+		dom->pgd = (void *)(long)phys;
+	}
+	ret = iopt_map(dom, (phys_t)(long)dom->pgd, level, pfn, npages, perm);
+	spinlock_unlock(&dom->iopt_lock);
 	
 	LIST_FOREACH(drhd_list, drhd)
 	{
-		iommu = drhd->iommu;
-		gcmd_wbf(iommu);
+		gcmd_wbf(drhd->iommu);
+		if (dma_remapping_enabled)
+			flush_iotlb_pages(drhd->iommu, dom->domain_id, pfn, npages);
 	}
-	return 0;
+	return ret;
 }
 
 static int search_remap(int bus, int dev, int func) {
@@ -601,6 +666,7 @@ static int enable_dma_remapping(void)
 		if (gcmd_te(drhd->iommu))
 			return -EIO;
 	}
+	dma_remapping_enabled = true;
 	return 0;
 }
 
@@ -647,13 +713,37 @@ static int remap_preconf()
 	return cnt;
 }
 
+// Permission of dom at page frame pfn.  The last matching entry wins.
+// *next is set to the first page frame where the permission may change.
+static int remap_perm(int dom, unsigned long pfn, unsigned long *next)
+{
+	int remap, perm = PERM_DMA_NO;
+	unsigned long start, end;
+	
+	*next = 0x100000;
+	for (remap=0; remap<num_remap ; remap++) {
+		if (rem[remap].dom!=dom) continue;
+		start = rem[remap].phys;
+		end = start + rem[remap].num_pages;
+		if (pfn>=start && pfn<end)
+			perm = rem[remap].perm;
+		if (start>pfn && start<*next)
+			*next = start;
+		if (end>pfn && end<*next)
+			*next = end;
+	}
+	
+	return perm;
+}
+
 void iommu_setup(void) __initcode__
 {
 #ifdef VTD_TRANS
 	
 	struct acpi_drhd_u *drhd;
-	unsigned long i;
-	int remap, dom, ndom, f;
+	unsigned long i, next;
+	unsigned long vmm_start, vmm_term;
+	int remap, dom, ndom, perm;
 	
 	if (!iommu_detected)
 		return;
@@ -669,8 +759,11 @@ void iommu_setup(void) __initcode__
 	ndom=remap_preconf();
 	
 	printf("(IOMMU) dom 0(PT Devs.) ");
-	for (i = 0; i <= 0xfffff; i++) 
-		dmar_map_page(dom_io[0], i, ((i>=vmm_start_inf() >> 12 && i<vmm_term_inf() >> 12) ? PERM_DMA_NO : PERM_DMA_RW));
+	vmm_start = vmm_start_inf() >> 12;
+	vmm_term = vmm_term_inf() >> 12;
+	dmar_map_range(dom_io[0], 0, vmm_start, PERM_DMA_RW);
+	dmar_map_range(dom_io[0], vmm_start, vmm_term - vmm_start, PERM_DMA_NO);
+	dmar_map_range(dom_io[0], vmm_term, 0x100000 - vmm_term, PERM_DMA_RW);
 	for (dom=1; dom<ndom ; dom++) {
 		printf("%x",dom);
 		for (i=0; i<num_remap ; i++) {
@@ -678,17 +771,9 @@ void iommu_setup(void) __initcode__
 			printf("(%x:%x:%x) ", rem[i].bus, rem[i].df.dev_no, rem[i].df.func_no);
 			break;
 		}
-		for (i = 0; i <= 0xfffff; i++) { 
-			f=0;
-			for (remap=0; remap<num_remap ; remap++) {
-				if (rem[remap].dom==dom && i>=rem[remap].phys && i<rem[remap].phys+rem[remap].num_pages) {
-					f=rem[remap].perm;
-				}
-			}
-			if (f) 
-				dmar_map_page(dom_io[dom], i, f);
-			else
-				dmar_map_page(dom_io[dom], i, PERM_DMA_NO);
+		for (i = 0; i <= 0xfffff; i = next) {
+			perm = remap_perm(dom, i, &next);
+			dmar_map_range(dom_io[dom], i, next - i, perm);
 		}
 	}
 	printf("... Ready.\n");
@@ -753,9 +838,9 @@ struct domain *create_dom(unsigned short int domid)
 	return dom;
 #endif // of VTD_TRANS
 	if (0)			/* make gcc happy */
-		printf ("%p%p%p%p%p%p%p", flush_all, dmar_map_page,
+		printf ("%p%p%p%p%p%p%p%p", flush_all, dmar_map_range,
 			setup_bitvisor_devs, mod_remap_conf, init_iommu,
-			enable_dma_remapping, remap_preconf);
+			enable_dma_remapping, remap_preconf, remap_perm);
 	return 0;
 }
 
@@ -181,6 +181,8 @@ struct desc_shadow {
 			struct tdesc *td;
 			phys_t td_phys;
 			void *tbuf[NUM_OF_TDESC];
+			phys_t tbuf_phys[NUM_OF_TDESC];
+			u32 ptail, ptail_eop; /* pass-through tail */
 		} t;
 		struct {
 			struct rdesc *rd;
@@ -216,6 +218,8 @@ struct data2 {
 	u32 regs_at_init[PCI_CONFIG_REGS32_NUM];
 	bool seize;
 	bool conceal;
+	bool passthrough;	/* forward guest descriptors as is */
+	int tx_queues;		/* queues used for VMM transmission */
 	LIST1_DEFINE (struct data2);
 
 	void *virtio_net;
@@ -238,6 +242,8 @@ static LIST1_DEFINE_HEAD (struct data2, d2list);
 
 static void receive_physnic (struct desc_shadow *s, struct data2 *d2,
 			     uint off2);
+static void guest_is_transmitting (struct desc_shadow *s, struct data2 *d2,
+				   uint off2);
 
 static int
 iohandler (core_io_t io, union mem *data, void *arg)
@@ -288,6 +294,8 @@ write_mydesc (struct desc_shadow *s, struct data2 *d2, uint off2,
 		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x18) = 0;
 		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x08) =
 			TDESC_SIZE;
+		s->u.t.ptail = 0;
+		s->u.t.ptail_eop = 0;
 	} else {
 		if (*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x08) ==
 		    RDESC_SIZE)
@@ -305,8 +313,8 @@ write_mydesc (struct desc_shadow *s, struct data2 *d2, uint off2,
 }
 
 static void
-send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
-		  UINT *packet_sizes, bool print_ok)
+send_physnic_sub (struct data2 *d2, int queue, UINT num_packets,
+		  void **packets, UINT *packet_sizes, bool print_ok)
 {
 	struct desc_shadow *s;
 	uint i, off2;
@@ -317,8 +325,8 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 		return;
 	if (!(d2->tctl & 2))	/* !EN: Transmit Enable */
 		return;
-	s = &d2->tdesc[0];	/* FIXME: 0 only */
-	off2 = 0x3800;		/* FIXME: 0 only */
+	s = &d2->tdesc[queue];
+	off2 = queue ? 0x3900 : 0x3800;
 	write_mydesc (s, d2, off2, true);
 	head = (void *)((u8 *)d2->d1[0].map + off2 + 0x10);
 	tail = (void *)((u8 *)d2->d1[0].map + off2 + 0x18);
@@ -342,6 +350,7 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 		}
 		memcpy (s->u.t.tbuf[t], packets[i], packet_sizes[i]);
 		td = &s->u.t.td[t];
+		td->addr = s->u.t.tbuf_phys[t];
 		td->len = packet_sizes[i];
 		td->cso = 0;
 		td->cmd_eop = 1;
@@ -364,15 +373,60 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 	*tail = t;
 }
 
+/* Choose a transmit queue from the IPv4 addresses and the TCP/UDP
+ * ports. */
+static int
+physnic_txqueue (u8 *pkt, uint len)
+{
+	uint ihl;
+	u32 hash;
+
+	if (len < 34 || pkt[12] != 0x08 || pkt[13] != 0x00)
+		return 0;
+	hash = *(u32 *)(void *)&pkt[26] ^ *(u32 *)(void *)&pkt[30];
+	ihl = (pkt[14] & 0xF) * 4;
+	if ((pkt[23] == 6 || pkt[23] == 17) && len >= 14 + ihl + 4 &&
+	    !(pkt[20] & 0x3F) && !pkt[21])
+		hash ^= *(u32 *)(void *)&pkt[14 + ihl];
+	hash ^= hash >> 16;
+	hash ^= hash >> 8;
+	return (hash ^ (hash >> 4) ^ (hash >> 2) ^ (hash >> 1)) & 1;
+}
+
 static void
 send_physnic (void *handle, unsigned int num_packets, void **packets,
 	      unsigned int *packet_sizes, bool print_ok)
 {
 	struct data2 *d2 = handle;
+	void *pkt[2][16];
+	UINT pktsize[2][16];
+	int n[2] = { 0, 0 };
+	uint i;
+	int q;
 
 	if (!print_ok && !d2->tdesc[0].initialized)
 		return;
-	send_physnic_sub (d2, num_packets, packets, packet_sizes, print_ok);
+	if (d2->tx_queues < 2 || !d2->tdesc[1].initialized) {
+		send_physnic_sub (d2, 0, num_packets, packets, packet_sizes,
+				  print_ok);
+		return;
+	}
+	/* Spread flows over the transmit queues.  Packets of a flow
+	 * always use the same queue to keep their order. */
+	for (i = 0; i < num_packets; i++) {
+		q = physnic_txqueue (packets[i], packet_sizes[i]);
+		pkt[q][n[q]] = packets[i];
+		pktsize[q][n[q]] = packet_sizes[i];
+		if (++n[q] == 16) {
+			send_physnic_sub (d2, q, n[q], pkt[q], pktsize[q],
+					  print_ok);
+			n[q] = 0;
+		}
+	}
+	for (q = 0; q < 2; q++)
+		if (n[q])
+			send_physnic_sub (d2, q, n[q], pkt[q], pktsize[q],
+					  print_ok);
 }
 
 static void
@@ -397,6 +451,21 @@ poll_physnic (void *handle)
 	spinlock_unlock (&d2->lock);
 }
 
+/* Resume pass-through transmission stopped by a full physical
+ * transmit ring. */
+static void
+guest_retransmit (struct data2 *d2)
+{
+	if (!d2->passthrough)
+		return;
+	if (d2->tdesc[0].initialized &&
+	    d2->tdesc[0].head != d2->tdesc[0].tail)
+		guest_is_transmitting (&d2->tdesc[0], d2, 0x3800);
+	if (d2->tdesc[1].initialized &&
+	    d2->tdesc[1].head != d2->tdesc[1].tail)
+		guest_is_transmitting (&d2->tdesc[1], d2, 0x3900);
+}
+
 static void
 getinfo_virtnic (void *handle, struct nicinfo *info)
 {
@@ -600,6 +669,7 @@ init_desc_transmit (struct desc_shadow *s, struct data2 *d2, uint off2)
 		for (i = 0; i < NUM_OF_TDESC; i++) {
 			alloc_page (&tmp1, &tmp2);
 			s->u.t.tbuf[i] = tmp1;
+			s->u.t.tbuf_phys[i] = tmp2;
 			s->u.t.td[i].addr = tmp2;
 		}
 	}
@@ -952,17 +1022,98 @@ process_tdesc (struct data2 *d2, struct tdesc *td)
 	return 0;
 }
 
+/* Forward a guest transmit descriptor to the physical ring of the
+ * same queue.  Context descriptors are copied as is, so TCP
+ * segmentation and checksum offload are done by the NIC.  Buffers are
+ * copied to the VMM and split into TBUF_SIZE pieces.  The tail is
+ * advanced by the caller at the end of packets.  Returns 1 if the
+ * physical ring is full. */
+static int
+process_tdesc_pass (struct desc_shadow *s, struct data2 *d2, uint off2,
+		    struct tdesc *td)
+{
+	struct tdesc_dext0 *td0 = (void *)td;
+	struct tdesc_dext1 *td1 = (void *)td;
+	struct tdesc *pd;
+	u32 h, t, need;
+	phys_t addr;
+	uint len, n;
+	u8 *q;
+
+	if (td->cmd_dext && td0->dtyp == 0) {
+		addr = 0;
+		len = 0;
+		need = 1;
+	} else if (td->cmd_dext && td1->dtyp == 1) {
+		addr = td1->addr;
+		len = td1->dtalen;
+		need = (len + TBUF_SIZE - 1) / TBUF_SIZE;
+	} else if (!td->cmd_dext && td->addr && td->len) {
+		addr = td->addr;
+		len = td->len;
+		need = (len + TBUF_SIZE - 1) / TBUF_SIZE;
+	} else {
+		if (td->cmd_dext)
+			printf ("bad DTYP=%u\n", td0->dtyp);
+		goto done;
+	}
+	h = *(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x10);
+	t = s->u.t.ptail;
+	if (h >= NUM_OF_TDESC)
+		return 1;
+	if ((h + NUM_OF_TDESC - t - 1) % NUM_OF_TDESC < need)
+		return 1;
+	if (!len) {
+		pd = &s->u.t.td[t];
+		memcpy (pd, td, sizeof *pd);
+		pd->cmd_rs = 0;
+		pd->sta_dd = 0;
+		t = (t + 1) % NUM_OF_TDESC;
+	}
+	while (len) {
+		n = len > TBUF_SIZE ? TBUF_SIZE : len;
+		q = mapmem_gphys (addr, n, 0);
+		memcpy (s->u.t.tbuf[t], q, n);
+		unmapmem (q, n);
+		pd = &s->u.t.td[t];
+		memcpy (pd, td, sizeof *pd);
+		pd->addr = s->u.t.tbuf_phys[t];
+		if (td->cmd_dext)
+			((struct tdesc_dext1 *)(void *)pd)->dtalen = n;
+		else
+			pd->len = n;
+		pd->cmd_rs = 0;
+		pd->sta_dd = 0;
+		addr += n;
+		len -= n;
+		if (len)
+			pd->cmd_eop = 0; /* same bit as dcmd_eop */
+		t = (t + 1) % NUM_OF_TDESC;
+		if (!len && td->cmd_eop)
+			s->u.t.ptail_eop = t;
+	}
+	s->u.t.ptail = t;
+done:
+	if (td->cmd_rs)
+		td->sta_dd = 1;
+	return 0;
+}
+
 static void
-guest_is_transmitting (struct desc_shadow *s, struct data2 *d2)
+guest_is_transmitting (struct desc_shadow *s, struct data2 *d2, uint off2)
 {
 	struct tdesc *td;
 	u32 i, j, l;
 	u64 k;
+	int r;
 
 	if (d2->d1->disable)	/* PCI config reg is disabled */
 		return;
 	if (!(d2->tctl & 2))	/* !EN: Transmit Enable */
 		return;
+	/* The ring may have been cleared by a device reset */
+	if (d2->passthrough)
+		write_mydesc (s, d2, off2, true);
 	i = s->head;
 	j = s->tail;
 	k = s->base.ll;
@@ -970,14 +1121,21 @@ guest_is_transmitting (struct desc_shadow *s, struct data2 *d2)
 	while (i != j) {
 		td = mapmem_gphys (k + i * 16, sizeof *td, MAPMEM_WRITE);
 		ASSERT (td);
-		if (process_tdesc (d2, td))
-			break;
+		if (d2->passthrough)
+			r = process_tdesc_pass (s, d2, off2, td);
+		else
+			r = process_tdesc (d2, td);
 		unmapmem (td, sizeof *td);
+		if (r)
+			break;
 		i++;
 		if (i * 16 >= l)
 			i = 0;
 	}
 	s->head = i;
+	if (d2->passthrough)
+		*(u32 *)(void *)((u8 *)d2->d1[0].map + off2 + 0x18) =
+			s->u.t.ptail_eop;
 	*(u32 *)(void *)((u8 *)d2->d1[0].map + 0xC8) |= 0x1; /* interrupt */
 }
 
@@ -1079,7 +1237,7 @@ handle_desc (uint off1, uint len1, bool wr, union mem *buf, bool recv,
 		else
 			buf->dword = s->tail;
 		if (wr && !recv)
-			guest_is_transmitting (s, d2);
+			guest_is_transmitting (s, d2, off2);
 	} else {
 		return false;
 	}
@@ -1152,6 +1310,7 @@ mmhandler2 (struct data *d1, struct data2 *d2, phys_t gphys, bool wr,
 			receive_physnic (&d2->rdesc[0], d2, 0x2800);
 		if (d2->rdesc[1].initialized)
 			receive_physnic (&d2->rdesc[1], d2, 0x2900);
+		guest_retransmit (d2);
 	}
 skip:
 	q = (union mem *)(void *)((u8 *)d1->map + (gphys - d1->mapaddr));
@@ -1235,6 +1394,24 @@ reghook (struct data *d, int i, struct pci_bar_info *bar)
 	d->e = 1;
 }
 
+/* 82571/82572/82574 have two transmit queues with independent
+ * descriptor rings at 0x3800 and 0x3900. */
+static int
+pro1000_tx_queues (struct pci_device *pci_device)
+{
+	static const u16 ids[] = {
+		0x105e, 0x105f, 0x1060, 0x10a4, 0x10a5, 0x10bc, 0x10d5,
+		0x10d9, 0x10da, 0x107d, 0x107e, 0x107f, 0x10b9, 0x10d3,
+		0x10f6,
+	};
+	int i;
+
+	for (i = 0; i < sizeof ids / sizeof ids[0]; i++)
+		if (pci_device->config_space.device_id == ids[i])
+			return 2;
+	return 1;
+}
+
 static void
 seize_pro1000 (struct data2 *d2)
 {
@@ -1330,6 +1507,10 @@ seize_pro1000 (struct data2 *d2)
 	{
 		init_desc_transmit (&d2->tdesc[0], d2, 0x3800);
 	}
+	if (d2->tx_queues > 1) {
+		init_desc_transmit (&d2->tdesc[1], d2, 0x3900);
+		d2->tdesc[1].initialized = true;
+	}
 	{
 		/* Transmit Control Register */
 		volatile u32 *tctl = (void *)(u8 *)d2->d1[0].map + 0x400;
@@ -1443,6 +1624,7 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 	pci_device->host = d;
 	pci_device->driver->options.use_base_address_mask_emulation = 1;
 	d2->pci_device = pci_device;
+	d2->tx_queues = pro1000_tx_queues (pci_device);
 	d2->virtio_net = NULL;
 	if (option_virtio) {
 		d2->virtio_net = virtio_net_init (&virtio_net_func,
@@ -1465,6 +1647,12 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 	if (d2->seize) {
 		seize_pro1000 (d2);
 		net_start (d2->nethandle);
+	} else if (!option_tty && option_net && !strcmp (option_net, "pass")) {
+		/* Nothing in the VMM needs to see each packet, so
+		 * guest descriptors including TSO and checksum offload
+		 * requests are forwarded to the NIC. */
+		d2->passthrough = true;
+		printf ("pro1000: pass-through transmission\n");
 	}
 	LIST1_PUSH (d2list, d2);
 	return;
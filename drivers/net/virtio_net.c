@@ -31,14 +31,87 @@
 #include <core.h>
 #include <core/time.h>
 #include <net/netapi.h>
+#include <net/pktbuf.h>
 #include "pci.h"
 #include "virtio_net.h"
 
+#define VIRTIO_NET_F_MAC		0x20
+#define VIRTIO_NET_F_MRG_RXBUF		0x8000
+#define VIRTIO_RING_F_INDIRECT_DESC	0x10000000
+#define VIRTIO_NET_HOST_FEATURES	(VIRTIO_NET_F_MAC | \
+					 VIRTIO_NET_F_MRG_RXBUF | \
+					 VIRTIO_RING_F_INDIRECT_DESC)
+#define VIRTIO_NET_HDR_LEN		10
+#define VIRTIO_NET_HDR_MRG_LEN		12
+
+#define VRING_DESC_F_NEXT		1
+#define VRING_DESC_F_WRITE		2
+#define VRING_DESC_F_INDIRECT		4
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+#define VIRTIO_NET_QUEUE_SIZE		1024 /* power of 2, up to 32768 */
+#define VIRTIO_NET_MAX_SEGS		32
+#define VIRTIO_NET_BATCH		32
+#define VIRTIO_NET_MAP_CACHE_LEN	(PAGESIZE * 4)
+
+struct virtio_ring_desc {
+	u64 addr;
+	u32 len;
+	u16 flags;
+	u16 next;
+};
+
+struct virtio_ring_avail {
+	u16 flags;
+	u16 idx;
+	u16 ring[];
+};
+
+struct virtio_ring_used {
+	u16 flags;
+	u16 idx;
+	struct {
+		u32 id;
+		u32 len;
+	} ring[];
+};
+
+/* A guest buffer mapped into the VMM.  Mappings of buffers pointed by
+ * the descriptor table are cached per descriptor and stay resident
+ * while the guest keeps using the same buffer address.  Other
+ * mappings are temporary. */
+struct virtio_net_seg {
+	u64 addr;
+	u8 *buf;
+	u32 len;
+	bool temp;
+};
+
+struct virtio_net_map {
+	u64 addr;
+	u32 len;
+	u8 *buf;
+};
+
+struct virtio_net_queue {
+	spinlock_t lock;
+	u32 pfn;
+	u16 last_avail;
+	u8 *ring;
+	uint ring_len;
+	struct virtio_ring_desc *desc;
+	struct virtio_ring_avail *avail;
+	struct virtio_ring_used *used;
+	struct virtio_net_map *map;
+	struct virtio_net_seg seg[VIRTIO_NET_MAX_SEGS];
+};
+
 struct virtio_net {
 	u32 prev_port;
 	u32 port;
 	u32 cmd;
-	u32 queue[2];
+	struct virtio_net_queue queue[2];
+	u32 guest_features;
 	bool ready;
 	u8 *macaddr;
 	net_recv_callback_t *recv_func;
@@ -56,28 +129,6 @@ struct virtio_net {
 	bool intr;
 };
 
-struct virtio_ring {
-	struct {
-		u64 addr;
-		u32 len;
-		u32 flags_next;	/* lower is flags, upper is next */
-	} desc[0x100];
-	struct {
-		u16 flags;
-		u16 idx;
-		u16 ring[0x100];
-		u16 padding[0x6FE];
-	} avail;
-	struct {
-		u16 flags;
-		u16 idx;
-		struct {
-			u32 id;
-			u32 len;
-		} ring[0x100];
-	} used;
-};
-
 static void
 virtio_net_get_nic_info (void *handle, struct nicinfo *info)
 {
@@ -88,130 +139,343 @@ virtio_net_get_nic_info (void *handle, struct nicinfo *info)
 	memcpy (info->mac_address, vnet->macaddr, 6);
 }
 
+static uint
+virtio_net_hdrlen (struct virtio_net *vnet)
+{
+	if (vnet->guest_features & VIRTIO_NET_F_MRG_RXBUF)
+		return VIRTIO_NET_HDR_MRG_LEN;
+	return VIRTIO_NET_HDR_LEN;
+}
+
+static void
+virtio_net_queue_unmap (struct virtio_net_queue *q)
+{
+	int i;
+
+	for (i = 0; i < VIRTIO_NET_QUEUE_SIZE; i++) {
+		if (q->map[i].buf)
+			unmapmem (q->map[i].buf, q->map[i].len);
+		q->map[i].buf = NULL;
+	}
+	if (q->ring)
+		unmapmem (q->ring, q->ring_len);
+	q->ring = NULL;
+	q->pfn = 0;
+}
+
+/* Map the legacy virtio ring at pfn: descriptor table, available ring
+ * and the used ring at the next page boundary. */
+static void
+virtio_net_queue_set (struct virtio_net_queue *q, u32 pfn)
+{
+	uint avail_off, used_off;
+
+	spinlock_lock (&q->lock);
+	virtio_net_queue_unmap (q);
+	if (pfn) {
+		avail_off = VIRTIO_NET_QUEUE_SIZE * sizeof *q->desc;
+		used_off = (avail_off + 6 + 2 * VIRTIO_NET_QUEUE_SIZE +
+			    PAGESIZE - 1) & ~(PAGESIZE - 1);
+		q->ring_len = used_off + 6 + 8 * VIRTIO_NET_QUEUE_SIZE;
+		q->ring = mapmem_hphys ((u64)pfn << 12, q->ring_len,
+					MAPMEM_WRITE);
+		q->desc = (void *)q->ring;
+		q->avail = (void *)(q->ring + avail_off);
+		q->used = (void *)(q->ring + used_off);
+		q->last_avail = q->used->idx;
+		q->pfn = pfn;
+	}
+	spinlock_unlock (&q->lock);
+}
+
+static u8 *
+virtio_net_map_desc (struct virtio_net_queue *q, u16 idx,
+		     struct virtio_net_seg *seg)
+{
+	struct virtio_net_map *m = &q->map[idx];
+	u64 addr = q->desc[idx].addr;
+	u32 len = q->desc[idx].len;
+
+	seg->addr = addr;
+	seg->len = len;
+	seg->temp = false;
+	if (m->buf && m->addr == addr && m->len == len)
+		return seg->buf = m->buf;
+	if (m->buf)
+		unmapmem (m->buf, m->len);
+	m->buf = NULL;
+	if (len > VIRTIO_NET_MAP_CACHE_LEN) {
+		seg->temp = true;
+		return seg->buf = mapmem_hphys (addr, len, MAPMEM_WRITE);
+	}
+	m->addr = addr;
+	m->len = len;
+	m->buf = mapmem_hphys (addr, len, MAPMEM_WRITE);
+	return seg->buf = m->buf;
+}
+
+/* Map the buffers of the descriptor chain starting at head into
+ * q->seg[], following an indirect table if there is one.  Returns the
+ * number of segments. */
+static int
+virtio_net_chain (struct virtio_net_queue *q, u16 head)
+{
+	struct virtio_ring_desc *table;
+	struct virtio_net_seg *seg;
+	u32 n, table_len, i, idx;
+	int nseg = 0;
+
+	idx = head & (VIRTIO_NET_QUEUE_SIZE - 1);
+	if (q->desc[idx].flags & VRING_DESC_F_INDIRECT) {
+		table_len = q->desc[idx].len;
+		n = table_len / sizeof *table;
+		table = mapmem_hphys (q->desc[idx].addr, table_len, 0);
+		for (i = 0, idx = 0; i < n && idx < n &&
+			     nseg < VIRTIO_NET_MAX_SEGS; i++) {
+			seg = &q->seg[nseg++];
+			seg->addr = table[idx].addr;
+			seg->len = table[idx].len;
+			seg->temp = true;
+			seg->buf = mapmem_hphys (seg->addr, seg->len,
+						 MAPMEM_WRITE);
+			if (!(table[idx].flags & VRING_DESC_F_NEXT))
+				break;
+			idx = table[idx].next;
+		}
+		unmapmem (table, table_len);
+		return nseg;
+	}
+	for (i = 0; i < VIRTIO_NET_QUEUE_SIZE && nseg < VIRTIO_NET_MAX_SEGS;
+	     i++) {
+		virtio_net_map_desc (q, idx, &q->seg[nseg++]);
+		if (!(q->desc[idx].flags & VRING_DESC_F_NEXT))
+			break;
+		idx = q->desc[idx].next & (VIRTIO_NET_QUEUE_SIZE - 1);
+	}
+	return nseg;
+}
+
+static void
+virtio_net_chain_done (struct virtio_net_queue *q, int nseg)
+{
+	int i;
+
+	for (i = 0; i < nseg; i++)
+		if (q->seg[i].temp)
+			unmapmem (q->seg[i].buf, q->seg[i].len);
+}
+
+/* Copy a packet to the guest.  With VIRTIO_NET_F_MRG_RXBUF the packet
+ * may be spread over several available buffers.  Used ring entries
+ * are written from *used_idx but not published.  Returns false if
+ * there are not enough buffers. */
+static bool
+virtio_net_put (struct virtio_net *vnet, struct virtio_net_queue *q,
+		u8 *buf, uint buflen, u16 *used_idx)
+{
+	u8 hdr[VIRTIO_NET_HDR_MRG_LEN], *p;
+	u64 num_buffers[2];
+	uint hdrlen, off, total, len, n;
+	u16 head, idx;
+	int nseg, i, nbuf;
+	bool mrg;
+
+	mrg = !!(vnet->guest_features & VIRTIO_NET_F_MRG_RXBUF);
+	hdrlen = virtio_net_hdrlen (vnet);
+	memset (hdr, 0, sizeof hdr);
+	hdr[10] = 1;		/* num_buffers */
+	num_buffers[0] = num_buffers[1] = 0;
+	off = 0;
+	total = hdrlen + buflen;
+	nbuf = 0;
+	do {
+		if (q->last_avail == q->avail->idx) {
+			/* Not enough buffers: roll back */
+			q->last_avail -= nbuf;
+			*used_idx -= nbuf;
+			return false;
+		}
+		head = q->avail->ring[q->last_avail++ &
+				      (VIRTIO_NET_QUEUE_SIZE - 1)];
+		nseg = virtio_net_chain (q, head);
+		len = 0;
+		for (i = 0; i < nseg && off < total; i++) {
+			u8 *d = q->seg[i].buf;
+			uint dlen = q->seg[i].len;
+
+			while (dlen && off < hdrlen) {
+				if (off == 10 || off == 11)
+					num_buffers[off - 10] = q->seg[i].addr +
+						(d - q->seg[i].buf);
+				*d++ = hdr[off++];
+				dlen--;
+				len++;
+			}
+			n = total - off;
+			if (n > dlen)
+				n = dlen;
+			if (n) {
+				memcpy (d, &buf[off - hdrlen], n);
+				off += n;
+				len += n;
+			}
+		}
+		virtio_net_chain_done (q, nseg);
+		idx = (*used_idx)++ & (VIRTIO_NET_QUEUE_SIZE - 1);
+		q->used->ring[idx].id = head;
+		q->used->ring[idx].len = len;
+		nbuf++;
+	} while (mrg && off < total);
+	/* The first buffer may have been a temporary mapping, so
+	 * num_buffers is updated through its physical address. */
+	for (i = 0; mrg && nbuf > 1 && i < 2; i++) {
+		p = mapmem_hphys (num_buffers[i], 1, MAPMEM_WRITE);
+		*p = nbuf >> (i * 8);
+		unmapmem (p, 1);
+	}
+	return true;
+}
+
 /* Send to guest */
 static void
 virtio_net_send (void *handle, unsigned int num_packets, void **packets,
 		 unsigned int *packet_sizes, bool print_ok)
 {
 	struct virtio_net *vnet = handle;
-	struct virtio_ring *p;
-	u16 idx_a, idx_u, ring;
-	u32 len, desc_len, i, j;
-	u32 ring_tmp;
-	u8 *buf_ring;
-	u8 *buf;
-	int buflen;
+	struct virtio_net_queue *q = &vnet->queue[0];
+	u16 used_idx;
 	bool intr = false;
 
 	if (!vnet->ready)
 		return;
-	p = mapmem_hphys ((u64)vnet->queue[0] << 12, sizeof *p, MAPMEM_WRITE);
-loop:
-	if (!num_packets--)
+	spinlock_lock (&q->lock);
+	if (!q->ring)
 		goto ret;
-	buf = *packets++;
-	buflen = *packet_sizes++;
-	idx_a = p->avail.idx;
-	idx_u = p->used.idx;
-	if (idx_a == idx_u) {
-		u64 now = get_time ();
-
-		if (now - vnet->last_time >= 1000000 && print_ok)
-			printf ("%s: Receive ring buffer full\n", __func__);
-		vnet->last_time = now;
-		goto ret;
-	}
-	idx_u &= 0xFF;
-	ring = p->avail.ring[idx_u];
-	ring_tmp = ((u32)ring << 16) | 1;
-	len = 0;
-	while (ring_tmp & 1) {
-		ring_tmp >>= 16;
-		desc_len = p->desc[ring_tmp & 0xFF].len;
-		buf_ring = mapmem_hphys (p->desc[ring_tmp & 0xFF].addr,
-					 desc_len, 0);
-		i = 0;
-		if (len < 10) {
-			i = 10 - len;
-			if (i > desc_len)
-				i = desc_len;
-			memset (buf_ring, 0, i);
-			len += i;
-		}
-		if (len >= 10 && i < desc_len) {
-			j = buflen - (len - 10);
-			if (j > desc_len - i)
-				j = desc_len - i;
-			memcpy (&buf_ring[i], &buf[len - 10], j);
-			len += j;
+	used_idx = q->used->idx;
+	while (num_packets--) {
+		if (!virtio_net_put (vnet, q, *packets++, *packet_sizes++,
+				     &used_idx)) {
+			u64 now = get_time ();
+
+			if (now - vnet->last_time >= 1000000 && print_ok)
+				printf ("%s: Receive ring buffer full\n",
+					__func__);
+			vnet->last_time = now;
+			break;
 		}
-		unmapmem (buf_ring, desc_len);
-		ring_tmp = p->desc[ring_tmp & 0xFF].flags_next;
+		intr = true;
+	}
+	if (intr) {
+		asm volatile ("" : : : "memory");
+		q->used->idx = used_idx;
+		if (q->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)
+			intr = false;
 	}
-	if (0)
-		printf ("Receive %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
-			" <- %02X:%02X:%02X:%02X:%02X:%02X\n", buflen,
-			buf[0], buf[1], buf[2], buf[3], buf[4], buf[5],
-			buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]);
-	p->used.ring[idx_u].id = ring;
-	p->used.ring[idx_u].len = len;
-	asm volatile ("" : : : "memory");
-	p->used.idx++;
-	intr = true;
-	goto loop;
 ret:
-	unmapmem (p, sizeof *p);
+	spinlock_unlock (&q->lock);
 	if (intr) {
 		vnet->intr = true;
 		vnet->intr_set (vnet->intr_param);
 	}
 }
 
+/* Get a packet sent by the guest.  The packet is passed without a copy
+ * if it is contiguous in a cached mapping, otherwise it is copied to
+ * a packet buffer *pkt which receivers may hold. */
+static bool
+virtio_net_get (struct virtio_net *vnet, struct virtio_net_queue *q,
+		int nseg, struct pktbuf **pkt, void **packet,
+		unsigned int *size, u32 *total)
+{
+	uint hdrlen, skip, len, i;
+	u8 *p;
+
+	hdrlen = virtio_net_hdrlen (vnet);
+	len = 0;
+	for (i = 0; i < nseg; i++)
+		len += q->seg[i].len;
+	*total = len;
+	if (len < hdrlen)
+		return false;
+	len -= hdrlen;
+	skip = hdrlen;
+	for (i = 0; i < nseg && skip >= q->seg[i].len; i++)
+		skip -= q->seg[i].len;
+	if (i < nseg && q->seg[i].len - skip == len && !q->seg[i].temp) {
+		*packet = q->seg[i].buf + skip;
+		*size = len;
+		return true;
+	}
+	if (len > PKTBUF_SIZE - PKTBUF_HEADROOM)
+		return false;
+	*pkt = pktbuf_alloc (PKTBUF_HEADROOM);
+	p = pktbuf_append (*pkt, len);
+	*packet = p;
+	*size = len;
+	for (; i < nseg; i++) {
+		memcpy (p, q->seg[i].buf + skip, q->seg[i].len - skip);
+		p += q->seg[i].len - skip;
+		skip = 0;
+	}
+	return true;
+}
+
 /* Receive from guest */
 static void
 virtio_net_recv (struct virtio_net *vnet)
 {
-	struct virtio_ring *p;
-	u16 idx_a, idx_u, ring;
-	u32 len, desc_len;
-	u32 ring_tmp;
-	u8 buf[2048], *buf_ring;
-
-	p = mapmem_hphys ((u64)vnet->queue[1] << 12, sizeof *p, MAPMEM_WRITE);
-	idx_a = p->avail.idx;
-	while (idx_a != p->used.idx) {
-		idx_u = p->used.idx & 0xFF;
-		ring = p->avail.ring[idx_u];
-		ring_tmp = ((u32)ring << 16) | 1;
-		len = 0;
-		while (ring_tmp & 1) {
-			ring_tmp >>= 16;
-			desc_len = p->desc[ring_tmp & 0xFF].len;
-			buf_ring = mapmem_hphys (p->desc[ring_tmp & 0xFF].addr,
-						 desc_len, 0);
-			memcpy (&buf[len], buf_ring, desc_len);
-			unmapmem (buf_ring, desc_len);
-			len += desc_len;
-			ring_tmp = p->desc[ring_tmp & 0xFF].flags_next;
+	struct virtio_net_queue *q = &vnet->queue[1];
+	void *packets[VIRTIO_NET_BATCH];
+	struct pktbuf *pkts[VIRTIO_NET_BATCH];
+	unsigned int sizes[VIRTIO_NET_BATCH];
+	u16 heads[VIRTIO_NET_BATCH];
+	u32 lens[VIRTIO_NET_BATCH];
+	u16 used_idx, idx;
+	int nseg, i, n, npkt;
+	bool intr = false;
+
+	spinlock_lock (&q->lock);
+	if (!q->ring)
+		goto ret;
+	used_idx = q->used->idx;
+	while (q->last_avail != q->avail->idx) {
+		n = 0;
+		npkt = 0;
+		while (n < VIRTIO_NET_BATCH && q->last_avail != q->avail->idx) {
+			heads[n] = q->avail->ring[q->last_avail++ &
+						  (VIRTIO_NET_QUEUE_SIZE - 1)];
+			nseg = virtio_net_chain (q, heads[n]);
+			pkts[npkt] = NULL;
+			if (virtio_net_get (vnet, q, nseg, &pkts[npkt],
+					    &packets[npkt], &sizes[npkt],
+					    &lens[n]))
+				npkt++;
+			virtio_net_chain_done (q, nseg);
+			n++;
 		}
-		{
-			void *packet = &buf[10];
-			unsigned int packet_size = len - 10;
-			vnet->recv_func (vnet, 1, &packet, &packet_size,
+		if (npkt)
+			vnet->recv_func (vnet, npkt, packets, sizes,
 					 vnet->recv_param, NULL);
+		for (i = 0; i < npkt; i++)
+			if (pkts[i])
+				pktbuf_put (pkts[i]);
+		for (i = 0; i < n; i++) {
+			idx = used_idx++ & (VIRTIO_NET_QUEUE_SIZE - 1);
+			q->used->ring[idx].id = heads[i];
+			q->used->ring[idx].len = lens[i];
 		}
-#if 0
-		printf ("Send %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
-			" <- %02X:%02X:%02X:%02X:%02X:%02X\n", len - 10,
-			buf[10], buf[11], buf[12], buf[13], buf[14], buf[15],
-			buf[16], buf[17], buf[18], buf[19], buf[20], buf[21]);
-#endif
-		p->used.ring[idx_u].id = ring;
-		p->used.ring[idx_u].len = len;
 		asm volatile ("" : : : "memory");
-		p->used.idx++;
+		q->used->idx = used_idx;
+		intr = true;
+	}
+	if (intr && (q->avail->flags & VRING_AVAIL_F_NO_INTERRUPT))
+		intr = false;
+ret:
+	spinlock_unlock (&q->lock);
+	if (intr) {
+		vnet->intr = true;
+		vnet->intr_set (vnet->intr_param);
 	}
-	unmapmem (p, sizeof *p);
 }
 
 static void
@@ -237,15 +501,19 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 		memset (data, 0, io.size);
 		switch (io.port & 0x1F) {
 		case 0x00:
-			data->byte = 0x20;	/* VIRTIO_NET_F_MAC */
+			data->dword = VIRTIO_NET_HOST_FEATURES;
+			break;
+		case 0x04:
+			data->dword = vnet->guest_features;
 			break;
 		case 0x08:
-			memcpy (data, &vnet->queue[vnet->selected_queue & 1],
+			memcpy (data,
+				&vnet->queue[vnet->selected_queue & 1].pfn,
 				io.size);
 			break;
 		case 0x0C:
 			if (io.size > 1 && vnet->selected_queue < 2)
-				data->word = 0x100;
+				data->word = VIRTIO_NET_QUEUE_SIZE;
 			break;
 		case 0x0E:
 			if (io.size == 1)
@@ -292,9 +560,16 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 		}
 	} else {
 		switch (io.port & 0x1F) {
+		case 0x04:
+			if (io.size == 4)
+				vnet->guest_features = data->dword &
+					VIRTIO_NET_HOST_FEATURES;
+			break;
 		case 0x08:
-			memcpy (&vnet->queue[vnet->selected_queue & 1], data,
-				io.size);
+			if (io.size == 4)
+				virtio_net_queue_set (&vnet->queue
+						      [vnet->selected_queue &
+						       1], data->dword);
 			break;
 		case 0x10:
 			if (!data->byte) {
@@ -313,6 +588,9 @@ virtio_net_iohandler (core_io_t io, union mem *data, void *arg)
 				vnet->dev_status = 0;
 				vnet->intr_disable (vnet->intr_param);
 				vnet->ready = false;
+				vnet->guest_features = 0;
+				virtio_net_queue_set (&vnet->queue[0], 0);
+				virtio_net_queue_set (&vnet->queue[1], 0);
 			}
 			break;
 		case 0x0E:
@@ -429,6 +707,7 @@ virtio_net_init (struct nicfunc **func, u8 *macaddr,
 		.set_recv_callback = virtio_net_set_recv_callback,
 	};
 	struct virtio_net *vnet;
+	int i;
 
 	vnet = alloc (sizeof *vnet);
 	vnet->prev_port = 0;
@@ -436,8 +715,16 @@ virtio_net_init (struct nicfunc **func, u8 *macaddr,
 	vnet->cmd = 0x5;       /* Interrupts should not be masked here
 				  because apparently OS X does not
 				  unmask interrupts. */
-	vnet->queue[0] = 0;
-	vnet->queue[1] = 0;
+	for (i = 0; i < 2; i++) {
+		spinlock_init (&vnet->queue[i].lock);
+		vnet->queue[i].pfn = 0;
+		vnet->queue[i].ring = NULL;
+		vnet->queue[i].map = alloc (VIRTIO_NET_QUEUE_SIZE *
+					    sizeof *vnet->queue[i].map);
+		memset (vnet->queue[i].map, 0, VIRTIO_NET_QUEUE_SIZE *
+			sizeof *vnet->queue[i].map);
+	}
+	vnet->guest_features = 0;
 	vnet->ready = false;
 	vnet->macaddr = macaddr;
 	vnet->intr_clear = intr_clear;
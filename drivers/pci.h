@@ -119,6 +119,24 @@ struct pci_config_space {
 #define PCI_CONFIG_COMMAND_MEMENABLE	0x2
 #define PCI_CONFIG_COMMAND_BUSMASTER	0x4
 
+enum pci_config_shadow_policy {
+	PCI_CONFIG_SHADOW_PASS,		/* always access the device */
+	PCI_CONFIG_SHADOW_CACHE,	/* read once until a write */
+	PCI_CONFIG_SHADOW_EMULATE,	/* never access the device */
+};
+
+// shadow of configuration space, policies and valid bits are byte
+// masks per dword
+struct pci_config_shadow {
+	spinlock_t lock;
+	u32 gen;
+	u8 cache[PCI_CONFIG_REGS32_NUM];
+	u8 emulate[PCI_CONFIG_REGS32_NUM];
+	u8 valid[PCI_CONFIG_REGS32_NUM];
+	u8 regs8[PCI_CONFIG_REGS8_NUM];
+	u32 hit, miss, pass;
+};
+
 struct pci_config_mmio_data;
 struct token;
 
@@ -143,6 +161,7 @@ struct pci_device {
 	struct pci_device *parent_bridge;
 	int disconnect;
 	u8 fake_command_mask, fake_command_fixed, fake_command_virtual;
+	struct pci_config_shadow config_shadow;
 };
 
 struct pci_driver {
@@ -218,5 +237,9 @@ int pci_reconnect_device (struct pci_device *dev, pci_config_address_t addr,
 void pci_set_bridge_io (struct pci_device *pci_device);
 void pci_set_bridge_fake_command (struct pci_device *pci_device, u8 mask,
 				  u8 fixed);
+void pci_set_config_shadow_policy (struct pci_device *pci_device, u16 offset,
+				   uint len,
+				   enum pci_config_shadow_policy policy);
+void pci_config_shadow_invalidate (struct pci_device *pci_device);
 
 #endif
@@ -403,6 +403,8 @@ ret:
 							data);
 		ioret = CORE_IO_RET_DONE;
 	}
+	if (dev && io.dir == CORE_IO_DIR_OUT)
+		pci_config_shadow_invalidate (dev);
 	return ioret;
 }
 
@@ -518,6 +520,7 @@ found:
 	pci_write_config_mmio (bridge->config_mmio, bridge->address.bus_no,
 			       bridge->address.device_no,
 			       bridge->address.func_no, 0x1D, 1, &tmp);
+	pci_config_shadow_invalidate (bridge);
 }
 
 void
@@ -595,6 +598,7 @@ void pci_register_driver(struct pci_driver *driver)
 		pci_write_config_data##size##_without_lock(addr, offset, data);	\
 		pci_restore_config_addr();				\
 		spinlock_unlock(&pci_config_lock);			\
+		pci_config_shadow_invalidate_addr(addr);		\
 	}
 DEFINE_pci_read_config_data(8)
 DEFINE_pci_read_config_data(16)
@@ -679,6 +683,8 @@ pci_handle_default_config_write (struct pci_device *pci_device, u8 iosize,
 	core_io_t io;
 	union mem data_fake;
 
+	if (pci_config_shadow_write (pci_device, iosize, offset, data))
+		return;
 	if (pci_device->fake_command_mask &&
 	    offset <= 4 && offset + iosize > 4) {
 		u8 *p = &(&data_fake.byte)[4 - offset];
@@ -723,14 +729,17 @@ pci_handle_default_config_read (struct pci_device *pci_device, u8 iosize,
 				u16 offset, union mem *data)
 {
 	core_io_t io;
+	u32 gen;
 
+	if (pci_config_shadow_read (pci_device, iosize, offset, data, &gen))
+		goto ret;
 	if (pci_device->config_mmio) {
 		pci_read_config_mmio (pci_device->config_mmio,
 				      pci_device->address.bus_no,
 				      pci_device->address.device_no,
 				      pci_device->address.func_no,
 				      offset, iosize, data);
-		goto ret;
+		goto fill;
 	}
 	if (offset >= 256)
 		panic ("pci_handle_default_config_read: offset %u >= 256",
@@ -739,6 +748,8 @@ pci_handle_default_config_read (struct pci_device *pci_device, u8 iosize,
 	io.dir = CORE_IO_DIR_IN;
 	io.size = iosize;
 	core_io_handle_default (io, data);
+fill:
+	pci_config_shadow_fill (pci_device, iosize, offset, data, gen);
 ret:
 	if (pci_device->fake_command_mask &&
 	    offset <= 4 && offset + iosize > 4) {
@@ -838,7 +849,7 @@ found:
 	if (func) {
 		ioret = func (dev, len, addr.s.reg_offset, buf);
 		if (ioret == CORE_IO_RET_DONE)
-			return 1;
+			goto done;
 	}
 def:
 	if (wr)
@@ -847,6 +858,9 @@ def:
 	else
 		pci_handle_default_config_read (dev, len, addr.s.reg_offset,
 						buf);
+done:
+	if (wr)
+		pci_config_shadow_invalidate (dev);
 	return 1;
 }
 
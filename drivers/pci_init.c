@@ -237,6 +237,7 @@ pci_reconnect_device (struct pci_device *dev, pci_config_address_t addr,
 			dev->config_space.vendor_id,
 			dev->config_space.device_id);
 		dev->disconnect = 0;
+		pci_config_shadow_invalidate (dev);
 		return 0;
 	}
 	/* The device has been changed.  If a driver has been loaded
@@ -264,6 +265,7 @@ pci_reconnect_device (struct pci_device *dev, pci_config_address_t addr,
 		data8 >> 8, data0 & 0xFFFF, data0 >> 16);
 	dev->disconnect = 0;
 	pci_read_config_space (dev);
+	pci_config_shadow_init (dev);
 	pci_save_base_address_masks (dev);
 	pci_save_bridge_info (dev);
 	return 1;
@@ -284,6 +286,7 @@ static struct pci_device *pci_new_device(pci_config_address_t addr)
 			dev->initial_bus_no = 0;
 		dev->config_mmio = pci_search_config_mmio (0, addr.bus_no);
 		pci_read_config_space(dev);
+		pci_config_shadow_init(dev);
 		pci_save_base_address_masks(dev);
 		pci_save_bridge_info (dev);
 		pci_append_device(dev);
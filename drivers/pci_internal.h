@@ -80,6 +80,14 @@ void pci_restore_config_addr(void);
 extern void pci_append_device(struct pci_device *dev);
 int pci_config_mmio_handler (void *data, phys_t gphys, bool wr, void *buf,
 			     uint len, u32 flags);
+void pci_config_shadow_init (struct pci_device *dev);
+bool pci_config_shadow_read (struct pci_device *dev, u8 iosize, u16 offset,
+			     union mem *data, u32 *gen);
+void pci_config_shadow_fill (struct pci_device *dev, u8 iosize, u16 offset,
+			     union mem *data, u32 gen);
+bool pci_config_shadow_write (struct pci_device *dev, u8 iosize, u16 offset,
+			      union mem *data);
+void pci_config_shadow_invalidate_addr (pci_config_address_t addr);
 
 extern struct pci_config_mmio_data *pci_config_mmio_data_head;
 extern struct list pci_device_list_head;
@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file	drivers/pci_shadow.c
+ * @brief	PCI configuration space shadow
+ *
+ * Guest OSes read read-only or software-owned configuration
+ * registers such as IDs, class codes, BARs and capability headers
+ * many times while probing.  Those bytes are cached per device and
+ * served without accessing the device.  Any write to a device drops
+ * its shadow, since writes to the command register, BARs or
+ * capability control registers (power state, function level reset)
+ * may change what the device returns.
+ */
+
+#include <core.h>
+#include "pci.h"
+#include "pci_internal.h"
+
+#define PCI_CAP_ID_PM		0x01
+#define PCI_CAP_ID_MSI		0x05
+#define PCI_CAP_ID_EXP		0x10
+#define PCI_CAP_ID_MSIX		0x11
+#define PCI_STATUS_CAP_LIST	0x10
+#define PCI_BIST_CAPABLE	0x80
+#define PCI_VENDOR_ID_RETRY	0x0001 /* configuration request retry */
+
+static bool
+shadow_range (u16 offset, uint iosize)
+{
+	return iosize >= 1 && iosize <= 4 && offset < PCI_CONFIG_REGS8_NUM &&
+		(offset & 3) + iosize <= 4;
+}
+
+static u8
+shadow_mask (u16 offset, uint iosize)
+{
+	return ((1 << iosize) - 1) << (offset & 3);
+}
+
+static void
+shadow_set_policy (struct pci_config_shadow *s, u16 offset, uint len,
+		   enum pci_config_shadow_policy policy)
+{
+	uint i;
+	u8 bit;
+
+	for (i = offset; i < offset + len && i < PCI_CONFIG_REGS8_NUM; i++) {
+		bit = 1 << (i & 3);
+		s->cache[i >> 2] &= ~bit;
+		s->emulate[i >> 2] &= ~bit;
+		if (policy == PCI_CONFIG_SHADOW_CACHE)
+			s->cache[i >> 2] |= bit;
+		else if (policy == PCI_CONFIG_SHADOW_EMULATE)
+			s->emulate[i >> 2] |= bit;
+	}
+}
+
+/* Called with pci_config_lock held, like pci_read_config_space() */
+static u8
+shadow_read_hw8 (struct pci_device *dev, u16 offset)
+{
+	pci_config_address_t addr = dev->address;
+	u8 data;
+
+	if (dev->config_mmio) {
+		pci_read_config_mmio (dev->config_mmio, addr.bus_no,
+				      addr.device_no, addr.func_no, offset, 1,
+				      &data);
+		return data;
+	}
+	addr.reg_no = offset >> 2;
+	return pci_read_config_data8_without_lock (addr, offset & 3);
+}
+
+/**
+ * @brief	set up default policies from the saved config_space
+ */
+void
+pci_config_shadow_init (struct pci_device *dev)
+{
+	struct pci_config_space *cs = &dev->config_space;
+	struct pci_config_shadow *s = &dev->config_shadow;
+	u8 cap, id;
+	int n;
+
+	memset (s, 0, sizeof *s);
+	spinlock_init (&s->lock);
+	if (cs->vendor_id == 0xFFFF)
+		return;
+	/* IDs, revision, class code, cache line size, latency timer
+	 * and header type.  The status register and a running BIST
+	 * are updated by the device. */
+	shadow_set_policy (s, 0x00, 4, PCI_CONFIG_SHADOW_CACHE);
+	shadow_set_policy (s, 0x08, 7, PCI_CONFIG_SHADOW_CACHE);
+	if (!(cs->bist & PCI_BIST_CAPABLE))
+		shadow_set_policy (s, 0x0F, 1, PCI_CONFIG_SHADOW_CACHE);
+	switch (cs->type) {
+	case 0:
+		/* BARs, subsystem IDs, expansion ROM, capabilities
+		 * pointer and interrupt registers */
+		shadow_set_policy (s, 0x10, 0x30, PCI_CONFIG_SHADOW_CACHE);
+		break;
+	case 1:
+		/* Same for a bridge except the secondary status */
+		shadow_set_policy (s, 0x10, 0x30, PCI_CONFIG_SHADOW_CACHE);
+		shadow_set_policy (s, 0x1E, 2, PCI_CONFIG_SHADOW_PASS);
+		break;
+	default:
+		return;
+	}
+	if (!(cs->status & PCI_STATUS_CAP_LIST))
+		return;
+	/* Capability IDs and next pointers, and the read-only or
+	 * software-owned word following them in well-known
+	 * capabilities.  The rest of the capabilities may contain
+	 * status bits and are passed through. */
+	cap = cs->regs8[0x34] & ~3;
+	for (n = 0; n < 48 && cap >= 0x40; n++) {
+		id = shadow_read_hw8 (dev, cap);
+		if (id == 0xFF)
+			break;
+		shadow_set_policy (s, cap, 2, PCI_CONFIG_SHADOW_CACHE);
+		switch (id) {
+		case PCI_CAP_ID_PM:
+		case PCI_CAP_ID_MSI:
+		case PCI_CAP_ID_EXP:
+		case PCI_CAP_ID_MSIX:
+			shadow_set_policy (s, cap + 2, 2,
+					   PCI_CONFIG_SHADOW_CACHE);
+			break;
+		}
+		cap = shadow_read_hw8 (dev, cap + 1) & ~3;
+	}
+}
+
+/**
+ * @brief	change the policy of configuration registers
+ * @param pci_device	device
+ * @param offset	first byte of the registers
+ * @param len		length in bytes
+ * @param policy	PCI_CONFIG_SHADOW_EMULATE latches the current value
+ */
+void
+pci_set_config_shadow_policy (struct pci_device *pci_device, u16 offset,
+			      uint len, enum pci_config_shadow_policy policy)
+{
+	struct pci_config_shadow *s = &pci_device->config_shadow;
+	pci_config_address_t addr = pci_device->address;
+	uint i;
+	u8 data;
+
+	for (i = offset; i < offset + len && i < PCI_CONFIG_REGS8_NUM; i++) {
+		if (policy == PCI_CONFIG_SHADOW_EMULATE &&
+		    !(s->emulate[i >> 2] & (1 << (i & 3)))) {
+			if (pci_device->config_mmio) {
+				pci_read_config_mmio (pci_device->config_mmio,
+						      addr.bus_no,
+						      addr.device_no,
+						      addr.func_no, i, 1,
+						      &data);
+			} else {
+				addr.reg_no = i >> 2;
+				data = pci_read_config_data8 (addr, i & 3);
+			}
+			spinlock_lock (&s->lock);
+			s->regs8[i] = data;
+			spinlock_unlock (&s->lock);
+		}
+		spinlock_lock (&s->lock);
+		shadow_set_policy (s, i, 1, policy);
+		spinlock_unlock (&s->lock);
+	}
+}
+
+/**
+ * @brief	read from the shadow
+ * @return	true if served, otherwise *gen is set for
+ *		pci_config_shadow_fill() after reading the device
+ */
+bool
+pci_config_shadow_read (struct pci_device *dev, u8 iosize, u16 offset,
+			union mem *data, u32 *gen)
+{
+	struct pci_config_shadow *s = &dev->config_shadow;
+	int i = offset >> 2;
+	u8 mask;
+	bool ret = false;
+
+	*gen = 0;
+	if (!shadow_range (offset, iosize))
+		return false;
+	mask = shadow_mask (offset, iosize);
+	spinlock_lock (&s->lock);
+	if (((s->emulate[i] | (s->cache[i] & s->valid[i])) & mask) == mask) {
+		memcpy (data, &s->regs8[offset], iosize);
+		s->hit++;
+		ret = true;
+	} else {
+		if (((s->emulate[i] | s->cache[i]) & mask) == mask)
+			s->miss++;
+		else
+			s->pass++;
+		*gen = s->gen;
+	}
+	spinlock_unlock (&s->lock);
+	return ret;
+}
+
+/* A device that is absent, or not ready after a reset or a power
+ * state change, returns all ones or the retry vendor ID.  Guests poll
+ * the vendor ID until the device responds, so such values must not
+ * be cached. */
+static bool
+shadow_cacheable (u8 iosize, u16 offset, union mem *data)
+{
+	if (iosize == 4 && data->dword == 0xFFFFFFFF)
+		return false;
+	if (offset == 0 && iosize >= 2 &&
+	    (data->word == 0xFFFF || data->word == PCI_VENDOR_ID_RETRY))
+		return false;
+	return true;
+}
+
+/**
+ * @brief	store the data read from the device and overlay
+ *		emulated bytes
+ * @param gen	the value set by pci_config_shadow_read(), the data
+ *		is not stored if a write has invalidated the shadow
+ *		since then or if the device is not responding
+ */
+void
+pci_config_shadow_fill (struct pci_device *dev, u8 iosize, u16 offset,
+			union mem *data, u32 gen)
+{
+	struct pci_config_shadow *s = &dev->config_shadow;
+	int i = offset >> 2;
+	uint j;
+	u8 bit;
+	bool cacheable;
+
+	if (!shadow_range (offset, iosize))
+		return;
+	cacheable = shadow_cacheable (iosize, offset, data);
+	spinlock_lock (&s->lock);
+	for (j = 0; j < iosize; j++) {
+		bit = 1 << ((offset + j) & 3);
+		if (s->emulate[i] & bit) {
+			(&data->byte)[j] = s->regs8[offset + j];
+		} else if ((s->cache[i] & bit) && s->gen == gen &&
+			   cacheable) {
+			s->regs8[offset + j] = (&data->byte)[j];
+			s->valid[i] |= bit;
+		}
+	}
+	spinlock_unlock (&s->lock);
+}
+
+/**
+ * @brief	write emulated bytes to the shadow
+ * @return	true if the write has been completed, the other bytes
+ *		of a partially emulated write are written one by one
+ */
+bool
+pci_config_shadow_write (struct pci_device *dev, u8 iosize, u16 offset,
+			 union mem *data)
+{
+	struct pci_config_shadow *s = &dev->config_shadow;
+	int i = offset >> 2;
+	uint j;
+	u8 mask, em;
+
+	if (!shadow_range (offset, iosize))
+		return false;
+	mask = shadow_mask (offset, iosize);
+	spinlock_lock (&s->lock);
+	em = s->emulate[i] & mask;
+	for (j = 0; j < iosize; j++)
+		if (em & (1 << ((offset + j) & 3)))
+			s->regs8[offset + j] = (&data->byte)[j];
+	spinlock_unlock (&s->lock);
+	if (!em)
+		return false;
+	if (em == mask)
+		return true;
+	for (j = 0; j < iosize; j++)
+		if (!(em & (1 << ((offset + j) & 3))))
+			pci_handle_default_config_write
+				(dev, 1, offset + j,
+				 (union mem *)&(&data->byte)[j]);
+	return true;
+}
+
+static void
+shadow_invalidate (struct pci_config_shadow *s)
+{
+	spinlock_lock (&s->lock);
+	s->gen++;
+	memset (s->valid, 0, sizeof s->valid);
+	spinlock_unlock (&s->lock);
+}
+
+/**
+ * @brief	drop cached values after the device has been written
+ */
+void
+pci_config_shadow_invalidate (struct pci_device *pci_device)
+{
+	struct pci_device *dev;
+
+	if (!pci_device->bridge.yes) {
+		shadow_invalidate (&pci_device->config_shadow);
+		return;
+	}
+	/* A bridge write may reset or renumber the buses below */
+	LIST_FOREACH (pci_device_list, dev)
+		shadow_invalidate (&dev->config_shadow);
+}
+
+void
+pci_config_shadow_invalidate_addr (pci_config_address_t addr)
+{
+	struct pci_device *dev;
+
+	LIST_FOREACH (pci_device_list, dev) {
+		if (dev->address.bus_no == addr.bus_no &&
+		    dev->address.device_no == addr.device_no &&
+		    dev->address.func_no == addr.func_no) {
+			pci_config_shadow_invalidate (dev);
+			break;
+		}
+	}
+}
+
+static char *
+pci_config_shadow_status (void)
+{
+	static char buf[4096];
+	struct pci_device *dev;
+	u64 hit = 0, miss = 0, pass = 0;
+	int n;
+
+	LIST_FOREACH (pci_device_list, dev) {
+		hit += dev->config_shadow.hit;
+		miss += dev->config_shadow.miss;
+		pass += dev->config_shadow.pass;
+	}
+	n = snprintf (buf, sizeof buf,
+		      "pci config shadow: hit %llu miss %llu pass %llu\n",
+		      hit, miss, pass);
+	LIST_FOREACH (pci_device_list, dev) {
+		if (n >= sizeof buf)
+			break;
+		if (!dev->config_shadow.hit && !dev->config_shadow.miss &&
+		    !dev->config_shadow.pass)
+			continue;
+		n += snprintf (buf + n, sizeof buf - n,
+			       " [%02X:%02X.%X] hit %u miss %u pass %u\n",
+			       dev->address.bus_no, dev->address.device_no,
+			       dev->address.func_no, dev->config_shadow.hit,
+			       dev->config_shadow.miss,
+			       dev->config_shadow.pass);
+	}
+	return buf;
+}
+
+static void
+pci_config_shadow_init_status (void)
+{
+	register_status_callback (pci_config_shadow_status);
+}
+
+INITFUNC ("paral01", pci_config_shadow_init_status);
@@ -33,6 +33,7 @@
  * @author	K. Matsubara
  */
 #include <core.h>
+#include <core/config.h>
 #include <core/mmio.h>
 #include <core/timer.h>
 #include "pci.h"
@@ -51,6 +52,8 @@ static const char virtual_revision[8] = "0.9     "; // 8 chars
 
 DEFINE_ALLOC_FUNC(ehci_host);
 
+static struct ehci_host *ehci_hosts;
+
 static struct usb_operations ehciop = {
 	.shadow_buffer = ehci_shadow_buffer,
 	.submit_control = ehci_submit_control,
@@ -60,6 +63,29 @@ static struct usb_operations ehciop = {
 	.deactivate_urb = ehci_deactivate_urb,
 };
 
+static char *
+ehci_status(void)
+{
+	static char buf[1024];
+	struct ehci_host *host;
+	int i, n;
+
+	n = snprintf(buf, sizeof buf, "ehci: %s async list monitor\n",
+		     config.vmm.driver.usb.ehci_poll ? "polling" :
+		     "event-driven");
+	for (host = ehci_hosts, i = 0; host && n < sizeof buf;
+	     host = host->next, i++)
+		n += snprintf(buf + n, sizeof buf - n,
+			      " host%d: scans %llu scan time %llu us"
+			      " kicks %llu sleeps %llu\n"
+			      "  transfers %llu latency %llu us max %llu us\n",
+			      i, host->stat_scans, host->stat_scan_time,
+			      host->stat_kicks, host->stat_sleeps,
+			      host->stat_transfers, host->stat_latency,
+			      host->stat_latency_max);
+	return buf;
+}
+
 static void 
 ehci_new(struct pci_device *pci_device)
 {
@@ -76,6 +102,7 @@ ehci_new(struct pci_device *pci_device)
 	host = alloc_ehci_host();
 	memset(host, 0, sizeof(*host));
 	spinlock_init(&host->lock_hurb);
+	thread_event_init(&host->async_event);
 	pci_device->host = host;
 	for (i = 0; i < EHCI_URBHASH_SIZE; i++)
 		LIST2_HEAD_INIT (host->urbhash[i], urbhash);
@@ -91,6 +118,10 @@ ehci_new(struct pci_device *pci_device)
 #if defined(HANDLE_USBHUB)
 	usbhub_init_handle(host->usb_host);
 #endif
+	if (!ehci_hosts)
+		register_status_callback(ehci_status);
+	host->next = ehci_hosts;
+	ehci_hosts = host;
 
 	return;
 }
@@ -250,6 +281,7 @@ ehci_register_handler(void *data, phys_t gphys, bool wr, void *buf,
 				if (cmd & 0x00000080)
 					dprintf(3, "LHCRESET,");
 				dprintf(3, "], %d)\n", len);
+				ehci_async_kick(host);
 			}
 			break;
 		case 0x04: /* USBSTS */
@@ -257,6 +289,7 @@ ehci_register_handler(void *data, phys_t gphys, bool wr, void *buf,
 				usb_sc_lock(host->usb_host);
 				ehci_check_advance(host->usb_host);
 				usb_sc_unlock(host->usb_host);
+				ehci_async_kick(host);
 				dprintft(3, "read(USBSTS, %d) = %08x[", 
 					len, *reg);
 				if (*reg & 0x00000001)
@@ -316,6 +349,7 @@ ehci_register_handler(void *data, phys_t gphys, bool wr, void *buf,
 					host->usb_stopped = 1;
 				else if (host->intr && host->running)
 					host->usb_stopped = 0;
+				ehci_async_kick(host);
 			}
 			break;
 		case 0x0c: /* FRINDEX */
@@ -343,6 +377,7 @@ ehci_register_handler(void *data, phys_t gphys, bool wr, void *buf,
 					buf32 & 0xffffffe0U;
 				host->usb_stopped = 0;
 				host->hcreset = 0;
+				ehci_async_kick(host);
 				if (host->headqh_phys[0] && 
 				    !host->headqh_phys[1]) {
 					host->headqh_phys[1] = 
@@ -29,6 +29,7 @@
 
 #ifndef _EHCI_H
 #define _EHCI_H
+#include <core/thread.h>
 #include "usb.h"
 #include "usb_log.h"
   
@@ -136,6 +137,19 @@ struct ehci_host {
 	int usb_stopped;
 	int running;
 	int intr;
+	/* async list monitor */
+	struct thread_event async_event;
+	void *async_timer;
+	int async_idle;
+	struct ehci_host *next;
+	/* statistics */
+	u64 stat_scans;
+	u64 stat_scan_time;
+	u64 stat_kicks;
+	u64 stat_sleeps;
+	u64 stat_transfers;
+	u64 stat_latency;
+	u64 stat_latency_max;
 };
 	
 struct urb_private_ehci {
@@ -149,6 +163,9 @@ struct urb_private_ehci {
 	/* cache of qTD overlay */
 	struct ehci_qh          qh_copy;
 	u32 check_advance_count;
+
+	/* time when the shadow was activated */
+	u64 submit_time;
 };
 
 #define URB_EHCI(_urb)					\
@@ -320,6 +337,7 @@ int
 ehci_shadow_buffer(struct usb_host *usbhc,
 		   struct usb_request_block *gurb, u32 flag);
 void ehci_cleanup_urbs (struct ehci_host *host);
+void ehci_async_kick (struct ehci_host *host);
 
 int 
 ehci_check_advance(struct usb_host *usbhc);
@@ -4,7 +4,9 @@
  * @author	K. Matsubara
  */
 #include <core.h>
+#include <core/config.h>
 #include <core/thread.h>
+#include <core/timer.h>
 #include <usb.h>
 #include <usb_device.h>
 #include <usb_hook.h>
@@ -14,6 +16,15 @@
 DEFINE_ALLOC_FUNC(ehci_qtd_meta);
 DEFINE_ZALLOC_FUNC(usb_buffer_list);
 
+/* The async list monitor keeps polling while shadow transfers are in
+   flight or the list keeps changing.  After EHCI_ASYNC_IDLE_SCANS
+   scans without any change, it sleeps until the guest touches
+   USBCMD, USBSTS or ASYNCLISTADDR, or EHCI_ASYNC_IDLE_POLL_USEC
+   passes.  The timeout catches qTDs appended to an idle queue, which
+   are not signalled through any register. */
+#define EHCI_ASYNC_IDLE_SCANS		64
+#define EHCI_ASYNC_IDLE_POLL_USEC	1000
+
 static struct usb_buffer_list *
 register_buffer_page(phys_t bufp, size_t s_off, u8 pid,
 		     size_t *offset, size_t *remain)
@@ -762,6 +773,7 @@ shadow_and_activate_urb(struct ehci_host *host, struct usb_request_block *gurb)
 		URB_EHCI(hurb)->qh_phys | 0x00000002;
 
 	hurb->status = URB_STATUS_RUN;
+	URB_EHCI(hurb)->submit_time = get_time();
 
 	/* update the hurb list */
 	LIST4_ADD (host->hurb, list, hurb);
@@ -861,44 +873,51 @@ deactivate_and_delete_urb(struct ehci_host *host,
 	return;
 }
 
-static void
+static int
 sweep_unmarked_gurbs (struct ehci_host *host)
 {
 	struct usb_request_block *next_gurb, *gurb;
 	u16 counter;
+	int n = 0;
 	
 	counter = host->inlink_counter;
 	LIST4_FOREACH_DELETABLE (host->gurb, list, gurb, next_gurb) {
-		if (!gurb->mark && gurb->inlink != counter)
+		if (!gurb->mark && gurb->inlink != counter) {
 			deactivate_and_delete_urb(host, gurb);
+			n++;
+		}
 	}
 
-	return;
+	return n;
 }
 
-static void
+static int
 shadow_marked_gurbs (struct ehci_host *host)
 {
 	struct usb_request_block *gurb;
+	int n = 0;
 
 	while ((gurb = LIST2_POP (host->need_shadow, need_shadow))) {
 		if (gurb->mark & URB_MARK_NEED_SHADOW) {
 			shadow_and_activate_urb(host, gurb);
 			gurb->mark &= ~URB_MARK_NEED_SHADOW;
+			n++;
 		}
 	}
 
-	return;
+	return n;
 }
 
-static void
+static int
 update_marked_gurbs (struct ehci_host *host)
 {
 	struct usb_request_block *gurb;
 	phys32_t qh_phys;
+	int n = 0;
 
 	while ((gurb = LIST2_POP (host->update, update))) {
 		if (gurb->mark & URB_MARK_UPDATE_REPLACED) {
+			n++;
 			gurb->mark &= ~URB_MARK_UPDATE_REPLACED;
 			do {
 				qh_phys = URB_EHCI(gurb)->qh_phys;
@@ -916,7 +935,7 @@ update_marked_gurbs (struct ehci_host *host)
 		}
 	}
 
-	return;
+	return n;
 }		  
 
 static void
@@ -1038,6 +1057,7 @@ ehci_check_advance(struct usb_host *usbhc)
 	struct ehci_host *host = (struct ehci_host *)usbhc->private;
 	struct usb_request_block *hurb;
 	int advance = 0;
+	u64 latency;
 
 	if (!LIST4_HEAD (host->gurb, list) ||
 	    !LIST4_HEAD (host->gurb, list)->shadow)
@@ -1078,6 +1098,14 @@ recheck:
 				 hurb->shadow ? 
 				 URB_EHCI(hurb->shadow)->qh_phys : 0ULL,
 				 URB_EHCI(hurb)->qh_phys);
+			if (URB_EHCI(hurb)->submit_time) {
+				latency = get_time() -
+					URB_EHCI(hurb)->submit_time;
+				host->stat_transfers++;
+				host->stat_latency += latency;
+				if (host->stat_latency_max < latency)
+					host->stat_latency_max = latency;
+			}
 			if (hurb->callback)
 				hurb->callback (host->usb_host, hurb,
 						hurb->cb_arg);
@@ -1136,18 +1164,72 @@ ehci_end_monitor_async(struct ehci_host *host){
 	usb_unregister_devices (host->usb_host);
 }
 
+static void
+ehci_async_timer(void *handle, void *data)
+{
+	struct ehci_host *host = data;
+
+	thread_event_signal(&host->async_event);
+}
+
+/* request a rescan of the async list */
+void
+ehci_async_kick(struct ehci_host *host)
+{
+	host->stat_kicks++;
+	host->async_idle = 0;
+	thread_event_signal(&host->async_event);
+}
+
+static bool
+ehci_async_busy(struct ehci_host *host)
+{
+	struct usb_request_block *hurb;
+	bool busy = false;
+
+	spinlock_lock(&host->lock_hurb);
+	LIST4_FOREACH (host->hurb, list, hurb) {
+		if (hurb->address != URB_ADDRESS_SKELTON &&
+		    hurb->status == URB_STATUS_RUN) {
+			busy = true;
+			break;
+		}
+	}
+	spinlock_unlock(&host->lock_hurb);
+	return busy;
+}
+
+static void
+ehci_async_wait(struct ehci_host *host, bool idle)
+{
+	if (config.vmm.driver.usb.ehci_poll || !host->async_timer) {
+		schedule();
+		return;
+	}
+	if (idle)
+		timer_set(host->async_timer, EHCI_ASYNC_IDLE_POLL_USEC);
+	host->stat_sleeps++;
+	thread_event_wait(&host->async_event);
+}
+
 void
 ehci_monitor_async_list(void *arg)
 {
 	struct ehci_host *host = (struct ehci_host *)arg;
+	u64 start;
+	int changed;
+
+	host->async_timer = timer_new(ehci_async_timer, host);
+	host->async_idle = 0;
 monitor_loop:
 
 	while (host->usb_stopped || !host->enable_async) {
 		if (host->hcreset)
 			goto exit_thread;
-		schedule();
+		ehci_async_wait(host, false);
 	}
 
+	start = get_time();
 	usb_sc_lock(host->usb_host);
 
 	/* unmark all QHs */
@@ -1157,25 +1239,39 @@ monitor_loop:
 	mark_inlinked_urbs(host, LIST4_HEAD (host->gurb, list));
 
 	/* update urb content link if needed */
-	update_marked_gurbs (host);
+	changed = update_marked_gurbs (host);
 
 	/* make copies of urb and activate it */
-	shadow_marked_gurbs (host);
+	changed += shadow_marked_gurbs (host);
 
 	/* deactivate and delete pairs of urbs */
-	sweep_unmarked_gurbs (host);
+	changed += sweep_unmarked_gurbs (host);
 
 	/* check advance in shadow urbs */
-	ehci_check_advance(host->usb_host);
+	changed += ehci_check_advance(host->usb_host);
 
 	usb_sc_unlock(host->usb_host);
-
-	schedule();
+	host->stat_scans++;
+	host->stat_scan_time += get_time() - start;
+
+	/* keep polling while the guest is actively queuing */
+	if (changed || ehci_async_busy(host))
+		host->async_idle = 0;
+	if (host->async_idle < EHCI_ASYNC_IDLE_SCANS) {
+		host->async_idle++;
+		schedule();
+	} else {
+		ehci_async_wait(host, true);
+	}
 	if (!host->hcreset)
 		goto monitor_loop;
 
 exit_thread:
 	dprintft(2, "=> ehci async monitor thread is stopped <=\n");
+	if (host->async_timer) {
+		timer_free(host->async_timer);
+		host->async_timer = NULL;
+	}
 	ehci_end_monitor_async(host);
 	return;
 }
@@ -107,6 +107,7 @@ static inline u64 core_mm_read_guest_phys64(phys_t phys)
 #include <core/panic.h>
 #include <core/printf.h>
 void	panic_oom() __attribute__ ((noreturn));
+void	register_status_callback (char *(*func) (void));
 
 /** init functions */
 #include <core/initfunc.h>
@@ -175,6 +175,7 @@ struct storage_keys_conf {
 struct config_data_storage {
 	u8 keys[NUM_OF_STORAGE_KEYS][32];
 	struct storage_keys_conf keys_conf[NUM_OF_STORAGE_KEYS_CONF];
+	int crypto_workers;
 } __attribute__ ((packed));
 
 struct config_data_vmm_driver_vpn {
@@ -187,6 +188,7 @@ struct config_data_vmm_driver_vpn {
 struct config_data_vmm_driver_usb {
 	int uhci;
 	int ehci;
+	int ehci_poll;
 };
 
 struct config_data_vmm_driver {
@@ -232,11 +234,14 @@ struct config_data_vmm {
 	int no_intr_intercept;
 	int ignore_tsc_invariant;
 	int unsafe_nested_virtualization;
+	int ept_tables;
+	int eager_nested_paging;
 	char tty_mac_address[6];
 	int tty_pro1000;
 	int tty_rtl8169;
 	int tty_x540;
 	int tty_ieee1394;
+	int tty_log_rate;
 	struct config_data_vmm_driver driver;
 	struct config_data_vmm_iccard iccard;
 	struct config_data_vmm_tty_syslog tty_syslog;
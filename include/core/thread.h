@@ -30,16 +30,29 @@
 #ifndef __CORE_THREAD_H
 #define __CORE_THREAD_H
 
+#include <core/spinlock.h>
 #include <core/types.h>
 
 typedef u8 tid_t;
 
+struct thread_event_waiter;
+
+struct thread_event {
+	spinlock_t lock;
+	bool signaled;
+	struct thread_event_waiter *waiter;
+};
+
 tid_t thread_gettid (void);
 void schedule (void);
 tid_t thread_new (void (*func) (void *), void *arg, int stacksize);
+tid_t thread_new_pcpu (void (*func) (void *), void *arg, int stacksize);
 void thread_exit (void);
 void thread_wakeup (tid_t tid);
 void thread_will_stop (void);
+void thread_event_init (struct thread_event *ev);
+void thread_event_wait (struct thread_event *ev);
+void thread_event_signal (struct thread_event *ev);
 
 #define VMM_STACKSIZE			(4096 * 8)
 
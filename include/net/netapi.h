@@ -31,6 +31,10 @@
 #ifndef __NET_NETAPI_H
 #define __NET_NETAPI_H
 
+/* Packets passed to a receive callback are valid until the callback
+ * returns.  A receiver that queues packets should use pktbuf_hold()
+ * in <net/pktbuf.h>, which takes a reference to the packet buffer
+ * instead of copying when the sender used one. */
 typedef void net_recv_callback_t (void *handle, unsigned int num_packets,
 				  void **packets, unsigned int *packet_sizes,
 				  void *param, long *premap);
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __NET_PKTBUF_H
+#define __NET_PKTBUF_H
+
+#include <core/types.h>
+
+/* Packet buffers are page sized.  The data usually starts after
+ * PKTBUF_HEADROOM bytes so that headers can be prepended without a
+ * copy.  A buffer is freed when the last reference is released.
+ * Buffers of a packet may be chained with the next member. */
+#define PKTBUF_SIZE		4096
+#define PKTBUF_HEADROOM		128
+
+struct pktbuf {
+	struct pktbuf *next;	/* next buffer of the packet */
+	unsigned char *data;	/* packet data */
+	unsigned int len;	/* length of the packet data */
+	void *buf;		/* start of the buffer */
+	u64 phys;		/* physical address of the buffer */
+	u64 time;		/* free for use by the owner */
+	int refcount;
+};
+
+struct pktbuf *pktbuf_alloc (unsigned int headroom);
+struct pktbuf *pktbuf_lookup (void *data);
+struct pktbuf *pktbuf_hold (void **data, unsigned int len);
+void pktbuf_get (struct pktbuf *p);
+void pktbuf_put (struct pktbuf *p);
+unsigned int pktbuf_total_len (struct pktbuf *p);
+
+static inline unsigned int
+pktbuf_headroom (struct pktbuf *p)
+{
+	return p->data - (unsigned char *)p->buf;
+}
+
+static inline unsigned int
+pktbuf_tailroom (struct pktbuf *p)
+{
+	return PKTBUF_SIZE - pktbuf_headroom (p) - p->len;
+}
+
+/* Prepend len bytes.  Returns the new start of the data or NULL if
+ * there is not enough headroom. */
+static inline void *
+pktbuf_push (struct pktbuf *p, unsigned int len)
+{
+	if (pktbuf_headroom (p) < len)
+		return NULL;
+	p->data -= len;
+	p->len += len;
+	return p->data;
+}
+
+/* Remove len bytes from the head of the data. */
+static inline void *
+pktbuf_pull (struct pktbuf *p, unsigned int len)
+{
+	if (p->len < len)
+		return NULL;
+	p->data += len;
+	p->len -= len;
+	return p->data;
+}
+
+/* Append len bytes.  Returns the start of the appended area or NULL
+ * if there is not enough tailroom. */
+static inline void *
+pktbuf_append (struct pktbuf *p, unsigned int len)
+{
+	unsigned char *r = p->data + p->len;
+
+	if (pktbuf_tailroom (p) < len)
+		return NULL;
+	p->len += len;
+	return r;
+}
+
+#endif
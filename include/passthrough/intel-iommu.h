@@ -47,6 +47,9 @@
 #define cap_mgaw(c)   ((((c) >> 16) & 0x3f) + 1) /* Maximum guest address width */
 #define cap_sagaw(c)  (((c) >> 8) & 0x1f)       /* Supported adjusted guest address widths */
 #define cap_rwbf(c)   (((c) >> 4) & 1)
+#define cap_sllps(c)  (((c) >> 34) & 0xf)       /* Second level large page support */
+#define cap_psi(c)    (((c) >> 39) & 1)         /* Page selective invalidation */
+#define cap_mamv(c)   (((c) >> 48) & 0x3f)      /* Maximum address mask value */
 
 /*
  * Decoding Extended Capability Register
@@ -60,6 +63,9 @@
 
 /* IOTLB Invalidate Register Field Offset */
 #define IOTLB_FLUSH_GLOBAL (((u64)1) << 60)
+#define IOTLB_FLUSH_DOMAIN (((u64)2) << 60)
+#define IOTLB_FLUSH_PAGE   (((u64)3) << 60)
+#define IOTLB_DID(d)       (((u64)(d)) << 32)
 #define IOTLB_DRAIN_READ   (((u64)1) << 49)
 #define IOTLB_DRAIN_WRITE  (((u64)1) << 48)
 #define IOTLB_IVT          (((u64)1) << 63)
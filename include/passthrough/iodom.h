@@ -36,6 +36,7 @@ struct domain
 	struct iopt_entry *pgd;   /* io page directory root */   // NOTICE !! PHYSICAL ADDRESS !!
 	spinlock_t iopt_lock;  /* io page table lock */
 	int agaw; /* adjusted guest address width, 0 is level 2 30-bit */
+	int sllps; /* large page sizes supported by all DRHDs, bit 0 is 2MiB */
 };
 
 #define MAX_IO_DOM 256
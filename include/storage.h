@@ -31,6 +31,7 @@
 #define _STORAGE_H_
 
 #include <core/config.h>
+#include <core/list.h>
 
 #define STORAGE_MAX_KEYS_PER_DEVICE 8
 
@@ -59,7 +60,21 @@ struct storage_extend {
 
 struct storage_device;
 
+struct storage_task {
+	LIST1_DEFINE (struct storage_task);
+	void (*func) (void *arg);
+	void *arg;
+	int volatile state;
+};
+
+typedef int (*storage_handle_sectors_t) (struct storage_device *device,
+					 struct storage_access *access,
+					 u8 *src, u8 *dst);
+
 int storage_handle_sectors(struct storage_device *device, struct storage_access *access, u8 *src, u8 *dst);
+int storage_handle_sectors_direct (struct storage_device *device,
+				   struct storage_access *access, u8 *src,
+				   u8 *dst);
 struct storage_device *storage_new (int type, int host_id, int device_id,
 				    struct guid *guid,
 				    struct storage_extend *extend);
@@ -69,5 +84,12 @@ long storage_premap_buf (void *buf, unsigned int len);
 int storage_premap_handle_sectors (struct storage_device *storage,
 				   struct storage_access *access, u8 *src,
 				   u8 *dst, long premap_src, long premap_dst);
+int storage_worker_handle_sectors (struct storage_device *storage,
+				   struct storage_access *access, u8 *src,
+				   u8 *dst, storage_handle_sectors_t func);
+void storage_task_submit (struct storage_task *task,
+			  void (*func) (void *arg), void *arg);
+bool storage_task_done (struct storage_task *task);
+void storage_task_wait (struct storage_task *task);
 
 #endif
@@ -37,6 +37,7 @@
 #include <core/string.h>
 #include <core/thread.h>
 #include <net/netapi.h>
+#include <net/pktbuf.h>
 #include "ip_main.h"
 
 struct net_task {
@@ -55,6 +56,7 @@ struct net_ip_data {
 
 struct net_ip_input_data {
 	struct net_ip_data *p;
+	struct pktbuf *pkt;
 	void *buf;
 	unsigned int len;
 };
@@ -158,7 +160,7 @@ net_main_input_direct (void *arg)
 	struct net_ip_input_data *data = arg;
 
 	ip_main_input (data->p->input_arg, data->buf, data->len);
-	free (data->buf);
+	pktbuf_put (data->pkt);
 	free (data);
 }
 
@@ -171,14 +173,17 @@ net_main_input_queue (struct net_ip_data *p, void **packets,
 
 	for (i = 0; i < num_packets; i++) {
 		/* Note: pbuf_alloc() must be called in the network
-		 * thread, but this function is not. */
-		/* FIXME: memcpy() is called twice for every input
-		 * packet. Copying to pbuf directly is better. */
+		 * thread, but this function is not.  The packet is
+		 * held without a copy if it is in a packet buffer. */
 		data = alloc (sizeof *data);
 		data->p = p;
-		data->buf = alloc (packet_sizes[i]);
+		data->buf = packets[i];
 		data->len = packet_sizes[i];
-		memcpy (data->buf, packets[i], packet_sizes[i]);
+		data->pkt = pktbuf_hold (&data->buf, data->len);
+		if (!data->pkt) {
+			free (data);
+			continue;
+		}
 		net_main_task_add (net_main_input_direct, data);
 	}
 }
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Packet buffer pool.  Buffers are taken from a physically contiguous
+ * region so that the buffer holding a packet can be found from a data
+ * pointer.  A receiver that wants to keep a packet after its receive
+ * callback returns can take a reference with pktbuf_hold() instead of
+ * copying it when the packet is in a pool buffer. */
+
+#include <core/assert.h>
+#include <core/initfunc.h>
+#include <core/mm.h>
+#include <core/panic.h>
+#include <core/spinlock.h>
+#include <core/string.h>
+#include <net/pktbuf.h>
+
+#define PKTBUF_POOL_NUM		512
+
+static spinlock_t pktbuf_lock;
+static struct pktbuf *pktbuf_pool, *pktbuf_free;
+static unsigned char *pktbuf_pool_virt;
+
+static bool
+pktbuf_in_pool (struct pktbuf *p)
+{
+	return p >= &pktbuf_pool[0] && p < &pktbuf_pool[PKTBUF_POOL_NUM];
+}
+
+/* Allocate a buffer with a reference count of 1.  If the pool is
+ * empty, a page is allocated instead. */
+struct pktbuf *
+pktbuf_alloc (unsigned int headroom)
+{
+	struct pktbuf *p;
+
+	if (headroom > PKTBUF_SIZE)
+		headroom = PKTBUF_SIZE;
+	spinlock_lock (&pktbuf_lock);
+	p = pktbuf_free;
+	if (p)
+		pktbuf_free = p->next;
+	spinlock_unlock (&pktbuf_lock);
+	if (!p) {
+		p = alloc (sizeof *p);
+		alloc_page (&p->buf, &p->phys);
+	}
+	p->next = NULL;
+	p->data = (unsigned char *)p->buf + headroom;
+	p->len = 0;
+	p->time = 0;
+	p->refcount = 1;
+	return p;
+}
+
+/* Find the pool buffer containing data. */
+struct pktbuf *
+pktbuf_lookup (void *data)
+{
+	unsigned char *d = data;
+	struct pktbuf *p;
+
+	if (d < pktbuf_pool_virt ||
+	    d >= pktbuf_pool_virt + PKTBUF_POOL_NUM * PKTBUF_SIZE)
+		return NULL;
+	p = &pktbuf_pool[(d - pktbuf_pool_virt) / PKTBUF_SIZE];
+	if (!p->refcount)
+		return NULL;
+	return p;
+}
+
+/* Get a reference to a buffer holding len bytes at *data.  The data
+ * is copied to a new buffer and *data is updated if it is not in a
+ * pool buffer.  A packet larger than a pool buffer, such as a jumbo
+ * or TSO frame, is copied to contiguous pages without headroom. */
+struct pktbuf *
+pktbuf_hold (void **data, unsigned int len)
+{
+	struct pktbuf *p;
+	unsigned int headroom;
+
+	p = pktbuf_lookup (*data);
+	if (p && (unsigned char *)*data - (unsigned char *)p->buf + len <=
+	    PKTBUF_SIZE) {
+		pktbuf_get (p);
+		return p;
+	}
+	if (len > PKTBUF_SIZE) {
+		p = alloc (sizeof *p);
+		alloc_pages (&p->buf, &p->phys,
+			     (len + PKTBUF_SIZE - 1) / PKTBUF_SIZE);
+		p->next = NULL;
+		p->data = p->buf;
+		p->time = 0;
+		p->refcount = 1;
+		goto copy;
+	}
+	headroom = PKTBUF_HEADROOM;
+	if (headroom > PKTBUF_SIZE - len)
+		headroom = PKTBUF_SIZE - len;
+	p = pktbuf_alloc (headroom);
+copy:
+	memcpy (p->data, *data, len);
+	p->len = len;
+	*data = p->data;
+	return p;
+}
+
+void
+pktbuf_get (struct pktbuf *p)
+{
+	spinlock_lock (&pktbuf_lock);
+	ASSERT (p->refcount > 0);
+	p->refcount++;
+	spinlock_unlock (&pktbuf_lock);
+}
+
+/* Release a reference.  Buffers chained to a freed buffer are
+ * released too. */
+void
+pktbuf_put (struct pktbuf *p)
+{
+	struct pktbuf *next;
+
+	while (p) {
+		spinlock_lock (&pktbuf_lock);
+		ASSERT (p->refcount > 0);
+		if (--p->refcount) {
+			spinlock_unlock (&pktbuf_lock);
+			break;
+		}
+		next = p->next;
+		if (pktbuf_in_pool (p)) {
+			p->next = pktbuf_free;
+			pktbuf_free = p;
+			spinlock_unlock (&pktbuf_lock);
+		} else {
+			spinlock_unlock (&pktbuf_lock);
+			free_page (p->buf);
+			free (p);
+		}
+		p = next;
+	}
+}
+
+unsigned int
+pktbuf_total_len (struct pktbuf *p)
+{
+	unsigned int len = 0;
+
+	for (; p; p = p->next)
+		len += p->len;
+	return len;
+}
+
+static void
+pktbuf_init (void)
+{
+	void *virt;
+	u64 phys;
+	int i;
+
+	spinlock_init (&pktbuf_lock);
+	alloc_pages (&virt, &phys, PKTBUF_POOL_NUM); /* a page per buffer */
+	pktbuf_pool_virt = virt;
+	pktbuf_pool = alloc (sizeof *pktbuf_pool * PKTBUF_POOL_NUM);
+	pktbuf_free = NULL;
+	for (i = PKTBUF_POOL_NUM - 1; i >= 0; i--) {
+		pktbuf_pool[i].buf = pktbuf_pool_virt + i * PKTBUF_SIZE;
+		pktbuf_pool[i].phys = phys + i * PKTBUF_SIZE;
+		pktbuf_pool[i].refcount = 0;
+		pktbuf_pool[i].next = pktbuf_free;
+		pktbuf_free = &pktbuf_pool[i];
+	}
+}
+
+INITFUNC ("driver0", pktbuf_init);
@@ -139,9 +139,9 @@ _storage_handle_sectors (struct storage_device *storage,
 	return ret;
 }
 
-int
-storage_handle_sectors (struct storage_device *storage,
-			struct storage_access *access, u8 *src, u8 *dst)
+static int
+storage_handle_sectors_pd (struct storage_device *storage,
+			   struct storage_access *access, u8 *src, u8 *dst)
 {
 	return _storage_handle_sectors (storage, access, src, dst, 0, 0);
 }
@@ -174,6 +174,19 @@ storage_init (struct config_data_storage *config_storage)
 
 #endif /* STORAGE_PD */
 
+int
+storage_handle_sectors (struct storage_device *storage,
+			struct storage_access *access, u8 *src, u8 *dst)
+{
+#ifdef STORAGE_PD
+	return storage_worker_handle_sectors (storage, access, src, dst,
+					      storage_handle_sectors_pd);
+#else
+	return storage_worker_handle_sectors (storage, access, src, dst,
+					      storage_handle_sectors_direct);
+#endif
+}
+
 long
 storage_premap_buf (void *buf, unsigned int len)
 {
@@ -139,6 +139,28 @@ static void aes_xts_decrypt(void *dst, void *src, void *keyctx, lba_t lba, int s
 	aes_xts_crypt(dst, src, (aes_crypt_func_t)AES_DEC_FUNC, &k->decrypt.tweak_key, &k->decrypt.decrypt_key, lba, sector_size);
 }
 
+static void aes_xts_encrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	struct aes_xts_keyctx *k = keyctx;
+	u8 *d = dst, *s = src;
+
+	for (; nsec > 0; nsec--) {
+		aes_xts_crypt(d, s, (aes_crypt_func_t)AES_ENC_FUNC, &k->encrypt.tweak_key, &k->encrypt.encrypt_key, lba++, sector_size);
+		d += sector_size; s += sector_size;
+	}
+}
+
+static void aes_xts_decrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	struct aes_xts_keyctx *k = keyctx;
+	u8 *d = dst, *s = src;
+
+	for (; nsec > 0; nsec--) {
+		aes_xts_crypt(d, s, (aes_crypt_func_t)AES_DEC_FUNC, &k->decrypt.tweak_key, &k->decrypt.decrypt_key, lba++, sector_size);
+		d += sector_size; s += sector_size;
+	}
+}
+
 static void *aes_xts_setkey(const u8 *key, int bits)
 {
 	int keybit = bits / 2;
@@ -159,6 +181,8 @@ static struct crypto aes_xts_crypto = {
 	.encrypt =	aes_xts_encrypt,
 	.decrypt =	aes_xts_decrypt,
 	.setkey =	aes_xts_setkey,
+	.encrypt_sectors = aes_xts_encrypt_sectors,
+	.decrypt_sectors = aes_xts_decrypt_sectors,
 };
 
 void
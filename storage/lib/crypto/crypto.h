@@ -41,6 +41,9 @@ struct crypto {
 	void	(*encrypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
 	void	(*decrypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
 	void	*(*setkey)(const u8 *key, int bits);
+	/* optional: process nsec consecutive sectors in one call */
+	void	(*encrypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size);
+	void	(*decrypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size);
 	int	block_size;
 	int	keyctx_size;
 	char	*name;
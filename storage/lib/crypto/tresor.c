@@ -54,8 +54,12 @@
 #include "tresor.h"
 
 #define AES_BLK_BYTES   16
+#define XTS_GROUP_BYTES	(4 * AES_BLK_BYTES)
+#define XTS_MAX_NSEC	64	/* sectors per interrupt-disabled window */
 
 typedef void (*aes_crypt_func_t)(u8 *out, const u8 *in);
+typedef void (*xts_sectors_func_t)(u8 *out, const u8 *in, u64 lba, u64 nsec,
+				   u64 sector_size);
 
 static void inline xor128(void *dst, const void *src1, const void *src2)
 {
@@ -97,16 +101,10 @@ static void gf_mul128(u8 *dst, const u8 *src)
 		dst[0] ^= gf_128_fdbk;
 }
 
-static void tresor_xts_crypt(u8 *dst, u8 *src, aes_crypt_func_t crypt, u64 lba, u32 sector_size)
+static void tresor_xts_crypt_sector(u8 *dst, u8 *src, aes_crypt_func_t crypt, u64 lba, u32 sector_size)
 {
 	int i;
 	u8 tweak[AES_BLK_BYTES];
-	static char fxsave_region[512] __attribute__((aligned(16)));
-
-	ASSERT(sector_size % AES_BLK_BYTES == 0);
-
-	asm volatile("pushf; cli");
-	asm volatile("fxsave %0" : "=m"(fxsave_region));
 
 	movzx128(tweak, lba);				// convert sector number to tweak plaintext
 	tresor_encblk_128_up(tweak, tweak);		// encrypt the tweak
@@ -118,19 +116,79 @@ static void tresor_xts_crypt(u8 *dst, u8 *src, aes_crypt_func_t crypt, u64 lba,
 		dst += AES_BLK_BYTES;
 		src += AES_BLK_BYTES;
 	}
+}
+
+/* Interrupts are disabled and the FPU state is saved once per run of up
+ * to XTS_MAX_NSEC sectors.  The multi-block kernel is used when the
+ * sector size allows it. */
+static void tresor_xts_crypt(u8 *dst, u8 *src, aes_crypt_func_t crypt, xts_sectors_func_t crypt_sectors, u64 lba, u32 nsec, u32 sector_size)
+{
+	u32 i, n;
+	char fxsave_region[512] __attribute__((aligned(16)));
+
+	ASSERT(sector_size % AES_BLK_BYTES == 0);
 
-	asm volatile("fxrstor %0 ":"=m"(fxsave_region));
-	asm volatile("popf");
+	if (sector_size % XTS_GROUP_BYTES)
+		crypt_sectors = NULL;
+	while (nsec > 0) {
+		n = nsec < XTS_MAX_NSEC ? nsec : XTS_MAX_NSEC;
+		asm volatile("pushf; cli");
+		asm volatile("fxsave %0" : "=m"(fxsave_region));
+		if (crypt_sectors)
+			crypt_sectors(dst, src, lba, n, sector_size);
+		else
+			for (i = 0; i < n; i++)
+				tresor_xts_crypt_sector(dst + i * sector_size,
+							src + i * sector_size,
+							crypt, lba + i,
+							sector_size);
+		asm volatile("fxrstor %0" : : "m"(fxsave_region));
+		asm volatile("popf");
+		dst += n * sector_size;
+		src += n * sector_size;
+		lba += n;
+		nsec -= n;
+	}
 }
 
 static void tresor_xts_encrypt(void *dst, void *src, void *keyctx, lba_t lba, int sector_size)
 {
-	tresor_xts_crypt(dst, src, tresor_encblk_128, lba, sector_size);
+	tresor_xts_crypt(dst, src, tresor_encblk_128, NULL, lba, 1, sector_size);
 }
 
 static void tresor_xts_decrypt(void *dst, void *src, void *keyctx, lba_t lba, int sector_size)
 {
-	tresor_xts_crypt(dst, src, tresor_decblk_128, lba, sector_size);
+	tresor_xts_crypt(dst, src, tresor_decblk_128, NULL, lba, 1, sector_size);
+}
+
+static void tresor_xts_encrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_encblk_128, NULL, lba, nsec, sector_size);
+}
+
+static void tresor_xts_decrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_decblk_128, NULL, lba, nsec, sector_size);
+}
+
+static void tresor_fast_encrypt(void *dst, void *src, void *keyctx, lba_t lba, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_encblk_128, tresor_xts_enc_128_sectors, lba, 1, sector_size);
+}
+
+static void tresor_fast_decrypt(void *dst, void *src, void *keyctx, lba_t lba, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_decblk_128, tresor_xts_dec_128_sectors, lba, 1, sector_size);
+}
+
+static void tresor_fast_encrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_encblk_128, tresor_xts_enc_128_sectors, lba, nsec, sector_size);
+}
+
+static void tresor_fast_decrypt_sectors(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size)
+{
+	tresor_xts_crypt(dst, src, tresor_decblk_128, tresor_xts_dec_128_sectors, lba, nsec, sector_size);
 }
 
 static void *tresor_xts_setkey(const u8 *key, int bits)
@@ -147,6 +205,19 @@ static struct crypto tresor_xts_crypto = {
 	.encrypt =	tresor_xts_encrypt,
 	.decrypt =	tresor_xts_decrypt,
 	.setkey =	tresor_xts_setkey,
+	.encrypt_sectors = tresor_xts_encrypt_sectors,
+	.decrypt_sectors = tresor_xts_decrypt_sectors,
+};
+
+static struct crypto tresor_fast_crypto = {
+	.name = 	"tresor4",
+	.block_size =	AES_BLK_BYTES,
+	.keyctx_size =	0,
+	.encrypt =	tresor_fast_encrypt,
+	.decrypt =	tresor_fast_decrypt,
+	.setkey =	tresor_xts_setkey,
+	.encrypt_sectors = tresor_fast_encrypt_sectors,
+	.decrypt_sectors = tresor_fast_decrypt_sectors,
 };
 
 void
@@ -154,4 +225,5 @@ tresor_xts_init (void)
 {
 	printf("Init Tresor\n");
 	crypto_register (&tresor_xts_crypto);
+	crypto_register (&tresor_fast_crypto);
 }
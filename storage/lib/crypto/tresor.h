@@ -42,5 +42,14 @@ asmlinkage void tresor_decblk_192(u8 *out, const u8 *in);
 asmlinkage void tresor_encblk_256(u8 *out, const u8 *in);
 asmlinkage void tresor_decblk_256(u8 *out, const u8 *in);
 
+/*
+ * XTS over a run of sectors: round keys are derived once per call and
+ * four blocks are processed interleaved (sector_size % 64 == 0)
+ */
+asmlinkage void tresor_xts_enc_128_sectors(u8 *out, const u8 *in, u64 lba,
+					   u64 nsec, u64 sector_size);
+asmlinkage void tresor_xts_dec_128_sectors(u8 *out, const u8 *in, u64 lba,
+					   u64 nsec, u64 sector_size);
+
 #endif /* _CRYPTO_TRESOR_H */
 
@@ -49,19 +49,33 @@
 .set   rk14,   %xmm2       /* round key 14 */
 
 
+/* 128-bit SSE registers of the multi-block XTS kernel */
+.set   xk0,    %xmm0       /* data round key  0 */
+.set   xk1,    %xmm1       /* data round key  1 */
+.set   xk2,    %xmm2       /* data round key  2 */
+.set   xk3,    %xmm3       /* data round key  3 */
+.set   xk4,    %xmm4       /* data round key  4 */
+.set   xk5,    %xmm5       /* data round key  5 */
+.set   xk6,    %xmm6       /* data round key  6 */
+.set   xk7,    %xmm7       /* data round key  7 */
+.set   xk8,    %xmm8       /* data round key  8 */
+.set   xk9,    %xmm9       /* data round key  9 */
+.set   xk10,   %xmm10      /* data round key 10 */
+.set   xs0,    %xmm11      /* AES state of block 0 */
+.set   xs1,    %xmm12      /* AES state of block 1 */
+.set   xs2,    %xmm13      /* AES state of block 2 */
+.set   xs3,    %xmm14      /* AES state of block 3 */
+.set   xhelp,  %xmm15      /* helping register */
+
+
 
 /***************************************************************************
  *                 MACROs
  ***************************************************************************/
 
 
-/* function epilogue */
-.macro epilog
-
-   /* write output */
-   movdqu  rstate,0(%rdi)
-
-   /* reset XMMs */
+/* reset XMMs */
+.macro clear_xmms
    pxor    %xmm0,%xmm0
    pxor    %xmm1,%xmm1
    pxor    %xmm2,%xmm2
@@ -78,6 +92,17 @@
    pxor    %xmm13,%xmm13
    pxor    %xmm14,%xmm14
    pxor    %xmm15,%xmm15
+.endm
+
+
+/* function epilogue */
+.macro epilog
+
+   /* write output */
+   movdqu  rstate,0(%rdi)
+
+   /* reset XMMs */
+   clear_xmms
 
    /* return true */
    xorq    %rax,%rax
@@ -131,20 +156,20 @@
 
 
 /* generate next round key (128- and 256-bit) */
-.macro  key_schedule r0 r1 r2 rcon
-        pxor            rhelp,rhelp
+.macro  key_schedule r0 r1 r2 rcon h=rhelp
+        pxor            \h,\h
         movdqu          \r0,\r2
-        shufps          $0x1f,\r2,rhelp
-        pxor            rhelp,\r2
-        shufps          $0x8c,\r2,rhelp
-        pxor            rhelp,\r2
-        aeskeygenassist $\rcon,\r1,rhelp
+        shufps          $0x1f,\r2,\h
+        pxor            \h,\r2
+        shufps          $0x8c,\r2,\h
+        pxor            \h,\r2
+        aeskeygenassist $\rcon,\r1,\h
         .if (\rcon == 0)
-        shufps          $0xaa,rhelp,rhelp
+        shufps          $0xaa,\h,\h
         .else
-        shufps          $0xff,rhelp,rhelp
+        shufps          $0xff,\h,\h
         .endif
-        pxor            rhelp,\r2
+        pxor            \h,\r2
 .endm
 
 
@@ -231,6 +256,181 @@
 .endm
 
 
+/* copy one 128-bit key from a pair of dbg regs into an xmm reg */
+.macro read_key_pair r0 h lo hi
+   movq    \lo,%rax
+   movq    %rax,\r0
+   movq    \hi,%rax
+   movq    %rax,\h
+   shufps  $0x44,\h,\r0
+.endm
+
+
+/* generate data round keys xk1 to xk10 (128-bit) */
+.macro generate_xks_10
+   key_schedule        xk0  xk0  xk1  0x1   xhelp
+   key_schedule        xk1  xk1  xk2  0x2   xhelp
+   key_schedule        xk2  xk2  xk3  0x4   xhelp
+   key_schedule        xk3  xk3  xk4  0x8   xhelp
+   key_schedule        xk4  xk4  xk5  0x10  xhelp
+   key_schedule        xk5  xk5  xk6  0x20  xhelp
+   key_schedule        xk6  xk6  xk7  0x40  xhelp
+   key_schedule        xk7  xk7  xk8  0x80  xhelp
+   key_schedule        xk8  xk8  xk9  0x1b  xhelp
+   key_schedule        xk9  xk9  xk10 0x36  xhelp
+.endm
+
+
+/* encrypt the sector number in %r9 with the upper key into %r11:%rax;
+ * the round keys are generated on the fly in xs1/xs2 so that the data
+ * round keys in xk0-xk10 stay untouched
+ */
+.macro xts_tweak
+   movq          %r9,xs0
+   read_key_pair xs1 xs3 db2 db3
+   pxor          xs1,xs0
+   key_schedule  xs1 xs1 xs2 0x1  xs3
+   aesenc        xs2,xs0
+   key_schedule  xs2 xs2 xs1 0x2  xs3
+   aesenc        xs1,xs0
+   key_schedule  xs1 xs1 xs2 0x4  xs3
+   aesenc        xs2,xs0
+   key_schedule  xs2 xs2 xs1 0x8  xs3
+   aesenc        xs1,xs0
+   key_schedule  xs1 xs1 xs2 0x10 xs3
+   aesenc        xs2,xs0
+   key_schedule  xs2 xs2 xs1 0x20 xs3
+   aesenc        xs1,xs0
+   key_schedule  xs1 xs1 xs2 0x40 xs3
+   aesenc        xs2,xs0
+   key_schedule  xs2 xs2 xs1 0x80 xs3
+   aesenc        xs1,xs0
+   key_schedule  xs1 xs1 xs2 0x1b xs3
+   aesenc        xs2,xs0
+   key_schedule  xs2 xs2 xs1 0x36 xs3
+   aesenclast    xs1,xs0
+   movq          xs0,%rax
+   pextrq        $1,xs0,%r11
+.endm
+
+
+/* store the tweak in %r11:%rax to the stack slot and multiply it by
+ * alpha in GF(2^128) for the next block
+ */
+.macro xts_tweak_next slot
+   movq    %rax,\slot(%rsp)
+   movq    %r11,\slot+8(%rsp)
+   movq    %r11,%rdx
+   sarq    $63,%rdx
+   andl    $0x87,%edx
+   shldq   $1,%rax,%r11
+   addq    %rax,%rax
+   xorq    %rdx,%rax
+.endm
+
+
+/* apply one round to all four interleaved blocks */
+.macro xts_round4 op rk
+   \op     \rk,xs0
+   \op     \rk,xs1
+   \op     \rk,xs2
+   \op     \rk,xs3
+.endm
+
+
+/* XTS-crypt a run of sectors, four blocks at a time
+ * (dst in %rdi, src in %rsi, lba in %rdx, nsec in %rcx,
+ *  sector size in %r8, must be a multiple of 64)
+ */
+.macro xts_crypt_sectors dir
+   subq          $72,%rsp
+   read_key_pair xk0 xhelp db0 db1
+   generate_xks_10
+   .ifc \dir,dec
+   aesimc        xk1,xk1
+   aesimc        xk2,xk2
+   aesimc        xk3,xk3
+   aesimc        xk4,xk4
+   aesimc        xk5,xk5
+   aesimc        xk6,xk6
+   aesimc        xk7,xk7
+   aesimc        xk8,xk8
+   aesimc        xk9,xk9
+   .endif
+   movq          %rdx,%r9
+   shrq          $6,%r8
+   testq         %rcx,%rcx
+   jz            3f
+1:
+   xts_tweak
+   movq          %r8,%r10
+2:
+   xts_tweak_next 0
+   xts_tweak_next 16
+   xts_tweak_next 32
+   xts_tweak_next 48
+   movdqu        0(%rsi),xs0
+   movdqu        16(%rsi),xs1
+   movdqu        32(%rsi),xs2
+   movdqu        48(%rsi),xs3
+   pxor          0(%rsp),xs0
+   pxor          16(%rsp),xs1
+   pxor          32(%rsp),xs2
+   pxor          48(%rsp),xs3
+   .ifc \dir,enc
+   xts_round4    pxor xk0
+   xts_round4    aesenc xk1
+   xts_round4    aesenc xk2
+   xts_round4    aesenc xk3
+   xts_round4    aesenc xk4
+   xts_round4    aesenc xk5
+   xts_round4    aesenc xk6
+   xts_round4    aesenc xk7
+   xts_round4    aesenc xk8
+   xts_round4    aesenc xk9
+   xts_round4    aesenclast xk10
+   .else
+   xts_round4    pxor xk10
+   xts_round4    aesdec xk9
+   xts_round4    aesdec xk8
+   xts_round4    aesdec xk7
+   xts_round4    aesdec xk6
+   xts_round4    aesdec xk5
+   xts_round4    aesdec xk4
+   xts_round4    aesdec xk3
+   xts_round4    aesdec xk2
+   xts_round4    aesdec xk1
+   xts_round4    aesdeclast xk0
+   .endif
+   pxor          0(%rsp),xs0
+   pxor          16(%rsp),xs1
+   pxor          32(%rsp),xs2
+   pxor          48(%rsp),xs3
+   movdqu        xs0,0(%rdi)
+   movdqu        xs1,16(%rdi)
+   movdqu        xs2,32(%rdi)
+   movdqu        xs3,48(%rdi)
+   addq          $64,%rsi
+   addq          $64,%rdi
+   decq          %r10
+   jnz           2b
+   incq          %r9
+   decq          %rcx
+   jnz           1b
+3:
+   /* wipe tweaks and round keys */
+   clear_xmms
+   movdqa        xs0,0(%rsp)
+   movdqa        xs0,16(%rsp)
+   movdqa        xs0,32(%rsp)
+   movdqa        xs0,48(%rsp)
+   xorq          %rax,%rax
+   xorq          %r11,%r11
+   addq          $72,%rsp
+   retq
+.endm
+
+
 /* Encrypt */
 .macro encrypt_block rounds up
    movdqu  0(%rsi),rstate
@@ -304,6 +504,9 @@
    .globl  tresor_encblk_128_up
    .globl  tresor_decblk_128_up
 
+   .globl  tresor_xts_enc_128_sectors
+   .globl  tresor_xts_dec_128_sectors
+
 
 /* void tresor_encblk(u8 *out, const u8 *in) */
 tresor_encblk_128:
@@ -326,3 +529,10 @@ tresor_decblk_256:
 tresor_decblk_128_up:
    decrypt_block   10 1
 
+
+/* void tresor_xts_crypt_128_sectors(u8 *out, const u8 *in, u64 lba,
+ *                                   u64 nsec, u64 sector_size) */
+tresor_xts_enc_128_sectors:
+   xts_crypt_sectors enc
+tresor_xts_dec_128_sectors:
+   xts_crypt_sectors dec
@@ -160,8 +160,8 @@ storage_set_keys (struct storage_device *storage, struct storage_init *init)
 }
 
 int
-storage_handle_sectors (struct storage_device *storage,
-			 struct storage_access *access, u8 *src, u8 *dst)
+storage_handle_sectors_direct (struct storage_device *storage,
+			       struct storage_access *access, u8 *src, u8 *dst)
 {
 	int i, sub_count;
 	unsigned long long int sub_count2;
@@ -170,6 +170,7 @@ storage_handle_sectors (struct storage_device *storage,
 	int sector_size = access->sector_size;
 	struct crypto *crypto;
 	void (*crypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
+	void (*crypt_sectors)(void *dst, void *src, void *keyctx, lba_t lba, int nsec, int sector_size);
 	void *keyctx;
 
 	for (i = 0; count > 0 && i < storage->keynum; i++) {
@@ -199,9 +200,20 @@ storage_handle_sectors (struct storage_device *storage,
 				sub_count = sub_count2 + 1;
 			keyctx = storage->keys[i].keyctx;
 			crypto = storage->keys[i].crypto;
-			crypt = (access->rw == STORAGE_READ) ? crypto->decrypt : crypto->encrypt;
 			sub_count = min(count, sub_count);
 			count -= sub_count;
+			crypt_sectors = (access->rw == STORAGE_READ) ?
+				crypto->decrypt_sectors :
+				crypto->encrypt_sectors;
+			if (crypt_sectors) {
+				crypt_sectors(dst, src, keyctx, lba, sub_count, sector_size);
+				lba += sub_count;
+				size = sub_count * sector_size;
+				src += size;
+				dst += size;
+				continue;
+			}
+			crypt = (access->rw == STORAGE_READ) ? crypto->decrypt : crypto->encrypt;
 			while (sub_count-- > 0) {
 				crypt(dst, src, keyctx, lba++, sector_size);
 				src += sector_size;
@@ -306,10 +318,10 @@ storage_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 		if (buf[0].len != sizeof *arg)
 			return -1;
 		arg = buf[0].base;
-		arg->retval = storage_handle_sectors (arg->storage,
-						      &arg->access,
-						      buf[1].base,
-						      buf[2].base);
+		arg->retval = storage_handle_sectors_direct (arg->storage,
+							     &arg->access,
+							     buf[1].base,
+							     buf[2].base);
 		return 0;
 	} else {
 		return -1;
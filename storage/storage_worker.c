@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Crypto worker pool.  A large access is split into ranges of
+   STORAGE_WORKER_CHUNK bytes.  Worker threads bound to physical CPUs
+   pick up ranges when they are scheduled, and the requesting CPU
+   processes ranges too until none are left, then waits for the ranges
+   taken by workers.  Independent tasks, such as the completion of
+   one queued command, can also be handed to the workers with
+   storage_task_submit() and collected later with
+   storage_task_wait(). */
+
+#include <core.h>
+#include <core/cpu.h>
+#include <core/list.h>
+#include <core/thread.h>
+#include <core/time.h>
+#include <storage.h>
+
+#define STORAGE_WORKER_CHUNK	(64 * 1024)
+#define STORAGE_WORKER_MAX	64
+
+enum {
+	STORAGE_TASK_QUEUED,
+	STORAGE_TASK_RUNNING,
+	STORAGE_TASK_DONE,
+};
+
+struct storage_job {
+	LIST1_DEFINE (struct storage_job);
+	struct storage_device *storage;
+	struct storage_access *access;
+	u8 *src, *dst;
+	storage_handle_sectors_t func;
+	count_t chunk_count;
+	int nchunks, claimed;
+	int volatile done;
+	int retval;
+};
+
+struct storage_worker {
+	bool active;
+	bool stopped;
+	tid_t tid;
+	u64 chunks;
+	u64 tasks;
+	u64 bytes;
+	u64 busy_time;
+};
+
+static LIST1_DEFINE_HEAD (struct storage_job, list1_job);
+static LIST1_DEFINE_HEAD (struct storage_task, list1_task);
+static spinlock_t worker_lock;
+static struct storage_worker workers[STORAGE_WORKER_MAX];
+static int num_workers;
+static u64 stat_serial, stat_parallel, stat_task;
+
+static int
+storage_job_run (struct storage_job *job, int i, u64 *bytes)
+{
+	struct storage_access access;
+	count_t off;
+	ulong size;
+
+	access = *job->access;
+	off = i * job->chunk_count;
+	access.lba += off;
+	access.count = job->access->count - off;
+	if (access.count > job->chunk_count)
+		access.count = job->chunk_count;
+	size = (ulong)off * access.sector_size;
+	*bytes = (u64)access.count * access.sector_size;
+	return job->func (job->storage, &access, job->src + size,
+			  job->dst + size);
+}
+
+/* worker_lock must be held */
+static void
+storage_job_done (struct storage_job *job, int ret)
+{
+	if (ret)
+		job->retval = ret;
+	job->done++;
+}
+
+/* worker_lock must be held */
+static void
+storage_worker_wakeup (void)
+{
+	int i;
+
+	for (i = 0; i < STORAGE_WORKER_MAX; i++) {
+		if (workers[i].stopped) {
+			workers[i].stopped = false;
+			thread_wakeup (workers[i].tid);
+		}
+	}
+}
+
+static void
+storage_worker_thread (void *arg)
+{
+	struct storage_worker *w = arg;
+	struct storage_job *job;
+	struct storage_task *task;
+	u64 start, bytes;
+	int i, ret;
+
+	for (;;) {
+		spinlock_lock (&worker_lock);
+		task = LIST1_POP (list1_task);
+		if (task) {
+			task->state = STORAGE_TASK_RUNNING;
+			spinlock_unlock (&worker_lock);
+			start = get_time ();
+			task->func (task->arg);
+			spinlock_lock (&worker_lock);
+			w->busy_time += get_time () - start;
+			w->tasks++;
+			/* the task must not be touched after this */
+			task->state = STORAGE_TASK_DONE;
+			spinlock_unlock (&worker_lock);
+			continue;
+		}
+		LIST1_FOREACH (list1_job, job) {
+			if (job->claimed < job->nchunks)
+				goto found;
+		}
+		w->stopped = true;
+		thread_will_stop ();
+		spinlock_unlock (&worker_lock);
+		schedule ();
+		continue;
+	found:
+		i = job->claimed++;
+		spinlock_unlock (&worker_lock);
+		start = get_time ();
+		ret = storage_job_run (job, i, &bytes);
+		spinlock_lock (&worker_lock);
+		w->busy_time += get_time () - start;
+		w->chunks++;
+		w->bytes += bytes;
+		/* the job must not be touched after this */
+		storage_job_done (job, ret);
+		spinlock_unlock (&worker_lock);
+	}
+}
+
+int
+storage_worker_handle_sectors (struct storage_device *storage,
+			       struct storage_access *access, u8 *src,
+			       u8 *dst, storage_handle_sectors_t func)
+{
+	struct storage_job job;
+	u64 bytes;
+	int i, ret;
+
+	job.chunk_count = STORAGE_WORKER_CHUNK / access->sector_size;
+	if (!num_workers || !job.chunk_count ||
+	    access->count < job.chunk_count * 2) {
+		stat_serial++;
+		return func (storage, access, src, dst);
+	}
+	job.storage = storage;
+	job.access = access;
+	job.src = src;
+	job.dst = dst;
+	job.func = func;
+	job.nchunks = (access->count + job.chunk_count - 1) / job.chunk_count;
+	job.claimed = 0;
+	job.done = 0;
+	job.retval = 0;
+	spinlock_lock (&worker_lock);
+	stat_parallel++;
+	LIST1_ADD (list1_job, &job);
+	storage_worker_wakeup ();
+	while (job.claimed < job.nchunks) {
+		i = job.claimed++;
+		spinlock_unlock (&worker_lock);
+		ret = storage_job_run (&job, i, &bytes);
+		spinlock_lock (&worker_lock);
+		storage_job_done (&job, ret);
+	}
+	LIST1_DEL (list1_job, &job);
+	spinlock_unlock (&worker_lock);
+	while (job.done < job.nchunks)
+		cpu_relax ();
+	return job.retval;
+}
+
+/* Run func (arg) on a worker.  Without workers, it is run now. */
+void
+storage_task_submit (struct storage_task *task, void (*func) (void *arg),
+		     void *arg)
+{
+	task->func = func;
+	task->arg = arg;
+	spinlock_lock (&worker_lock);
+	stat_task++;
+	if (!num_workers) {
+		spinlock_unlock (&worker_lock);
+		func (arg);
+		task->state = STORAGE_TASK_DONE;
+		return;
+	}
+	task->state = STORAGE_TASK_QUEUED;
+	LIST1_ADD (list1_task, task);
+	storage_worker_wakeup ();
+	spinlock_unlock (&worker_lock);
+}
+
+bool
+storage_task_done (struct storage_task *task)
+{
+	return task->state == STORAGE_TASK_DONE;
+}
+
+/* Wait for the task.  A task not yet taken by a worker is run by
+   the caller. */
+void
+storage_task_wait (struct storage_task *task)
+{
+	spinlock_lock (&worker_lock);
+	if (task->state == STORAGE_TASK_QUEUED) {
+		LIST1_DEL (list1_task, task);
+		task->state = STORAGE_TASK_RUNNING;
+		spinlock_unlock (&worker_lock);
+		task->func (task->arg);
+		task->state = STORAGE_TASK_DONE;
+		return;
+	}
+	spinlock_unlock (&worker_lock);
+	while (task->state != STORAGE_TASK_DONE)
+		cpu_relax ();
+}
+
+static char *
+storage_worker_status (void)
+{
+	static char buf[4096];
+	int i, n;
+
+	n = snprintf (buf, sizeof buf,
+		      "storage workers: %d\n"
+		      " serial: %llu\n"
+		      " parallel: %llu\n"
+		      " tasks: %llu\n"
+		      , num_workers, stat_serial, stat_parallel, stat_task);
+	for (i = 0; i < STORAGE_WORKER_MAX; i++) {
+		if (!workers[i].active)
+			continue;
+		n += snprintf (buf + n, sizeof buf - n,
+			       " cpu%d: chunks %llu tasks %llu bytes %llu"
+			       " busy %llu us\n",
+			       i, workers[i].chunks, workers[i].tasks,
+			       workers[i].bytes, workers[i].busy_time);
+	}
+	return buf;
+}
+
+static void
+storage_worker_init_global (void)
+{
+	LIST1_HEAD_INIT (list1_job);
+	LIST1_HEAD_INIT (list1_task);
+	spinlock_init (&worker_lock);
+	num_workers = 0;
+}
+
+static void
+storage_worker_init_status (void)
+{
+	register_status_callback (storage_worker_status);
+}
+
+static void
+storage_worker_init_pcpu (void)
+{
+	struct storage_worker *w;
+	int cpu;
+
+	cpu = get_cpu_id ();
+	if (cpu >= config.storage.crypto_workers || cpu >= STORAGE_WORKER_MAX)
+		return;
+	w = &workers[cpu];
+	w->stopped = false;
+	w->chunks = 0;
+	w->tasks = 0;
+	w->bytes = 0;
+	w->busy_time = 0;
+	w->tid = thread_new_pcpu (storage_worker_thread, w, VMM_STACKSIZE);
+	spinlock_lock (&worker_lock);
+	w->active = true;
+	num_workers++;
+	spinlock_unlock (&worker_lock);
+}
+
+INITFUNC ("global3", storage_worker_init_global);
+INITFUNC ("paral01", storage_worker_init_status);
+INITFUNC ("pcpu4", storage_worker_init_pcpu);
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "call_vmm.h"
+#include "exitprof.h"
+
+struct reason_sum {
+	int reason;
+	uint64_t count;
+	uint64_t cycles;
+	uint64_t hist[64];
+};
+
+static const char *const vt_reason_name[] = {
+	"EXCEPTION_NMI", "EXTERNAL_INT", "TRIPLE_FAULT", "INIT",
+	"STARTUP_IPI", "IO_SMI", "OTHER_SMI", "INTERRUPT_WINDOW",
+	"NMI_WINDOW", "TASK_SWITCH", "CPUID", "GETSEC",
+	"HLT", "INVD", "INVLPG", "RDPMC",
+	"RDTSC", "RSM", "VMCALL", "VMCLEAR",
+	"VMLAUNCH", "VMPTRLD", "VMPTRST", "VMREAD",
+	"VMRESUME", "VMWRITE", "VMXOFF", "VMXON",
+	"MOV_CR", "MOV_DR", "IO_INSTRUCTION", "RDMSR",
+	"WRMSR", "ENTRY_INVALID_GUEST", "ENTRY_MSR_LOADING", NULL,
+	"MWAIT", "MONITOR_TRAP_FLAG", NULL, "MONITOR",
+	"PAUSE", "ENTRY_MACHINE_CHECK", NULL, "TPR_BELOW_THRESHOLD",
+	"APIC_ACCESS", "VIRTUALIZED_EOI", "GDTR_IDTR", "LDTR_TR",
+	"EPT_VIOLATION", "EPT_MISCONFIG", "INVEPT", "RDTSCP",
+	"PREEMPTION_TIMER", "INVVPID", "WBINVD", "XSETBV",
+	"APIC_WRITE", "RDRAND", "INVPCID", "VMFUNC",
+	"ENCLS", "RDSEED", "PML_FULL", "XSAVES",
+	"XRSTORS",
+};
+
+static const struct {
+	int code;
+	const char *name;
+} svm_reason_name[] = {
+	{ 0x60, "INTR" }, { 0x61, "NMI" }, { 0x62, "SMI" },
+	{ 0x63, "INIT" }, { 0x64, "VINTR" }, { 0x65, "CR0_SEL_WRITE" },
+	{ 0x72, "CPUID" }, { 0x73, "RSM" }, { 0x74, "IRET" },
+	{ 0x75, "SWINT" }, { 0x76, "INVD" }, { 0x77, "PAUSE" },
+	{ 0x78, "HLT" }, { 0x79, "INVLPG" }, { 0x7A, "INVLPGA" },
+	{ 0x7B, "IOIO" }, { 0x7C, "MSR" }, { 0x7D, "TASK_SWITCH" },
+	{ 0x7F, "SHUTDOWN" }, { 0x80, "VMRUN" }, { 0x81, "VMMCALL" },
+	{ 0x82, "VMLOAD" }, { 0x83, "VMSAVE" }, { 0x84, "STGI" },
+	{ 0x85, "CLGI" }, { 0x86, "SKINIT" }, { 0x87, "RDTSCP" },
+	{ 0x88, "ICEBP" }, { 0x89, "WBINVD" }, { 0x8A, "MONITOR" },
+	{ 0x8B, "MWAIT" }, { 0x8D, "XSETBV" }, { 0xF0, "NPF" },
+	{ 0xF1, "AVIC_INCOMPLETE_IPI" }, { 0xF2, "AVIC_NOACCEL" },
+	{ 0xF3, "VMGEXIT" }, { 0xFF, "OTHER" },
+};
+
+static const char *const tag_name[] = {
+	"-", "EPT", "IO", "MMIO", "MSR",
+};
+
+static void
+reason_name (uint32_t arch, int reason, char *buf, int len)
+{
+	unsigned int i;
+
+	if (arch == EXITPROF_ARCH_VT) {
+		if (reason < (int)(sizeof vt_reason_name /
+				   sizeof vt_reason_name[0]) &&
+		    vt_reason_name[reason]) {
+			snprintf (buf, len, "%s", vt_reason_name[reason]);
+			return;
+		}
+	} else if (arch == EXITPROF_ARCH_SVM) {
+		if (reason < 0x10) {
+			snprintf (buf, len, "CR%d_READ", reason);
+			return;
+		}
+		if (reason < 0x20) {
+			snprintf (buf, len, "CR%d_WRITE", reason - 0x10);
+			return;
+		}
+		if (reason < 0x30) {
+			snprintf (buf, len, "DR%d_READ", reason - 0x20);
+			return;
+		}
+		if (reason < 0x40) {
+			snprintf (buf, len, "DR%d_WRITE", reason - 0x30);
+			return;
+		}
+		if (reason < 0x60) {
+			snprintf (buf, len, "EXCP%d", reason - 0x40);
+			return;
+		}
+		for (i = 0; i < sizeof svm_reason_name /
+			     sizeof svm_reason_name[0]; i++) {
+			if (svm_reason_name[i].code == reason) {
+				snprintf (buf, len, "%s",
+					  svm_reason_name[i].name);
+				return;
+			}
+		}
+	}
+	snprintf (buf, len, "0x%02X", reason);
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static uint64_t
+percentile (uint64_t *hist, int nbuckets, uint64_t count, int pct)
+{
+	uint64_t sum, limit;
+	int i;
+
+	limit = (count * pct + 99) / 100;
+	sum = 0;
+	for (i = 0; i < nbuckets; i++) {
+		sum += hist[i];
+		if (sum >= limit)
+			break;
+	}
+	if (i >= nbuckets - 1)
+		return ~0ULL;
+	return (2ULL << i) - 1;
+}
+
+static int
+cmp_reason (const void *a, const void *b)
+{
+	const struct reason_sum *x = a, *y = b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	return x->reason - y->reason;
+}
+
+static int
+cmp_tag (const void *a, const void *b)
+{
+	const struct exitprof_tag *x = a, *y = b;
+
+	if (x->cycles != y->cycles)
+		return x->cycles < y->cycles ? 1 : -1;
+	return 0;
+}
+
+/* Get the exit profile from the VMM.  *blob is allocated with
+ * malloc() and must be freed by the caller. */
+int
+exitprof_get (void **blob, int *len)
+{
+	call_vmm_function_t f;
+	call_vmm_arg_t a;
+	call_vmm_ret_t r;
+	void *buf;
+	int size;
+
+	CALL_VMM_GET_FUNCTION ("get_exitprof", &f);
+	if (!call_vmm_function_callable (&f))
+		return -1;
+	size = 65536;
+	for (;;) {
+		buf = malloc (size);
+		if (!buf)
+			return -1;
+		/* Touch the buffer so that the VMM can write to it */
+		memset (buf, 0, size);
+		a.rbx = (intptr_t)buf;
+		a.rcx = size;
+		call_vmm_call_function (&f, &a, &r);
+		if (!(int)r.rax)
+			break;
+		free (buf);
+		if ((int)r.rcx <= size)
+			return -1;
+		size = (int)r.rcx;
+	}
+	*blob = buf;
+	*len = (int)r.rcx;
+	return 0;
+}
+
+/* Print reasons and tags sorted by total cycles, summed over all CPUs
+ * if cpu is negative.  At most top lines are printed for each table
+ * if top is positive. */
+int
+exitprof_render (FILE *fp, void *blob, int len, int cpu, int top)
+{
+	struct exitprof_header *h;
+	struct exitprof_cpu *c;
+	struct exitprof_reason *r;
+	struct exitprof_tag *t, *tags;
+	struct reason_sum *sum;
+	uint32_t *hist;
+	uint64_t overflow;
+	unsigned char *p;
+	size_t cpusize, reasonsize;
+	uint32_t i, j, k;
+	int ntags, n;
+	char name[32];
+
+	h = blob;
+	if (len < (int)sizeof *h || h->magic != EXITPROF_MAGIC ||
+	    h->version != EXITPROF_VERSION || h->nbuckets > 64)
+		return -1;
+	reasonsize = sizeof *r + h->nbuckets * sizeof *hist;
+	cpusize = sizeof *c + h->nreasons * reasonsize +
+		h->ntags * sizeof *t;
+	if (len < (int)(sizeof *h + h->ncpus * cpusize))
+		return -1;
+	sum = calloc (h->nreasons, sizeof *sum);
+	tags = calloc (h->ncpus * h->ntags, sizeof *tags);
+	if (!sum || !tags) {
+		free (sum);
+		free (tags);
+		return -1;
+	}
+	for (i = 0; i < h->nreasons; i++)
+		sum[i].reason = i;
+	ntags = 0;
+	overflow = 0;
+	for (i = 0; i < h->ncpus; i++) {
+		p = (unsigned char *)(h + 1) + i * cpusize;
+		c = (struct exitprof_cpu *)p;
+		if (cpu >= 0 && c->cpunum != (uint32_t)cpu)
+			continue;
+		overflow += c->tag_overflow;
+		p += sizeof *c;
+		for (j = 0; j < h->nreasons; j++, p += reasonsize) {
+			r = (struct exitprof_reason *)p;
+			hist = (uint32_t *)(r + 1);
+			sum[j].count += r->count;
+			sum[j].cycles += r->cycles;
+			for (k = 0; k < h->nbuckets; k++)
+				sum[j].hist[k] += hist[k];
+		}
+		t = (struct exitprof_tag *)p;
+		for (j = 0; j < h->ntags; j++) {
+			if (t[j].type == EXITPROF_TAG_NONE)
+				continue;
+			for (n = 0; n < ntags; n++)
+				if (tags[n].type == t[j].type &&
+				    tags[n].value == t[j].value)
+					break;
+			if (n == ntags)
+				tags[ntags++] = t[j];
+			else {
+				tags[n].count += t[j].count;
+				tags[n].cycles += t[j].cycles;
+			}
+		}
+	}
+	qsort (sum, h->nreasons, sizeof *sum, cmp_reason);
+	qsort (tags, ntags, sizeof *tags, cmp_tag);
+	fprintf (fp, "%-22s %12s %16s %10s %10s %10s\n", "Exit reason",
+		 "Count", "Cycles", "Avg", "p50<=", "p99<=");
+	for (i = 0; i < h->nreasons; i++) {
+		if (!sum[i].count || (top > 0 && i >= (uint32_t)top))
+			break;
+		reason_name (h->arch, sum[i].reason, name, sizeof name);
+		fprintf (fp, "%-22s %12llu %16llu %10llu %10llu %10llu\n",
+			 name, (unsigned long long)sum[i].count,
+			 (unsigned long long)sum[i].cycles,
+			 (unsigned long long)(sum[i].cycles / sum[i].count),
+			 (unsigned long long)percentile (sum[i].hist,
+							 h->nbuckets,
+							 sum[i].count, 50),
+			 (unsigned long long)percentile (sum[i].hist,
+							 h->nbuckets,
+							 sum[i].count, 99));
+	}
+	fprintf (fp, "\n%-4s %-18s %12s %16s %10s\n", "Tag", "Value",
+		 "Count", "Cycles", "Avg");
+	for (n = 0; n < ntags && (top <= 0 || n < top); n++) {
+		fprintf (fp, "%-4s 0x%-16llX %12llu %16llu %10llu\n",
+			 tags[n].type < sizeof tag_name / sizeof tag_name[0] ?
+			 tag_name[tags[n].type] : "?",
+			 (unsigned long long)tags[n].value,
+			 (unsigned long long)tags[n].count,
+			 (unsigned long long)tags[n].cycles,
+			 (unsigned long long)(tags[n].count ?
+					      tags[n].cycles /
+					      tags[n].count : 0));
+	}
+	if (overflow)
+		fprintf (fp, "(%llu exits not tagged: tag table full)\n",
+			 (unsigned long long)overflow);
+	free (sum);
+	free (tags);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EXITPROF_H
+#define _EXITPROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Must be kept in sync with core/exitprof.h */
+#define EXITPROF_MAGIC		0x46505845 /* "EXPF" */
+#define EXITPROF_VERSION	1
+#define EXITPROF_ARCH_VT	1
+#define EXITPROF_ARCH_SVM	2
+
+enum exitprof_tag_type {
+	EXITPROF_TAG_NONE = 0,
+	EXITPROF_TAG_EPT = 1,
+	EXITPROF_TAG_IO = 2,
+	EXITPROF_TAG_MMIO = 3,
+	EXITPROF_TAG_MSR = 4,
+};
+
+struct exitprof_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ncpus;
+	uint32_t nreasons;
+	uint32_t nbuckets;
+	uint32_t ntags;
+	uint32_t arch;
+	uint32_t reserved;
+};
+
+/* Followed by nbuckets uint32_t histogram entries */
+struct exitprof_reason {
+	uint64_t count;
+	uint64_t cycles;
+};
+
+struct exitprof_tag {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t value;
+	uint64_t count;
+	uint64_t cycles;
+};
+
+/* Followed by nreasons reasons and ntags tags */
+struct exitprof_cpu {
+	uint32_t cpunum;
+	uint32_t reserved;
+	uint64_t tag_overflow;
+};
+
+int exitprof_get (void **blob, int *len);
+int exitprof_render (FILE *fp, void *blob, int len, int cpu, int top);
+
+#endif
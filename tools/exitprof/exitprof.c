@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2007, 2008 University of Tsukuba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Print the VM exit profile collected by the VMM (vmm.status=1) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../common/call_vmm.h"
+#include "../common/exitprof.h"
+
+static void
+usage (char *name)
+{
+	fprintf (stderr, "usage: %s [-c cpu] [-n top] [-w file | -r file]\n"
+		 "  -c cpu   show only the given physical CPU\n"
+		 "  -n top   show at most top lines per table\n"
+		 "  -w file  save the raw profile to file\n"
+		 "  -r file  read a raw profile from file instead of the"
+		 " VMM\n", name);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	int c, cpu, top, len;
+	char *wfile, *rfile;
+	void *blob;
+	FILE *fp;
+
+	cpu = -1;
+	top = 0;
+	wfile = NULL;
+	rfile = NULL;
+	while ((c = getopt (argc, argv, "c:n:w:r:")) != -1) {
+		switch (c) {
+		case 'c':
+			cpu = atoi (optarg);
+			break;
+		case 'n':
+			top = atoi (optarg);
+			break;
+		case 'w':
+			wfile = optarg;
+			break;
+		case 'r':
+			rfile = optarg;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (rfile) {
+		fp = fopen (rfile, "rb");
+		if (!fp) {
+			perror (rfile);
+			exit (1);
+		}
+		fseek (fp, 0, SEEK_END);
+		len = ftell (fp);
+		rewind (fp);
+		blob = malloc (len);
+		if (!blob || fread (blob, 1, len, fp) != (size_t)len) {
+			fprintf (stderr, "%s: read error\n", rfile);
+			exit (1);
+		}
+		fclose (fp);
+	} else if (exitprof_get (&blob, &len)) {
+		fprintf (stderr, "vmmcall \"get_exitprof\" failed\n");
+		exit (1);
+	}
+	if (wfile) {
+		fp = fopen (wfile, "wb");
+		if (!fp || fwrite (blob, 1, len, fp) != (size_t)len) {
+			perror (wfile);
+			exit (1);
+		}
+		fclose (fp);
+	}
+	if (exitprof_render (stdout, blob, len, cpu, top)) {
+		fprintf (stderr, "invalid profile data\n");
+		exit (1);
+	}
+	free (blob);
+	return 0;
+}
@@ -47,6 +47,7 @@
 #include <string.h>
 #include <sys/ucontext.h>
 #include "call_vmm.h"
+#include "../../common/exitprof.h"
 
 static char buf[16384];
 
@@ -69,13 +70,36 @@ vmcall_getstatus (char *buf, int len)
 	return 0;
 }
 
+/* Append the most expensive exit reasons and tags to buf */
+static void
+getexitprof (char *buf, int len)
+{
+	void *blob;
+	int bloblen;
+	FILE *fp;
+
+	if (exitprof_get (&blob, &bloblen))
+		return;
+	fp = fmemopen (buf, len, "w");
+	if (fp) {
+		fputs ("\n", fp);
+		exitprof_render (fp, blob, bloblen, -1, 8);
+		fclose (fp);
+	}
+	free (blob);
+}
+
 static void
 getstatus (char **st1, char **st2)
 {
+	int len;
+
 	*st1 = "Unknown";
 	*st2 = "";
 	if (vmcall_getstatus (buf, sizeof buf))
 		return;
+	len = strlen (buf);
+	getexitprof (buf + len, sizeof buf - len);
 	*st1 = "Running";
 	*st2 = buf;
 }
@@ -53,6 +53,7 @@
 #include <openssl/md5.h>
 #include <openssl/sha.h>
 #include <openssl/des.h>
+#include <openssl/aes.h>
 #include <openssl/dh.h>
 #include <openssl/pem.h>
 #include <Se/Se.h>
@@ -1626,6 +1627,740 @@ void SeDes3Decrypt(void *dest, void *src, UINT size, SE_DES_KEY *key, void *ivec
 		0);
 }
 
+// AES-NI / PCLMULQDQ use the SSE registers, which the VMM does not save
+// for the guest.  Interrupts are disabled and the FPU state is saved
+// around every use, the same as TRESOR does.
+#define SE_SIMD_SAVE_SIZE				512
+
+static unsigned long SeSimdBegin(void *save)
+{
+	unsigned long flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r" (flags) : : "memory");
+	asm volatile ("fxsave %0" : "=m" (*(UCHAR (*)[SE_SIMD_SAVE_SIZE])save));
+
+	return flags;
+}
+
+static void SeSimdEnd(void *save, unsigned long flags)
+{
+	asm volatile ("fxrstor %0" : : "m" (*(UCHAR (*)[SE_SIMD_SAVE_SIZE])save));
+	asm volatile ("push %0; popf" : : "r" (flags) : "memory", "cc");
+}
+
+// Byte reversal mask for PSHUFB
+static const UCHAR se_bswap_mask[SE_AES_BLOCK_SIZE] __attribute__ ((aligned (16))) =
+{
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+};
+
+// Encrypt one block with AES-NI
+static void SeAesNiEncryptBlock(void *dst, void *src, UCHAR *rk, UINT rounds)
+{
+	UINT n = rounds - 1;
+
+	asm volatile ("movdqu (%3), %%xmm0\n"
+				  "movdqu (%0), %%xmm1\n"
+				  "pxor %%xmm1, %%xmm0\n"
+				  "1:\n"
+				  "add $16, %0\n"
+				  "movdqu (%0), %%xmm1\n"
+				  "aesenc %%xmm1, %%xmm0\n"
+				  "dec %1\n"
+				  "jnz 1b\n"
+				  "movdqu 16(%0), %%xmm1\n"
+				  "aesenclast %%xmm1, %%xmm0\n"
+				  "movdqu %%xmm0, (%2)\n"
+				  : "+r" (rk), "+r" (n)
+				  : "r" (dst), "r" (src)
+				  : "memory", "cc");
+}
+
+// Decrypt one block with AES-NI
+static void SeAesNiDecryptBlock(void *dst, void *src, UCHAR *rk, UINT rounds)
+{
+	UINT n = rounds - 1;
+
+	asm volatile ("movdqu (%3), %%xmm0\n"
+				  "movdqu (%0), %%xmm1\n"
+				  "pxor %%xmm1, %%xmm0\n"
+				  "1:\n"
+				  "add $16, %0\n"
+				  "movdqu (%0), %%xmm1\n"
+				  "aesdec %%xmm1, %%xmm0\n"
+				  "dec %1\n"
+				  "jnz 1b\n"
+				  "movdqu 16(%0), %%xmm1\n"
+				  "aesdeclast %%xmm1, %%xmm0\n"
+				  "movdqu %%xmm0, (%2)\n"
+				  : "+r" (rk), "+r" (n)
+				  : "r" (dst), "r" (src)
+				  : "memory", "cc");
+}
+
+// GHASH over whole blocks with PCLMULQDQ.  x is the running hash in
+// GCM byte order, h the byte-reversed hash key.  The multiplication
+// follows the Intel carry-less multiplication white paper and uses
+// only %xmm0-%xmm7 so that it also assembles for a 32-bit VMM.
+static void SeGhashClmul(UCHAR *x, UCHAR *h, UCHAR *data, UINT blocks)
+{
+	asm volatile ("movdqu (%0), %%xmm0\n"
+				  "pshufb %3, %%xmm0\n"
+				  : : "r" (x), "r" (h), "r" (data), "m" (se_bswap_mask)
+				  : "memory");
+
+	while (blocks-- > 0)
+	{
+		asm volatile ("movdqu (%1), %%xmm1\n"
+					  "movdqu (%2), %%xmm2\n"
+					  "pshufb %3, %%xmm2\n"
+					  "pxor %%xmm2, %%xmm0\n"
+					  // 256-bit carry-less product <xmm6:xmm3>
+					  "movdqa %%xmm0, %%xmm3\n"
+					  "pclmulqdq $0x00, %%xmm1, %%xmm3\n"
+					  "movdqa %%xmm0, %%xmm4\n"
+					  "pclmulqdq $0x10, %%xmm1, %%xmm4\n"
+					  "movdqa %%xmm0, %%xmm5\n"
+					  "pclmulqdq $0x01, %%xmm1, %%xmm5\n"
+					  "movdqa %%xmm0, %%xmm6\n"
+					  "pclmulqdq $0x11, %%xmm1, %%xmm6\n"
+					  "pxor %%xmm5, %%xmm4\n"
+					  "movdqa %%xmm4, %%xmm5\n"
+					  "psrldq $8, %%xmm4\n"
+					  "pslldq $8, %%xmm5\n"
+					  "pxor %%xmm5, %%xmm3\n"
+					  "pxor %%xmm4, %%xmm6\n"
+					  // Shift the product left by one bit
+					  "movdqa %%xmm3, %%xmm4\n"
+					  "movdqa %%xmm6, %%xmm5\n"
+					  "pslld $1, %%xmm3\n"
+					  "pslld $1, %%xmm6\n"
+					  "psrld $31, %%xmm4\n"
+					  "psrld $31, %%xmm5\n"
+					  "movdqa %%xmm4, %%xmm7\n"
+					  "pslldq $4, %%xmm5\n"
+					  "pslldq $4, %%xmm4\n"
+					  "psrldq $12, %%xmm7\n"
+					  "por %%xmm4, %%xmm3\n"
+					  "por %%xmm5, %%xmm6\n"
+					  "por %%xmm7, %%xmm6\n"
+					  // Reduce modulo x^128 + x^7 + x^2 + x + 1
+					  "movdqa %%xmm3, %%xmm4\n"
+					  "movdqa %%xmm3, %%xmm5\n"
+					  "movdqa %%xmm3, %%xmm7\n"
+					  "pslld $31, %%xmm4\n"
+					  "pslld $30, %%xmm5\n"
+					  "pslld $25, %%xmm7\n"
+					  "pxor %%xmm5, %%xmm4\n"
+					  "pxor %%xmm7, %%xmm4\n"
+					  "movdqa %%xmm4, %%xmm5\n"
+					  "pslldq $12, %%xmm4\n"
+					  "psrldq $4, %%xmm5\n"
+					  "pxor %%xmm4, %%xmm3\n"
+					  "movdqa %%xmm3, %%xmm2\n"
+					  "movdqa %%xmm3, %%xmm4\n"
+					  "movdqa %%xmm3, %%xmm7\n"
+					  "psrld $1, %%xmm2\n"
+					  "psrld $2, %%xmm4\n"
+					  "psrld $7, %%xmm7\n"
+					  "pxor %%xmm4, %%xmm2\n"
+					  "pxor %%xmm7, %%xmm2\n"
+					  "pxor %%xmm5, %%xmm2\n"
+					  "pxor %%xmm2, %%xmm3\n"
+					  "pxor %%xmm3, %%xmm6\n"
+					  "movdqa %%xmm6, %%xmm0\n"
+					  : : "r" (x), "r" (h), "r" (data), "m" (se_bswap_mask)
+					  : "memory");
+		data += SE_AES_BLOCK_SIZE;
+	}
+
+	asm volatile ("pshufb %1, %%xmm0\n"
+				  "movdqu %%xmm0, (%0)\n"
+				  : : "r" (x), "m" (se_bswap_mask)
+				  : "memory");
+}
+
+// 4-bit table GHASH multiplication x = x * H (portable version)
+static void SeGhashMult4bit(UCHAR *x, UINT64 htable[16][2])
+{
+	static const UINT64 rem_4bit[16] =
+	{
+		0x0000ULL << 48, 0x1C20ULL << 48, 0x3840ULL << 48, 0x2460ULL << 48,
+		0x7080ULL << 48, 0x6CA0ULL << 48, 0x48C0ULL << 48, 0x54E0ULL << 48,
+		0xE100ULL << 48, 0xFD20ULL << 48, 0xD940ULL << 48, 0xC560ULL << 48,
+		0x9180ULL << 48, 0x8DA0ULL << 48, 0xA9C0ULL << 48, 0xB5E0ULL << 48,
+	};
+	UINT64 zh, zl;
+	UINT rem, nlo, nhi;
+	int cnt = 15;
+	UINT i;
+
+	nlo = x[15];
+	nhi = nlo >> 4;
+	nlo &= 0xf;
+
+	zh = htable[nlo][0];
+	zl = htable[nlo][1];
+
+	while (true)
+	{
+		rem = (UINT)zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ rem_4bit[rem];
+		zh ^= htable[nhi][0];
+		zl ^= htable[nhi][1];
+
+		if (--cnt < 0)
+		{
+			break;
+		}
+
+		nlo = x[cnt];
+		nhi = nlo >> 4;
+		nlo &= 0xf;
+
+		rem = (UINT)zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ rem_4bit[rem];
+		zh ^= htable[nlo][0];
+		zl ^= htable[nlo][1];
+	}
+
+	for (i = 0;i < 8;i++)
+	{
+		x[i] = (UCHAR)(zh >> (56 - i * 8));
+		x[i + 8] = (UCHAR)(zl >> (56 - i * 8));
+	}
+}
+
+// Build the 4-bit GHASH table from H
+static void SeGhashInit4bit(UINT64 htable[16][2], UCHAR *h)
+{
+	UINT64 vh = 0, vl = 0;
+	UINT i, j;
+
+	for (i = 0;i < 8;i++)
+	{
+		vh = (vh << 8) | h[i];
+		vl = (vl << 8) | h[i + 8];
+	}
+
+	htable[0][0] = htable[0][1] = 0;
+	htable[8][0] = vh;
+	htable[8][1] = vl;
+	for (i = 4;i > 0;i >>= 1)
+	{
+		UINT64 t = 0xe100000000000000ULL & (0 - (vl & 1));
+
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ t;
+		htable[i][0] = vh;
+		htable[i][1] = vl;
+	}
+	for (i = 2;i < 16;i <<= 1)
+	{
+		for (j = 1;j < i;j++)
+		{
+			htable[i + j][0] = htable[i][0] ^ htable[j][0];
+			htable[i + j][1] = htable[i][1] ^ htable[j][1];
+		}
+	}
+}
+
+// XOR of two 16-byte blocks
+static void SeXorBlock(void *dst, void *a, void *b)
+{
+	UINT i;
+
+	for (i = 0;i < SE_AES_BLOCK_SIZE;i++)
+	{
+		((UCHAR *)dst)[i] = ((UCHAR *)a)[i] ^ ((UCHAR *)b)[i];
+	}
+}
+
+// Encrypt one AES block
+static void SeAesEncryptBlock(SE_AES_KEY *k, void *dst, void *src)
+{
+	if (k->UseAesNi)
+	{
+		SeAesNiEncryptBlock(dst, src, k->EncRoundKey, k->Rounds);
+	}
+	else
+	{
+		AES_encrypt(src, dst, k->EncryptKey);
+	}
+}
+
+// GHASH over data; a trailing partial block is zero padded
+static void SeGhash(SE_AES_GCM_KEY *k, UCHAR *x, void *data, UINT size)
+{
+	UCHAR *p = (UCHAR *)data;
+	UINT blocks = size / SE_AES_BLOCK_SIZE;
+	UINT rest = size % SE_AES_BLOCK_SIZE;
+	UCHAR tmp[SE_AES_BLOCK_SIZE];
+	UINT i;
+
+	if (k->UsePclmul)
+	{
+		if (blocks != 0)
+		{
+			SeGhashClmul(x, k->HSwap, p, blocks);
+		}
+	}
+	else
+	{
+		for (i = 0;i < blocks;i++)
+		{
+			SeXorBlock(x, x, p + i * SE_AES_BLOCK_SIZE);
+			SeGhashMult4bit(x, k->HTable);
+		}
+	}
+
+	if (rest != 0)
+	{
+		SeZero(tmp, sizeof(tmp));
+		SeCopy(tmp, p + blocks * SE_AES_BLOCK_SIZE, rest);
+
+		if (k->UsePclmul)
+		{
+			SeGhashClmul(x, k->HSwap, tmp, 1);
+		}
+		else
+		{
+			SeXorBlock(x, x, tmp);
+			SeGhashMult4bit(x, k->HTable);
+		}
+	}
+}
+
+// Compute the GCM tag over aad and the ciphertext
+static void SeAesGcmTag(SE_AES_GCM_KEY *k, void *tag, UCHAR *j0, void *aad, UINT aad_size,
+						void *c, UINT size)
+{
+	UCHAR x[SE_AES_BLOCK_SIZE];
+	UCHAR len[SE_AES_BLOCK_SIZE];
+	UINT64 aad_bits = (UINT64)aad_size * 8, c_bits = (UINT64)size * 8;
+	UINT i;
+
+	SeZero(x, sizeof(x));
+	SeGhash(k, x, aad, aad_size);
+	SeGhash(k, x, c, size);
+
+	for (i = 0;i < 8;i++)
+	{
+		len[i] = (UCHAR)(aad_bits >> (56 - i * 8));
+		len[i + 8] = (UCHAR)(c_bits >> (56 - i * 8));
+	}
+	SeGhash(k, x, len, sizeof(len));
+
+	SeAesEncryptBlock(k->AesKey, len, j0);
+	SeXorBlock(tag, x, len);
+}
+
+// AES-CTR with the 32-bit counter of GCM starting after j0
+static void SeAesGcmCtr(SE_AES_GCM_KEY *k, UCHAR *dst, UCHAR *src, UINT size, UCHAR *j0)
+{
+	UCHAR ctr[SE_AES_BLOCK_SIZE];
+	UCHAR ks[SE_AES_BLOCK_SIZE];
+	UINT n = SeEndian32(*(UINT *)(j0 + 12));
+	UINT i, len;
+
+	SeCopy(ctr, j0, SE_AES_BLOCK_SIZE);
+
+	while (size > 0)
+	{
+		UINT n_be = SeEndian32(++n);
+
+		SeCopy(ctr + 12, &n_be, sizeof(UINT));
+		SeAesEncryptBlock(k->AesKey, ks, ctr);
+
+		len = MIN(size, SE_AES_BLOCK_SIZE);
+		for (i = 0;i < len;i++)
+		{
+			dst[i] = src[i] ^ ks[i];
+		}
+
+		dst += len;
+		src += len;
+		size -= len;
+	}
+}
+
+// Build the pre-counter block salt || iv || 1
+static void SeAesGcmJ0(SE_AES_GCM_KEY *k, UCHAR *j0, void *iv)
+{
+	SeCopy(j0, k->Salt, SE_AES_GCM_SALT_SIZE);
+	SeCopy(j0 + SE_AES_GCM_SALT_SIZE, iv, SE_AES_GCM_IV_SIZE);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+}
+
+// AES-GCM encryption (RFC 4106).  dest may be equal to src.
+void SeAesGcmEncrypt(void *dest, void *src, UINT size, SE_AES_GCM_KEY *key, void *iv,
+					 void *aad, UINT aad_size, void *tag)
+{
+	UCHAR j0[SE_AES_BLOCK_SIZE];
+	UCHAR save[SE_SIMD_SAVE_SIZE] __attribute__ ((aligned (16)));
+	unsigned long flags = 0;
+	bool simd;
+	// 引数チェック
+	if (dest == NULL || src == NULL || key == NULL || iv == NULL || tag == NULL)
+	{
+		return;
+	}
+
+	simd = key->AesKey->UseAesNi || key->UsePclmul;
+	if (simd)
+	{
+		flags = SeSimdBegin(save);
+	}
+
+	SeAesGcmJ0(key, j0, iv);
+	SeAesGcmCtr(key, dest, src, size, j0);
+	SeAesGcmTag(key, tag, j0, aad, aad_size, dest, size);
+
+	if (simd)
+	{
+		SeSimdEnd(save, flags);
+	}
+}
+
+// AES-GCM decryption (RFC 4106).  The tag is verified before anything
+// is decrypted; false is returned if it does not match.
+bool SeAesGcmDecrypt(void *dest, void *src, UINT size, SE_AES_GCM_KEY *key, void *iv,
+					 void *aad, UINT aad_size, void *tag)
+{
+	UCHAR j0[SE_AES_BLOCK_SIZE];
+	UCHAR tag2[SE_AES_GCM_ICV_SIZE];
+	UCHAR save[SE_SIMD_SAVE_SIZE] __attribute__ ((aligned (16)));
+	unsigned long flags = 0;
+	bool simd;
+	UCHAR diff = 0;
+	UINT i;
+	// 引数チェック
+	if (dest == NULL || src == NULL || key == NULL || iv == NULL || tag == NULL)
+	{
+		return false;
+	}
+
+	simd = key->AesKey->UseAesNi || key->UsePclmul;
+	if (simd)
+	{
+		flags = SeSimdBegin(save);
+	}
+
+	SeAesGcmJ0(key, j0, iv);
+	SeAesGcmTag(key, tag2, j0, aad, aad_size, src, size);
+	for (i = 0;i < SE_AES_GCM_ICV_SIZE;i++)
+	{
+		diff |= tag2[i] ^ ((UCHAR *)tag)[i];
+	}
+	if (diff == 0)
+	{
+		SeAesGcmCtr(key, dest, src, size, j0);
+	}
+
+	if (simd)
+	{
+		SeSimdEnd(save, flags);
+	}
+
+	return (diff == 0);
+}
+
+// AES-GCM 鍵の作成
+SE_AES_GCM_KEY *SeAesGcmNewKey(void *key, UINT key_size, void *salt)
+{
+	SE_AES_GCM_KEY *k;
+	UCHAR zero[SE_AES_BLOCK_SIZE];
+	UCHAR h[SE_AES_BLOCK_SIZE];
+	UCHAR save[SE_SIMD_SAVE_SIZE] __attribute__ ((aligned (16)));
+	unsigned long flags;
+	UINT i;
+	// 引数チェック
+	if (key == NULL || salt == NULL)
+	{
+		return NULL;
+	}
+
+	k = SeZeroMalloc(sizeof(SE_AES_GCM_KEY));
+	k->AesKey = SeAesNewKey(key, key_size);
+	if (k->AesKey == NULL)
+	{
+		SeFree(k);
+		return NULL;
+	}
+	SeCopy(k->Salt, salt, SE_AES_GCM_SALT_SIZE);
+	k->UsePclmul = rt->CpuPclmul;
+
+	SeZero(zero, sizeof(zero));
+	if (k->AesKey->UseAesNi)
+	{
+		flags = SeSimdBegin(save);
+		SeAesEncryptBlock(k->AesKey, h, zero);
+		SeSimdEnd(save, flags);
+	}
+	else
+	{
+		SeAesEncryptBlock(k->AesKey, h, zero);
+	}
+
+	SeGhashInit4bit(k->HTable, h);
+	for (i = 0;i < SE_AES_BLOCK_SIZE;i++)
+	{
+		k->HSwap[i] = h[SE_AES_BLOCK_SIZE - 1 - i];
+	}
+
+	return k;
+}
+
+// AES-GCM 鍵の解放
+void SeAesGcmFreeKey(SE_AES_GCM_KEY *k)
+{
+	// 引数チェック
+	if (k == NULL)
+	{
+		return;
+	}
+
+	SeAesFreeKey(k->AesKey);
+	SeFree(k);
+}
+
+// AES-CBC 暗号化
+void SeAesEncrypt(void *dest, void *src, UINT size, SE_AES_KEY *key, void *ivec)
+{
+	UCHAR ivec_copy[SE_AES_IV_SIZE];
+	UCHAR save[SE_SIMD_SAVE_SIZE] __attribute__ ((aligned (16)));
+	unsigned long flags;
+	UCHAR *d = (UCHAR *)dest, *s = (UCHAR *)src;
+	UINT i;
+	// 引数チェック
+	if (dest == NULL || src == NULL || size == 0 || key == NULL || ivec == NULL)
+	{
+		return;
+	}
+
+	SeCopy(ivec_copy, ivec, SE_AES_IV_SIZE);
+
+	if (key->UseAesNi == false)
+	{
+		AES_cbc_encrypt(src, dest, size, key->EncryptKey, ivec_copy, AES_ENCRYPT);
+		return;
+	}
+
+	flags = SeSimdBegin(save);
+	for (i = 0;i < size;i += SE_AES_BLOCK_SIZE)
+	{
+		SeXorBlock(ivec_copy, ivec_copy, s + i);
+		SeAesNiEncryptBlock(d + i, ivec_copy, key->EncRoundKey, key->Rounds);
+		SeCopy(ivec_copy, d + i, SE_AES_BLOCK_SIZE);
+	}
+	SeSimdEnd(save, flags);
+}
+
+// AES-CBC 解読
+void SeAesDecrypt(void *dest, void *src, UINT size, SE_AES_KEY *key, void *ivec)
+{
+	UCHAR ivec_copy[SE_AES_IV_SIZE];
+	UCHAR c[SE_AES_BLOCK_SIZE];
+	UCHAR save[SE_SIMD_SAVE_SIZE] __attribute__ ((aligned (16)));
+	unsigned long flags;
+	UCHAR *d = (UCHAR *)dest, *s = (UCHAR *)src;
+	UINT i;
+	// 引数チェック
+	if (dest == NULL || src == NULL || size == 0 || key == NULL || ivec == NULL)
+	{
+		return;
+	}
+
+	SeCopy(ivec_copy, ivec, SE_AES_IV_SIZE);
+
+	if (key->UseAesNi == false)
+	{
+		AES_cbc_encrypt(src, dest, size, key->DecryptKey, ivec_copy, AES_DECRYPT);
+		return;
+	}
+
+	flags = SeSimdBegin(save);
+	for (i = 0;i < size;i += SE_AES_BLOCK_SIZE)
+	{
+		SeCopy(c, s + i, SE_AES_BLOCK_SIZE);
+		SeAesNiDecryptBlock(d + i, c, key->DecRoundKey, key->Rounds);
+		SeXorBlock(d + i, d + i, ivec_copy);
+		SeCopy(ivec_copy, c, SE_AES_BLOCK_SIZE);
+	}
+	SeSimdEnd(save, flags);
+}
+
+// Convert an OpenSSL key schedule to the AES-NI byte order
+static void SeAesNiRoundKey(UCHAR *dst, AES_KEY *k)
+{
+	UINT i;
+
+	for (i = 0;i < 4 * ((UINT)k->rounds + 1);i++)
+	{
+		UINT w = k->rd_key[i];
+
+		dst[i * 4 + 0] = (UCHAR)(w >> 24);
+		dst[i * 4 + 1] = (UCHAR)(w >> 16);
+		dst[i * 4 + 2] = (UCHAR)(w >> 8);
+		dst[i * 4 + 3] = (UCHAR)w;
+	}
+}
+
+// AES 鍵の作成
+SE_AES_KEY *SeAesNewKey(void *key, UINT key_size)
+{
+	SE_AES_KEY *k;
+	// 引数チェック
+	if (key == NULL || (key_size != SE_AES128_KEY_SIZE && key_size != SE_AES256_KEY_SIZE))
+	{
+		return NULL;
+	}
+
+	k = SeZeroMalloc(sizeof(SE_AES_KEY));
+	k->KeySize = key_size;
+	k->EncryptKey = SeZeroMalloc(sizeof(AES_KEY));
+	k->DecryptKey = SeZeroMalloc(sizeof(AES_KEY));
+
+	AES_set_encrypt_key(key, key_size * 8, k->EncryptKey);
+	AES_set_decrypt_key(key, key_size * 8, k->DecryptKey);
+	k->Rounds = k->EncryptKey->rounds;
+
+	// The decryption schedule of OpenSSL is already in the "equivalent
+	// inverse cipher" form that AESDEC expects.
+	k->UseAesNi = rt->CpuAesNi;
+	SeAesNiRoundKey(k->EncRoundKey, k->EncryptKey);
+	SeAesNiRoundKey(k->DecRoundKey, k->DecryptKey);
+
+	return k;
+}
+
+// AES 鍵の解放
+void SeAesFreeKey(SE_AES_KEY *k)
+{
+	// 引数チェック
+	if (k == NULL)
+	{
+		return;
+	}
+
+	SeFree(k->EncryptKey);
+	SeFree(k->DecryptKey);
+	SeFree(k);
+}
+
+// HMAC 鍵の作成.  hash_size selects SHA-1 or SHA-256.
+SE_HMAC_KEY *SeHmacNewKey(UINT hash_size, void *key, UINT key_size)
+{
+	SE_HMAC_KEY *k;
+	UCHAR key_plus[SE_SHA256_BLOCK_SIZE];
+	UCHAR ipad[SE_SHA256_BLOCK_SIZE];
+	UCHAR opad[SE_SHA256_BLOCK_SIZE];
+	UINT i;
+	// 引数チェック
+	if (key == NULL ||
+		(hash_size != SE_SHA1_HASH_SIZE && hash_size != SE_SHA256_HASH_SIZE))
+	{
+		return NULL;
+	}
+
+	SeZero(key_plus, sizeof(key_plus));
+	if (key_size <= sizeof(key_plus))
+	{
+		SeCopy(key_plus, key, key_size);
+	}
+	else if (hash_size == SE_SHA1_HASH_SIZE)
+	{
+		SeSha1(key_plus, key, key_size);
+	}
+	else
+	{
+		SHA256(key, key_size, key_plus);
+	}
+
+	for (i = 0;i < sizeof(key_plus);i++)
+	{
+		ipad[i] = key_plus[i] ^ 0x36;
+		opad[i] = key_plus[i] ^ 0x5c;
+	}
+
+	k = SeZeroMalloc(sizeof(SE_HMAC_KEY));
+	k->HashSize = hash_size;
+
+	if (hash_size == SE_SHA1_HASH_SIZE)
+	{
+		k->Sha1Inner = SeZeroMalloc(sizeof(SHA_CTX));
+		k->Sha1Outer = SeZeroMalloc(sizeof(SHA_CTX));
+		SHA1_Init(k->Sha1Inner);
+		SHA1_Update(k->Sha1Inner, ipad, sizeof(ipad));
+		SHA1_Init(k->Sha1Outer);
+		SHA1_Update(k->Sha1Outer, opad, sizeof(opad));
+	}
+	else
+	{
+		k->Sha256Inner = SeZeroMalloc(sizeof(SHA256_CTX));
+		k->Sha256Outer = SeZeroMalloc(sizeof(SHA256_CTX));
+		SHA256_Init(k->Sha256Inner);
+		SHA256_Update(k->Sha256Inner, ipad, sizeof(ipad));
+		SHA256_Init(k->Sha256Outer);
+		SHA256_Update(k->Sha256Outer, opad, sizeof(opad));
+	}
+
+	return k;
+}
+
+// HMAC 鍵の解放
+void SeHmacFreeKey(SE_HMAC_KEY *k)
+{
+	// 引数チェック
+	if (k == NULL)
+	{
+		return;
+	}
+
+	SeFree(k->Sha1Inner);
+	SeFree(k->Sha1Outer);
+	SeFree(k->Sha256Inner);
+	SeFree(k->Sha256Outer);
+	SeFree(k);
+}
+
+// HMAC の計算.  dst receives the full k->HashSize bytes.
+void SeHmac(void *dst, SE_HMAC_KEY *k, void *data, UINT data_size)
+{
+	UCHAR inner[SE_SHA256_HASH_SIZE];
+	// 引数チェック
+	if (dst == NULL || k == NULL || data == NULL)
+	{
+		return;
+	}
+
+	if (k->HashSize == SE_SHA1_HASH_SIZE)
+	{
+		SHA_CTX c;
+
+		c = *k->Sha1Inner;
+		SHA1_Update(&c, data, data_size);
+		SHA1_Final(inner, &c);
+		c = *k->Sha1Outer;
+		SHA1_Update(&c, inner, SE_SHA1_HASH_SIZE);
+		SHA1_Final(dst, &c);
+	}
+	else
+	{
+		SHA256_CTX c;
+
+		c = *k->Sha256Inner;
+		SHA256_Update(&c, data, data_size);
+		SHA256_Final(inner, &c);
+		c = *k->Sha256Outer;
+		SHA256_Update(&c, inner, SE_SHA256_HASH_SIZE);
+		SHA256_Final(dst, &c);
+	}
+}
+
 // ランダムな 3DES 鍵の生成
 SE_DES_KEY *SeDes3RandKey()
 {
@@ -1789,9 +2524,30 @@ bool SeRand1()
 	return ((SeRand8() & 1) == 0 ? false : true);
 }
 
+// Detect AES-NI and PCLMULQDQ (the latter is used with PSHUFB, so SSSE3
+// is required as well)
+static void SeCheckCpuCrypto()
+{
+#ifndef	VPN_PD
+	UINT a = 1, b, c, d;
+
+	asm volatile ("cpuid" : "+a" (a), "=b" (b), "=c" (c), "=d" (d));
+
+	rt->CpuAesNi = (c & (1 << 25)) ? true : false;
+	rt->CpuPclmul = ((c & (1 << 1)) && (c & (1 << 9))) ? true : false;
+#else	// VPN_PD
+	// A protection domain can neither disable interrupts nor is its
+	// SSE state saved for it, so the portable code is used there.
+	rt->CpuAesNi = false;
+	rt->CpuPclmul = false;
+#endif	// VPN_PD
+}
+
 // 初期化
 void SeInitCrypto(bool init_openssl)
 {
+	SeCheckCpuCrypto();
+
 	if (init_openssl)
 	{
 		char tmp[16];
@@ -45,6 +45,14 @@
 #define	SE_DES_IV_SIZE					8			// DES IV サイズ
 #define SE_DES_BLOCK_SIZE				8			// DES ブロックサイズ
 #define SE_3DES_KEY_SIZE				(8 * 3)		// 3DES 鍵サイズ
+#define SE_AES128_KEY_SIZE				16			// AES-128 key size
+#define SE_AES256_KEY_SIZE				32			// AES-256 key size
+#define SE_AES_IV_SIZE					16			// AES-CBC IV size
+#define SE_AES_BLOCK_SIZE				16			// AES block size
+#define SE_AES_MAX_ROUNDS				14			// AES-256 round count
+#define SE_AES_GCM_SALT_SIZE			4			// AES-GCM salt size (RFC 4106)
+#define SE_AES_GCM_IV_SIZE				8			// AES-GCM explicit IV size (RFC 4106)
+#define SE_AES_GCM_ICV_SIZE				16			// AES-GCM ICV size
 #define SE_RSA_KEY_SIZE					128			// RSA 鍵サイズ
 #define SE_DH_KEY_SIZE					128			// DH 鍵サイズ
 #define	SE_RSA_MIN_SIGN_HASH_SIZE		(15 + SE_SHA1_HASH_SIZE)	// 最小 RSA ハッシュサイズ
@@ -55,6 +63,10 @@
 #define SE_HMAC_SHA1_96_KEY_SIZE		20			// HMAC-SHA-1-96 鍵サイズ
 #define SE_HMAC_SHA1_96_HASH_SIZE		12			// HMAC-SHA-1-96 ハッシュサイズ
 #define SE_HMAC_SHA1_SIZE				(SE_SHA1_HASH_SIZE)	// HMAC-SHA-1 ハッシュサイズ
+#define SE_SHA256_HASH_SIZE				32			// SHA-256 hash size
+#define SE_SHA256_BLOCK_SIZE			64			// SHA-256 block size
+#define SE_HMAC_SHA256_128_KEY_SIZE		32			// HMAC-SHA-256-128 key size
+#define SE_HMAC_SHA256_128_HASH_SIZE	16			// HMAC-SHA-256-128 hash size (RFC 4868)
 
 #define SE_DH_GROUP2_PRIME_1024 \
 	"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1" \
@@ -95,6 +107,39 @@ struct SE_DES_KEY
 	SE_DES_KEY_VALUE *k1, *k2, *k3;
 };
 
+// AES key.  The AES-NI round keys are kept in the byte order the
+// AESENC/AESDEC instructions expect.
+struct SE_AES_KEY
+{
+	UINT KeySize;
+	UINT Rounds;
+	bool UseAesNi;
+	AES_KEY *EncryptKey;
+	AES_KEY *DecryptKey;
+	UCHAR EncRoundKey[SE_AES_BLOCK_SIZE * (SE_AES_MAX_ROUNDS + 1)];
+	UCHAR DecRoundKey[SE_AES_BLOCK_SIZE * (SE_AES_MAX_ROUNDS + 1)];
+};
+
+// AES-GCM key.  H is the GHASH key E(K, 0^128); HTable holds its 4-bit
+// multiples for the portable GHASH, HSwap its byte-reversed form for
+// PCLMULQDQ.
+struct SE_AES_GCM_KEY
+{
+	SE_AES_KEY *AesKey;
+	UCHAR Salt[SE_AES_GCM_SALT_SIZE];
+	bool UsePclmul;
+	UINT64 HTable[16][2];
+	UCHAR HSwap[SE_AES_BLOCK_SIZE];
+};
+
+// HMAC key with precomputed inner and outer hash states
+struct SE_HMAC_KEY
+{
+	UINT HashSize;
+	SHA_CTX *Sha1Inner, *Sha1Outer;
+	SHA256_CTX *Sha256Inner, *Sha256Outer;
+};
+
 // DH
 struct SE_DH
 {
@@ -127,6 +172,21 @@ SE_DES_KEY *SeDesRandKey();
 void SeDes3Encrypt(void *dest, void *src, UINT size, SE_DES_KEY *key, void *ivec);
 void SeDes3Decrypt(void *dest, void *src, UINT size, SE_DES_KEY *key, void *ivec);
 
+SE_AES_KEY *SeAesNewKey(void *key, UINT key_size);
+void SeAesFreeKey(SE_AES_KEY *k);
+void SeAesEncrypt(void *dest, void *src, UINT size, SE_AES_KEY *key, void *ivec);
+void SeAesDecrypt(void *dest, void *src, UINT size, SE_AES_KEY *key, void *ivec);
+SE_AES_GCM_KEY *SeAesGcmNewKey(void *key, UINT key_size, void *salt);
+void SeAesGcmFreeKey(SE_AES_GCM_KEY *k);
+void SeAesGcmEncrypt(void *dest, void *src, UINT size, SE_AES_GCM_KEY *key, void *iv,
+					 void *aad, UINT aad_size, void *tag);
+bool SeAesGcmDecrypt(void *dest, void *src, UINT size, SE_AES_GCM_KEY *key, void *iv,
+					 void *aad, UINT aad_size, void *tag);
+
+SE_HMAC_KEY *SeHmacNewKey(UINT hash_size, void *key, UINT key_size);
+void SeHmacFreeKey(SE_HMAC_KEY *k);
+void SeHmac(void *dst, SE_HMAC_KEY *k, void *data, UINT data_size);
+
 void SeSha1(void *dst, void *src, UINT size);
 void SeMd5(void *dst, void *src, UINT size);
 void SeMacSha1(void *dst, void *key, UINT key_size, void *data, UINT data_size);
@@ -92,6 +92,37 @@ UINT SeIkePhase2CryptIdToKeySize(UCHAR id)
 		return SE_DES_KEY_SIZE;
 	}
 
+	// AES has a variable key size, see SeIkeStrToPhase2KeySize()
+	return 0;
+}
+
+// Key size in bytes of a phase 2 algorithm name
+UINT SeIkeStrToPhase2KeySize(char *name)
+{
+	if (SeStrCmpi(name, "AES128") == 0 || SeStrCmpi(name, "AES128-GCM") == 0)
+	{
+		return SE_AES128_KEY_SIZE;
+	}
+	else if (SeStrCmpi(name, "AES256") == 0 || SeStrCmpi(name, "AES256-GCM") == 0)
+	{
+		return SE_AES256_KEY_SIZE;
+	}
+
+	return SeIkePhase2CryptIdToKeySize(SeIkeStrToPhase2CryptId(name));
+}
+
+// Authentication key size of a phase 2 HMAC algorithm
+UINT SeIkePhase2HashIdToKeySize(UCHAR id)
+{
+	switch (id)
+	{
+	case SE_IKE_P2_HMAC_SHA1:
+		return SE_HMAC_SHA1_96_KEY_SIZE;
+
+	case SE_IKE_P2_HMAC_SHA2_256:
+		return SE_HMAC_SHA256_128_KEY_SIZE;
+	}
+
 	return 0;
 }
 
@@ -139,7 +170,15 @@ UCHAR SeIkeStrToPhase1HashId(char *name)
 }
 UCHAR SeIkeStrToPhase2CryptId(char *name)
 {
-	if (SeStartWith(name, "3DES") || SeStartWith("3DES", name))
+	if (SeStrCmpi(name, "AES128-GCM") == 0 || SeStrCmpi(name, "AES256-GCM") == 0)
+	{
+		return SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16;
+	}
+	else if (SeStrCmpi(name, "AES128") == 0 || SeStrCmpi(name, "AES256") == 0)
+	{
+		return SE_IKE_TRANSFORM_ID_P2_ESP_AES;
+	}
+	else if (SeStartWith(name, "3DES") || SeStartWith("3DES", name))
 	{
 		return SE_IKE_TRANSFORM_ID_P2_ESP_3DES;
 	}
@@ -158,6 +197,10 @@ UCHAR SeIkeStrToPhase2HashId(char *name)
 	{
 		return SE_IKE_P2_HMAC_SHA1;
 	}
+	else if (SeStrCmpi(name, "SHA-256") == 0)
+	{
+		return SE_IKE_P2_HMAC_SHA2_256;
+	}
 
 	return 0;
 }
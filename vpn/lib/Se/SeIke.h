@@ -137,6 +137,8 @@ struct SE_IKE_TRANSFORM_HEADER
 // IKE トランスフォームペイロードヘッダにおけるトランスフォーム ID (フェーズ 2)
 #define SE_IKE_TRANSFORM_ID_P2_ESP_DES			2	// DES-CBC
 #define SE_IKE_TRANSFORM_ID_P2_ESP_3DES			3	// 3DES-CBC
+#define SE_IKE_TRANSFORM_ID_P2_ESP_AES			12	// AES-CBC (RFC 3602)
+#define SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16	20	// AES-GCM, 16 byte ICV (RFC 4106)
 
 // IKE トランスフォーム値 (固定長)
 struct SE_IKE_TRANSFORM_VALUE
@@ -183,6 +185,7 @@ struct SE_IKE_TRANSFORM_VALUE
 
 // フェーズ 2: IKE トランスフォーム値における HMAC アルゴリズム
 #define SE_IKE_P2_HMAC_SHA1						2
+#define SE_IKE_P2_HMAC_SHA2_256					5	// HMAC-SHA-256-128 (RFC 4868)
 
 // フェーズ 2: IKE トランスフォーム値における DH グループ番号
 #define SE_IKE_P2_DH_GROUP_1024_MODP			2
@@ -482,6 +485,8 @@ UCHAR SeIkeStrToPhase2HashId(char *name);
 SE_BUF *SeIkeStrToPassword(char *str);
 UINT SeIkePhase1CryptIdToKeySize(UCHAR id);
 UINT SeIkePhase2CryptIdToKeySize(UCHAR id);
+UINT SeIkeStrToPhase2KeySize(char *name);
+UINT SeIkePhase2HashIdToKeySize(UCHAR id);
 
 
 #endif	// SEIKE_H
@@ -91,6 +91,8 @@ struct SE_ROOT
 {
 	SE_SYSCALL_TABLE *SysCall;							// システムコールテーブル
 	bool OpenSslInited;									// OpenSSL を初期化したかどうか
+	bool CpuAesNi;										// CPU supports AES-NI
+	bool CpuPclmul;										// CPU supports PCLMULQDQ
 	SE_LOCK *TickLock;									// Tick 値関係のロック
 	UINT LastTick;										// 前回の Tick 値
 	UINT TickRoundCounter;								// Tick 値の周回カウンタ
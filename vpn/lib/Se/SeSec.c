@@ -1029,14 +1029,14 @@ void SeSecProcessIkeSaMsgPhase2(SE_SEC *s, SE_IKE_SA *sa, SE_IKE_PACKET *packet_
 							sa->MySpi,
 							sa->Phase2MyRand,
 							sa->Phase2YourRand,
-							SeIkePhase2CryptIdToKeySize(config->VpnPhase2Crypto) + SE_HMAC_SHA1_96_KEY_SIZE);
+							SeSecGetKeymatSize(config));
 
 						sa->YourKEYMAT = SeSecCalcKEYMAT(sa->P1KeySet.SKEYID_d,
 							SE_IKE_PROTOCOL_ID_IPSEC_ESP,
 							sa->YourSpi,
 							sa->Phase2MyRand,
 							sa->Phase2YourRand,
-							SeIkePhase2CryptIdToKeySize(config->VpnPhase2Crypto) + SE_HMAC_SHA1_96_KEY_SIZE);
+							SeSecGetKeymatSize(config));
 
 						SeCopy(sa->Phase2Iv, cparam.NextIv, SE_DES_BLOCK_SIZE);
 
@@ -1079,12 +1079,106 @@ void SeSecFreeIPsecSa(SE_SEC *s, SE_IPSEC_SA *sa)
 	SeFreeBuf(sa->EncryptionKey);
 	SeFreeBuf(sa->HashKey);
 	SeDes3FreeKey(sa->DesKey);
+	SeAesFreeKey(sa->AesKey);
+	SeAesGcmFreeKey(sa->GcmKey);
+	SeHmacFreeKey(sa->HmacKey);
+	SeFree(sa->Buf);
+
+	if (sa->Outgoing == false)
+	{
+		// ハッシュ表から削除
+		SE_IPSEC_SA **pp = &s->IPsecSaHash[SeSecIPsecSaHash(sa->Spi)];
+
+		while (*pp != NULL && *pp != sa)
+		{
+			pp = &(*pp)->HashNext;
+		}
+
+		if (*pp != NULL)
+		{
+			*pp = sa->HashNext;
+		}
+	}
 
 	SeDelete(s->IPsecSaList, sa);
 
 	SeFree(sa);
 }
 
+// ESP パケットバッファの取得 (必要に応じて拡張)
+UCHAR *SeSecGetIPsecSaBuf(SE_IPSEC_SA *sa, UINT size)
+{
+	// 引数チェック
+	if (sa == NULL)
+	{
+		return NULL;
+	}
+
+	if (sa->BufSize < size)
+	{
+		SeFree(sa->Buf);
+		sa->BufSize = size;
+		sa->Buf = SeMalloc(sa->BufSize);
+	}
+
+	return sa->Buf;
+}
+
+// ESP の CBC 暗号化 (in place)
+void SeSecEspEncrypt(SE_IPSEC_SA *sa, void *data, UINT size, void *iv)
+{
+	// 引数チェック
+	if (sa == NULL || data == NULL || iv == NULL)
+	{
+		return;
+	}
+
+	if (sa->AesKey != NULL)
+	{
+		SeAesEncrypt(data, data, size, sa->AesKey, iv);
+	}
+	else
+	{
+		SeDes3Encrypt(data, data, size, sa->DesKey, iv);
+	}
+}
+
+// ESP の CBC 解読
+void SeSecEspDecrypt(SE_IPSEC_SA *sa, void *dest, void *src, UINT size, void *iv)
+{
+	// 引数チェック
+	if (sa == NULL || dest == NULL || src == NULL || iv == NULL)
+	{
+		return;
+	}
+
+	if (sa->AesKey != NULL)
+	{
+		SeAesDecrypt(dest, src, size, sa->AesKey, iv);
+	}
+	else
+	{
+		SeDes3Decrypt(dest, src, size, sa->DesKey, iv);
+	}
+}
+
+// KEYMAT のサイズ (暗号化鍵 + 認証鍵または GCM の salt)
+UINT SeSecGetKeymatSize(SE_SEC_CONFIG *config)
+{
+	// 引数チェック
+	if (config == NULL)
+	{
+		return 0;
+	}
+
+	if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16)
+	{
+		return config->VpnPhase2KeySize + SE_AES_GCM_SALT_SIZE;
+	}
+
+	return config->VpnPhase2KeySize + SeIkePhase2HashIdToKeySize(config->VpnPhase2Hash);
+}
+
 // IPsec SA の確立
 SE_IPSEC_SA *SeSecNewIPsecSa(SE_SEC *s, SE_IKE_SA *ike_sa, bool outgoing, UINT spi,
 							 SE_IKE_IP_ADDR src_addr, SE_IKE_IP_ADDR dest_addr,
@@ -1109,23 +1203,66 @@ SE_IPSEC_SA *SeSecNewIPsecSa(SE_SEC *s, SE_IKE_SA *ike_sa, bool outgoing, UINT s
 	sa->SrcAddr = src_addr;
 	sa->DestAddr = dest_addr;
 
-	sa->EncryptionKey = SeMemToBuf(((UCHAR *)keymat->Buf), SeIkePhase2CryptIdToKeySize(config->VpnPhase2Crypto));
-	sa->HashKey = SeMemToBuf(((UCHAR *)keymat->Buf) + SeIkePhase2CryptIdToKeySize(config->VpnPhase2Crypto), SE_HMAC_SHA1_96_KEY_SIZE);
+	sa->Crypto = config->VpnPhase2Crypto;
+	sa->EncryptionKey = SeMemToBuf(((UCHAR *)keymat->Buf), config->VpnPhase2KeySize);
 
-	if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_3DES)
+	if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16)
 	{
-		// 3DES
-		sa->DesKey = SeDes3NewKey(
-			((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 0,
-			((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 1,
-			((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 2);
+		// AES-GCM: KEYMAT の後ろ 4 バイトは salt
+		sa->BlockSize = sizeof(UINT);
+		sa->IvSize = SE_AES_GCM_IV_SIZE;
+		sa->HashSize = SE_AES_GCM_ICV_SIZE;
+		sa->GcmKey = SeAesGcmNewKey(sa->EncryptionKey->Buf, sa->EncryptionKey->Size,
+			((UCHAR *)keymat->Buf) + config->VpnPhase2KeySize);
+		sa->GcmIv = SeRand64();
 	}
 	else
 	{
-		// DES
-		sa->DesKey = SeDesNewKey(sa->EncryptionKey->Buf);
+		UINT hash_key_size = SeIkePhase2HashIdToKeySize(config->VpnPhase2Hash);
+
+		sa->HashKey = SeMemToBuf(((UCHAR *)keymat->Buf) + config->VpnPhase2KeySize, hash_key_size);
+
+		if (config->VpnPhase2Hash == SE_IKE_P2_HMAC_SHA2_256)
+		{
+			sa->HashSize = SE_HMAC_SHA256_128_HASH_SIZE;
+			sa->HmacKey = SeHmacNewKey(SE_SHA256_HASH_SIZE, sa->HashKey->Buf, hash_key_size);
+		}
+		else
+		{
+			sa->HashSize = SE_HMAC_SHA1_96_HASH_SIZE;
+			sa->HmacKey = SeHmacNewKey(SE_SHA1_HASH_SIZE, sa->HashKey->Buf, hash_key_size);
+		}
+
+		if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_AES)
+		{
+			// AES-CBC
+			sa->BlockSize = SE_AES_BLOCK_SIZE;
+			sa->IvSize = SE_AES_IV_SIZE;
+			sa->AesKey = SeAesNewKey(sa->EncryptionKey->Buf, sa->EncryptionKey->Size);
+		}
+		else if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_3DES)
+		{
+			// 3DES
+			sa->BlockSize = SE_DES_BLOCK_SIZE;
+			sa->IvSize = SE_DES_IV_SIZE;
+			sa->DesKey = SeDes3NewKey(
+				((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 0,
+				((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 1,
+				((UCHAR *)sa->EncryptionKey->Buf) + SE_DES_KEY_SIZE * 2);
+		}
+		else
+		{
+			// DES
+			sa->BlockSize = SE_DES_BLOCK_SIZE;
+			sa->IvSize = SE_DES_IV_SIZE;
+			sa->DesKey = SeDesNewKey(sa->EncryptionKey->Buf);
+		}
 	}
 
+	// ESP パケットバッファ
+	sa->BufSize = SE_SEC_IPSEC_SA_BUF_SIZE;
+	sa->Buf = SeMalloc(sa->BufSize);
+
 	sa->EstablishedTick = SeSecTick(s);
 	if (config->VpnPhase2LifeSeconds != 0)
 	{
@@ -1134,9 +1271,45 @@ SE_IPSEC_SA *SeSecNewIPsecSa(SE_SEC *s, SE_IKE_SA *ike_sa, bool outgoing, UINT s
 
 	SeInsert(s->IPsecSaList, sa);
 
+	if (outgoing == false)
+	{
+		// 受信用 SA は SPI のハッシュ表にも登録する
+		UINT h = SeSecIPsecSaHash(spi);
+
+		sa->HashNext = s->IPsecSaHash[h];
+		s->IPsecSaHash[h] = sa;
+	}
+
 	return sa;
 }
 
+// SPI のハッシュ値
+UINT SeSecIPsecSaHash(UINT spi)
+{
+	return (spi ^ (spi >> 8) ^ (spi >> 16) ^ (spi >> 24)) & (SE_SEC_IPSEC_SA_HASH_SIZE - 1);
+}
+
+// SPI をキーとして受信用 IPsec SA の検索
+SE_IPSEC_SA *SeSecSearchInboundIPsecSa(SE_SEC *s, UINT spi)
+{
+	SE_IPSEC_SA *sa;
+	// 引数チェック
+	if (s == NULL)
+	{
+		return NULL;
+	}
+
+	for (sa = s->IPsecSaHash[SeSecIPsecSaHash(spi)];sa != NULL;sa = sa->HashNext)
+	{
+		if (sa->Spi == spi)
+		{
+			return sa;
+		}
+	}
+
+	return NULL;
+}
+
 // IKE SA フェーズ 2 クイックモード 要求送信処理
 void SeSecSendIkeSaMsgPhase2(SE_SEC *s, SE_IKE_SA *sa)
 {
@@ -1193,7 +1366,16 @@ void SeSecSendIkeSaMsgPhase2(SE_SEC *s, SE_IKE_SA *sa)
 
 		// トランスフォーム値リストの作成
 		transform_value_list = SeNewList(NULL);
-		SeAdd(transform_value_list, SeIkeNewTransformValue(SE_IKE_TRANSFORM_VALUE_P2_HMAC, config->VpnPhase2Hash));
+		if (config->VpnPhase2Crypto != SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16)
+		{
+			// AES-GCM は認証アルゴリズムを指定しない (RFC 4106)
+			SeAdd(transform_value_list, SeIkeNewTransformValue(SE_IKE_TRANSFORM_VALUE_P2_HMAC, config->VpnPhase2Hash));
+		}
+		if (config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_AES ||
+			config->VpnPhase2Crypto == SE_IKE_TRANSFORM_ID_P2_ESP_AES_GCM_16)
+		{
+			SeAdd(transform_value_list, SeIkeNewTransformValue(SE_IKE_TRANSFORM_VALUE_P2_KEY_SIZE, config->VpnPhase2KeySize * 8));
+		}
 		SeAdd(transform_value_list, SeIkeNewTransformValue(SE_IKE_TRANSFORM_VALUE_P2_LIFE_TYPE, SE_IKE_P1_LIFE_TYPE_SECONDS));
 		SeAdd(transform_value_list, SeIkeNewTransformValue(SE_IKE_TRANSFORM_VALUE_P2_LIFE, config->VpnPhase2LifeSeconds));
 		if (config->VpnPhase2LifeKilobytes != 0)
@@ -2252,6 +2434,9 @@ void SeSecProcessMain(SE_SEC *s)
 	// 定期的ポーリングの発生
 	SeSecDoInterval(s, &s->PoolingVar, SE_SEC_POLLING_INTERVAL);
 
+	// SA を削除する前に溜まっている ESP パケットを処理する
+	SeSecFlushEspRecv(s);
+
 	do
 	{
 		s->StatusChanged = false;
@@ -2541,6 +2726,9 @@ void SeSecUdpRecvCallback(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, U
 		return;
 	}
 
+	// IKE メッセージにより SA が削除される前に溜まっている ESP パケットを処理する
+	SeSecFlushEspRecv(s);
+
 	// IKE パース
 	packet_header = SeIkeParseHeader(data, size, NULL);
 	if (packet_header == NULL)
@@ -2612,93 +2800,198 @@ void SeSecUdpRecvCallback(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, U
 void SeSecEspRecvCallback(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, void *data, UINT size, void *param)
 {
 	SE_SEC *s = (SE_SEC *)param;
-	SE_SEC_CONFIG *config;
-	SE_IPSEC_SA *sa;
+	SE_SEC_ESP_PACKET *p;
 	// 引数チェック
-	if (s == NULL || data == NULL)
+	if (s == NULL || dest_addr == NULL || src_addr == NULL || data == NULL)
 	{
 		return;
 	}
 
-	config = &s->Config;
-	sa = SeSecGetIPsecSa(s, false);
-	if (sa == NULL)
+	// パケットはバッチに溜めておき SeSecFlushEspRecv() でまとめて処理する
+	if (s->NumEspRecvBatch >= SE_SEC_ESP_RECV_BATCH ||
+		(size > SE_SEC_ESP_RECV_SLOT_SIZE && s->NumEspRecvBatch != 0))
 	{
+		SeSecFlushEspRecv(s);
+	}
+
+	p = &s->EspRecvBatch[s->NumEspRecvBatch++];
+	p->SrcAddr = *src_addr;
+	p->DestAddr = *dest_addr;
+	p->Size = size;
+	p->Sa = NULL;
+	p->Seq = 0;
+
+	if (size > SE_SEC_ESP_RECV_SLOT_SIZE)
+	{
+		// スロットに入らない (再構築された) パケットはコピーせずに単独で処理する
+		p->Data = data;
+		SeSecFlushEspRecv(s);
 		return;
 	}
 
-	// ESP パケットの解析
-	if (SeCmp(&sa->DestAddr, src_addr, sizeof(SE_IKE_IP_ADDR)) == 0 &&
-		SeCmp(&sa->SrcAddr, dest_addr, sizeof(SE_IKE_IP_ADDR)) == 0)
+	p->Data = s->EspRecvBuf + (s->NumEspRecvBatch - 1) * SE_SEC_ESP_RECV_SLOT_SIZE;
+	SeCopy(p->Data, data, size);
+}
+
+// 溜まっている ESP パケットの一括処理
+void SeSecFlushEspRecv(SE_SEC *s)
+{
+	UINT i, num;
+	// 引数チェック
+	if (s == NULL)
 	{
-		UCHAR *esp = (UCHAR *)data;
-		UINT esp_size = size;
-		UINT enc_block_size = SE_DES_BLOCK_SIZE;
-		UINT enc_iv_size = SE_DES_IV_SIZE;
-		UINT hash_size = SE_HMAC_SHA1_96_HASH_SIZE;
+		return;
+	}
 
-		if (esp_size >= sizeof(UINT) + sizeof(UINT) + enc_iv_size + enc_block_size + hash_size)
+	num = s->NumEspRecvBatch;
+
+	// 先にバッチ全体を分類する: SPI で SA を検索し, 不正なパケットと
+	// リプレイされたパケットは解読する前に捨てる
+	for (i = 0;i < num;i++)
+	{
+		SE_SEC_ESP_PACKET *p = &s->EspRecvBatch[i];
+		UCHAR *esp = (UCHAR *)p->Data;
+		SE_IPSEC_SA *sa = NULL;
+
+		if (p->Size >= sizeof(UINT) + sizeof(UINT))
 		{
-			// SPI の検査
-			UINT *spi = (UINT *)((UCHAR *)esp);
+			sa = SeSecSearchInboundIPsecSa(s, *((UINT *)esp));
+		}
 
-			if (*spi == sa->Spi)
+		if (sa != NULL)
+		{
+			if (SeCmp(&sa->DestAddr, &p->SrcAddr, sizeof(SE_IKE_IP_ADDR)) != 0 ||
+				SeCmp(&sa->SrcAddr, &p->DestAddr, sizeof(SE_IKE_IP_ADDR)) != 0 ||
+				p->Size < sizeof(UINT) + sizeof(UINT) + sa->IvSize + sa->BlockSize + sa->HashSize)
 			{
-				// シーケンス番号
-				UINT *seq = (UINT *)(((UCHAR *)esp) + sizeof(UINT));
+				sa = NULL;
+			}
+			else
+			{
+				p->Seq = SeEndian32(*((UINT *)(esp + sizeof(UINT))));
 
-				// IV
-				UCHAR *iv = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT));
+				if (SeSecCheckReplay(sa, p->Seq) == false)
+				{
+					sa = NULL;
+				}
+			}
+		}
 
-				// データブロック
-				UCHAR *data_block = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT) + enc_iv_size);
+		p->Sa = sa;
+	}
 
-				// データブロックサイズの計算
-				UINT data_block_size = esp_size - (sizeof(UINT) + sizeof(UINT) + enc_iv_size + hash_size);
+	// 解読
+	for (i = 0;i < num;i++)
+	{
+		SE_SEC_ESP_PACKET *p = &s->EspRecvBatch[i];
 
-				if (data_block_size > 0 && ((data_block_size % enc_block_size) == 0))
-				{
-					// 認証データ
-					UCHAR *hash = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size);
-					UCHAR hash2[SE_HMAC_SHA1_96_HASH_SIZE];
+		if (p->Sa != NULL)
+		{
+			SeSecRecvEspPacket(s, p);
+		}
 
-					// ハッシュの計算
-					SeMacSha196(hash2, sa->HashKey->Buf, esp, esp_size - hash_size);
+		p->Data = NULL;
+	}
 
-					// ハッシュの比較
-					if (SeCmp(hash, hash2, SE_HMAC_SHA1_96_HASH_SIZE) == 0)
-					{
-						// データ本体の解読
-						UCHAR *payload_data = SeMalloc(data_block_size);
+	s->NumEspRecvBatch = 0;
+}
+
+// 分類済みの ESP パケットの解読
+void SeSecRecvEspPacket(SE_SEC *s, SE_SEC_ESP_PACKET *p)
+{
+	SE_IPSEC_SA *sa;
+	UCHAR *esp;
+	UINT esp_size;
+	UINT enc_block_size;
+	UINT enc_iv_size;
+	UINT hash_size;
+	// 引数チェック
+	if (s == NULL || p == NULL || p->Sa == NULL)
+	{
+		return;
+	}
 
-						UINT payload_size;
+	sa = p->Sa;
+	esp = (UCHAR *)p->Data;
+	esp_size = p->Size;
+	enc_block_size = sa->BlockSize;
+	enc_iv_size = sa->IvSize;
+	hash_size = sa->HashSize;
 
-						UCHAR *padding_size = payload_data + data_block_size - sizeof(UCHAR) * 2;
+	// 同じバッチ内の重複パケット
+	if (SeSecCheckReplay(sa, p->Seq) == false)
+	{
+		return;
+	}
 
-						UCHAR *next_header = padding_size + 1;
+	if (true)
+	{
+		// IV
+		UCHAR *iv = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT));
 
-						UCHAR next_header_2 = s->IPv6 ? 41 : 4;
+		// データブロック
+		UCHAR *data_block = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT) + enc_iv_size);
 
-						SeDes3Decrypt(payload_data, data_block, data_block_size,
-							sa->DesKey, iv);
+		// データブロックサイズの計算
+		UINT data_block_size = esp_size - (sizeof(UINT) + sizeof(UINT) + enc_iv_size + hash_size);
 
-						if (data_block_size >= (sizeof(UCHAR) * 2 + *padding_size))
-						{
-							// ペイロードサイズの計算
-							payload_size = data_block_size - (sizeof(UCHAR) * 2 + *padding_size);
+		if (data_block_size > 0 && ((data_block_size % enc_block_size) == 0))
+		{
+			// 認証データ
+			UCHAR *hash = (UCHAR *)(((UCHAR *)esp) + sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size);
 
-							// IP ヘッダ番号の確認
-							if (*next_header == next_header_2)
-							{
-								// 送信
-								SeSecSendVirtualIp(s, payload_data, payload_size);
+			// データ本体は SA のバッファに解読する
+			UCHAR *payload_data = SeSecGetIPsecSaBuf(sa, data_block_size);
+			bool ok;
 
-								sa->TransferBytes += payload_size;
-								sa->IkeSa->LastCommTick = SeSecTick(s);
-							}
-						}
+			if (sa->GcmKey != NULL)
+			{
+				// 認証と解読 (AAD は SPI とシーケンス番号)
+				ok = SeAesGcmDecrypt(payload_data, data_block, data_block_size,
+					sa->GcmKey, iv, esp, sizeof(UINT) + sizeof(UINT), hash);
+			}
+			else
+			{
+				UCHAR hash2[SE_SHA256_HASH_SIZE];
+
+				// ハッシュの計算
+				SeHmac(hash2, sa->HmacKey, esp, esp_size - hash_size);
+
+				// ハッシュの比較
+				ok = (SeCmp(hash, hash2, hash_size) == 0);
+
+				if (ok)
+				{
+					SeSecEspDecrypt(sa, payload_data, data_block, data_block_size, iv);
+				}
+			}
+
+			if (ok)
+			{
+				UINT payload_size;
+
+				UCHAR *padding_size = payload_data + data_block_size - sizeof(UCHAR) * 2;
+
+				UCHAR *next_header = padding_size + 1;
 
-						SeFree(payload_data);
+				UCHAR next_header_2 = s->IPv6 ? 41 : 4;
+
+				// 認証に成功したのでリプレイウィンドウを更新する
+				SeSecUpdateReplay(sa, p->Seq);
+
+				if (data_block_size >= (sizeof(UCHAR) * 2 + *padding_size))
+				{
+					// ペイロードサイズの計算
+					payload_size = data_block_size - (sizeof(UCHAR) * 2 + *padding_size);
+
+					// IP ヘッダ番号の確認
+					if (*next_header == next_header_2)
+					{
+						// 送信
+						SeSecSendVirtualIp(s, payload_data, payload_size);
+
+						sa->TransferBytes += payload_size;
+						sa->IkeSa->LastCommTick = SeSecTick(s);
 					}
 				}
 			}
@@ -2706,6 +2999,65 @@ void SeSecEspRecvCallback(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, v
 	}
 }
 
+// アンチリプレイの検査 (RFC 4303 3.4.3)
+bool SeSecCheckReplay(SE_IPSEC_SA *sa, UINT seq)
+{
+	UINT bit;
+	// 引数チェック
+	if (sa == NULL || seq == 0)
+	{
+		return false;
+	}
+
+	if (seq > sa->ReplaySeq)
+	{
+		return true;
+	}
+
+	if (sa->ReplaySeq - seq >= SE_SEC_REPLAY_WINDOW_SIZE)
+	{
+		// ウィンドウより古い
+		return false;
+	}
+
+	bit = seq % (SE_SEC_REPLAY_BITMAP_WORDS * 32);
+
+	return (sa->ReplayBitmap[bit / 32] & (1U << (bit % 32))) == 0;
+}
+
+// アンチリプレイウィンドウの更新
+void SeSecUpdateReplay(SE_IPSEC_SA *sa, UINT seq)
+{
+	UINT bit;
+	// 引数チェック
+	if (sa == NULL)
+	{
+		return;
+	}
+
+	if (seq > sa->ReplaySeq)
+	{
+		// ウィンドウを進め, 新しく入るワードをクリアする
+		UINT i;
+		UINT n = seq / 32 - sa->ReplaySeq / 32;
+
+		if (n > SE_SEC_REPLAY_BITMAP_WORDS)
+		{
+			n = SE_SEC_REPLAY_BITMAP_WORDS;
+		}
+
+		for (i = 1;i <= n;i++)
+		{
+			sa->ReplayBitmap[(sa->ReplaySeq / 32 + i) % SE_SEC_REPLAY_BITMAP_WORDS] = 0;
+		}
+
+		sa->ReplaySeq = seq;
+	}
+
+	bit = seq % (SE_SEC_REPLAY_BITMAP_WORDS * 32);
+	sa->ReplayBitmap[bit / 32] |= 1U << (bit % 32);
+}
+
 // 仮想 IP 受信コールバック
 void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 {
@@ -2728,11 +3080,11 @@ void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 	// ESP パケットの構築
 	if (true)
 	{
-		UINT enc_block_size = SE_DES_BLOCK_SIZE;
-		UINT enc_iv_size = SE_DES_IV_SIZE;
+		UINT enc_block_size = sa->BlockSize;
+		UINT enc_iv_size = sa->IvSize;
 		UINT data_block_size;
 		UINT esp_size;
-		UINT hash_size = SE_HMAC_SHA1_96_HASH_SIZE;
+		UINT hash_size = sa->HashSize;
 		UINT padding_size;
 		UCHAR padding_size_char;
 		UCHAR *esp;
@@ -2740,6 +3092,7 @@ void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 		UCHAR n;
 		UCHAR next_header = (s->IPv6 ? 41 : 4);
 		UINT seq_be;
+		UCHAR *block;
 
 		// 暗号化の対象となるデータブロックサイズを取得する
 		data_block_size = size + sizeof(UCHAR) * 2;
@@ -2751,8 +3104,9 @@ void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 		// ESP パケットサイズを計算する
 		esp_size = sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size + hash_size;
 
-		// ESP パケットを構築する
-		esp = SeMalloc(esp_size);
+		// ESP パケットを SA のバッファ上に構築する
+		esp = SeSecGetIPsecSaBuf(sa, esp_size);
+		block = esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size;
 
 		// SPI
 		SeCopy(esp, &sa->Spi, sizeof(UINT));
@@ -2762,7 +3116,18 @@ void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 		SeCopy(esp + sizeof(UINT), &seq_be, sizeof(UINT));
 
 		// IV
-		SeCopy(esp + sizeof(UINT) + sizeof(UINT), sa->NextIv, enc_iv_size);
+		if (sa->GcmKey != NULL)
+		{
+			UINT64 iv = sa->GcmIv++;
+
+			SeCopy(esp + sizeof(UINT) + sizeof(UINT), &iv, enc_iv_size);
+		}
+		else
+		{
+			// CBC の IV はパケットごとに予測不能な乱数とする (RFC 3602)
+			SeRand(sa->NextIv, enc_iv_size);
+			SeCopy(esp + sizeof(UINT) + sizeof(UINT), sa->NextIv, enc_iv_size);
+		}
 
 		// ペイロードデータ
 		SeCopy(esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size, data, size);
@@ -2786,28 +3151,30 @@ void SeSecVirtualIpRecvCallback(void *data, UINT size, void *param)
 			esp[i] = ++n;
 		}
 
-		// 暗号化
-		SeDes3Encrypt(esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size,
-			esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size,
-			data_block_size,
-			sa->DesKey,
-			sa->NextIv);
+		if (sa->GcmKey != NULL)
+		{
+			// 暗号化と認証 (AAD は SPI とシーケンス番号)
+			SeAesGcmEncrypt(block, block, data_block_size, sa->GcmKey,
+				esp + sizeof(UINT) + sizeof(UINT),
+				esp, sizeof(UINT) + sizeof(UINT),
+				block + data_block_size);
+		}
+		else
+		{
+			UCHAR hash[SE_SHA256_HASH_SIZE];
+
+			// 暗号化
+			SeSecEspEncrypt(sa, block, data_block_size, sa->NextIv);
 
-		// 認証
-		SeMacSha196(esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size,
-			sa->HashKey->Buf,
-			esp,
-			sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size);
+			// 認証
+			SeHmac(hash, sa->HmacKey, esp,
+				sizeof(UINT) + sizeof(UINT) + enc_iv_size + data_block_size);
+			SeCopy(block + data_block_size, hash, hash_size);
+		}
 
 		// 送信
 		SeSecSendEsp(s, &sa->DestAddr, &sa->SrcAddr, esp, esp_size);
 
-		// 最終ブロックを次の IV として保持
-		SeCopy(sa->NextIv, esp + sizeof(UINT) + sizeof(UINT) + enc_iv_size
-			+ data_block_size - enc_block_size, enc_block_size);
-
-		SeFree(esp);
-
 		sa->TransferBytes += size;
 
 		if (sa->Seq == 0xffffffff)
@@ -3416,6 +3783,7 @@ SE_SEC *SeSecInit(SE_VPN *vpn, bool ipv6, SE_SEC_CONFIG *config, SE_SEC_CLIENT_F
 	s->Config = *config;
 	s->IPv6 = ipv6;
 	s->SendStrictIdV6 = send_strict_id;
+	s->EspRecvBuf = SeMalloc(SE_SEC_ESP_RECV_BATCH * SE_SEC_ESP_RECV_SLOT_SIZE);
 
 	SeSecSetTimerCallback(s, SeSecTimerCallback);
 	SeSecSetRecvUdpCallback(s, SeSecUdpRecvCallback);
@@ -3439,6 +3807,10 @@ void SeSecFree(SE_SEC *s)
 
 	s->Halting = true;
 
+	// 溜まっている ESP パケットの破棄
+	s->NumEspRecvBatch = 0;
+	SeFree(s->EspRecvBuf);
+
 	// 解放メイン
 	SeSecFreeMain(s);
 
@@ -65,6 +65,22 @@
 // 定期的ポーリング間隔
 #define SE_SEC_POLLING_INTERVAL					500
 
+// Initial size of the per-SA ESP packet buffer
+#define SE_SEC_IPSEC_SA_BUF_SIZE				2048
+
+// Number of buckets of the inbound IPsec SA hash table (power of 2)
+#define SE_SEC_IPSEC_SA_HASH_SIZE				16
+
+// Anti-replay window (RFC 4303 3.4.3)
+#define SE_SEC_REPLAY_WINDOW_SIZE				1024	// Window size in bits
+#define SE_SEC_REPLAY_BITMAP_WORDS				(SE_SEC_REPLAY_WINDOW_SIZE / 32 + 1)
+
+// Maximum number of ESP packets received in a batch
+#define SE_SEC_ESP_RECV_BATCH					32
+
+// Size of a preallocated slot for a batched ESP packet
+#define SE_SEC_ESP_RECV_SLOT_SIZE				SE_V4_MTU_MAX
+
 
 //
 // データ構造
@@ -89,6 +105,7 @@ struct SE_SEC_CONFIG
 	UINT VpnPhase1LifeSeconds;		// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
 	UINT VpnWaitPhase2BlankSpan;	// フェーズ 1 完了からフェーズ 2 開始までの間にあける時間 (単位: ミリ秒)
 	UCHAR VpnPhase2Crypto;			// フェーズ 2 における暗号化アルゴリズム
+	UINT VpnPhase2KeySize;			// Key size of VpnPhase2Crypto in bytes
 	UCHAR VpnPhase2Hash;			// フェーズ 2 における署名アルゴリズム
 	UINT VpnPhase2LifeKilobytes;	// ISAKMP SA の有効期限の値 (単位: キロバイト, 0 の場合は無効)
 	UINT VpnPhase2LifeSeconds;		// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
@@ -174,7 +191,7 @@ struct SE_IPSEC_SA
 	SE_IKE_IP_ADDR SrcAddr, DestAddr;
 	bool Outgoing;										// true のとき送信方向, false のとき受信方向
 	UINT Spi;											// SPI
-	UCHAR NextIv[SE_DES_BLOCK_SIZE];					// 次の IV
+	UCHAR NextIv[SE_AES_IV_SIZE];						// 次の IV
 	SE_IKE_SA *IkeSa;									// IKE SA へのポインタ
 	UINT64 EstablishedTick;								// 確立完了時刻
 	UINT64 TransferBytes;								// 転送バイト数
@@ -182,6 +199,29 @@ struct SE_IPSEC_SA
 	SE_BUF *EncryptionKey;								// 暗号化鍵
 	SE_BUF *HashKey;									// ハッシュ鍵
 	SE_DES_KEY *DesKey;									// DES 鍵
+	UCHAR Crypto;										// Phase 2 transform ID
+	UINT BlockSize;										// Cipher block size (ESP padding unit)
+	UINT IvSize;										// Explicit IV size
+	UINT HashSize;										// ICV size
+	SE_AES_KEY *AesKey;									// AES-CBC key
+	SE_AES_GCM_KEY *GcmKey;								// AES-GCM key
+	SE_HMAC_KEY *HmacKey;								// HMAC key (not used with AES-GCM)
+	UINT64 GcmIv;										// Next AES-GCM IV
+	UCHAR *Buf;											// ESP packet buffer
+	UINT BufSize;										// Size of Buf
+	SE_IPSEC_SA *HashNext;								// Next SA in the same hash bucket
+	UINT ReplaySeq;										// Highest sequence number received
+	UINT ReplayBitmap[SE_SEC_REPLAY_BITMAP_WORDS];		// Sequence numbers received in the window
+};
+
+// ESP packet waiting for a batch
+struct SE_SEC_ESP_PACKET
+{
+	SE_IKE_IP_ADDR SrcAddr, DestAddr;					// Addresses of the IP header
+	void *Data;											// ESP packet (a slot of EspRecvBuf)
+	UINT Size;											// Size of Data
+	SE_IPSEC_SA *Sa;									// Inbound SA found by SPI
+	UINT Seq;											// Sequence number
 };
 
 // IPsec 処理構造体
@@ -199,6 +239,10 @@ struct SE_SEC
 	UINT64 PoolingVar;									// ポーリング用変数
 	bool StatusChanged;									// 状態変化
 	bool SendStrictIdV6;								// IPv6 において厳密に ID を送信する
+	SE_IPSEC_SA *IPsecSaHash[SE_SEC_IPSEC_SA_HASH_SIZE];	// Inbound IPsec SAs by SPI
+	SE_SEC_ESP_PACKET EspRecvBatch[SE_SEC_ESP_RECV_BATCH];	// Received ESP packets
+	UINT NumEspRecvBatch;								// Number of packets in EspRecvBatch
+	UCHAR *EspRecvBuf;									// Slots for EspRecvBatch
 };
 
 // 関数プロトタイプ
@@ -286,9 +330,19 @@ SE_IPSEC_SA *SeSecNewIPsecSa(SE_SEC *s, SE_IKE_SA *ike_sa, bool outgoing, UINT s
 							 SE_IKE_IP_ADDR src_addr, SE_IKE_IP_ADDR dest_addr,
 							 SE_BUF *keymat);
 void SeSecFreeIPsecSa(SE_SEC *s, SE_IPSEC_SA *sa);
+UCHAR *SeSecGetIPsecSaBuf(SE_IPSEC_SA *sa, UINT size);
+void SeSecEspEncrypt(SE_IPSEC_SA *sa, void *data, UINT size, void *iv);
+void SeSecEspDecrypt(SE_IPSEC_SA *sa, void *dest, void *src, UINT size, void *iv);
+UINT SeSecGetKeymatSize(SE_SEC_CONFIG *config);
 UINT64 SeSecLifeSeconds64bit(UINT value);
 
 SE_IPSEC_SA *SeSecGetIPsecSa(SE_SEC *s, bool outgoing);
+UINT SeSecIPsecSaHash(UINT spi);
+SE_IPSEC_SA *SeSecSearchInboundIPsecSa(SE_SEC *s, UINT spi);
+bool SeSecCheckReplay(SE_IPSEC_SA *sa, UINT seq);
+void SeSecUpdateReplay(SE_IPSEC_SA *sa, UINT seq);
+void SeSecRecvEspPacket(SE_SEC *s, SE_SEC_ESP_PACKET *p);
+void SeSecFlushEspRecv(SE_SEC *s);
 
 #endif	// SESEC_H
 
@@ -53,6 +53,9 @@ typedef struct X509_req_st X509_REQ;
 typedef struct bignum_st BIGNUM;
 typedef struct DES_ks DES_key_schedule;
 typedef struct dh_st DH;
+typedef struct aes_key_st AES_KEY;
+typedef struct SHAstate_st SHA_CTX;
+typedef struct SHA256state_st SHA256_CTX;
 #endif	// ENCRYPT_C
 
 // コンパイラ依存コード
@@ -208,6 +211,9 @@ typedef struct SE_CONFIG_ENTRY SE_CONFIG_ENTRY;
 // SeCrypto.h
 typedef struct SE_DES_KEY SE_DES_KEY;
 typedef struct SE_DES_KEY_VALUE SE_DES_KEY_VALUE;
+typedef struct SE_AES_KEY SE_AES_KEY;
+typedef struct SE_AES_GCM_KEY SE_AES_GCM_KEY;
+typedef struct SE_HMAC_KEY SE_HMAC_KEY;
 typedef struct SE_CERT SE_CERT;
 typedef struct SE_KEY SE_KEY;
 typedef struct SE_DH SE_DH;
@@ -304,6 +310,7 @@ typedef struct SE_SEC_CLIENT_FUNCTION_TABLE SE_SEC_CLIENT_FUNCTION_TABLE;
 typedef struct SE_SEC_CONFIG SE_SEC_CONFIG;
 typedef struct SE_IKE_SA SE_IKE_SA;
 typedef struct SE_IPSEC_SA SE_IPSEC_SA;
+typedef struct SE_SEC_ESP_PACKET SE_SEC_ESP_PACKET;
 typedef void (SE_SEC_TIMER_CALLBACK)(UINT64 tick, void *param);
 typedef void (SE_SEC_UDP_RECV_CALLBACK)(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, UINT dest_port, UINT src_port, void *data, UINT size, void *param);
 typedef void (SE_SEC_ESP_RECV_CALLBACK)(SE_IKE_IP_ADDR *dest_addr, SE_IKE_IP_ADDR *src_addr, void *data, UINT size, void *param);
@@ -339,6 +339,16 @@ void SeVpnMainProcess(SE_VPN *v)
 		SeFree(packet);
 	}
 
+	// 受信した ESP パケットの一括処理
+	if (v->Vpn4 != NULL)
+	{
+		SeSecFlushEspRecv(v->Vpn4->Sec);
+	}
+	if (v->Vpn6 != NULL)
+	{
+		SeSecFlushEspRecv(v->Vpn6->Sec);
+	}
+
 	// 送信キューに入れた Ethernet パケットの一括送信
 	num_pe = SeEthSendAll(v->PhysicalEth);
 	num_ve = SeEthSendAll(v->VirtualEth);
@@ -833,6 +843,7 @@ SE_VPN_CONFIG *SeVpnLoadConfig(SE_LIST *o)
 			c.VpnPhase1LifeSecondsV4 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnPhase1LifeSecondsV4"), SE_SEC_DEFAULT_P1_LIFE_SECONDS);
 			c.VpnWaitPhase2BlankSpanV4 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnWaitPhase2BlankSpanV4"), SE_SEC_DEFAULT_WAIT_P2_BLANK_SPAN);
 			c.VpnPhase2CryptoV4 = SeIkeStrToPhase2CryptId(SeGetConfigStr(o, "VpnPhase2CryptoV4"));
+			c.VpnPhase2KeySizeV4 = SeIkeStrToPhase2KeySize(SeGetConfigStr(o, "VpnPhase2CryptoV4"));
 			c.VpnPhase2HashV4 = SeIkeStrToPhase2HashId(SeGetConfigStr(o, "VpnPhase2HashV4"));
 			c.VpnPhase2LifeKilobytesV4 = SeGetConfigInt(o, "VpnPhase2LifeKilobytesV4");
 			c.VpnPhase2LifeSecondsV4 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnPhase2LifeSecondsV4"), SE_SEC_DEFAULT_P2_LIFE_SECONDS);
@@ -889,7 +900,7 @@ SE_VPN_CONFIG *SeVpnLoadConfig(SE_LIST *o)
 				SeStrCpy(error_str, sizeof(error_str), "VpnPhase1HashV4: Invalid Value.");
 				goto LABEL_ERROR;
 			}
-			if (c.VpnPhase2CryptoV4 == 0)
+			if (c.VpnPhase2CryptoV4 == 0 || c.VpnPhase2KeySizeV4 == 0)
 			{
 				SeStrCpy(error_str, sizeof(error_str), "VpnPhase2CryptoV4: Invalid Value.");
 				goto LABEL_ERROR;
@@ -1012,6 +1023,7 @@ SE_VPN_CONFIG *SeVpnLoadConfig(SE_LIST *o)
 			c.VpnPhase1LifeSecondsV6 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnPhase1LifeSecondsV6"), SE_SEC_DEFAULT_P1_LIFE_SECONDS);
 			c.VpnWaitPhase2BlankSpanV6 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnWaitPhase2BlankSpanV6"), SE_SEC_DEFAULT_WAIT_P2_BLANK_SPAN);
 			c.VpnPhase2CryptoV6 = SeIkeStrToPhase2CryptId(SeGetConfigStr(o, "VpnPhase2CryptoV6"));
+			c.VpnPhase2KeySizeV6 = SeIkeStrToPhase2KeySize(SeGetConfigStr(o, "VpnPhase2CryptoV6"));
 			c.VpnPhase2HashV6 = SeIkeStrToPhase2HashId(SeGetConfigStr(o, "VpnPhase2HashV6"));
 			c.VpnPhase2LifeKilobytesV6 = SeGetConfigInt(o, "VpnPhase2LifeKilobytesV6");
 			c.VpnPhase2LifeSecondsV6 = SE_DEFAULT_VALUE(SeGetConfigInt(o, "VpnPhase2LifeSecondsV6"), SE_SEC_DEFAULT_P2_LIFE_SECONDS);
@@ -1069,7 +1081,7 @@ SE_VPN_CONFIG *SeVpnLoadConfig(SE_LIST *o)
 				SeStrCpy(error_str, sizeof(error_str), "VpnPhase1HashV6: Invalid Value.");
 				goto LABEL_ERROR;
 			}
-			if (c.VpnPhase2CryptoV6 == 0)
+			if (c.VpnPhase2CryptoV6 == 0 || c.VpnPhase2KeySizeV6 == 0)
 			{
 				SeStrCpy(error_str, sizeof(error_str), "VpnPhase2CryptoV6: Invalid Value.");
 				goto LABEL_ERROR;
@@ -82,6 +82,7 @@ struct SE_VPN_CONFIG
 	UINT VpnPhase1LifeSecondsV4;	// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
 	UINT VpnWaitPhase2BlankSpanV4;	// フェーズ 1 完了からフェーズ 2 開始までの間にあける時間 (単位: ミリ秒)
 	UCHAR VpnPhase2CryptoV4;		// フェーズ 2 における暗号化アルゴリズム
+	UINT VpnPhase2KeySizeV4;		// Key size of VpnPhase2CryptoV4 in bytes
 	UCHAR VpnPhase2HashV4;			// フェーズ 2 における署名アルゴリズム
 	UINT VpnPhase2LifeKilobytesV4;	// ISAKMP SA の有効期限の値 (単位: キロバイト, 0 の場合は無効)
 	UINT VpnPhase2LifeSecondsV4;	// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
@@ -123,6 +124,7 @@ struct SE_VPN_CONFIG
 	UINT VpnPhase1LifeSecondsV6;	// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
 	UINT VpnWaitPhase2BlankSpanV6;	// フェーズ 1 完了からフェーズ 2 開始までの間にあける時間 (単位: ミリ秒)
 	UCHAR VpnPhase2CryptoV6;		// フェーズ 2 における暗号化アルゴリズム
+	UINT VpnPhase2KeySizeV6;		// Key size of VpnPhase2CryptoV6 in bytes
 	UCHAR VpnPhase2HashV6;			// フェーズ 2 における署名アルゴリズム
 	UINT VpnPhase2LifeKilobytesV6;	// ISAKMP SA の有効期限の値 (単位: キロバイト, 0 の場合は無効)
 	UINT VpnPhase2LifeSecondsV6;	// ISAKMP SA の有効期限の値 (単位: 秒, 0 の場合は無効)
@@ -424,6 +424,7 @@ void SeVpn4InitSecConfig(SE_VPN4 *v4, SE_SEC_CONFIG *c)
 	c->VpnPhase1LifeSeconds = vc->VpnPhase1LifeSecondsV4;
 	c->VpnWaitPhase2BlankSpan = vc->VpnWaitPhase2BlankSpanV4;
 	c->VpnPhase2Crypto = vc->VpnPhase2CryptoV4;
+	c->VpnPhase2KeySize = vc->VpnPhase2KeySizeV4;
 	c->VpnPhase2Hash = vc->VpnPhase2HashV4;
 	c->VpnPhase2LifeKilobytes = vc->VpnPhase2LifeKilobytesV4;
 	c->VpnPhase2LifeSeconds = vc->VpnPhase2LifeSecondsV4;
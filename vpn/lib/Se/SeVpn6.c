@@ -285,6 +285,7 @@ void SeVpn6InitSecConfig(SE_VPN6 *v6, SE_SEC_CONFIG *c)
 	c->VpnPhase1LifeSeconds = vc->VpnPhase1LifeSecondsV6;
 	c->VpnWaitPhase2BlankSpan = vc->VpnWaitPhase2BlankSpanV6;
 	c->VpnPhase2Crypto = vc->VpnPhase2CryptoV6;
+	c->VpnPhase2KeySize = vc->VpnPhase2KeySizeV6;
 	c->VpnPhase2Hash = vc->VpnPhase2HashV6;
 	c->VpnPhase2LifeKilobytes = vc->VpnPhase2LifeKilobytesV6;
 	c->VpnPhase2LifeSeconds = vc->VpnPhase2LifeSecondsV6;